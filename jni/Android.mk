@@ -2,7 +2,36 @@ LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
 
+# Socket core, server engine, benchmark client, coalescing policy and
+# capture files, free of JNI
+LOCAL_MODULE    := EchoSocket
+LOCAL_SRC_FILES := EchoSocket.cpp EchoServer.cpp EchoTrace.cpp EchoLoad.cpp \
+	EchoCoalesce.cpp EchoCapture.cpp
+
+# Trace probes, exported with nativeExportTrace, the flag is
+# passed on to the modules linking the library
+# LOCAL_CFLAGS += -DECHO_TRACE
+# LOCAL_EXPORT_CFLAGS += -DECHO_TRACE
+
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
 LOCAL_MODULE    := Echo
 LOCAL_SRC_FILES := Echo.cpp
+LOCAL_STATIC_LIBRARIES := EchoSocket
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+
+# Standalone benchmark suite, run over adb shell
+LOCAL_MODULE    := EchoBenchmark
+LOCAL_SRC_FILES := EchoBenchmark.cpp
+LOCAL_STATIC_LIBRARIES := EchoSocket
+
+# Executables have to be position independent since Android 5.0
+LOCAL_CFLAGS  += -fPIE
+LOCAL_LDFLAGS += -fPIE -pie
+
+include $(BUILD_EXECUTABLE)
@@ -1,7 +1,23 @@
+#include "com_apress_echo_AbstractEchoActivity.h"
 #include "com_apress_echo_EchoClientActivity.h"
 #include "com_apress_echo_EchoServerActivity.h"
 #include "com_apress_echo_LocalEchoActivity.h"
 
+// Socket core
+#include "EchoSocket.h"
+
+// Server engine
+#include "EchoServer.h"
+
+// Benchmark client
+#include "EchoLoad.h"
+
+// Capture files and their replay
+#include "EchoCapture.h"
+
+// Trace probes
+#include "EchoTrace.h"
+
 // JNI
 #include <jni.h>
 
@@ -17,1043 +33,5587 @@
 // strerror_r, memset
 #include <string.h>
 
-// socket, bind, getsockname, listen, accept, recv, send, connect
+// socket, accept, recv, send, connect
 #include <sys/types.h>
 #include <sys/socket.h>
 
-// sockaddr_un
-#include <sys/un.h>
-
-// htons, sockaddr_in
+// htons, sockaddr_in, sockaddr_in6
 #include <netinet/in.h>
 
-// inet_ntop
+// inet_ntop, inet_pton
 #include <arpa/inet.h>
 
-// close, unlink
+// getaddrinfo, freeaddrinfo, gai_strerror
+#include <netdb.h>
+
+// close
 #include <unistd.h>
 
-// offsetof
-#include <stddef.h>
+// malloc, free, strtol
+#include <stdlib.h>
 
-// Max log message length
-#define MAX_LOG_MESSAGE_LENGTH 256
+// fcntl
+#include <fcntl.h>
 
-// Max data buffer size
-#define MAX_BUFFER_SIZE 80
+// epoll_create, epoll_ctl, epoll_wait
+#include <sys/epoll.h>
 
-/**
- * Logs the given message to the application.
- *
- * @param env JNIEnv interface.
- * @param obj object instance.
- * @param format message format and arguments.
- */
-static void LogMessage(
-		JNIEnv* env,
-		jobject obj,
-		const char* format,
-		...)
-{
-	// Cached log method ID
-	static jmethodID methodID = NULL;
+// mmap, munmap
+#include <sys/mman.h>
 
-	// If method ID is not cached
-	if (NULL == methodID)
-	{
-		// Get class from object
-		jclass clazz = env->GetObjectClass(obj);
+// fstat
+#include <sys/stat.h>
 
-		// Get the method ID for the given method
-		methodID = env->GetMethodID(clazz, "logMessage",
-				"(Ljava/lang/String;)V");
+// pthread_create, pthread_join, pthread_once
+#include <pthread.h>
 
-		// Release the class reference
-		env->DeleteLocalRef(clazz);
-	}
+// SCHED_FIFO, CPU_SETSIZE
+#include <sched.h>
 
-	// If method is found
-	if (NULL != methodID)
-	{
-		// Format the log message
-		char buffer[MAX_LOG_MESSAGE_LENGTH];
+// sem_init, sem_wait, sem_post
+#include <semaphore.h>
 
-		va_list ap;
-		va_start(ap, format);
-		vsnprintf(buffer, MAX_LOG_MESSAGE_LENGTH, format, ap);
-		va_end(ap);
+// iovec
+#include <sys/uio.h>
 
-		// Convert the buffer to a Java string
-		jstring message = env->NewStringUTF(buffer);
+// TCP_NODELAY
+#include <netinet/tcp.h>
 
-		// If string is properly constructed
-		if (NULL != message)
-		{
-			// Log message
-			env->CallVoidMethod(obj, methodID, message);
+// uint64_t
+#include <stdint.h>
 
-			// Release the message reference
-			env->DeleteLocalRef(message);
-		}
-	}
-}
+// clock_gettime
+#include <time.h>
+
+// syscall
+#include <sys/syscall.h>
+
+// eventfd
+#include <sys/eventfd.h>
+
+// poll
+#include <poll.h>
+
+// memfd_create is missing from the older C libraries
+#ifdef __NR_memfd_create
+#define HAVE_MEMFD 1
+#endif
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1U
+#endif
+
+// Scheduling policies missing from the older platform headers
+#ifndef SCHED_BATCH
+#define SCHED_BATCH 3
+#endif
+
+#ifndef SCHED_IDLE
+#define SCHED_IDLE 5
+#endif
+
+// Number of elements in a static array
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+
+// Min and max data buffer sizes
+#define MIN_BUFFER_SIZE 4096
+#define MAX_BUFFER_SIZE 65536
+
+// Max number of buffers allocated at once by a buffer pool
+#define MAX_POOL_SIZE 1024
+
+// Max number of events returned by a single event loop wait
+#define MAX_EPOLL_EVENTS 64
+
+// Max bytes queued for a connection before reading stops
+#define MAX_HIGH_WATER_MARK 16777216
+
+// Max frame payload size accepted by the server
+#define MAX_MAX_FRAME_SIZE 16777216
+
+// Max time given to a stopping server to send the queued data, in ms
+#define MAX_DRAIN_TIMEOUT 60000
+
+// Max connection timeout in ms
+#define MAX_CONNECTION_TIMEOUT 3600000
+
+// Max listen backlog, the kernel caps it at somaxconn
+#define MAX_BACKLOG 65535
+
+// Time the echoed data may be held to coalesce it, in microseconds
+#define MAX_COALESCE_DELAY 100000
+
+// Max bytes coalesced before they are sent
+#define MAX_COALESCE_SIZE 1048576
+
+// Min and max size of the capture file
+#define MIN_CAPTURE_SIZE 65536
+#define MAX_CAPTURE_SIZE 1073741824
+
+// Replay speed in percent of the captured timing
+#define MAX_REPLAY_SPEED 100000
+
+// Real time priority range of the FIFO and RR policies
+#define MIN_WORKER_PRIORITY 1
+#define MAX_WORKER_PRIORITY 99
+
+// Socket buffer size limit, zero keeps the system default
+#define MAX_SOCKET_BUFFER_SIZE 16777216
+
+// Busy poll time limit in microseconds
+#define MAX_BUSY_POLL 1000000
+
+// TCP Fast Open pending request limit
+#define MAX_FAST_OPEN 65535
+
+// Max host name length, including the terminator
+#define MAX_HOST_LENGTH 256
+
+// Max number of addresses kept for a resolved host
+#define MAX_RESOLVED_ADDRESSES 8
+
+// Number of hosts kept in the resolver cache
+#define RESOLVER_CACHE_SIZE 16
+
+// Time resolved and failed hosts are kept in the cache, in nanoseconds
+#define RESOLVER_TTL 30000000000ULL
+#define RESOLVER_NEGATIVE_TTL 5000000000ULL
+
+// Max time to wait for the resolver thread in ms
+#define MAX_RESOLVE_TIMEOUT 60000
+
+// Delay before the next address joins the connect race, in ms
+#define HAPPY_EYEBALLS_DELAY 250
+
+// Max time a connect attempt may take in ms
+#define MAX_CONNECT_TIMEOUT 600000
+
+// Endpoints connected to at once by a fan-out
+#define MAX_FAN_OUT 64
+
+// Local benchmark transports, same as in LocalEchoActivity
+#define LOCAL_TRANSPORT_SOCKET 0
+#define LOCAL_TRANSPORT_SHARED_MEMORY 1
+
+// Size of each shared memory ring, must be a power of two
+#define SHARED_RING_SIZE 262144
+
+// Size of the shared ring message length prefix
+#define SHARED_HEADER_SIZE 4
+
+// Max message size that fits a shared ring
+#define MAX_SHARED_MESSAGE_SIZE (SHARED_RING_SIZE / 2)
+
+// Shared memory region layout check, "ECHR"
+#define SHARED_REGION_MAGIC 0x45434852
+
+// Number of descriptors passed to set up a shared channel
+#define SHARED_CHANNEL_FDS 3
+
+// Empty polls of the shared rings before sleeping on the eventfd
+#define SHARED_SPIN_COUNT 4096
+
+// Session protocols, same as in EchoClientActivity
+#define SESSION_TCP 0
+#define SESSION_UDP 1
+
+// Max number of idle sessions kept for reuse
+#define MAX_IDLE_SESSIONS 8
+
+// Max keepalive idle time in seconds
+#define MAX_KEEP_ALIVE 7200
+
+// Max number of flows kept per UDP worker
+#define MAX_UDP_FLOWS 65536
+
+// Max datagrams per second a UDP peer may send
+#define MAX_UDP_RATE_LIMIT 1000000
+
+// Number of log records in the ring, must be a power of two
+#define LOG_RING_SIZE 512
+
+// Max number of log records passed to a single Java call
+#define LOG_BATCH_SIZE 32
+
+// Log drainer time slice in microseconds
+#define LOG_DRAIN_INTERVAL 20000
+
+// Max time to wait for the log records to be drained in microseconds
+#define LOG_FLUSH_TIMEOUT 200000
 
 /**
- * Throws a new exception using the given exception class
- * and exception message.
- *
- * @param env JNIEnv interface.
- * @param className class name.
- * @param message exception message.
+ * Classes and method IDs that are resolved once when the
+ * library is loaded. Classes are pinned with global references
+ * so that the IDs stay valid.
  */
-static void ThrowException(
-		JNIEnv* env,
-		const char* className,
-		const char* message)
+struct JniCache
 {
-	// Get the exception class
-	jclass clazz = env->FindClass(className);
+	// Activity classes
+	jclass abstractEchoActivity;
+	jclass echoClientActivity;
+	jclass echoServerActivity;
+	jclass localEchoActivity;
+
+	// Exception classes
+	jclass ioException;
+	jclass illegalArgumentException;
+	jclass illegalStateException;
+	jclass nullPointerException;
+	jclass outOfMemoryError;
+
+	// AbstractEchoActivity.logMessage, dispatched to the subclasses
+	jmethodID logMessage;
+};
+
+// Process wide JNI cache, filled in JNI_OnLoad
+static struct JniCache jniCache;
 
-	// If exception class is found
-	if (NULL != clazz)
-	{
-		// Throw exception
-		env->ThrowNew(clazz, message);
+/**
+ * Fixed-size log record in the log ring.
+ */
+struct LogRecord
+{
+	// Ring position the record is ready for
+	size_t sequence;
 
-		// Release local class reference
-		env->DeleteLocalRef(clazz);
-	}
-}
+	// Global reference to the object instance to log to
+	jobject obj;
+
+	// Record is releasing the object instance
+	bool release;
+
+	// Log message
+	char message[MAX_LOG_MESSAGE_LENGTH];
+};
 
 /**
- * Throws a new exception using the given exception class
- * and error message based on the error number.
+ * Multiple producer, single consumer ring of log records.
+ * I/O threads only format into the ring, the drainer thread
+ * passes the messages to the application in batches.
+ */
+struct LogRing
+{
+	// Records
+	struct LogRecord records[LOG_RING_SIZE];
+
+	// Next position to enqueue
+	size_t enqueuePos;
+
+	// Next position to dequeue
+	size_t dequeuePos;
+
+	// Number of messages dropped since the ring was full
+	size_t dropCount;
+
+	// Drainer is waiting for records
+	int drainerIdle;
+
+	// Wakes up the idle drainer
+	sem_t wakeup;
+
+	// Java VM to attach the drainer thread
+	JavaVM* vm;
+};
+
+// Process wide log ring
+static struct LogRing logRing;
+
+// Log ring initialization
+static pthread_once_t logRingOnce = PTHREAD_ONCE_INIT;
+
+// Log ring is initialized and drainer is running
+static bool logRingReady = false;
+
+/**
+ * Claims the next free log record in the log ring. The
+ * record must be published once it is filled.
  *
- * @param env JNIEnv interface.
- * @param className class name.
- * @param errnum error number.
+ * @param pos ring position of the record.
+ * @return log record or NULL if ring is full.
  */
-static void ThrowErrnoException(
-		JNIEnv* env,
-		const char* className,
-		int errnum)
+static struct LogRecord* ClaimLogRecord(size_t* pos)
 {
-	char buffer[MAX_LOG_MESSAGE_LENGTH];
+	size_t enqueuePos = __atomic_load_n(&logRing.enqueuePos,
+			__ATOMIC_RELAXED);
 
-	// Get message for the error number
-	if (-1 == strerror_r(errnum, buffer, MAX_LOG_MESSAGE_LENGTH))
+	while (1)
 	{
-		strerror_r(errno, buffer, MAX_LOG_MESSAGE_LENGTH);
-	}
+		struct LogRecord* record =
+				&logRing.records[enqueuePos & (LOG_RING_SIZE - 1)];
 
-	// Throw exception
-	ThrowException(env, className, buffer);
+		size_t sequence = __atomic_load_n(&record->sequence,
+				__ATOMIC_ACQUIRE);
+		ssize_t diff = (ssize_t) sequence - (ssize_t) enqueuePos;
+
+		// Record is free, try to claim it
+		if (0 == diff)
+		{
+			if (__atomic_compare_exchange_n(&logRing.enqueuePos,
+					&enqueuePos, enqueuePos + 1, true,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				*pos = enqueuePos;
+				return record;
+			}
+		}
+		else if (diff < 0)
+		{
+			// Ring is full
+			return NULL;
+		}
+		else
+		{
+			// Another producer claimed it
+			enqueuePos = __atomic_load_n(&logRing.enqueuePos,
+					__ATOMIC_RELAXED);
+		}
+	}
 }
 
 /**
- * Constructs a new TCP socket.
+ * Publishes the claimed log record to the drainer.
  *
- * @param env JNIEnv interface.
- * @param obj object instance.
- * @return socket descriptor.
- * @throws IOException
+ * @param record log record.
+ * @param pos ring position of the record.
  */
-static int NewTcpSocket(JNIEnv* env, jobject obj)
+static void PublishLogRecord(struct LogRecord* record, size_t pos)
 {
-	// Construct socket
-	LogMessage(env, obj, "Constructing a new TCP socket...");
-	int tcpSocket = socket(PF_INET, SOCK_STREAM, 0);
+	__atomic_store_n(&record->sequence, pos + 1, __ATOMIC_RELEASE);
 
-	// Check if socket is properly constructed
-	if (-1 == tcpSocket)
+	// Wake up the drainer if it is waiting
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&logRing.drainerIdle, 0, __ATOMIC_SEQ_CST))
 	{
-		// Throw an exception with error number
-		ThrowErrnoException(env, "java/io/IOException", errno);
+		sem_post(&logRing.wakeup);
 	}
-
-	return tcpSocket;
 }
 
 /**
- * Binds socket to a port number.
+ * Passes the given batch of messages to the object instance
+ * with a single Java call.
  *
  * @param env JNIEnv interface.
  * @param obj object instance.
- * @param sd socket descriptor.
- * @param port port number or zero for random port.
- * @throws IOException
+ * @param batch batch of messages, separated by new lines.
  */
-static void BindSocketToPort(
+static void DeliverLogBatch(
 		JNIEnv* env,
 		jobject obj,
-		int sd,
-		unsigned short port)
+		const char* batch)
 {
-	struct sockaddr_in address;
-
-	// Address to bind socket
-	memset(&address, 0, sizeof(address));
-	address.sin_family = PF_INET;
+	// Convert the batch to a Java string
+	jstring message = env->NewStringUTF(batch);
 
-	// Bind to all addresses
-	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	// If string is properly constructed
+	if (NULL != message)
+	{
+		// Log message
+		TRACE_BEGIN(TRACE_LOG_CALLBACK);
+		env->CallVoidMethod(obj, jniCache.logMessage, message);
+		TRACE_END();
 
-	// Convert port to network byte order
-	address.sin_port = htons(port);
+		// Release the message reference
+		env->DeleteLocalRef(message);
+	}
 
-	// Bind socket
-	LogMessage(env, obj, "Binding to port %hu.", port);
-	if (-1 == bind(sd, (struct sockaddr*) &address, sizeof(address)))
+	// Drainer has nobody to report to
+	if (NULL != env->ExceptionOccurred())
 	{
-		// Throw an exception with error number
-		ThrowErrnoException(env, "java/io/IOException", errno);
+		env->ExceptionClear();
 	}
 }
 
 /**
- * Gets the port number socket is currently binded.
+ * Log drainer thread, dequeues the log records and passes
+ * them to the application in batches, once per time slice.
  *
- * @param env JNIEnv interface.
- * @param obj object instance.
- * @param sd socket descriptor.
- * @return port number.
- * @throws IOException
+ * @param arg unused.
+ * @return NULL.
  */
-static unsigned short GetSocketPort(
-		JNIEnv* env,
-		jobject obj,
-		int sd)
+static void* LogDrainerThread(void* arg)
 {
-	unsigned short port = 0;
+	JNIEnv* env;
 
-	struct sockaddr_in address;
-	socklen_t addressLength = sizeof(address);
+	if (0 != logRing.vm->AttachCurrentThread(&env, NULL))
+		return NULL;
 
-	// Get the socket address
-	if (-1 == getsockname(sd, (struct sockaddr*) &address, &addressLength))
-	{
-		// Throw an exception with error number
-		ThrowErrnoException(env, "java/io/IOException", errno);
-	}
-	else
+	// Batch of messages separated by new lines
+	static char batch[(LOG_BATCH_SIZE + 1) * MAX_LOG_MESSAGE_LENGTH];
+	size_t batchLength = 0;
+	size_t batchCount = 0;
+	jobject batchObj = NULL;
+
+	while (1)
 	{
-		// Convert port to host byte order
-		port = ntohs(address.sin_port);
+		size_t pos = logRing.dequeuePos;
+		struct LogRecord* record =
+				&logRing.records[pos & (LOG_RING_SIZE - 1)];
+
+		bool ready = ((pos + 1) == __atomic_load_n(&record->sequence,
+				__ATOMIC_ACQUIRE));
+
+		// Deliver the batch if it is full, the ring is empty,
+		// or the record is for another object instance
+		if ((batchCount > 0) && (!ready || record->release
+				|| (record->obj != batchObj)
+				|| (LOG_BATCH_SIZE == batchCount)))
+		{
+			DeliverLogBatch(env, batchObj, batch);
+			batchLength = 0;
+			batchCount = 0;
+		}
+
+		if (!ready)
+		{
+			// Announce being idle, recheck to not miss a wake up
+			__atomic_store_n(&logRing.drainerIdle, 1, __ATOMIC_SEQ_CST);
+
+			if ((pos + 1) != __atomic_load_n(&record->sequence,
+					__ATOMIC_ACQUIRE))
+			{
+				while ((-1 == sem_wait(&logRing.wakeup)) && (EINTR == errno));
+			}
+			else
+			{
+				__atomic_store_n(&logRing.drainerIdle, 0, __ATOMIC_SEQ_CST);
+			}
+
+			// Let the records pile up for a time slice
+			usleep(LOG_DRAIN_INTERVAL);
+			continue;
+		}
+
+		if (record->release)
+		{
+			env->DeleteGlobalRef(record->obj);
+		}
+		else
+		{
+			// Report the dropped messages first
+			size_t dropCount = __atomic_exchange_n(&logRing.dropCount, 0,
+					__ATOMIC_RELAXED);
+
+			if (dropCount > 0)
+			{
+				batchLength += snprintf(batch + batchLength,
+						sizeof(batch) - batchLength,
+						"%s%zu log messages dropped.",
+						(batchCount > 0) ? "\n" : "", dropCount);
+				batchCount++;
+
+				if (batchLength >= sizeof(batch))
+				{
+					batchLength = sizeof(batch) - 1;
+				}
+			}
+
+			// Append the message to the batch
+			batchLength += snprintf(batch + batchLength,
+					sizeof(batch) - batchLength,
+					"%s%s", (batchCount > 0) ? "\n" : "", record->message);
+
+			if (batchLength >= sizeof(batch))
+			{
+				batchLength = sizeof(batch) - 1;
+			}
+
+			batchObj = record->obj;
+			batchCount++;
+		}
 
-		LogMessage(env, obj, "Binded to random port %hu.", port);
+		// Release the record to the producers
+		__atomic_store_n(&record->sequence, pos + LOG_RING_SIZE,
+				__ATOMIC_RELEASE);
+		__atomic_store_n(&logRing.dequeuePos, pos + 1, __ATOMIC_RELEASE);
 	}
 
-	return port;
+	return NULL;
 }
 
 /**
- * Listens on given socket with the given backlog for
- * pending connections. When the backlog is full, the
- * new connections will be rejected.
- *
- * @param env JNIEnv interface.
- * @param obj object instance.
- * @param sd socket descriptor.
- * @param backlog backlog size.
- * @throws IOException
+ * Initializes the log ring and starts the drainer thread.
  */
-static void ListenOnSocket(
-		JNIEnv* env,
-		jobject obj,
-		int sd,
-		int backlog)
+static void InitLogRing()
 {
-	// Listen on socket with the given backlog
-	LogMessage(env, obj,
-			"Listening on socket with a backlog of %d pending connections.",
-			backlog);
+	for (size_t i = 0; i < LOG_RING_SIZE; i++)
+	{
+		logRing.records[i].sequence = i;
+	}
+
+	if (0 != sem_init(&logRing.wakeup, 0, 0))
+		return;
 
-	if (-1 == listen(sd, backlog))
+	pthread_t thread;
+	if (0 == pthread_create(&thread, NULL, LogDrainerThread, NULL))
 	{
-		// Throw an exception with error number
-		ThrowErrnoException(env, "java/io/IOException", errno);
+		pthread_detach(thread);
+		logRingReady = true;
 	}
 }
 
 /**
- * Logs the IP address and the port number from the
- * given address.
+ * Begins logging to the given object instance. Returns a
+ * global reference to be used as the object instance until
+ * the log is ended.
  *
  * @param env JNIEnv interface.
  * @param obj object instance.
- * @param message message text.
- * @param address adress instance.
- * @throws IOException
+ * @return global reference to object instance.
  */
-static void LogAddress(
-		JNIEnv* env,
-		jobject obj,
-		const char* message,
-		const struct sockaddr_in* address)
+static jobject BeginLog(JNIEnv* env, jobject obj)
 {
-	char ip[INET_ADDRSTRLEN];
-
-	// Convert the IP address to string
-	if (NULL == inet_ntop(PF_INET,
-			&(address->sin_addr),
-			ip,
-			INET_ADDRSTRLEN))
+	if (NULL == logRing.vm)
 	{
-		// Throw an exception with error number
-		ThrowErrnoException(env, "java/io/IOException", errno);
+		env->GetJavaVM(&logRing.vm);
 	}
-	else
-	{
-		// Convert port to host byte order
-		unsigned short port = ntohs(address->sin_port);
 
-		// Log address
-		LogMessage(env, obj, "%s %s:%hu.", message, ip, port);
-	}
+	pthread_once(&logRingOnce, InitLogRing);
+
+	return env->NewGlobalRef(obj);
 }
 
 /**
- * Blocks and waits for incoming client connections on the
- * given socket.
+ * Ends logging to the given object instance. Waits for the
+ * pending messages to be passed to the application, and let
+ * the drainer release the global reference.
  *
  * @param env JNIEnv interface.
- * @param obj object instance.
- * @param sd socket descriptor.
- * @return client socket.
- * @throws IOException
+ * @param obj global reference to object instance.
  */
-static int AcceptOnSocket(
-		JNIEnv* env,
-		jobject obj,
-		int sd)
+static void EndLog(JNIEnv* env, jobject obj)
 {
-	struct sockaddr_in address;
-	socklen_t addressLength = sizeof(address);
-
-	// Blocks and waits for an incoming client connection
-	// and accepts it
-	LogMessage(env, obj, "Waiting for a client connection...");
+	if (!logRingReady)
+	{
+		env->DeleteGlobalRef(obj);
+		return;
+	}
 
-	int clientSocket = accept(sd,
-			(struct sockaddr*) &address,
-			&addressLength);
+	// Release record cannot be dropped, wait for space
+	size_t pos;
+	struct LogRecord* record;
 
-	// If client socket is not valid
-	if (-1 == clientSocket)
+	while (NULL == (record = ClaimLogRecord(&pos)))
 	{
-		// Throw an exception with error number
-		ThrowErrnoException(env, "java/io/IOException", errno);
+		usleep(LOG_DRAIN_INTERVAL);
 	}
-	else
+
+	record->obj = obj;
+	record->release = true;
+	PublishLogRecord(record, pos);
+
+	// Wait for the messages to be delivered
+	for (useconds_t waited = 0; (waited < LOG_FLUSH_TIMEOUT)
+			&& (pos >= __atomic_load_n(&logRing.dequeuePos,
+					__ATOMIC_ACQUIRE)); waited += 1000)
 	{
-		// Log address
-		LogAddress(env, obj, "Client connection from ", &address);
+		usleep(1000);
 	}
-
-	return clientSocket;
 }
 
 /**
- * Block and receive data from the socket into the buffer.
+ * Logs the given message to the application at the given
+ * level. The message is only formatted into the log ring,
+ * no Java calls are made on the calling thread.
  *
- * @param env JNIEnv interface.
- * @param obj object instance.
- * @param sd socket descriptor.
- * @param buffer data buffer.
- * @param bufferSize buffer size.
- * @return receive size.
- * @throws IOException
+ * @param level log level.
+ * @param obj object instance from BeginLog.
+ * @param format message format.
+ * @param ap message arguments.
  */
-static ssize_t ReceiveFromSocket(
-		JNIEnv* env,
+static void LogMessageV(
+		int level,
 		jobject obj,
-		int sd,
-		char* buffer,
-		size_t bufferSize)
+		const char* format,
+		va_list ap)
 {
-	// Block and receive data from the socket into the buffer
-	LogMessage(env, obj, "Receiving from the socket...");
-	ssize_t recvSize = recv(sd, buffer, bufferSize - 1, 0);
+	if ((level > LOG_LEVEL) || !logRingReady)
+		return;
 
-	// If receive is failed
-	if (-1 == recvSize)
+	size_t pos;
+	struct LogRecord* record = ClaimLogRecord(&pos);
+
+	if (NULL == record)
 	{
-		// Throw an exception with error number
-		ThrowErrnoException(env, "java/io/IOException", errno);
+		__atomic_add_fetch(&logRing.dropCount, 1, __ATOMIC_RELAXED);
 	}
 	else
 	{
-		// NULL terminate the buffer to make it a string
-		buffer[recvSize] = NULL;
+		// Format the log message
+		vsnprintf(record->message, MAX_LOG_MESSAGE_LENGTH, format, ap);
 
-		// If data is received
-		if (recvSize > 0)
-		{
-			LogMessage(env, obj, "Received %d bytes: %s", recvSize, buffer);
-		}
-		else
-		{
-			LogMessage(env, obj, "Client disconnected.");
-		}
+		record->obj = obj;
+		record->release = false;
+		PublishLogRecord(record, pos);
 	}
-
-	return recvSize;
 }
 
 /**
- * Send data buffer to the socket.
+ * Logs the given message to the application.
  *
  * @param env JNIEnv interface.
- * @param obj object instance.
- * @param sd socket descriptor.
- * @param buffer data buffer.
- * @param bufferSize buffer size.
- * @return sent size.
- * @throws IOException
+ * @param obj object instance from BeginLog.
+ * @param format message format and arguments.
  */
-static ssize_t SendToSocket(
+static void LogMessage(
 		JNIEnv* env,
 		jobject obj,
-		int sd,
-		const char* buffer,
-		size_t bufferSize)
+		const char* format,
+		...)
 {
-	// Send data buffer to the socket
-	LogMessage(env, obj, "Sending to the socket...");
-	ssize_t sentSize = send(sd, buffer, bufferSize, 0);
+	va_list ap;
+	va_start(ap, format);
+	LogMessageV(LOG_LEVEL_INFO, obj, format, ap);
+	va_end(ap);
+}
+
+/**
+ * Logs the given error message to the application.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance from BeginLog.
+ * @param format message format and arguments.
+ */
+static void LogError(
+		JNIEnv* env,
+		jobject obj,
+		const char* format,
+		...)
+{
+	va_list ap;
+	va_start(ap, format);
+	LogMessageV(LOG_LEVEL_ERROR, obj, format, ap);
+	va_end(ap);
+}
+
+/**
+ * Passes the socket core and server engine messages to the
+ * log ring.
+ *
+ * @param context object instance from BeginLog.
+ * @param level log level.
+ * @param format message format.
+ * @param ap message arguments.
+ */
+static void LogToRing(
+		void* context,
+		int level,
+		const char* format,
+		va_list ap)
+{
+	LogMessageV(level, (jobject) context, format, ap);
+}
+
+/**
+ * Gets the log sink for the given object. Objects not from
+ * BeginLog are not logged.
+ *
+ * @param obj object instance from BeginLog or NULL.
+ * @return log sink.
+ */
+static struct EchoLogSink GetLogSink(jobject obj)
+{
+	struct EchoLogSink sink = { LogToRing, obj };
+
+	if (NULL == obj)
+	{
+		sink.log = NULL;
+	}
+
+	return sink;
+}
+
+/**
+ * Throws a new exception using the given exception class
+ * and exception message.
+ *
+ * @param env JNIEnv interface.
+ * @param clazz exception class from the JNI cache.
+ * @param message exception message.
+ */
+static void ThrowException(
+		JNIEnv* env,
+		jclass clazz,
+		const char* message)
+{
+	// Throw exception
+	env->ThrowNew(clazz, message);
+}
+
+/**
+ * Throws a new exception using the given exception class
+ * and error message based on the error number.
+ *
+ * @param env JNIEnv interface.
+ * @param clazz exception class from the JNI cache.
+ * @param errnum error number.
+ */
+static void ThrowErrnoException(
+		JNIEnv* env,
+		jclass clazz,
+		int errnum)
+{
+	char buffer[MAX_LOG_MESSAGE_LENGTH];
+
+	// Get message for the error number
+	if (-1 == strerror_r(errnum, buffer, MAX_LOG_MESSAGE_LENGTH))
+	{
+		strerror_r(errno, buffer, MAX_LOG_MESSAGE_LENGTH);
+	}
+
+	// Throw exception
+	ThrowException(env, clazz, buffer);
+}
+
+/**
+ * Logs the given message with the error message based on
+ * the error number.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance.
+ * @param message message text.
+ * @param errnum error number.
+ */
+static void LogErrno(
+		JNIEnv* env,
+		jobject obj,
+		const char* message,
+		int errnum)
+{
+	char buffer[MAX_LOG_MESSAGE_LENGTH];
+
+	// Get message for the error number
+	if (-1 == strerror_r(errnum, buffer, MAX_LOG_MESSAGE_LENGTH))
+	{
+		strerror_r(errno, buffer, MAX_LOG_MESSAGE_LENGTH);
+	}
+
+	// Log message
+	LogError(env, obj, "%s %s", message, buffer);
+}
+
+/**
+ * Gets the memory address and the capacity of the given direct
+ * byte buffer, so that its content is used without copying.
+ *
+ * @param env JNIEnv interface.
+ * @param buffer direct byte buffer.
+ * @param capacity buffer capacity.
+ * @return buffer address or NULL if not a direct buffer.
+ * @throws IllegalArgumentException
+ */
+static char* GetDirectBuffer(
+		JNIEnv* env,
+		jobject buffer,
+		size_t* capacity)
+{
+	char* address = (NULL == buffer) ? NULL
+			: (char*) env->GetDirectBufferAddress(buffer);
+
+	if (NULL == address)
+	{
+		ThrowException(env, jniCache.illegalArgumentException,
+				"Buffer is not a direct buffer.");
+		return NULL;
+	}
+
+	*capacity = (size_t) env->GetDirectBufferCapacity(buffer);
+
+	return address;
+}
+
+/**
+ * Gets the payload and the reply areas of the given direct
+ * byte buffers.
+ *
+ * @param env JNIEnv interface.
+ * @param payload payload buffer.
+ * @param payloadSize payload size.
+ * @param reply reply buffer.
+ * @param payloadAddress payload address.
+ * @param replyAddress reply address.
+ * @param replyCapacity reply capacity.
+ * @return true if both buffers are valid.
+ * @throws IllegalArgumentException
+ */
+static bool GetPayloadBuffers(
+		JNIEnv* env,
+		jobject payload,
+		jint payloadSize,
+		jobject reply,
+		const char** payloadAddress,
+		char** replyAddress,
+		size_t* replyCapacity)
+{
+	size_t payloadCapacity;
+
+	*payloadAddress = GetDirectBuffer(env, payload, &payloadCapacity);
+	if (NULL == *payloadAddress)
+		return false;
+
+	if ((payloadSize < 0) || ((size_t) payloadSize > payloadCapacity))
+	{
+		ThrowException(env, jniCache.illegalArgumentException,
+				"Payload size exceeds the buffer capacity.");
+		return false;
+	}
+
+	*replyAddress = GetDirectBuffer(env, reply, replyCapacity);
+
+	return (NULL != *replyAddress);
+}
+
+/**
+ * Named socket profile.
+ */
+struct SocketProfilePreset
+{
+	// Preset name
+	const char* name;
+
+	// Socket profile
+	struct EchoSocketProfile profile;
+};
+
+// Socket profile presets, the first one is the default
+static const struct SocketProfilePreset socketProfilePresets[] =
+{
+	{ "default", { 0, 0, true, false, 0, 0, DEFAULT_BACKLOG, 0,
+			DEFAULT_COALESCE_SIZE } },
+	{ "low-latency", { 0, 0, true, true, 50, 256, 1024, 0,
+			DEFAULT_COALESCE_SIZE } },
+	{ "bulk-throughput", { 4194304, 4194304, false, false, 0, 0, 1024, 500,
+			262144 } }
+};
+
+/**
+ * Named scheduling policy.
+ */
+struct SchedulingPolicy
+{
+	// Policy name
+	const char* name;
+
+	// Policy, or SCHED_INHERIT
+	int policy;
+};
+
+// Scheduling policies by name
+static const struct SchedulingPolicy schedulingPolicies[] =
+{
+	{ "inherit", SCHED_INHERIT },
+	{ "other", SCHED_OTHER },
+	{ "batch", SCHED_BATCH },
+	{ "idle", SCHED_IDLE },
+	{ "fifo", SCHED_FIFO },
+	{ "rr", SCHED_RR }
+};
+
+// Process wide configuration, set through nativeConfigure and
+// read when a server or client is started, defaults set in JNI_OnLoad
+static struct EchoConfig config;
+
+/**
+ * Allocates a new page aligned data buffer of the given size.
+ *
+ * @param env JNIEnv interface.
+ * @param size buffer size.
+ * @return data buffer.
+ * @throws OutOfMemoryError
+ */
+static char* NewBuffer(JNIEnv* env, size_t size)
+{
+	char* buffer = EchoNewBuffer(size);
+
+	if (NULL == buffer)
+	{
+		ThrowException(env, jniCache.outOfMemoryError,
+				"Unable to allocate buffer.");
+	}
+
+	return buffer;
+}
+
+/**
+ * Parses the given integer option value and checks it is
+ * within the given range.
+ *
+ * @param env JNIEnv interface.
+ * @param name option name.
+ * @param value option value.
+ * @param min min value.
+ * @param max max value.
+ * @return option value.
+ * @throws IllegalArgumentException
+ */
+static long ParseIntegerOption(
+		JNIEnv* env,
+		const char* name,
+		const char* value,
+		long min,
+		long max)
+{
+	char* end;
+
+	errno = 0;
+	long result = strtol(value, &end, 0);
+
+	if ((0 != errno) || (end == value) || ('\0' != *end)
+			|| (result < min) || (result > max))
+	{
+		char message[MAX_LOG_MESSAGE_LENGTH];
+		snprintf(message, MAX_LOG_MESSAGE_LENGTH,
+				"Invalid %s value %s, expected %ld to %ld.",
+				name, value, min, max);
+
+		ThrowException(env, jniCache.illegalArgumentException, message);
+	}
+
+	return result;
+}
+
+/**
+ * Replaces the socket profile in the configuration with the
+ * given preset. Options that follow it can still override the
+ * preset values.
+ *
+ * @param env JNIEnv interface.
+ * @param target target configuration.
+ * @param name preset name.
+ * @throws IllegalArgumentException
+ */
+static void SetSocketProfilePreset(
+		JNIEnv* env,
+		struct EchoConfig* target,
+		const char* name)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(socketProfilePresets); i++)
+	{
+		if (0 == strcmp(socketProfilePresets[i].name, name))
+		{
+			target->socket = socketProfilePresets[i].profile;
+			return;
+		}
+	}
+
+	char message[MAX_LOG_MESSAGE_LENGTH];
+	snprintf(message, MAX_LOG_MESSAGE_LENGTH,
+			"Unknown socket profile %s.", name);
+
+	ThrowException(env, jniCache.illegalArgumentException, message);
+}
+
+/**
+ * Parses the given CPU list option, such as 0-3,6. An empty
+ * list is valid.
+ *
+ * @param env JNIEnv interface.
+ * @param name option name.
+ * @param value option value.
+ * @param cpus parsed CPUs, MAX_WORKER_CPUS at most.
+ * @return number of parsed CPUs.
+ * @throws IllegalArgumentException
+ */
+static size_t ParseCpuListOption(
+		JNIEnv* env,
+		const char* name,
+		const char* value,
+		int* cpus)
+{
+	size_t count = 0;
+	const char* p = value;
+
+	while ('\0' != *p)
+	{
+		char* end;
+		long first = strtol(p, &end, 10);
+		long last = first;
+
+		bool valid = (end != p) && (first >= 0) && (first < CPU_SETSIZE);
+
+		if (valid && ('-' == *end))
+		{
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			valid = (end != p) && (last >= first) && (last < CPU_SETSIZE);
+		}
+
+		valid = valid && ((',' == *end) || ('\0' == *end))
+				&& ((size_t) (last - first) < MAX_WORKER_CPUS - count);
+
+		if (!valid)
+		{
+			char message[MAX_LOG_MESSAGE_LENGTH];
+			snprintf(message, MAX_LOG_MESSAGE_LENGTH,
+					"Invalid %s value %s, expected up to %d CPUs such as 0-3,6.",
+					name, value, MAX_WORKER_CPUS);
+
+			ThrowException(env, jniCache.illegalArgumentException, message);
+			return 0;
+		}
+
+		for (long cpu = first; cpu <= last; cpu++)
+		{
+			cpus[count++] = (int) cpu;
+		}
+
+		p = (',' == *end) ? end + 1 : end;
+	}
+
+	return count;
+}
+
+/**
+ * Sets the scheduling policy in the configuration.
+ *
+ * @param env JNIEnv interface.
+ * @param target target configuration.
+ * @param name policy name.
+ * @throws IllegalArgumentException
+ */
+static void SetSchedulingPolicy(
+		JNIEnv* env,
+		struct EchoConfig* target,
+		const char* name)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(schedulingPolicies); i++)
+	{
+		if (0 == strcmp(schedulingPolicies[i].name, name))
+		{
+			target->scheduling.policy = schedulingPolicies[i].policy;
+			return;
+		}
+	}
+
+	char message[MAX_LOG_MESSAGE_LENGTH];
+	snprintf(message, MAX_LOG_MESSAGE_LENGTH,
+			"Unknown scheduling policy %s.", name);
+
+	ThrowException(env, jniCache.illegalArgumentException, message);
+}
+
+/**
+ * Sets the given name=value option in the configuration.
+ *
+ * @param env JNIEnv interface.
+ * @param target target configuration.
+ * @param option option text.
+ * @throws IllegalArgumentException
+ */
+static void SetOption(
+		JNIEnv* env,
+		struct EchoConfig* target,
+		const char* option)
+{
+	char name[MAX_LOG_MESSAGE_LENGTH];
+	char message[MAX_LOG_MESSAGE_LENGTH];
+
+	// Split the option name and the value
+	const char* separator = strchr(option, '=');
+	if ((NULL == separator)
+			|| ((size_t) (separator - option) >= sizeof(name)))
+	{
+		snprintf(message, MAX_LOG_MESSAGE_LENGTH,
+				"Option %s is not a name=value pair.", option);
+
+		ThrowException(env, jniCache.illegalArgumentException, message);
+		return;
+	}
+
+	memcpy(name, option, separator - option);
+	name[separator - option] = '\0';
+
+	const char* value = separator + 1;
+
+	if (0 == strcmp("bufferSize", name))
+	{
+		target->bufferSize = (size_t) ParseIntegerOption(env, name, value,
+				MIN_BUFFER_SIZE, MAX_BUFFER_SIZE);
+	}
+	else if (0 == strcmp("poolSize", name))
+	{
+		target->poolSize = (size_t) ParseIntegerOption(env, name, value,
+				1, MAX_POOL_SIZE);
+	}
+	else if (0 == strcmp("zeroCopy", name))
+	{
+		target->zeroCopy = (0 != ParseIntegerOption(env, name, value,
+				0, 1));
+	}
+	else if (0 == strcmp("highWaterMark", name))
+	{
+		target->highWaterMark = (size_t) ParseIntegerOption(env, name, value,
+				MIN_BUFFER_SIZE, MAX_HIGH_WATER_MARK);
+	}
+	else if (0 == strcmp("noDelay", name))
+	{
+		target->socket.noDelay = (0 != ParseIntegerOption(env, name, value,
+				0, 1));
+	}
+	else if (0 == strcmp("keepAlive", name))
+	{
+		target->keepAlive = (int) ParseIntegerOption(env, name, value,
+				0, MAX_KEEP_ALIVE);
+	}
+	else if (0 == strcmp("framing", name))
+	{
+		target->framing = (0 != ParseIntegerOption(env, name, value,
+				0, 1));
+	}
+	else if (0 == strcmp("maxFrameSize", name))
+	{
+		target->maxFrameSize = (size_t) ParseIntegerOption(env, name, value,
+				1, MAX_MAX_FRAME_SIZE);
+	}
+	else if (0 == strcmp("ioUring", name))
+	{
+		target->ioUring = (0 != ParseIntegerOption(env, name, value,
+				0, 1));
+	}
+	else if (0 == strcmp("drainTimeout", name))
+	{
+		target->drainTimeout = (int) ParseIntegerOption(env, name, value,
+				0, MAX_DRAIN_TIMEOUT);
+	}
+	else if (0 == strcmp("idleTimeout", name))
+	{
+		target->idleTimeout = (int) ParseIntegerOption(env, name, value,
+				0, MAX_CONNECTION_TIMEOUT);
+	}
+	else if (0 == strcmp("readTimeout", name))
+	{
+		target->readTimeout = (int) ParseIntegerOption(env, name, value,
+				0, MAX_CONNECTION_TIMEOUT);
+	}
+	else if (0 == strcmp("writeTimeout", name))
+	{
+		target->writeTimeout = (int) ParseIntegerOption(env, name, value,
+				0, MAX_CONNECTION_TIMEOUT);
+	}
+	else if (0 == strcmp("udpFlows", name))
+	{
+		target->udpFlows = (size_t) ParseIntegerOption(env, name, value,
+				0, MAX_UDP_FLOWS);
+	}
+	else if (0 == strcmp("udpRateLimit", name))
+	{
+		target->udpRateLimit = (int) ParseIntegerOption(env, name, value,
+				0, MAX_UDP_RATE_LIMIT);
+	}
+	else if (0 == strcmp("udpOffload", name))
+	{
+		target->udpOffload = (0 != ParseIntegerOption(env, name, value,
+				0, 1));
+	}
+	else if (0 == strcmp("dualStack", name))
+	{
+		target->dualStack = (0 != ParseIntegerOption(env, name, value,
+				0, 1));
+	}
+	else if (0 == strcmp("resolveTimeout", name))
+	{
+		target->resolveTimeout = (int) ParseIntegerOption(env, name, value,
+				1, MAX_RESOLVE_TIMEOUT);
+	}
+	else if (0 == strcmp("connectTimeout", name))
+	{
+		target->connectTimeout = (int) ParseIntegerOption(env, name, value,
+				0, MAX_CONNECT_TIMEOUT);
+	}
+	else if (0 == strcmp("socketProfile", name))
+	{
+		SetSocketProfilePreset(env, target, value);
+	}
+	else if (0 == strcmp("receiveBuffer", name))
+	{
+		target->socket.receiveBuffer = (int) ParseIntegerOption(env, name,
+				value, 0, MAX_SOCKET_BUFFER_SIZE);
+	}
+	else if (0 == strcmp("sendBuffer", name))
+	{
+		target->socket.sendBuffer = (int) ParseIntegerOption(env, name,
+				value, 0, MAX_SOCKET_BUFFER_SIZE);
+	}
+	else if (0 == strcmp("quickAck", name))
+	{
+		target->socket.quickAck = (0 != ParseIntegerOption(env, name, value,
+				0, 1));
+	}
+	else if (0 == strcmp("busyPoll", name))
+	{
+		target->socket.busyPoll = (int) ParseIntegerOption(env, name, value,
+				0, MAX_BUSY_POLL);
+	}
+	else if (0 == strcmp("fastOpen", name))
+	{
+		target->socket.fastOpen = (int) ParseIntegerOption(env, name, value,
+				0, MAX_FAST_OPEN);
+	}
+	else if (0 == strcmp("backlog", name))
+	{
+		target->socket.backlog = (int) ParseIntegerOption(env, name, value,
+				1, MAX_BACKLOG);
+	}
+	else if (0 == strcmp("coalesceDelay", name))
+	{
+		target->socket.coalesceDelay = (int) ParseIntegerOption(env, name,
+				value, 0, MAX_COALESCE_DELAY);
+	}
+	else if (0 == strcmp("coalesceSize", name))
+	{
+		target->socket.coalesceSize = (int) ParseIntegerOption(env, name,
+				value, 1, MAX_COALESCE_SIZE);
+	}
+	else if (0 == strcmp("capturePath", name))
+	{
+		if (strlen(value) >= sizeof(target->capturePath))
+		{
+			snprintf(message, MAX_LOG_MESSAGE_LENGTH,
+					"Capture path is longer than %zu bytes.",
+					sizeof(target->capturePath) - 1);
+
+			ThrowException(env, jniCache.illegalArgumentException, message);
+			return;
+		}
+
+		strcpy(target->capturePath, value);
+	}
+	else if (0 == strcmp("captureSize", name))
+	{
+		target->captureSize = (size_t) ParseIntegerOption(env, name, value,
+				MIN_CAPTURE_SIZE, MAX_CAPTURE_SIZE);
+	}
+	else if (0 == strcmp("workerCpus", name))
+	{
+		target->scheduling.cpuCount = ParseCpuListOption(env, name, value,
+				target->scheduling.cpus);
+	}
+	else if (0 == strcmp("acceptThread", name))
+	{
+		target->scheduling.acceptThread = (0 != ParseIntegerOption(env, name,
+				value, 0, 1));
+	}
+	else if (0 == strcmp("acceptCpus", name))
+	{
+		target->scheduling.acceptCpuCount = ParseCpuListOption(env, name,
+				value, target->scheduling.acceptCpus);
+	}
+	else if (0 == strcmp("workerPolicy", name))
+	{
+		SetSchedulingPolicy(env, target, value);
+	}
+	else if (0 == strcmp("workerPriority", name))
+	{
+		target->scheduling.priority = (int) ParseIntegerOption(env, name,
+				value, MIN_WORKER_PRIORITY, MAX_WORKER_PRIORITY);
+	}
+	else if (0 == strcmp("workerNice", name))
+	{
+		target->scheduling.nice = (int) ParseIntegerOption(env, name, value,
+				-20, 19);
+		target->scheduling.niceSet = true;
+	}
+	else
+	{
+		snprintf(message, MAX_LOG_MESSAGE_LENGTH,
+				"Unknown option %.*s.", MAX_LOG_MESSAGE_LENGTH / 2, name);
+
+		ThrowException(env, jniCache.illegalArgumentException, message);
+	}
+}
+
+void Java_com_apress_echo_AbstractEchoActivity_nativeConfigure(
+		JNIEnv* env,
+		jclass clazz,
+		jobjectArray options)
+{
+	// Options are applied only if they are all valid
+	struct EchoConfig target = config;
+
+	jsize optionCount = env->GetArrayLength(options);
+
+	for (jsize i = 0; i < optionCount; i++)
+	{
+		jstring option = (jstring) env->GetObjectArrayElement(options, i);
+		if (NULL == option)
+		{
+			ThrowException(env, jniCache.nullPointerException,
+					"Option is null.");
+			return;
+		}
+
+		// Get option as C string
+		const char* optionText = env->GetStringUTFChars(option, NULL);
+		if (NULL != optionText)
+		{
+			SetOption(env, &target, optionText);
+
+			// Release the option text
+			env->ReleaseStringUTFChars(option, optionText);
+		}
+
+		env->DeleteLocalRef(option);
+
+		if (NULL != env->ExceptionOccurred())
+			return;
+	}
+
+	config = target;
+}
+
+/**
+ * Applies the configured socket profile to the given socket.
+ * Every socket the library creates goes through here.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance, or NULL to not log.
+ * @param sd socket descriptor.
+ * @param family socket family.
+ * @param type socket type.
+ * @param role SOCKET_NEW, SOCKET_LISTENING or SOCKET_ACCEPTED.
+ */
+static void ApplySocketProfile(
+		JNIEnv* env,
+		jobject obj,
+		int sd,
+		int family,
+		int type,
+		int role)
+{
+	struct EchoLogSink sink = GetLogSink(obj);
+	EchoApplySocketProfile(&sink, &config.socket, sd, family, type, role);
+}
+
+/**
+ * Constructs a new UDP socket.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance.
+ * @param family socket family, PF_INET or PF_INET6.
+ * @return socket descriptor.
+ * @throws IOException
+ */
+static int NewUdpSocket(JNIEnv* env, jobject obj, int family)
+{
+	struct EchoLogSink sink = GetLogSink(obj);
+	int udpSocket = EchoNewSocket(&sink, family, SOCK_DGRAM);
+
+	// Check if socket is properly constructed
+	if (udpSocket < 0)
+	{
+		// Throw an exception with error number
+		ThrowErrnoException(env, jniCache.ioException, -udpSocket);
+		return -1;
+	}
+
+	ApplySocketProfile(env, obj, udpSocket, family, SOCK_DGRAM,
+			SOCKET_NEW);
+
+	return udpSocket;
+}
+
+/**
+ * Listens on given socket with the given backlog for
+ * pending connections. When the backlog is full, the
+ * new connections will be rejected.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance.
+ * @param sd socket descriptor.
+ * @param backlog backlog size.
+ * @throws IOException
+ */
+static void ListenOnSocket(
+		JNIEnv* env,
+		jobject obj,
+		int sd,
+		int backlog)
+{
+	struct EchoLogSink sink = GetLogSink(obj);
+	int result = EchoListenOnSocket(&sink, sd, backlog);
+
+	if (result < 0)
+	{
+		// Throw an exception with error number
+		ThrowErrnoException(env, jniCache.ioException, -result);
+	}
+}
+
+/**
+ * Logs the IP address and the port number from the
+ * given address.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance.
+ * @param message message text.
+ * @param address IPv4 or IPv6 address.
+ * @throws IOException
+ */
+static void LogAddress(
+		JNIEnv* env,
+		jobject obj,
+		const char* message,
+		const struct sockaddr_storage* address)
+{
+	struct EchoLogSink sink = GetLogSink(obj);
+	int result = EchoLogAddress(&sink, LOG_LEVEL_INFO, message, address);
+
+	if (result < 0)
+	{
+		// Throw an exception with error number
+		ThrowErrnoException(env, jniCache.ioException, -result);
+	}
+}
+
+/**
+ * Block and receive data from the socket into the buffer.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance.
+ * @param sd socket descriptor.
+ * @param buffer data buffer.
+ * @param bufferSize buffer size.
+ * @return receive size.
+ * @throws IOException
+ */
+static ssize_t ReceiveFromSocket(
+		JNIEnv* env,
+		jobject obj,
+		int sd,
+		char* buffer,
+		size_t bufferSize)
+{
+	struct EchoLogSink sink = GetLogSink(obj);
+	ssize_t recvSize = EchoReceiveFromSocket(&sink, sd, buffer, bufferSize);
+
+	// If receive is failed
+	if (recvSize < 0)
+	{
+		// Throw an exception with error number
+		ThrowErrnoException(env, jniCache.ioException, (int) -recvSize);
+		return -1;
+	}
+
+	return recvSize;
+}
+
+/**
+ * Send data buffer to the socket.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance.
+ * @param sd socket descriptor.
+ * @param buffer data buffer.
+ * @param bufferSize buffer size.
+ * @return sent size.
+ * @throws IOException
+ */
+static ssize_t SendToSocket(
+		JNIEnv* env,
+		jobject obj,
+		int sd,
+		const char* buffer,
+		size_t bufferSize)
+{
+	struct EchoLogSink sink = GetLogSink(obj);
+	ssize_t sentSize = EchoSendToSocket(&sink, sd, buffer, bufferSize);
+
+	// If send is failed
+	if (sentSize < 0)
+	{
+		// Throw an exception with error number
+		ThrowErrnoException(env, jniCache.ioException, (int) -sentSize);
+		return -1;
+	}
+
+	return sentSize;
+}
+
+/**
+ * Host in the resolver cache.
+ */
+struct ResolverEntry
+{
+	// Host name, empty if the entry is unused
+	char host[MAX_HOST_LENGTH];
+
+	// Resolved addresses in the preferred order, without the port
+	struct sockaddr_storage addresses[MAX_RESOLVED_ADDRESSES];
+
+	// Number of resolved addresses
+	size_t count;
+
+	// getaddrinfo error, zero if resolved
+	int error;
+
+	// Waiting to be resolved, the entry is not replaced meanwhile
+	bool pending;
+
+	// Taken by the resolver thread
+	bool resolving;
+
+	// Time the entry expires at, in nanoseconds
+	uint64_t expires;
+};
+
+/**
+ * Resolves the host names on a background thread, so that a
+ * stalled DNS query only keeps the caller waiting until its
+ * resolve timeout. Results are cached for a short time.
+ */
+struct Resolver
+{
+	// Protects the cache
+	pthread_mutex_t mutex;
+
+	// Signaled when a host is queued to be resolved
+	pthread_cond_t queued;
+
+	// Broadcast when a host is resolved
+	pthread_cond_t resolved;
+
+	// Resolver thread is running
+	bool started;
+
+	// Cached hosts
+	struct ResolverEntry entries[RESOLVER_CACHE_SIZE];
+};
+
+// Process wide resolver
+static struct Resolver resolver = { PTHREAD_MUTEX_INITIALIZER,
+		PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, false };
+
+/**
+ * Parses an IPv4 or an IPv6 address literal, the latter may
+ * be in brackets.
+ *
+ * @param host host name or address literal.
+ * @param port port number.
+ * @param address parsed address.
+ * @return true if host is an address literal.
+ */
+static bool ParseAddressLiteral(
+		const char* host,
+		unsigned short port,
+		struct sockaddr_storage* address)
+{
+	memset(address, 0, sizeof(struct sockaddr_storage));
+
+	struct sockaddr_in* address4 = (struct sockaddr_in*) address;
+	if (1 == inet_pton(PF_INET, host, &address4->sin_addr))
+	{
+		address4->sin_family = PF_INET;
+		address4->sin_port = htons(port);
+		return true;
+	}
+
+	char literal[INET6_ADDRSTRLEN];
+	size_t length = strlen(host);
+
+	// Strip the brackets of a URL style literal
+	if ((length > 2) && ('[' == host[0]) && (']' == host[length - 1])
+			&& (length - 2 < sizeof(literal)))
+	{
+		memcpy(literal, host + 1, length - 2);
+		literal[length - 2] = '\0';
+		host = literal;
+	}
+
+	struct sockaddr_in6* address6 = (struct sockaddr_in6*) address;
+	if (1 == inet_pton(PF_INET6, host, &address6->sin6_addr))
+	{
+		address6->sin6_family = PF_INET6;
+		address6->sin6_port = htons(port);
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Resolver thread body, resolves the pending hosts one at a
+ * time. It has no Java environment and does not log.
+ *
+ * @param arg not used.
+ * @return NULL.
+ */
+static void* RunResolver(void* arg)
+{
+	pthread_mutex_lock(&resolver.mutex);
+
+	while (1)
+	{
+		struct ResolverEntry* entry = NULL;
+
+		for (int i = 0; (i < RESOLVER_CACHE_SIZE) && (NULL == entry); i++)
+		{
+			if (resolver.entries[i].pending && !resolver.entries[i].resolving)
+			{
+				entry = &resolver.entries[i];
+			}
+		}
+
+		if (NULL == entry)
+		{
+			pthread_cond_wait(&resolver.queued, &resolver.mutex);
+			continue;
+		}
+
+		entry->resolving = true;
+
+		char host[MAX_HOST_LENGTH];
+		memcpy(host, entry->host, sizeof(host));
+
+		pthread_mutex_unlock(&resolver.mutex);
+
+		// Addresses come sorted by the system preference
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		struct addrinfo* result = NULL;
+		int error = getaddrinfo(host, NULL, &hints, &result);
+
+		pthread_mutex_lock(&resolver.mutex);
+
+		entry->count = 0;
+		entry->error = error;
+
+		for (struct addrinfo* info = result; (NULL != info)
+				&& (entry->count < MAX_RESOLVED_ADDRESSES); info = info->ai_next)
+		{
+			if (((AF_INET == info->ai_family) || (AF_INET6 == info->ai_family))
+					&& (info->ai_addrlen <= sizeof(struct sockaddr_storage)))
+			{
+				memset(&entry->addresses[entry->count], 0,
+						sizeof(struct sockaddr_storage));
+				memcpy(&entry->addresses[entry->count], info->ai_addr,
+						info->ai_addrlen);
+				entry->count++;
+			}
+		}
+
+		if ((0 == error) && (0 == entry->count))
+		{
+			entry->error = EAI_NONAME;
+		}
+
+		entry->expires = EchoGetMonotonicTime() + ((0 == entry->error)
+				? RESOLVER_TTL : RESOLVER_NEGATIVE_TTL);
+		entry->pending = false;
+		entry->resolving = false;
+
+		if (NULL != result)
+		{
+			freeaddrinfo(result);
+		}
+
+		pthread_cond_broadcast(&resolver.resolved);
+	}
+
+	return NULL;
+}
+
+/**
+ * Finds the cache entry of the given host, or takes over an
+ * unused or the first expiring entry that is not pending.
+ *
+ * @param host host name.
+ * @return entry or NULL if all entries are pending.
+ */
+static struct ResolverEntry* GetResolverEntry(const char* host)
+{
+	struct ResolverEntry* victim = NULL;
+
+	for (int i = 0; i < RESOLVER_CACHE_SIZE; i++)
+	{
+		struct ResolverEntry* entry = &resolver.entries[i];
+
+		if (0 == strcmp(entry->host, host))
+			return entry;
+
+		if (!entry->pending && ((NULL == victim)
+				|| ('\0' == entry->host[0])
+				|| (('\0' != victim->host[0])
+						&& (entry->expires < victim->expires))))
+		{
+			victim = entry;
+		}
+	}
+
+	if (NULL != victim)
+	{
+		strcpy(victim->host, host);
+		victim->count = 0;
+		victim->error = 0;
+		victim->expires = 0;
+	}
+
+	return victim;
+}
+
+/**
+ * Resolves the given host name to its addresses with the
+ * given port. Address literals are parsed in place, names
+ * are taken from the cache or passed to the resolver thread.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance, or NULL to not log.
+ * @param host host name or address literal.
+ * @param port port number.
+ * @param addresses resolved addresses.
+ * @return number of resolved addresses, zero on error.
+ * @throws IOException
+ */
+static size_t ResolveHost(
+		JNIEnv* env,
+		jobject obj,
+		const char* host,
+		unsigned short port,
+		struct sockaddr_storage* addresses)
+{
+	char message[MAX_LOG_MESSAGE_LENGTH];
+
+	if (ParseAddressLiteral(host, port, &addresses[0]))
+		return 1;
+
+	if ((strlen(host) >= MAX_HOST_LENGTH) || ('\0' == host[0]))
+	{
+		ThrowException(env, jniCache.illegalArgumentException,
+				"Invalid host name.");
+		return 0;
+	}
+
+	// Timed waits are on the realtime clock
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += config.resolveTimeout / 1000;
+	deadline.tv_nsec += (long) (config.resolveTimeout % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	size_t count = 0;
+	message[0] = '\0';
+
+	pthread_mutex_lock(&resolver.mutex);
+
+	while (1)
+	{
+		struct ResolverEntry* entry = GetResolverEntry(host);
+		if (NULL == entry)
+		{
+			snprintf(message, sizeof(message),
+					"Resolver is busy, unable to resolve %s.", host);
+			break;
+		}
+
+		if (!entry->pending && (entry->expires > EchoGetMonotonicTime()))
+		{
+			if (0 != entry->error)
+			{
+				snprintf(message, sizeof(message), "Unable to resolve %s: %s.",
+						host, gai_strerror(entry->error));
+				break;
+			}
+
+			for (count = 0; count < entry->count; count++)
+			{
+				addresses[count] = entry->addresses[count];
+				EchoSetAddressPort(&addresses[count], port);
+			}
+
+			break;
+		}
+
+		// Queue the host for the resolver thread
+		if (!entry->pending)
+		{
+			entry->pending = true;
+			pthread_cond_signal(&resolver.queued);
+
+			if (NULL != obj)
+			{
+				LogMessage(env, obj, "Resolving %s...", host);
+			}
+		}
+
+		if (!resolver.started)
+		{
+			pthread_t thread;
+			pthread_attr_t attributes;
+
+			pthread_attr_init(&attributes);
+			pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+
+			resolver.started = (0 == pthread_create(&thread, &attributes,
+					RunResolver, NULL));
+
+			pthread_attr_destroy(&attributes);
+
+			if (!resolver.started)
+			{
+				entry->pending = false;
+				snprintf(message, sizeof(message),
+						"Unable to start the resolver.");
+				break;
+			}
+		}
+
+		// Entry may be replaced once resolved, so it is looked up again
+		if (ETIMEDOUT == pthread_cond_timedwait(&resolver.resolved,
+				&resolver.mutex, &deadline))
+		{
+			snprintf(message, sizeof(message), "Resolving %s timed out.",
+					host);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&resolver.mutex);
+
+	if ('\0' != message[0])
+	{
+		ThrowException(env, jniCache.ioException, message);
+	}
+
+	return count;
+}
+
+/**
+ * Orders the addresses for the connect race, alternating the
+ * address families starting with the preferred one.
+ *
+ * @param addresses addresses in the preferred order.
+ * @param count number of addresses.
+ * @param ordered ordered addresses.
+ */
+static void OrderHappyEyeballs(
+		const struct sockaddr_storage* addresses,
+		size_t count,
+		struct sockaddr_storage* ordered)
+{
+	bool taken[MAX_RESOLVED_ADDRESSES];
+	memset(taken, 0, sizeof(taken));
+
+	sa_family_t family = addresses[0].ss_family;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		// Next of the wanted family, or of any if there is none left
+		size_t next = count;
+
+		for (size_t j = 0; j < count; j++)
+		{
+			if (!taken[j] && ((count == next)
+					|| (addresses[j].ss_family == family)))
+			{
+				if (count == next)
+				{
+					next = j;
+				}
+
+				if (addresses[j].ss_family == family)
+				{
+					next = j;
+					break;
+				}
+			}
+		}
+
+		taken[next] = true;
+		ordered[i] = addresses[next];
+
+		family = (AF_INET6 == family) ? AF_INET : AF_INET6;
+	}
+}
+
+/**
+ * Starts a non-blocking connect to the given address.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance, or NULL to not log.
+ * @param address server address.
+ * @param type socket type, stream or datagram.
+ * @param connected set if connected at once.
+ * @return socket descriptor, or -1 with errno.
+ */
+static int StartConnect(
+		JNIEnv* env,
+		jobject obj,
+		const struct sockaddr_storage* address,
+		int type,
+		bool* connected)
+{
+	int sd = socket(address->ss_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (-1 == sd)
+		return -1;
+
+	ApplySocketProfile(env, obj, sd, address->ss_family, type, SOCKET_NEW);
+
+	if (NULL != obj)
+	{
+		LogAddress(env, obj, "Connecting to", address);
+	}
+
+	*connected = (0 == connect(sd, (const struct sockaddr*) address,
+			EchoGetAddressLength(address)));
+
+	if (!*connected && (EINPROGRESS != errno))
+	{
+		int error = errno;
+		close(sd);
+		errno = error;
+
+		return -1;
+	}
+
+	return sd;
+}
+
+/**
+ * Connect race of the resolved addresses of a host. It is
+ * advanced by its owner's poll loop, so that many races can
+ * run on a single thread.
+ */
+struct ConnectRace
+{
+	// Addresses in the order they join the race
+	struct sockaddr_storage addresses[MAX_RESOLVED_ADDRESSES];
+
+	// Number of addresses
+	size_t count;
+
+	// Next address to join the race
+	size_t next;
+
+	// Socket type, stream or datagram
+	int type;
+
+	// Attempts in flight
+	struct pollfd attempts[MAX_RESOLVED_ADDRESSES];
+
+	// Time each attempt gives up at in nanoseconds, zero for never
+	uint64_t deadlines[MAX_RESOLVED_ADDRESSES];
+
+	// Number of attempts in flight
+	size_t attemptCount;
+
+	// Time the next address joins at in nanoseconds
+	uint64_t nextStart;
+
+	// Error number of the last failed attempt
+	int error;
+
+	// Connected socket of the winner, or -1
+	int sd;
+};
+
+/**
+ * Initializes the connect race of the given addresses.
+ *
+ * @param race connect race.
+ * @param addresses resolved addresses in the preferred order.
+ * @param count number of addresses.
+ * @param type socket type, stream or datagram.
+ */
+static void InitConnectRace(
+		struct ConnectRace* race,
+		const struct sockaddr_storage* addresses,
+		size_t count,
+		int type)
+{
+	OrderHappyEyeballs(addresses, count, race->addresses);
+
+	race->count = count;
+	race->next = 0;
+	race->type = type;
+	race->attemptCount = 0;
+	race->nextStart = 0;
+	race->error = ECONNREFUSED;
+	race->sd = -1;
+}
+
+/**
+ * Checks if the connect race is won or all of its attempts
+ * failed.
+ *
+ * @param race connect race.
+ * @return true if done.
+ */
+static inline bool IsConnectRaceDone(const struct ConnectRace* race)
+{
+	return (-1 != race->sd)
+			|| ((0 == race->attemptCount) && (race->next >= race->count));
+}
+
+/**
+ * Removes the attempt from the race, keeping the attempts
+ * packed. The last attempt takes its slot.
+ *
+ * @param race connect race.
+ * @param index attempt index.
+ */
+static void RemoveConnectAttempt(struct ConnectRace* race, size_t index)
+{
+	race->attemptCount--;
+	race->attempts[index] = race->attempts[race->attemptCount];
+	race->deadlines[index] = race->deadlines[race->attemptCount];
+}
+
+/**
+ * Gives up the attempts past their deadline, and starts the
+ * next addresses whose turn has come. A failed attempt hands
+ * its turn to the next address at once.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance, or NULL to not log.
+ * @param race connect race.
+ * @param now current time in nanoseconds.
+ */
+static void AdvanceConnectRace(
+		JNIEnv* env,
+		jobject obj,
+		struct ConnectRace* race,
+		uint64_t now)
+{
+	for (size_t i = 0; i < race->attemptCount; i++)
+	{
+		if ((0 != race->deadlines[i]) && (now >= race->deadlines[i]))
+		{
+			close(race->attempts[i].fd);
+			race->error = ETIMEDOUT;
+			race->nextStart = now;
+
+			RemoveConnectAttempt(race, i--);
+		}
+	}
+
+	// Next address joins when its turn comes or nothing is left
+	while ((-1 == race->sd) && (race->next < race->count)
+			&& ((0 == race->attemptCount) || (now >= race->nextStart)))
+	{
+		bool connected = false;
+		int attempt = StartConnect(env, obj, &race->addresses[race->next++],
+				race->type, &connected);
+
+		if (-1 == attempt)
+		{
+			race->error = errno;
+			race->nextStart = now;
+		}
+		else if (connected)
+		{
+			race->sd = attempt;
+		}
+		else
+		{
+			race->attempts[race->attemptCount].fd = attempt;
+			race->attempts[race->attemptCount].events = POLLOUT;
+			race->attempts[race->attemptCount].revents = 0;
+			race->deadlines[race->attemptCount] = (0 == config.connectTimeout)
+					? 0 : now + ((uint64_t) config.connectTimeout * 1000000ULL);
+			race->attemptCount++;
+
+			race->nextStart = now + (HAPPY_EYEBALLS_DELAY * 1000000ULL);
+		}
+	}
+}
+
+/**
+ * Gets the time until the connect race has to be advanced,
+ * either for the next address or for an attempt deadline.
+ *
+ * @param race connect race.
+ * @param now current time in nanoseconds.
+ * @return timeout in ms, or -1 to wait for the attempts only.
+ */
+static int GetConnectRaceTimeout(const struct ConnectRace* race, uint64_t now)
+{
+	uint64_t wake = (race->next < race->count) ? race->nextStart : 0;
+
+	for (size_t i = 0; i < race->attemptCount; i++)
+	{
+		if ((0 != race->deadlines[i])
+				&& ((0 == wake) || (race->deadlines[i] < wake)))
+		{
+			wake = race->deadlines[i];
+		}
+	}
+
+	if (0 == wake)
+		return -1;
+
+	if (wake <= now)
+		return 0;
+
+	return (int) ((wake - now + 999999ULL) / 1000000ULL);
+}
+
+/**
+ * Completes the attempts that poll reported ready. The first
+ * connected one wins the race.
+ *
+ * @param race connect race.
+ * @param now current time in nanoseconds.
+ */
+static void CompleteConnectRace(struct ConnectRace* race, uint64_t now)
+{
+	for (size_t i = 0; (i < race->attemptCount) && (-1 == race->sd); i++)
+	{
+		if (0 == race->attempts[i].revents)
+			continue;
+
+		int socketError = 0;
+		socklen_t errorLength = sizeof(socketError);
+
+		if (-1 == getsockopt(race->attempts[i].fd, SOL_SOCKET, SO_ERROR,
+				&socketError, &errorLength))
+		{
+			socketError = errno;
+		}
+
+		if (0 == socketError)
+		{
+			race->sd = race->attempts[i].fd;
+		}
+		else
+		{
+			race->error = socketError;
+			race->nextStart = now;
+			close(race->attempts[i].fd);
+		}
+
+		RemoveConnectAttempt(race, i--);
+	}
+}
+
+/**
+ * Closes the attempts still in flight once the race is over.
+ *
+ * @param race connect race.
+ */
+static void FinishConnectRace(struct ConnectRace* race)
+{
+	for (size_t i = 0; i < race->attemptCount; i++)
+	{
+		close(race->attempts[i].fd);
+	}
+
+	race->attemptCount = 0;
+}
+
+/**
+ * Connects to the given host and port. The resolved addresses
+ * race each other, a new attempt starts every happy eyeballs
+ * delay or as soon as one fails, alternating the address
+ * families. The first connected socket wins, so a broken
+ * IPv6 path costs no more than the delay. Each attempt gives
+ * up after the connect timeout. Datagram sockets connect at
+ * once, they only race the unroutable addresses.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance, or NULL to not log.
+ * @param host host name or address literal.
+ * @param port port number.
+ * @param type socket type, stream or datagram.
+ * @return connected blocking socket, or -1 on error.
+ * @throws IOException
+ */
+static int ConnectToHost(
+		JNIEnv* env,
+		jobject obj,
+		const char* host,
+		unsigned short port,
+		int type)
+{
+	struct sockaddr_storage addresses[MAX_RESOLVED_ADDRESSES];
+
+	size_t count = ResolveHost(env, obj, host, port, addresses);
+	if (0 == count)
+		return -1;
+
+	struct ConnectRace race;
+	InitConnectRace(&race, addresses, count, type);
+
+	while (1)
+	{
+		uint64_t now = EchoGetMonotonicTime();
+
+		AdvanceConnectRace(env, obj, &race, now);
+		if (IsConnectRaceDone(&race))
+			break;
+
+		if (-1 == poll(race.attempts, race.attemptCount,
+				GetConnectRaceTimeout(&race, now)))
+		{
+			if (EINTR == errno)
+				continue;
+
+			race.error = errno;
+			break;
+		}
+
+		CompleteConnectRace(&race, EchoGetMonotonicTime());
+	}
+
+	// Losers of the race are dropped
+	FinishConnectRace(&race);
+
+	int sd = race.sd;
+
+	if (-1 == sd)
+	{
+		// Throw an exception with the last error number
+		ThrowErrnoException(env, jniCache.ioException, race.error);
+		return -1;
+	}
+
+	// Clients use the socket blocking
+	int flags = fcntl(sd, F_GETFL, 0);
+	if ((-1 == flags) || (-1 == fcntl(sd, F_SETFL, flags & ~O_NONBLOCK)))
+	{
+		ThrowErrnoException(env, jniCache.ioException, errno);
+		close(sd);
+		return -1;
+	}
+
+	if (NULL != obj)
+	{
+		LogMessage(env, obj, "Connected.");
+	}
+
+	return sd;
+}
+
+void Java_com_apress_echo_EchoClientActivity_nativeStartTcpClient(
+		JNIEnv* env,
+		jobject obj,
+		jstring ip,
+		jint port,
+		jstring message)
+{
+	// Log through the log ring
+	obj = BeginLog(env, obj);
+	if (NULL == obj)
+		return;
+
+	int clientSocket = -1;
+
+	// Get host name or IP address as C string
+	const char* ipAddress = env->GetStringUTFChars(ip, NULL);
+	if (NULL == ipAddress)
+		goto exit;
+
+	// Connect to the first answering address of the host
+	clientSocket = ConnectToHost(env, obj, ipAddress, (unsigned short) port,
+			SOCK_STREAM);
+
+	// Release the IP address
+	env->ReleaseStringUTFChars(ip, ipAddress);
+
+	// If connection was successful
+	if (NULL == env->ExceptionOccurred())
+	{
+		// Get message as C string
+		const char* messageText = env->GetStringUTFChars(message, NULL);
+		if (NULL == messageText)
+			goto exit;
+
+		// Get the message size
+		jsize messageSize = env->GetStringUTFLength(message);
+
+		// Send message to socket
+		SendToSocket(env, obj, clientSocket, messageText, messageSize);
+
+		// Release the message text
+		env->ReleaseStringUTFChars(message, messageText);
+
+		// If send was not successful
+		if (NULL != env->ExceptionOccurred())
+			goto exit;
+
+		// Allocate the receive buffer
+		char* buffer = NewBuffer(env, config.bufferSize);
+		if (NULL == buffer)
+			goto exit;
+
+		// Receive from the socket
+		ReceiveFromSocket(env, obj, clientSocket, buffer, config.bufferSize);
+
+		// Release the receive buffer
+		free(buffer);
+	}
+
+exit:
+	if (clientSocket > 0)
+	{
+		close(clientSocket);
+	}
+
+	// Let the pending messages drain
+	EndLog(env, obj);
+}
+
+jint Java_com_apress_echo_EchoClientActivity_nativeStartTcpBufferClient(
+		JNIEnv* env,
+		jobject obj,
+		jstring ip,
+		jint port,
+		jobject payload,
+		jint payloadSize,
+		jobject reply)
+{
+	const char* payloadAddress;
+	char* replyAddress;
+	size_t replyCapacity;
+	size_t replySize = 0;
+
+	// Payload and reply are used in place
+	if (!GetPayloadBuffers(env, payload, payloadSize, reply,
+			&payloadAddress, &replyAddress, &replyCapacity))
+		return -1;
+
+	// Log through the log ring
+	obj = BeginLog(env, obj);
+	if (NULL == obj)
+		return -1;
+
+	int clientSocket = -1;
+
+	// Get host name or IP address as C string
+	const char* ipAddress = env->GetStringUTFChars(ip, NULL);
+	if (NULL == ipAddress)
+		goto exit;
+
+	// Connect to the first answering address of the host
+	clientSocket = ConnectToHost(env, obj, ipAddress, (unsigned short) port,
+			SOCK_STREAM);
+
+	// Release the IP address
+	env->ReleaseStringUTFChars(ip, ipAddress);
+
+	// If connection was successful
+	if (NULL == env->ExceptionOccurred())
+	{
+		// Send the payload straight from the buffer
+		SendToSocket(env, obj, clientSocket, payloadAddress,
+				(size_t) payloadSize);
+
+		// If send was not successful
+		if (NULL != env->ExceptionOccurred())
+			goto exit;
+
+		// Receive until the payload is echoed or the reply is full
+		while ((replySize < (size_t) payloadSize)
+				&& (replySize < replyCapacity))
+		{
+			ssize_t recvSize = ReceiveFromSocket(env, obj, clientSocket,
+					replyAddress + replySize, replyCapacity - replySize);
+
+			if ((recvSize <= 0) || (NULL != env->ExceptionOccurred()))
+				break;
+
+			replySize += (size_t) recvSize;
+		}
+	}
+
+exit:
+	if (clientSocket > 0)
+	{
+		close(clientSocket);
+	}
+
+	// Let the pending messages drain
+	EndLog(env, obj);
+
+	return (jint) replySize;
+}
+
+/**
+ * Throws an exception for the given negative error number
+ * returned by the server engine or the socket core.
+ *
+ * @param env JNIEnv interface.
+ * @param error negative error number.
+ * @throws IOException
+ * @throws IllegalArgumentException
+ * @throws IllegalStateException
+ * @throws OutOfMemoryError
+ */
+static void ThrowResultException(
+		JNIEnv* env,
+		int error)
+{
+	if (-ENOMEM == error)
+	{
+		ThrowException(env, jniCache.outOfMemoryError,
+				"Unable to allocate memory.");
+	}
+	else if (-EINVAL == error)
+	{
+		ThrowException(env, jniCache.illegalArgumentException,
+				"Invalid argument.");
+	}
+	else if (-EUSERS == error)
+	{
+		ThrowException(env, jniCache.illegalStateException,
+				"Too many workers.");
+	}
+	else
+	{
+		// Throw an exception with error number
+		ThrowErrnoException(env, jniCache.ioException, -error);
+	}
+}
+
+/**
+ * Gets the server control for the given handle.
+ *
+ * @param handle server handle, or zero if not stoppable.
+ * @return server control or NULL.
+ */
+static struct EchoServerControl* GetServerControl(jlong handle)
+{
+	return (struct EchoServerControl*) (intptr_t) handle;
+}
+
+jlong Java_com_apress_echo_AbstractEchoActivity_nativeNewServerHandle(
+		JNIEnv* env,
+		jclass clazz)
+{
+	struct EchoServerControl* control;
+
+	int result = EchoNewServerControl(&control);
+	if (result < 0)
+	{
+		ThrowResultException(env, result);
+		return 0;
+	}
+
+	return (jlong) (intptr_t) control;
+}
+
+void Java_com_apress_echo_AbstractEchoActivity_nativeStopServer(
+		JNIEnv* env,
+		jclass clazz,
+		jlong handle)
+{
+	struct EchoServerControl* control = GetServerControl(handle);
+
+	if (NULL == control)
+	{
+		ThrowException(env, jniCache.illegalArgumentException,
+				"Invalid server handle.");
+		return;
+	}
+
+	EchoStopServer(control);
+}
+
+void Java_com_apress_echo_AbstractEchoActivity_nativeDeleteServerHandle(
+		JNIEnv* env,
+		jclass clazz,
+		jlong handle)
+{
+	EchoDeleteServerControl(GetServerControl(handle));
+}
+
+jint Java_com_apress_echo_AbstractEchoActivity_nativeExportTrace(
+		JNIEnv* env,
+		jclass clazz,
+		jstring path)
+{
+	// Get path as C string
+	const char* pathText = env->GetStringUTFChars(path, NULL);
+	if (NULL == pathText)
+		return -1;
+
+	int spanCount = EchoExportTrace(pathText);
+
+	// Release the path
+	env->ReleaseStringUTFChars(path, pathText);
+
+	// Library is built without the trace probes
+	if (-ENOSYS == spanCount)
+		return -1;
+
+	if (spanCount < 0)
+	{
+		// Throw an exception with error number
+		ThrowErrnoException(env, jniCache.ioException, -spanCount);
+		return -1;
+	}
+
+	return (jint) spanCount;
+}
+
+/**
+ * Runs the given server on the calling thread until it is
+ * stopped or fails, and deletes it. The workers run on their
+ * own native threads, unattached to the Java VM, and their
+ * errors are thrown here once they are joined.
+ *
+ * @param env JNIEnv interface.
+ * @param server server.
+ * @throws IOException
+ */
+static void RunServer(
+		JNIEnv* env,
+		struct EchoServer* server)
+{
+	// Serve the clients until a fatal error or the stop
+	int result = EchoRunServer(server);
+
+	// Close the client connections and the server sockets
+	EchoDeleteServer(server);
+
+	if (result < 0)
+	{
+		ThrowResultException(env, result);
+	}
+}
+
+void Java_com_apress_echo_EchoServerActivity_nativeStartTcpServer(
+		JNIEnv* env,
+		jobject obj,
+		jint port,
+		jint workerCount,
+		jlong handle)
+{
+	// Log through the log ring
+	obj = BeginLog(env, obj);
+	if (NULL == obj)
+		return;
+
+	struct EchoLogSink sink = GetLogSink(obj);
+	struct EchoServer* server;
+
+	int result = EchoNewTcpServer(&server, &sink, &config,
+			(unsigned short) port, workerCount, GetServerControl(handle));
+
+	if (result < 0)
+	{
+		ThrowResultException(env, result);
+	}
+	else
+	{
+		RunServer(env, server);
+	}
+
+	// Let the pending messages drain
+	EndLog(env, obj);
+}
+
+/**
+ * Block and receive datagram from the socket into
+ * the buffer, and populate the client address.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance.
+ * @param sd socket descriptor.
+ * @param address client address.
+ * @param buffer data buffer.
+ * @param bufferSize buffer size.
+ * @return receive size.
+ * @throws IOException
+ */
+static ssize_t ReceiveDatagramFromSocket(
+		JNIEnv* env,
+		jobject obj,
+		int sd,
+		struct sockaddr_storage* address,
+		char* buffer,
+		size_t bufferSize)
+{
+	struct EchoLogSink sink = GetLogSink(obj);
+	ssize_t recvSize = EchoReceiveDatagram(&sink, sd, address, buffer,
+			bufferSize);
+
+	// If receive is failed
+	if (recvSize < 0)
+	{
+		// Throw an exception with error number
+		ThrowErrnoException(env, jniCache.ioException, (int) -recvSize);
+		return -1;
+	}
+
+	return recvSize;
+}
+
+/**
+ * Sends datagram to the given address using the given socket.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance.
+ * @param sd socket descriptor.
+ * @param address remote address.
+ * @param buffer data buffer.
+ * @param bufferSize buffer size.
+ * @return sent size.
+ * @throws IOException
+ */
+static ssize_t SendDatagramToSocket(
+		JNIEnv* env,
+		jobject obj,
+		int sd,
+		const struct sockaddr_storage* address,
+		const char* buffer,
+		size_t bufferSize)
+{
+	struct EchoLogSink sink = GetLogSink(obj);
+	ssize_t sentSize = EchoSendDatagram(&sink, sd, address, buffer,
+			bufferSize);
 
 	// If send is failed
-	if (-1 == sentSize)
+	if (sentSize < 0)
+	{
+		// Throw an exception with error number
+		ThrowErrnoException(env, jniCache.ioException, (int) -sentSize);
+		return -1;
+	}
+
+	return sentSize;
+}
+
+void Java_com_apress_echo_EchoClientActivity_nativeStartUdpClient(
+		JNIEnv* env,
+		jobject obj,
+		jstring ip,
+		jint port,
+		jstring message)
+{
+	// Log through the log ring
+	obj = BeginLog(env, obj);
+	if (NULL == obj)
+		return;
+
+	int clientSocket = -1;
+	struct sockaddr_storage addresses[MAX_RESOLVED_ADDRESSES];
+	struct sockaddr_storage address;
+
+	// Get host name or IP address as C string
+	const char* ipAddress = env->GetStringUTFChars(ip, NULL);
+	if (NULL == ipAddress)
+		goto exit;
+
+	// Host addresses in the preferred order
+	ResolveHost(env, obj, ipAddress, (unsigned short) port, addresses);
+
+	// Release the IP address
+	env->ReleaseStringUTFChars(ip, ipAddress);
+
+	if (NULL != env->ExceptionOccurred())
+		goto exit;
+
+	// Send to the preferred address
+	address = addresses[0];
+
+	// Construct a new UDP socket of the address family.
+	clientSocket = NewUdpSocket(env, obj, address.ss_family);
+	if (NULL == env->ExceptionOccurred())
+	{
+		// Get message as C string
+		const char* messageText = env->GetStringUTFChars(message, NULL);
+		if (NULL == messageText)
+			goto exit;
+
+		// Get the message size
+		jsize messageSize = env->GetStringUTFLength(message);
+
+		// Send message to socket
+		SendDatagramToSocket(env, obj, clientSocket, &address,
+				messageText, messageSize);
+
+		// Release the message text
+		env->ReleaseStringUTFChars(message, messageText);
+
+		// If send was not successful
+		if (NULL != env->ExceptionOccurred())
+			goto exit;
+
+		// Allocate the receive buffer
+		char* buffer = NewBuffer(env, config.bufferSize);
+		if (NULL == buffer)
+			goto exit;
+
+		// Clear address
+		memset(&address, 0, sizeof(address));
+
+		// Receive from the socket
+		ReceiveDatagramFromSocket(env, obj, clientSocket, &address,
+				buffer, config.bufferSize);
+
+		// Release the receive buffer
+		free(buffer);
+	}
+
+exit:
+	if (clientSocket > 0)
+	{
+		close(clientSocket);
+	}
+
+	// Let the pending messages drain
+	EndLog(env, obj);
+}
+
+jint Java_com_apress_echo_EchoClientActivity_nativeStartUdpBufferClient(
+		JNIEnv* env,
+		jobject obj,
+		jstring ip,
+		jint port,
+		jobject payload,
+		jint payloadSize,
+		jobject reply)
+{
+	const char* payloadAddress;
+	char* replyAddress;
+	size_t replyCapacity;
+	ssize_t replySize = 0;
+
+	// Payload and reply are used in place
+	if (!GetPayloadBuffers(env, payload, payloadSize, reply,
+			&payloadAddress, &replyAddress, &replyCapacity))
+		return -1;
+
+	// Log through the log ring
+	obj = BeginLog(env, obj);
+	if (NULL == obj)
+		return -1;
+
+	int clientSocket = -1;
+
+	// Get host name or IP address as C string
+	const char* ipAddress = env->GetStringUTFChars(ip, NULL);
+	if (NULL == ipAddress)
+		goto exit;
+
+	// Replies only come from the server
+	clientSocket = ConnectToHost(env, obj, ipAddress, (unsigned short) port,
+			SOCK_DGRAM);
+
+	// Release the IP address
+	env->ReleaseStringUTFChars(ip, ipAddress);
+
+	// If connection was successful
+	if (NULL == env->ExceptionOccurred())
+	{
+		// Send the payload straight from the buffer
+		SendToSocket(env, obj, clientSocket, payloadAddress,
+				(size_t) payloadSize);
+
+		// If send was not successful
+		if (NULL != env->ExceptionOccurred())
+			goto exit;
+
+		// Receive the echoed datagram into the reply buffer
+		replySize = ReceiveFromSocket(env, obj, clientSocket,
+				replyAddress, replyCapacity);
+	}
+
+exit:
+	if (clientSocket > 0)
+	{
+		close(clientSocket);
+	}
+
+	// Let the pending messages drain
+	EndLog(env, obj);
+
+	return (replySize > 0) ? (jint) replySize : 0;
+}
+
+/**
+ * Client session on a connected socket, kept open across the
+ * messages.
+ */
+struct Session
+{
+	// Socket descriptor
+	int sd;
+
+	// Session protocol
+	jint proto;
+
+	// Server host name or IP address, and port
+	char host[MAX_HOST_LENGTH];
+	unsigned short port;
+
+	// Socket failed and cannot be reused
+	bool broken;
+
+	// Next idle session in the session pool
+	struct Session* next;
+};
+
+/**
+ * Idle sessions that are reused for the same server address
+ * and protocol instead of connecting again.
+ */
+struct SessionPool
+{
+	// Protects the idle sessions
+	pthread_mutex_t mutex;
+
+	// Idle sessions
+	struct Session* idle;
+
+	// Number of idle sessions
+	size_t idleCount;
+};
+
+// Process wide session pool
+static struct SessionPool sessionPool = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+/**
+ * Closes the session socket and releases the session.
+ *
+ * @param session session.
+ */
+static void DeleteSession(struct Session* session)
+{
+	close(session->sd);
+	free(session);
+}
+
+/**
+ * Checks that the idle session is still connected and has no
+ * stale data waiting, so that it can be reused.
+ *
+ * @param session session.
+ * @return true if reusable.
+ */
+static bool IsSessionReusable(struct Session* session)
+{
+	char data;
+
+	ssize_t recvSize = recv(session->sd, &data, sizeof(data),
+			MSG_PEEK | MSG_DONTWAIT);
+
+	return (-1 == recvSize) && ((EAGAIN == errno) || (EWOULDBLOCK == errno));
+}
+
+/**
+ * Takes an idle session to the given server from the pool.
+ * Sessions are matched by the host as given, so a reused one
+ * needs no resolving.
+ *
+ * @param proto session protocol.
+ * @param host server host name or IP address.
+ * @param port server port.
+ * @return session or NULL if none is idle.
+ */
+static struct Session* TakeIdleSession(
+		jint proto,
+		const char* host,
+		unsigned short port)
+{
+	struct Session* session = NULL;
+
+	pthread_mutex_lock(&sessionPool.mutex);
+
+	struct Session** link = &sessionPool.idle;
+	while (NULL != *link)
+	{
+		struct Session* candidate = *link;
+
+		if ((candidate->proto == proto) && (candidate->port == port)
+				&& (0 == strcmp(candidate->host, host)))
+		{
+			*link = candidate->next;
+			sessionPool.idleCount--;
+			session = candidate;
+			break;
+		}
+
+		link = &candidate->next;
+	}
+
+	pthread_mutex_unlock(&sessionPool.mutex);
+
+	return session;
+}
+
+/**
+ * Returns the session to the pool, or closes it if it is
+ * broken or the pool is full.
+ *
+ * @param session session.
+ */
+static void PutIdleSession(struct Session* session)
+{
+	if (!session->broken)
+	{
+		pthread_mutex_lock(&sessionPool.mutex);
+
+		if (sessionPool.idleCount < MAX_IDLE_SESSIONS)
+		{
+			session->next = sessionPool.idle;
+			sessionPool.idle = session;
+			sessionPool.idleCount++;
+			session = NULL;
+		}
+
+		pthread_mutex_unlock(&sessionPool.mutex);
+	}
+
+	if (NULL != session)
+	{
+		DeleteSession(session);
+	}
+}
+
+/**
+ * Applies the configured keepalive to the session socket, the
+ * other options come from the socket profile.
+ *
+ * @param env JNIEnv interface.
+ * @param sd socket descriptor.
+ * @throws IOException
+ */
+static void SetSessionOptions(JNIEnv* env, int sd)
+{
+	int keepAlive = (config.keepAlive > 0) ? 1 : 0;
+
+	if ((-1 == setsockopt(sd, SOL_SOCKET, SO_KEEPALIVE, &keepAlive,
+			sizeof(keepAlive)))
+			|| (keepAlive && (-1 == setsockopt(sd, IPPROTO_TCP, TCP_KEEPIDLE,
+					&config.keepAlive, sizeof(config.keepAlive)))))
+	{
+		// Throw an exception with error number
+		ThrowErrnoException(env, jniCache.ioException, errno);
+	}
+}
+
+/**
+ * Gets the session for the given handle.
+ *
+ * @param env JNIEnv interface.
+ * @param handle session handle.
+ * @return session or NULL if handle is invalid.
+ * @throws IllegalArgumentException
+ */
+static struct Session* GetSession(JNIEnv* env, jlong handle)
+{
+	struct Session* session = (struct Session*) (intptr_t) handle;
+
+	if (NULL == session)
+	{
+		ThrowException(env, jniCache.illegalArgumentException,
+				"Invalid session handle.");
+	}
+
+	return session;
+}
+
+jlong Java_com_apress_echo_EchoClientActivity_nativeOpenSession(
+		JNIEnv* env,
+		jclass clazz,
+		jstring ip,
+		jint port,
+		jint proto)
+{
+	if ((SESSION_TCP != proto) && (SESSION_UDP != proto))
+	{
+		ThrowException(env, jniCache.illegalArgumentException,
+				"Unknown session protocol.");
+		return 0;
+	}
+
+	struct Session* session = (struct Session*) calloc(1,
+			sizeof(struct Session));
+
+	if (NULL == session)
+	{
+		ThrowException(env, jniCache.outOfMemoryError,
+				"Unable to allocate session.");
+		return 0;
+	}
+
+	// Get host name or IP address as C string
+	const char* ipAddress = env->GetStringUTFChars(ip, NULL);
+	if (NULL == ipAddress)
+	{
+		free(session);
+		return 0;
+	}
+
+	bool valid = (strlen(ipAddress) < MAX_HOST_LENGTH);
+	if (valid)
+	{
+		strcpy(session->host, ipAddress);
+	}
+
+	// Release the IP address
+	env->ReleaseStringUTFChars(ip, ipAddress);
+
+	if (!valid)
+	{
+		ThrowException(env, jniCache.illegalArgumentException,
+				"Invalid host name.");
+		free(session);
+		return 0;
+	}
+
+	session->proto = proto;
+	session->port = (unsigned short) port;
+
+	// Reuse an idle connection to the same server
+	struct Session* idle;
+
+	while (NULL != (idle = TakeIdleSession(proto, session->host,
+			session->port)))
+	{
+		if (IsSessionReusable(idle))
+		{
+			free(session);
+			return (jlong) (intptr_t) idle;
+		}
+
+		DeleteSession(idle);
+	}
+
+	// Sessions have no log, rejected options are only skipped
+	int type = (SESSION_TCP == proto) ? SOCK_STREAM : SOCK_DGRAM;
+	session->sd = ConnectToHost(env, NULL, session->host, session->port,
+			type);
+
+	if (-1 == session->sd)
+	{
+		free(session);
+		return 0;
+	}
+
+	if (SESSION_TCP == proto)
+	{
+		SetSessionOptions(env, session->sd);
+		if (NULL != env->ExceptionOccurred())
+		{
+			DeleteSession(session);
+			return 0;
+		}
+	}
+
+	return (jlong) (intptr_t) session;
+}
+
+jint Java_com_apress_echo_EchoClientActivity_nativeSend(
+		JNIEnv* env,
+		jclass clazz,
+		jlong handle,
+		jobject payload,
+		jint payloadSize)
+{
+	struct Session* session = GetSession(env, handle);
+	if (NULL == session)
+		return -1;
+
+	size_t capacity;
+	const char* buffer = GetDirectBuffer(env, payload, &capacity);
+	if (NULL == buffer)
+		return -1;
+
+	if ((payloadSize < 0) || ((size_t) payloadSize > capacity))
+	{
+		ThrowException(env, jniCache.illegalArgumentException,
+				"Payload size exceeds the buffer capacity.");
+		return -1;
+	}
+
+	size_t sentSize = 0;
+
+	// Send may return before the whole payload is sent
+	while (sentSize < (size_t) payloadSize)
+	{
+		ssize_t result = send(session->sd, buffer + sentSize,
+				payloadSize - sentSize, MSG_NOSIGNAL);
+
+		if (-1 == result)
+		{
+			if (EINTR == errno)
+				continue;
+
+			session->broken = true;
+
+			// Throw an exception with error number
+			ThrowErrnoException(env, jniCache.ioException, errno);
+			return -1;
+		}
+
+		sentSize += (size_t) result;
+	}
+
+	return (jint) sentSize;
+}
+
+jint Java_com_apress_echo_EchoClientActivity_nativeReceive(
+		JNIEnv* env,
+		jclass clazz,
+		jlong handle,
+		jobject reply)
+{
+	struct Session* session = GetSession(env, handle);
+	if (NULL == session)
+		return -1;
+
+	size_t capacity;
+	char* buffer = GetDirectBuffer(env, reply, &capacity);
+	if (NULL == buffer)
+		return -1;
+
+	while (1)
+	{
+		ssize_t recvSize = recv(session->sd, buffer, capacity, 0);
+
+		if (-1 == recvSize)
+		{
+			if (EINTR == errno)
+				continue;
+
+			session->broken = true;
+
+			// Throw an exception with error number
+			ThrowErrnoException(env, jniCache.ioException, errno);
+			return -1;
+		}
+
+		// Server closed the connection
+		if ((0 == recvSize) && (SESSION_TCP == session->proto))
+		{
+			session->broken = true;
+		}
+
+		return (jint) recvSize;
+	}
+}
+
+/**
+ * Receives exactly the given number of bytes from the socket.
+ *
+ * @param sd socket descriptor.
+ * @param buffer data buffer.
+ * @param size size to receive.
+ * @return received size, less if closed, -1 if failed.
+ */
+static ssize_t ReceiveFully(int sd, char* buffer, size_t size)
+{
+	size_t recvSize = 0;
+
+	while (recvSize < size)
+	{
+		ssize_t result = recv(sd, buffer + recvSize, size - recvSize,
+				MSG_WAITALL);
+
+		if (-1 == result)
+		{
+			if (EINTR == errno)
+				continue;
+
+			return -1;
+		}
+
+		if (0 == result)
+			break;
+
+		recvSize += (size_t) result;
+	}
+
+	return (ssize_t) recvSize;
+}
+
+jint Java_com_apress_echo_EchoClientActivity_nativeSendFrame(
+		JNIEnv* env,
+		jclass clazz,
+		jlong handle,
+		jobject payload,
+		jint payloadSize)
+{
+	struct Session* session = GetSession(env, handle);
+	if (NULL == session)
+		return -1;
+
+	size_t capacity;
+	char* buffer = GetDirectBuffer(env, payload, &capacity);
+	if (NULL == buffer)
+		return -1;
+
+	if ((payloadSize < 0) || ((size_t) payloadSize > capacity))
+	{
+		ThrowException(env, jniCache.illegalArgumentException,
+				"Payload size exceeds the buffer capacity.");
+		return -1;
+	}
+
+	// Length prefix in network byte order
+	uint32_t header = htonl((uint32_t) payloadSize);
+
+	struct iovec vectors[2];
+	vectors[0].iov_base = &header;
+	vectors[0].iov_len = sizeof(header);
+	vectors[1].iov_base = buffer;
+	vectors[1].iov_len = (size_t) payloadSize;
+
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = vectors;
+	message.msg_iovlen = 2;
+
+	size_t remaining = sizeof(header) + (size_t) payloadSize;
+
+	// Prefix and payload go with a single call, short sends resume
+	while (remaining > 0)
+	{
+		ssize_t sentSize = sendmsg(session->sd, &message, MSG_NOSIGNAL);
+
+		if (-1 == sentSize)
+		{
+			if (EINTR == errno)
+				continue;
+
+			session->broken = true;
+
+			// Throw an exception with error number
+			ThrowErrnoException(env, jniCache.ioException, errno);
+			return -1;
+		}
+
+		remaining -= (size_t) sentSize;
+
+		// Advance the vectors past the sent bytes
+		while (sentSize > 0)
+		{
+			struct iovec* vector = message.msg_iov;
+			size_t part = ((size_t) sentSize < vector->iov_len)
+					? (size_t) sentSize : vector->iov_len;
+
+			vector->iov_base = (char*) vector->iov_base + part;
+			vector->iov_len -= part;
+			sentSize -= part;
+
+			if ((0 == vector->iov_len) && (message.msg_iovlen > 1))
+			{
+				message.msg_iov++;
+				message.msg_iovlen--;
+			}
+		}
+	}
+
+	return payloadSize;
+}
+
+jint Java_com_apress_echo_EchoClientActivity_nativeReceiveFrame(
+		JNIEnv* env,
+		jclass clazz,
+		jlong handle,
+		jobject reply)
+{
+	struct Session* session = GetSession(env, handle);
+	if (NULL == session)
+		return -1;
+
+	size_t capacity;
+	char* buffer = GetDirectBuffer(env, reply, &capacity);
+	if (NULL == buffer)
+		return -1;
+
+	uint32_t header;
+
+	ssize_t recvSize = ReceiveFully(session->sd, (char*) &header,
+			sizeof(header));
+
+	// Server closed the session between the frames
+	if (0 == recvSize)
+	{
+		session->broken = true;
+		return -1;
+	}
+
+	if (recvSize == (ssize_t) sizeof(header))
+	{
+		size_t frameSize = ntohl(header);
+
+		// Stream cannot be followed after a skipped frame
+		if (frameSize > capacity)
+		{
+			session->broken = true;
+			ThrowException(env, jniCache.ioException,
+					"Frame exceeds the buffer capacity.");
+			return -1;
+		}
+
+		recvSize = ReceiveFully(session->sd, buffer, frameSize);
+		if (recvSize == (ssize_t) frameSize)
+			return (jint) frameSize;
+	}
+
+	session->broken = true;
+
+	if (-1 == recvSize)
+	{
+		// Throw an exception with error number
+		ThrowErrnoException(env, jniCache.ioException, errno);
+	}
+	else
+	{
+		ThrowException(env, jniCache.ioException,
+				"Server closed the session within a frame.");
+	}
+
+	return -1;
+}
+
+void Java_com_apress_echo_EchoClientActivity_nativeClose(
+		JNIEnv* env,
+		jclass clazz,
+		jlong handle)
+{
+	struct Session* session = GetSession(env, handle);
+	if (NULL == session)
+		return;
+
+	// Keep the connection for the next session to the same server
+	PutIdleSession(session);
+}
+
+jlongArray Java_com_apress_echo_EchoClientActivity_nativeConnectFanOut(
+		JNIEnv* env,
+		jclass clazz,
+		jobjectArray hosts,
+		jintArray ports)
+{
+	jlongArray result = NULL;
+
+	jsize count = env->GetArrayLength(hosts);
+	if ((count != env->GetArrayLength(ports)) || (count > MAX_FAN_OUT))
+	{
+		ThrowException(env, jniCache.illegalArgumentException,
+				"Invalid endpoint list.");
+		return NULL;
+	}
+
+	jint endpointPorts[MAX_FAN_OUT];
+	jlong latencies[MAX_FAN_OUT];
+	bool running[MAX_FAN_OUT];
+	size_t runningCount = 0;
+
+	memset(running, 0, sizeof(running));
+
+	env->GetIntArrayRegion(ports, 0, count, endpointPorts);
+
+	struct ConnectRace* races = (struct ConnectRace*) malloc(
+			(count + 1) * sizeof(struct ConnectRace));
+	struct pollfd* fds = (struct pollfd*) malloc(
+			(count * MAX_RESOLVED_ADDRESSES + 1) * sizeof(struct pollfd));
+
+	if ((NULL == races) || (NULL == fds))
+	{
+		ThrowException(env, jniCache.outOfMemoryError,
+				"Unable to allocate fan-out.");
+		goto exit;
+	}
+
+	// Hosts are resolved first, the cached ones do not wait
+	for (jsize i = 0; i < count; i++)
+	{
+		jstring host = (jstring) env->GetObjectArrayElement(hosts, i);
+		if (NULL == host)
+		{
+			ThrowException(env, jniCache.nullPointerException,
+					"Host is null.");
+			goto exit;
+		}
+
+		const char* hostName = env->GetStringUTFChars(host, NULL);
+		if (NULL == hostName)
+		{
+			env->DeleteLocalRef(host);
+			goto exit;
+		}
+
+		struct sockaddr_storage addresses[MAX_RESOLVED_ADDRESSES];
+		size_t addressCount = ResolveHost(env, NULL, hostName,
+				(unsigned short) endpointPorts[i], addresses);
+
+		env->ReleaseStringUTFChars(host, hostName);
+		env->DeleteLocalRef(host);
+
+		// Unresolved host fails alone, the others are still probed
+		if (0 == addressCount)
+		{
+			env->ExceptionClear();
+			latencies[i] = -EHOSTUNREACH;
+			continue;
+		}
+
+		InitConnectRace(&races[i], addresses, addressCount, SOCK_STREAM);
+		running[i] = true;
+		runningCount++;
+	}
+
+	{
+		// Latencies count from the same start, after the resolving
+		uint64_t start = EchoGetMonotonicTime();
+		uint64_t now = start;
+
+		while (runningCount > 0)
+		{
+			int timeout = -1;
+			size_t fdCount = 0;
+
+			for (jsize i = 0; i < count; i++)
+			{
+				if (!running[i])
+					continue;
+
+				struct ConnectRace* race = &races[i];
+
+				AdvanceConnectRace(env, NULL, race, now);
+
+				if (IsConnectRaceDone(race))
+				{
+					FinishConnectRace(race);
+
+					// Endpoint is only probed, the connection is not kept
+					if (-1 != race->sd)
+					{
+						latencies[i] = (jlong) ((now - start) / 1000ULL);
+						close(race->sd);
+					}
+					else
+					{
+						latencies[i] = -race->error;
+					}
+
+					running[i] = false;
+					runningCount--;
+					continue;
+				}
+
+				int raceTimeout = GetConnectRaceTimeout(race, now);
+				if ((-1 == timeout)
+						|| ((-1 != raceTimeout) && (raceTimeout < timeout)))
+				{
+					timeout = raceTimeout;
+				}
+
+				memcpy(&fds[fdCount], race->attempts,
+						race->attemptCount * sizeof(struct pollfd));
+				fdCount += race->attemptCount;
+			}
+
+			if (0 == runningCount)
+				break;
+
+			if (-1 == poll(fds, fdCount, timeout))
+			{
+				if (EINTR == errno)
+					continue;
+
+				// Throw an exception with error number
+				ThrowErrnoException(env, jniCache.ioException, errno);
+				goto exit;
+			}
+
+			now = EchoGetMonotonicTime();
+			fdCount = 0;
+
+			// Attempts are in the same order as they were polled
+			for (jsize i = 0; i < count; i++)
+			{
+				if (!running[i])
+					continue;
+
+				struct ConnectRace* race = &races[i];
+				size_t attemptCount = race->attemptCount;
+
+				for (size_t j = 0; j < attemptCount; j++)
+				{
+					race->attempts[j].revents = fds[fdCount + j].revents;
+				}
+
+				CompleteConnectRace(race, now);
+				fdCount += attemptCount;
+			}
+		}
+	}
+
+	result = env->NewLongArray(count);
+	if (NULL != result)
+	{
+		env->SetLongArrayRegion(result, 0, count, latencies);
+	}
+
+exit:
+	if (NULL != races)
+	{
+		for (jsize i = 0; i < count; i++)
+		{
+			if (running[i])
+			{
+				FinishConnectRace(&races[i]);
+
+				if (-1 != races[i].sd)
+				{
+					close(races[i].sd);
+				}
+			}
+		}
+	}
+
+	free(fds);
+	free(races);
+
+	return result;
+}
+
+void Java_com_apress_echo_EchoServerActivity_nativeStartUdpServer(
+		JNIEnv* env,
+		jobject obj,
+		jint port,
+		jint workerCount,
+		jlong handle)
+{
+	// Log through the log ring
+	obj = BeginLog(env, obj);
+	if (NULL == obj)
+		return;
+
+	struct EchoLogSink sink = GetLogSink(obj);
+	struct EchoServer* server;
+
+	int result = EchoNewUdpServer(&server, &sink, &config,
+			(unsigned short) port, workerCount, GetServerControl(handle));
+
+	if (result < 0)
+	{
+		ThrowResultException(env, result);
+	}
+	else
+	{
+		// Echo the datagrams until a fatal error or the stop
+		RunServer(env, server);
+	}
+
+	// Let the pending messages drain
+	EndLog(env, obj);
+}
+
+jlongArray Java_com_apress_echo_EchoServerActivity_nativeGetStats(
+		JNIEnv* env,
+		jclass clazz)
+{
+	uint64_t totals[STAT_COUNT];
+
+	// Sum the counters without stopping the workers
+	EchoGetStats(totals);
+
+	jlong values[STAT_COUNT];
+	for (int i = 0; i < STAT_COUNT; i++)
+	{
+		values[i] = (jlong) totals[i];
+	}
+
+	jlongArray stats = env->NewLongArray(STAT_COUNT);
+	if (NULL != stats)
+	{
+		env->SetLongArrayRegion(stats, 0, STAT_COUNT, values);
+	}
+
+	return stats;
+}
+
+jlongArray Java_com_apress_echo_EchoServerActivity_nativeGetUdpFlows(
+		JNIEnv* env,
+		jclass clazz)
+{
+	uint64_t* values;
+	size_t count;
+
+	// Flows are read while the workers update them
+	int result = EchoGetUdpFlows(&values, &count);
+	if (result < 0)
+	{
+		ThrowResultException(env, result);
+		return NULL;
+	}
+
+	jsize length = (jsize) (count * UDP_FLOW_FIELDS);
+
+	jlongArray flows = env->NewLongArray(length);
+	if ((NULL != flows) && (length > 0))
+	{
+		// Values are the same width, only their signedness differs
+		env->SetLongArrayRegion(flows, 0, length, (const jlong*) values);
+	}
+
+	free(values);
+
+	return flows;
+}
+
+/**
+ * Constructs a new Local UNIX socket.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance.
+ * @param type socket type, stream or sequenced packets.
+ * @return socket descriptor.
+ * @throws IOException
+ */
+static int NewLocalSocket(JNIEnv* env, jobject obj, int type)
+{
+	struct EchoLogSink sink = GetLogSink(obj);
+	int localSocket = EchoNewSocket(&sink, PF_LOCAL, type);
+
+	// Check if socket is properly constructed
+	if (localSocket < 0)
+	{
+		// Throw an exception with error number
+		ThrowErrnoException(env, jniCache.ioException, -localSocket);
+		return -1;
+	}
+
+	ApplySocketProfile(env, obj, localSocket, PF_LOCAL, type,
+			SOCKET_NEW);
+
+	return localSocket;
+}
+
+/**
+ * Throws an exception for the given local name result.
+ *
+ * @param env JNIEnv interface.
+ * @param error negative error number.
+ * @throws IOException
+ */
+static void ThrowLocalNameException(JNIEnv* env, int error)
+{
+	if (-ENAMETOOLONG == error)
+	{
+		ThrowException(env, jniCache.ioException, "Name is too big.");
+	}
+	else
+	{
+		// Throw an exception with error number
+		ThrowErrnoException(env, jniCache.ioException, -error);
+	}
+}
+
+/**
+ * Binds a local UNIX socket to a name.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance.
+ * @param sd socket descriptor.
+ * @param name socket name.
+ * @throws IOException
+ */
+static void BindLocalSocketToName(
+		JNIEnv* env,
+		jobject obj,
+		int sd,
+		const char* name)
+{
+	struct EchoLogSink sink = GetLogSink(obj);
+	int result = EchoBindLocalSocketToName(&sink, sd, name);
+
+	if (result < 0)
+	{
+		ThrowLocalNameException(env, result);
+	}
+}
+
+/**
+ * Connects the local UNIX socket to the given name.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance.
+ * @param sd socket descriptor.
+ * @param name socket name.
+ * @throws IOException
+ */
+static void ConnectToLocalName(
+		JNIEnv* env,
+		jobject obj,
+		int sd,
+		const char* name)
+{
+	struct EchoLogSink sink = GetLogSink(obj);
+	int result = EchoConnectToLocalName(&sink, sd, name);
+
+	if (result < 0)
+	{
+		ThrowLocalNameException(env, result);
+	}
+}
+
+void Java_com_apress_echo_LocalEchoActivity_nativeStartLocalServer(
+		JNIEnv* env,
+		jobject obj,
+		jstring name,
+		jint type,
+		jlong handle)
+{
+	// Log through the log ring
+	obj = BeginLog(env, obj);
+	if (NULL == obj)
+		return;
+
+	// Get name as C string
+	const char* nameText = env->GetStringUTFChars(name, NULL);
+	if (NULL != nameText)
+	{
+		struct EchoLogSink sink = GetLogSink(obj);
+		struct EchoServer* server;
+
+		int result = EchoNewLocalServer(&server, &sink, &config,
+				nameText, type, GetServerControl(handle));
+
+		// Release the name text
+		env->ReleaseStringUTFChars(name, nameText);
+
+		if (result < 0)
+		{
+			ThrowResultException(env, result);
+		}
+		else
+		{
+			// Serve the clients until a fatal error or the stop
+			RunServer(env, server);
+		}
+	}
+
+	// Let the pending messages drain
+	EndLog(env, obj);
+}
+
+/**
+ * Logs the latency percentiles of the histogram.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance.
+ * @param histogram latency histogram.
+ */
+static void LogHistogramPercentiles(
+		JNIEnv* env,
+		jobject obj,
+		const struct EchoHistogram* histogram)
+{
+	LogMessage(env, obj, "Latency p50 %.1f us, p99 %.1f us, "
+			"p99.9 %.1f us, max %.1f us.",
+			EchoGetHistogramPercentile(histogram, 50.0) / 1e3,
+			EchoGetHistogramPercentile(histogram, 99.0) / 1e3,
+			EchoGetHistogramPercentile(histogram, 99.9) / 1e3,
+			histogram->max / 1e3);
+}
+
+/**
+ * Connects all benchmark streams to the given address.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance.
+ * @param benchmark benchmark.
+ * @param ip IP address.
+ * @param port port number.
+ * @throws IOException
+ */
+static void ConnectBenchmark(
+		JNIEnv* env,
+		jobject obj,
+		struct EchoBenchmark* benchmark,
+		const char* ip,
+		unsigned short port)
+{
+	for (size_t i = 0; i < benchmark->streamCount; i++)
+	{
+		// Connected UDP sockets only receive from the server
+		int sd = ConnectToHost(env, obj, ip, port, benchmark->type);
+		if (NULL != env->ExceptionOccurred())
+			return;
+
+		// Small messages must not wait for coalescing
+		int noDelay = 1;
+		if ((SOCK_STREAM == benchmark->type) && (-1 == setsockopt(sd,
+				IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay))))
+		{
+			// Throw an exception with error number
+			ThrowErrnoException(env, jniCache.ioException, errno);
+			close(sd);
+			return;
+		}
+
+		int result = EchoAddBenchmarkStream(benchmark, i, sd);
+		if (result < 0)
+		{
+			ThrowResultException(env, result);
+			return;
+		}
+	}
+}
+
+/**
+ * Runs a benchmark against the given server and logs the
+ * throughput and the round trip latency percentiles.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance.
+ * @param type socket type.
+ * @param ip IP address.
+ * @param port port number.
+ * @param streamCount number of connections or UDP flows.
+ * @param payloadSize message size.
+ * @param rate messages per second per stream, zero for closed loop.
+ * @param duration duration in seconds.
+ * @throws IOException
+ * @throws IllegalArgumentException
+ */
+static void RunBenchmark(
+		JNIEnv* env,
+		jobject obj,
+		int type,
+		jstring ip,
+		jint port,
+		jint streamCount,
+		jint payloadSize,
+		jint rate,
+		jint duration)
+{
+	// Check the benchmark parameters
+	if ((streamCount < 1) || (streamCount > MAX_BENCHMARK_STREAMS)
+			|| (payloadSize < (jint) sizeof(uint64_t))
+			|| (payloadSize > MAX_BUFFER_SIZE)
+			|| (rate < 0) || (duration < 1))
+	{
+		ThrowException(env, jniCache.illegalArgumentException,
+				"Invalid benchmark parameters.");
+		return;
+	}
+
+	// Get IP address as C string
+	const char* ipAddress = env->GetStringUTFChars(ip, NULL);
+	if (NULL == ipAddress)
+		return;
+
+	struct EchoBenchmark* benchmark = NULL;
+	int result = EchoNewBenchmark(&benchmark, type, (size_t) streamCount,
+			(size_t) payloadSize, config.bufferSize,
+			(0 == rate) ? 0 : (1000000000ULL / rate));
+
+	if (result < 0)
+	{
+		ThrowResultException(env, result);
+	}
+	else
+	{
+		ConnectBenchmark(env, obj, benchmark, ipAddress,
+				(unsigned short) port);
+	}
+
+	// Release the IP address
+	env->ReleaseStringUTFChars(ip, ipAddress);
+
+	if (NULL == benchmark)
+		return;
+
+	if (NULL != env->ExceptionOccurred())
+	{
+		EchoDeleteBenchmark(benchmark);
+		return;
+	}
+
+	LogMessage(env, obj, "Running %s benchmark with %d streams for %d s...",
+			(0 == rate) ? "closed loop" : "open loop", streamCount, duration);
+
+	uint64_t startTime = EchoGetMonotonicTime();
+	result = EchoRunBenchmark(benchmark,
+			startTime + ((uint64_t) duration * 1000000000ULL));
+
+	if (result < 0)
+	{
+		ThrowResultException(env, result);
+	}
+	else
+	{
+		double elapsed = (double) (EchoGetMonotonicTime() - startTime) / 1e9;
+		uint64_t lostCount = benchmark->sentCount - benchmark->receivedCount;
+
+		LogMessage(env, obj, "Sent %llu and received %llu messages, "
+				"%llu unanswered, in %.2f s.",
+				(unsigned long long) benchmark->sentCount,
+				(unsigned long long) benchmark->receivedCount,
+				(unsigned long long) lostCount, elapsed);
+
+		LogMessage(env, obj, "Throughput %.0f msgs/s, %.2f MB/s.",
+				(double) benchmark->receivedCount / elapsed,
+				(double) (benchmark->receivedCount * benchmark->payloadSize)
+						/ elapsed / 1e6);
+
+		LogHistogramPercentiles(env, obj, &benchmark->histogram);
+	}
+
+	EchoDeleteBenchmark(benchmark);
+}
+
+void Java_com_apress_echo_EchoClientActivity_nativeStartTcpBenchmark(
+		JNIEnv* env,
+		jobject obj,
+		jstring ip,
+		jint port,
+		jint connectionCount,
+		jint payloadSize,
+		jint rate,
+		jint duration)
+{
+	// Log through the log ring
+	obj = BeginLog(env, obj);
+	if (NULL == obj)
+		return;
+
+	RunBenchmark(env, obj, SOCK_STREAM, ip, port, connectionCount,
+			payloadSize, rate, duration);
+
+	// Let the pending messages drain
+	EndLog(env, obj);
+}
+
+void Java_com_apress_echo_EchoClientActivity_nativeStartUdpBenchmark(
+		JNIEnv* env,
+		jobject obj,
+		jstring ip,
+		jint port,
+		jint flowCount,
+		jint payloadSize,
+		jint rate,
+		jint duration)
+{
+	// Log through the log ring
+	obj = BeginLog(env, obj);
+	if (NULL == obj)
+		return;
+
+	RunBenchmark(env, obj, SOCK_DGRAM, ip, port, flowCount,
+			payloadSize, rate, duration);
+
+	// Let the pending messages drain
+	EndLog(env, obj);
+}
+
+/**
+ * Connects all replay streams to the given address.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance.
+ * @param replay replay.
+ * @param ip IP address.
+ * @param port port number.
+ * @throws IOException
+ */
+static void ConnectReplay(
+		JNIEnv* env,
+		jobject obj,
+		struct EchoReplay* replay,
+		const char* ip,
+		unsigned short port)
+{
+	for (size_t i = 0; i < replay->streamCount; i++)
+	{
+		int sd = ConnectToHost(env, obj, ip, port, SOCK_STREAM);
+		if (NULL != env->ExceptionOccurred())
+			return;
+
+		// Captured messages go out as they were received
+		int noDelay = 1;
+		if (-1 == setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &noDelay,
+				sizeof(noDelay)))
+		{
+			// Throw an exception with error number
+			ThrowErrnoException(env, jniCache.ioException, errno);
+			close(sd);
+			return;
+		}
+
+		int result = EchoAddReplayStream(replay, i, sd);
+		if (result < 0)
+		{
+			ThrowResultException(env, result);
+			return;
+		}
+	}
+}
+
+void Java_com_apress_echo_EchoClientActivity_nativeStartTcpReplay(
+		JNIEnv* env,
+		jobject obj,
+		jstring ip,
+		jint port,
+		jstring path,
+		jint connectionCount,
+		jint speed)
+{
+	// Log through the log ring
+	obj = BeginLog(env, obj);
+	if (NULL == obj)
+		return;
+
+	struct EchoLogSink sink = GetLogSink(obj);
+	struct EchoReplay* replay = NULL;
+	const char* ipAddress = NULL;
+	const char* pathText = NULL;
+	int result;
+
+	// Check the replay parameters
+	if ((connectionCount < 0) || (connectionCount > MAX_BENCHMARK_STREAMS)
+			|| (speed < 0) || (speed > MAX_REPLAY_SPEED))
+	{
+		ThrowException(env, jniCache.illegalArgumentException,
+				"Invalid replay parameters.");
+		goto exit;
+	}
+
+	// Get path as C string
+	pathText = env->GetStringUTFChars(path, NULL);
+	if (NULL == pathText)
+		goto exit;
+
+	result = EchoNewReplay(&replay, &sink, pathText,
+			(size_t) connectionCount, speed, config.bufferSize);
+
+	if (result < 0)
+	{
+		ThrowResultException(env, result);
+	}
+	else if (0 == speed)
+	{
+		LogMessage(env, obj, "Replaying %s over %zu connections "
+				"without waits...", pathText, replay->streamCount);
+	}
+	else
+	{
+		LogMessage(env, obj, "Replaying %s over %zu connections "
+				"at %d%% speed...", pathText, replay->streamCount, speed);
+	}
+
+	// Release the path
+	env->ReleaseStringUTFChars(path, pathText);
+
+	if (NULL == replay)
+		goto exit;
+
+	// Get IP address as C string
+	ipAddress = env->GetStringUTFChars(ip, NULL);
+	if (NULL == ipAddress)
+		goto exit;
+
+	ConnectReplay(env, obj, replay, ipAddress, (unsigned short) port);
+
+	// Release the IP address
+	env->ReleaseStringUTFChars(ip, ipAddress);
+
+	if (NULL != env->ExceptionOccurred())
+		goto exit;
+
+	{
+		uint64_t startTime = EchoGetMonotonicTime();
+
+		result = EchoRunReplay(replay);
+		if (result < 0)
+		{
+			ThrowResultException(env, result);
+			goto exit;
+		}
+
+		double elapsed = (double) (EchoGetMonotonicTime() - startTime) / 1e9;
+
+		LogMessage(env, obj, "Replayed %llu messages, %llu bytes sent "
+				"and %llu echoed in %.2f s.",
+				(unsigned long long) replay->sentCount,
+				(unsigned long long) replay->sentBytes,
+				(unsigned long long) replay->receivedBytes, elapsed);
+
+		// Records have no schedule at full speed
+		if (0 != replay->speed)
+		{
+			LogMessage(env, obj, "Send lag p50 %.1f us, p99 %.1f us, "
+					"max %.1f us.",
+					EchoGetHistogramPercentile(&replay->lag, 50.0) / 1e3,
+					EchoGetHistogramPercentile(&replay->lag, 99.0) / 1e3,
+					replay->lag.max / 1e3);
+		}
+	}
+
+exit:
+	if (NULL != replay)
+	{
+		EchoDeleteReplay(replay);
+	}
+
+	// Let the pending messages drain
+	EndLog(env, obj);
+}
+
+/**
+ * Single producer single consumer message ring in shared
+ * memory. Positions are free running byte counts, and each
+ * message is a length prefix followed by the payload.
+ */
+struct SharedRing
+{
+	// Bytes written by the producer
+	uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+
+	// Consumer sleeps on its eventfd until data is written
+	uint32_t consumerWaiting;
+
+	// Bytes read by the consumer
+	uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+
+	// Producer sleeps on its eventfd until space is freed
+	uint32_t producerWaiting;
+
+	// Message data
+	char data[SHARED_RING_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+/**
+ * Shared memory region set up by the client, holding the
+ * request and the reply rings.
+ */
+struct SharedRegion
+{
+	// Region layout check
+	uint32_t magic;
+	uint32_t ringSize;
+
+	// Client to server messages
+	struct SharedRing requests;
+
+	// Server to client messages
+	struct SharedRing replies;
+};
+
+/**
+ * One side of a shared memory channel. The local socket
+ * it is set up on only tells that the peer is gone.
+ */
+struct SharedChannel
+{
+	// Local socket the channel is set up on
+	int controlSocket;
+
+	// Mapped shared region
+	struct SharedRegion* region;
+
+	// Ring written by this side and ring read by this side
+	struct SharedRing* outbound;
+	struct SharedRing* inbound;
+
+	// Eventfd this side sleeps on, and the one of the peer
+	int wakeFd;
+	int peerWakeFd;
+
+	// Peer is gone or broke the ring
+	bool closed;
+
+	// Next channel served by the server
+	struct SharedChannel* next;
+};
+
+/**
+ * Hints the CPU that the thread is spinning.
+ */
+static inline void CpuRelax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * Gets the number of polls to spin before sleeping. On a
+ * single CPU spinning only delays the peer, so it is off.
+ *
+ * @return spin count.
+ */
+static int GetSharedSpinCount()
+{
+	static int spinCount = -1;
+
+	if (-1 == spinCount)
+	{
+		spinCount = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SHARED_SPIN_COUNT : 0;
+	}
+
+	return spinCount;
+}
+
+/**
+ * Copies the given data into the ring at the given
+ * position, wrapping around the end.
+ *
+ * @param ring shared ring.
+ * @param position ring position.
+ * @param data data to copy.
+ * @param size data size.
+ */
+static void CopyToSharedRing(
+		struct SharedRing* ring,
+		uint32_t position,
+		const char* data,
+		uint32_t size)
+{
+	uint32_t offset = position & (SHARED_RING_SIZE - 1);
+	uint32_t chunk = SHARED_RING_SIZE - offset;
+
+	if (chunk > size)
+	{
+		chunk = size;
+	}
+
+	memcpy(ring->data + offset, data, chunk);
+	memcpy(ring->data, data + chunk, size - chunk);
+}
+
+/**
+ * Copies the data at the given ring position out of the
+ * ring, wrapping around the end.
+ *
+ * @param ring shared ring.
+ * @param position ring position.
+ * @param data data buffer.
+ * @param size data size.
+ */
+static void CopyFromSharedRing(
+		const struct SharedRing* ring,
+		uint32_t position,
+		char* data,
+		uint32_t size)
+{
+	uint32_t offset = position & (SHARED_RING_SIZE - 1);
+	uint32_t chunk = SHARED_RING_SIZE - offset;
+
+	if (chunk > size)
 	{
-		// Throw an exception with error number
-		ThrowErrnoException(env, "java/io/IOException", errno);
+		chunk = size;
 	}
-	else
+
+	memcpy(data, ring->data + offset, chunk);
+	memcpy(data + chunk, ring->data, size - chunk);
+}
+
+/**
+ * Copies the data at the given position of one ring to the
+ * given position of the other, without a bounce buffer.
+ *
+ * @param to target ring.
+ * @param toPosition target ring position.
+ * @param from source ring.
+ * @param fromPosition source ring position.
+ * @param size data size.
+ */
+static void CopyBetweenSharedRings(
+		struct SharedRing* to,
+		uint32_t toPosition,
+		const struct SharedRing* from,
+		uint32_t fromPosition,
+		uint32_t size)
+{
+	while (size > 0)
 	{
-		if (sentSize > 0)
+		uint32_t toOffset = toPosition & (SHARED_RING_SIZE - 1);
+		uint32_t fromOffset = fromPosition & (SHARED_RING_SIZE - 1);
+
+		// Largest piece that does not wrap around either ring
+		uint32_t chunk = size;
+
+		if (chunk > SHARED_RING_SIZE - toOffset)
 		{
-			LogMessage(env, obj, "Sent %d bytes: %s", sentSize, buffer);
+			chunk = SHARED_RING_SIZE - toOffset;
 		}
-		else
+
+		if (chunk > SHARED_RING_SIZE - fromOffset)
 		{
-			LogMessage(env, obj, "Client disconnected.");
+			chunk = SHARED_RING_SIZE - fromOffset;
 		}
+
+		memcpy(to->data + toOffset, from->data + fromOffset, chunk);
+
+		toPosition += chunk;
+		fromPosition += chunk;
+		size -= chunk;
 	}
+}
 
-	return sentSize;
+/**
+ * Gets the free space of the ring as seen by the producer.
+ *
+ * @param ring shared ring.
+ * @return free space in bytes.
+ */
+static uint32_t GetSharedRingSpace(struct SharedRing* ring)
+{
+	uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	return SHARED_RING_SIZE - (ring->tail - head);
+}
+
+/**
+ * Checks if the ring has a message for the consumer.
+ *
+ * @param ring shared ring.
+ * @return true if not empty.
+ */
+static bool HasSharedMessage(struct SharedRing* ring)
+{
+	return (ring->head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Wakes the peer up through its eventfd if it is waiting
+ * on any of the given flags. The full barrier orders the
+ * published position before reading the flags.
+ *
+ * @param channel shared channel.
+ * @param waiting flag set by the peer before sleeping.
+ * @param otherWaiting other flag set by the peer.
+ */
+static void WakeSharedPeer(
+		struct SharedChannel* channel,
+		uint32_t* waiting,
+		uint32_t* otherWaiting)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if ((0 != __atomic_load_n(waiting, __ATOMIC_RELAXED))
+			|| ((NULL != otherWaiting)
+					&& (0 != __atomic_load_n(otherWaiting, __ATOMIC_RELAXED))))
+	{
+		uint64_t value = 1;
+
+		// Counter only overflows if the peer never reads it
+		while ((-1 == write(channel->peerWakeFd, &value, sizeof(value)))
+				&& (EINTR == errno))
+		{
+		}
+	}
+}
+
+/**
+ * Writes the message into the outbound ring and wakes the
+ * peer up if it is sleeping.
+ *
+ * @param channel shared channel.
+ * @param data message data.
+ * @param size message size.
+ * @return true if written, false if the ring is full.
+ */
+static bool PushSharedMessage(
+		struct SharedChannel* channel,
+		const char* data,
+		uint32_t size)
+{
+	struct SharedRing* ring = channel->outbound;
+
+	if (GetSharedRingSpace(ring) < SHARED_HEADER_SIZE + size)
+		return false;
+
+	uint32_t tail = ring->tail;
+	CopyToSharedRing(ring, tail, (const char*) &size, SHARED_HEADER_SIZE);
+	CopyToSharedRing(ring, tail + SHARED_HEADER_SIZE, data, size);
+
+	__atomic_store_n(&ring->tail, tail + SHARED_HEADER_SIZE + size,
+			__ATOMIC_RELEASE);
+
+	WakeSharedPeer(channel, &ring->consumerWaiting, NULL);
+
+	return true;
+}
+
+/**
+ * Reads the next message from the inbound ring and wakes
+ * the peer up if it is waiting for space.
+ *
+ * @param channel shared channel.
+ * @param buffer message buffer.
+ * @param bufferSize message buffer size.
+ * @return message size, -1 if empty, -2 if the message
+ *         does not fit the buffer.
+ */
+static ssize_t PopSharedMessage(
+		struct SharedChannel* channel,
+		char* buffer,
+		uint32_t bufferSize)
+{
+	struct SharedRing* ring = channel->inbound;
+
+	if (!HasSharedMessage(ring))
+		return -1;
+
+	uint32_t head = ring->head;
+	uint32_t size;
+	CopyFromSharedRing(ring, head, (char*) &size, SHARED_HEADER_SIZE);
+
+	if (size > bufferSize)
+		return -2;
+
+	CopyFromSharedRing(ring, head + SHARED_HEADER_SIZE, buffer, size);
+
+	__atomic_store_n(&ring->head, head + SHARED_HEADER_SIZE + size,
+			__ATOMIC_RELEASE);
+
+	WakeSharedPeer(channel, &ring->producerWaiting, NULL);
+
+	return (ssize_t) size;
+}
+
+/**
+ * Clears the wake-ups counted on the eventfd of the channel.
+ *
+ * @param channel shared channel.
+ * @return true if cleared, false if the eventfd failed.
+ */
+static bool ClearSharedWakeUps(struct SharedChannel* channel)
+{
+	uint64_t value;
+
+	while (-1 == read(channel->wakeFd, &value, sizeof(value)))
+	{
+		if (EINTR == errno)
+			continue;
+
+		// Nothing counted, an earlier read took the wake-ups
+		return (EAGAIN == errno) || (EWOULDBLOCK == errno);
+	}
+
+	return true;
+}
+
+/**
+ * Waits until the inbound ring has a message, or until the
+ * outbound ring has the given space. Spins first, then
+ * sleeps on the eventfd or until the peer is gone.
+ *
+ * @param channel shared channel.
+ * @param space outbound space to wait for, zero to wait
+ *        for an inbound message.
+ * @return true if ready, false if the peer is gone.
+ */
+static bool WaitSharedChannel(struct SharedChannel* channel, uint32_t space)
+{
+	uint32_t* waiting = (0 == space) ? &channel->inbound->consumerWaiting
+			: &channel->outbound->producerWaiting;
+
+	while (1)
+	{
+		for (int i = GetSharedSpinCount(); i > 0; i--)
+		{
+			if ((0 == space) ? HasSharedMessage(channel->inbound)
+					: (GetSharedRingSpace(channel->outbound) >= space))
+			{
+				return true;
+			}
+
+			CpuRelax();
+		}
+
+		// Check once more after telling the peer to wake us up
+		__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+
+		bool ready = (0 == space) ? HasSharedMessage(channel->inbound)
+				: (GetSharedRingSpace(channel->outbound) >= space);
+
+		if (!ready)
+		{
+			struct pollfd fds[2];
+			fds[0].fd = channel->wakeFd;
+			fds[0].events = POLLIN;
+			fds[1].fd = channel->controlSocket;
+			fds[1].events = POLLIN;
+
+			int result = poll(fds, 2, -1);
+
+			if ((-1 == result) && (EINTR != errno))
+			{
+				__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+				return false;
+			}
+
+			// Control socket carries no data, readable means closed
+			if ((result > 0) && (0 != fds[1].revents))
+			{
+				__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+				return false;
+			}
+
+			if (!ClearSharedWakeUps(channel))
+			{
+				__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+				return false;
+			}
+		}
+
+		__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+
+		if (ready)
+			return true;
+	}
+}
+
+/**
+ * Deletes the shared channel by unmapping the region and
+ * closing its descriptors.
+ *
+ * @param channel shared channel.
+ */
+static void DeleteSharedChannel(struct SharedChannel* channel)
+{
+	if (NULL != channel->region)
+	{
+		munmap(channel->region, sizeof(struct SharedRegion));
+	}
+
+	if (-1 != channel->controlSocket)
+	{
+		close(channel->controlSocket);
+	}
+
+	if (-1 != channel->wakeFd)
+	{
+		close(channel->wakeFd);
+	}
+
+	if (-1 != channel->peerWakeFd)
+	{
+		close(channel->peerWakeFd);
+	}
+
+	free(channel);
+}
+
+/**
+ * Allocates an empty shared channel.
+ *
+ * @param env JNIEnv interface.
+ * @return shared channel.
+ * @throws OutOfMemoryError
+ */
+static struct SharedChannel* AllocateSharedChannel(JNIEnv* env)
+{
+	struct SharedChannel* channel = (struct SharedChannel*) calloc(1,
+			sizeof(struct SharedChannel));
+
+	if (NULL == channel)
+	{
+		ThrowException(env, jniCache.outOfMemoryError,
+				"Unable to allocate shared channel.");
+		return NULL;
+	}
+
+	channel->controlSocket = -1;
+	channel->wakeFd = -1;
+	channel->peerWakeFd = -1;
+
+	return channel;
+}
+
+/**
+ * Maps the shared region of the given memory descriptor.
+ *
+ * @param fd memory descriptor.
+ * @return shared region or NULL with errno.
+ */
+static struct SharedRegion* MapSharedRegion(int fd)
+{
+	void* region = mmap(NULL, sizeof(struct SharedRegion),
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	return (MAP_FAILED == region) ? NULL : (struct SharedRegion*) region;
 }
 
 /**
- * Connects to given IP address and given port.
+ * Connects to the shared memory server with the given name
+ * and sets up a new shared channel. The client creates the
+ * region and both eventfds, and passes them over the local
+ * socket.
  *
  * @param env JNIEnv interface.
  * @param obj object instance.
- * @param sd socket descriptor.
- * @param ip IP address.
- * @param port port number.
+ * @param name socket name.
+ * @return shared channel or NULL.
  * @throws IOException
  */
-static void ConnectToAddress(
+static struct SharedChannel* NewSharedChannel(
 		JNIEnv* env,
 		jobject obj,
-		int sd,
-		const char* ip,
-		unsigned short port)
+		const char* name)
 {
-	// Connecting to given IP address and given port
-	LogMessage(env, obj, "Connecting to %s:%uh...", ip, port);
-
-	struct sockaddr_in address;
-
-	memset(&address, 0, sizeof(address));
-	address.sin_family = PF_INET;
-
-	// Convert IP address string to Internet address
-	if (0 == inet_aton(ip, &(address.sin_addr)))
+#ifndef HAVE_MEMFD
+	ThrowException(env, jniCache.ioException,
+			"Shared memory is not supported.");
+	return NULL;
+#else
+	struct SharedChannel* channel = AllocateSharedChannel(env);
+	if (NULL == channel)
+		return NULL;
+
+	int memFd = -1;
+
+	channel->controlSocket = NewLocalSocket(env, obj, SOCK_SEQPACKET);
+	if (NULL != env->ExceptionOccurred())
+		goto exit;
+
+	ConnectToLocalName(env, obj, channel->controlSocket, name);
+	if (NULL != env->ExceptionOccurred())
+		goto exit;
+
+	// Anonymous memory that can be passed and mapped by the peer
+	memFd = (int) syscall(__NR_memfd_create, "echo", MFD_CLOEXEC);
+	channel->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	channel->peerWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if ((-1 == memFd) || (-1 == channel->wakeFd)
+			|| (-1 == channel->peerWakeFd)
+			|| (-1 == ftruncate(memFd, sizeof(struct SharedRegion)))
+			|| (NULL == (channel->region = MapSharedRegion(memFd))))
 	{
 		// Throw an exception with error number
-		ThrowErrnoException(env, "java/io/IOException", errno);
+		ThrowErrnoException(env, jniCache.ioException, errno);
+		goto exit;
 	}
-	else
-	{
-		// Convert port to network byte order
-		address.sin_port = htons(port);
 
-		// Connect to address
-		if (-1 == connect(sd, (const sockaddr*) &address, sizeof(address)))
+	channel->region->magic = SHARED_REGION_MAGIC;
+	channel->region->ringSize = SHARED_RING_SIZE;
+	channel->outbound = &channel->region->requests;
+	channel->inbound = &channel->region->replies;
+
+	{
+		// Pass the region and the eventfds, server wakes up first
+		int fds[SHARED_CHANNEL_FDS] = { memFd, channel->peerWakeFd,
+				channel->wakeFd };
+
+		uint32_t magic = SHARED_REGION_MAGIC;
+		struct iovec vector;
+		vector.iov_base = &magic;
+		vector.iov_len = sizeof(magic);
+
+		union EchoPassedFdsControl control;
+		memset(&control, 0, sizeof(control));
+
+		struct msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = &vector;
+		message.msg_iovlen = 1;
+		message.msg_control = control.buffer;
+		message.msg_controllen = CMSG_SPACE(sizeof(fds));
+
+		struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+		header->cmsg_level = SOL_SOCKET;
+		header->cmsg_type = SCM_RIGHTS;
+		header->cmsg_len = CMSG_LEN(sizeof(fds));
+		memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+		if (-1 == sendmsg(channel->controlSocket, &message, MSG_NOSIGNAL))
 		{
 			// Throw an exception with error number
-			ThrowErrnoException(env, "java/io/IOException", errno);
+			ThrowErrnoException(env, jniCache.ioException, errno);
+			goto exit;
 		}
-		else
+
+		// Wait for the server to map the region
+		char ack;
+		if (1 != ReceiveFully(channel->controlSocket, &ack, 1))
 		{
-			LogMessage(env, obj, "Connected.");
+			ThrowException(env, jniCache.ioException,
+					"Shared channel is refused.");
+			goto exit;
 		}
 	}
+
+	LogMessage(env, obj, "Shared channel is set up.");
+
+exit:
+	// Mapping keeps the memory
+	if (-1 != memFd)
+	{
+		close(memFd);
+	}
+
+	if (NULL != env->ExceptionOccurred())
+	{
+		DeleteSharedChannel(channel);
+		channel = NULL;
+	}
+
+	return channel;
+#endif
 }
 
-void Java_com_apress_echo_EchoClientActivity_nativeStartTcpClient(
+/**
+ * Accepts a client on the shared memory server socket and
+ * sets up its shared channel from the passed descriptors.
+ * A client that passes an invalid setup is only dropped.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance.
+ * @param serverSocket server socket descriptor.
+ * @return shared channel or NULL.
+ * @throws OutOfMemoryError
+ */
+static struct SharedChannel* AcceptSharedChannel(
 		JNIEnv* env,
 		jobject obj,
-		jstring ip,
-		jint port,
-		jstring message)
+		int serverSocket)
 {
-	// Construct a new TCP socket.
-	int clientSocket = NewTcpSocket(env, obj);
-	if (NULL == env->ExceptionOccurred())
+	int clientSocket = accept(serverSocket, NULL, NULL);
+	if (-1 == clientSocket)
 	{
-		// Get IP address as C string
-		const char* ipAddress = env->GetStringUTFChars(ip, NULL);
-		if (NULL == ipAddress)
-			goto exit;
+		LogErrno(env, obj, "Unable to accept connection:", errno);
+		return NULL;
+	}
 
-		// Connect to IP address and port
-		ConnectToAddress(env, obj, clientSocket, ipAddress,
-				(unsigned short) port);
+	LogMessage(env, obj, "Local client connection.");
 
-		// Release the IP address
-		env->ReleaseStringUTFChars(ip, ipAddress);
+	struct SharedChannel* channel = AllocateSharedChannel(env);
+	if (NULL == channel)
+	{
+		close(clientSocket);
+		return NULL;
+	}
 
-		// If connection was successful
-		if (NULL != env->ExceptionOccurred())
-			goto exit;
+	channel->controlSocket = clientSocket;
 
-		// Get message as C string
-		const char* messageText = env->GetStringUTFChars(message, NULL);
-		if (NULL == messageText)
-			goto exit;
+	uint32_t magic = 0;
+	struct iovec vector;
+	vector.iov_base = &magic;
+	vector.iov_len = sizeof(magic);
 
-		// Get the message size
-		jsize messageSize = env->GetStringUTFLength(message);
+	union EchoPassedFdsControl control;
 
-		// Send message to socket
-		SendToSocket(env, obj, clientSocket, messageText, messageSize);
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &vector;
+	message.msg_iovlen = 1;
+	message.msg_control = control.buffer;
+	message.msg_controllen = sizeof(control.buffer);
 
-		// Release the message text
-		env->ReleaseStringUTFChars(message, messageText);
+	int fds[SHARED_CHANNEL_FDS] = { -1, -1, -1 };
+	size_t fdCount = 0;
 
-		// If send was not successful
-		if (NULL != env->ExceptionOccurred())
-			goto exit;
+	ssize_t recvSize = recvmsg(clientSocket, &message, MSG_CMSG_CLOEXEC);
+
+	for (struct cmsghdr* header = (-1 == recvSize) ? NULL
+			: CMSG_FIRSTHDR(&message); NULL != header;
+			header = CMSG_NXTHDR(&message, header))
+	{
+		if ((SOL_SOCKET != header->cmsg_level)
+				|| (SCM_RIGHTS != header->cmsg_type))
+		{
+			continue;
+		}
 
-		char buffer[MAX_BUFFER_SIZE];
+		int* passedFds = (int*) CMSG_DATA(header);
+		size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
 
-		// Receive from the socket
-		ReceiveFromSocket(env, obj, clientSocket, buffer, MAX_BUFFER_SIZE);
+		for (size_t i = 0; i < count; i++)
+		{
+			if (fdCount < SHARED_CHANNEL_FDS)
+			{
+				fds[fdCount++] = passedFds[i];
+			}
+			else
+			{
+				close(passedFds[i]);
+			}
+		}
 	}
 
-exit:
-	if (clientSocket > 0)
+	// Take the eventfds so that they are closed with the channel
+	channel->wakeFd = fds[1];
+	channel->peerWakeFd = fds[2];
+
+	struct stat status;
+	bool valid = ((ssize_t) sizeof(magic) == recvSize)
+			&& (SHARED_REGION_MAGIC == magic)
+			&& (SHARED_CHANNEL_FDS == fdCount)
+			&& (0 == fstat(fds[0], &status))
+			&& (status.st_size >= (off_t) sizeof(struct SharedRegion));
+
+	if (valid)
 	{
-		close(clientSocket);
+		channel->region = MapSharedRegion(fds[0]);
+		valid = (NULL != channel->region)
+				&& (SHARED_REGION_MAGIC == channel->region->magic)
+				&& (SHARED_RING_SIZE == channel->region->ringSize);
+	}
+
+	if (-1 != fds[0])
+	{
+		close(fds[0]);
+	}
+
+	// Let the client know the region is mapped
+	char ack = 1;
+	if (!valid || (1 != send(clientSocket, &ack, 1, MSG_NOSIGNAL)))
+	{
+		LogError(env, obj, "Invalid shared channel setup.");
+		DeleteSharedChannel(channel);
+		return NULL;
 	}
+
+	channel->outbound = &channel->region->replies;
+	channel->inbound = &channel->region->requests;
+
+	return channel;
 }
 
-void Java_com_apress_echo_EchoServerActivity_nativeStartTcpServer(
-		JNIEnv* env,
-		jobject obj,
-		jint port)
+/**
+ * Echoes the requests of the shared channel back as the
+ * replies, copying from ring to ring, until the requests
+ * are consumed or the reply ring is full.
+ *
+ * @param channel shared channel.
+ * @param stats worker counters.
+ * @return number of echoed messages.
+ */
+static size_t EchoSharedChannel(
+		struct SharedChannel* channel,
+		struct EchoWorkerStats* stats)
 {
-	// Construct a new TCP socket.
-	int serverSocket = NewTcpSocket(env, obj);
-	if (NULL == env->ExceptionOccurred())
+	struct SharedRing* requests = channel->inbound;
+	struct SharedRing* replies = channel->outbound;
+	size_t count = 0;
+
+	__atomic_store_n(&replies->producerWaiting, 0, __ATOMIC_RELAXED);
+
+	while (HasSharedMessage(requests))
 	{
-		// Bind socket to a port number
-		BindSocketToPort(env, obj, serverSocket, (unsigned short) port);
-		if (NULL != env->ExceptionOccurred())
-			goto exit;
+		uint32_t head = requests->head;
+		uint32_t size;
+		CopyFromSharedRing(requests, head, (char*) &size, SHARED_HEADER_SIZE);
 
-		// If random port number is requested
-		if (0 == port)
+		// Peer broke the ring
+		if (size > MAX_SHARED_MESSAGE_SIZE)
 		{
-			// Get the port number socket is currently binded
-			GetSocketPort(env, obj, serverSocket);
-			if (NULL != env->ExceptionOccurred())
-				goto exit;
+			channel->closed = true;
+			break;
 		}
 
-		// Listen on socket with a backlog of 4 pending connections
-		ListenOnSocket(env, obj, serverSocket, 4);
-		if (NULL != env->ExceptionOccurred())
-			goto exit;
+		uint32_t recordSize = SHARED_HEADER_SIZE + size;
 
-		// Accept a client connection on socket
-		int clientSocket = AcceptOnSocket(env, obj, serverSocket);
-		if (NULL != env->ExceptionOccurred())
-			goto exit;
+		if (GetSharedRingSpace(replies) < recordSize)
+		{
+			// Check once more after telling the client to wake us up
+			__atomic_store_n(&replies->producerWaiting, 1, __ATOMIC_SEQ_CST);
+
+			if (GetSharedRingSpace(replies) < recordSize)
+				break;
+
+			__atomic_store_n(&replies->producerWaiting, 0, __ATOMIC_RELAXED);
+		}
+
+		uint32_t tail = replies->tail;
+		CopyBetweenSharedRings(replies, tail, requests, head, recordSize);
+
+		__atomic_store_n(&replies->tail, tail + recordSize, __ATOMIC_RELEASE);
+		__atomic_store_n(&requests->head, head + recordSize, __ATOMIC_RELEASE);
+
+		EchoAddStat(stats, STAT_BYTES_IN, size);
+		EchoAddStat(stats, STAT_BYTES_OUT, size);
+		count++;
+	}
+
+	// One wakeup for both the replies and the freed request space
+	if (count > 0)
+	{
+		WakeSharedPeer(channel, &replies->consumerWaiting,
+				&requests->producerWaiting);
+	}
+
+	return count;
+}
+
+/**
+ * Echoes the requests of all shared channels, and deletes
+ * the closed ones.
+ *
+ * @param env JNIEnv interface.
+ * @param obj object instance.
+ * @param channels shared channels list.
+ * @param stats worker counters.
+ * @return number of echoed messages.
+ */
+static size_t ServeSharedChannels(
+		JNIEnv* env,
+		jobject obj,
+		struct SharedChannel** channels,
+		struct EchoWorkerStats* stats)
+{
+	size_t count = 0;
 
-		char buffer[MAX_BUFFER_SIZE];
-		ssize_t recvSize;
-		ssize_t sentSize;
+	for (struct SharedChannel** link = channels; NULL != *link;)
+	{
+		struct SharedChannel* channel = *link;
 
-		// Receive and send back the data
-		while (1)
+		if (!channel->closed)
 		{
-			// Receive from the socket
-			recvSize = ReceiveFromSocket(env, obj, clientSocket,
-					buffer, MAX_BUFFER_SIZE);
-
-			if ((0 == recvSize) || (NULL != env->ExceptionOccurred()))
-				break;
+			count += EchoSharedChannel(channel, stats);
+		}
 
-			// Send to the socket
-			sentSize = SendToSocket(env, obj, clientSocket,
-					buffer, (size_t) recvSize);
+		if (channel->closed)
+		{
+			*link = channel->next;
+			DeleteSharedChannel(channel);
+			EchoAddStat(stats, STAT_ACTIVE_CONNECTIONS, (uint64_t) -1);
 
-			if ((0 == sentSize) || (NULL != env->ExceptionOccurred()))
-				break;
+			LogMessage(env, obj, "Shared channel closed.");
+		}
+		else
+		{
+			link = &channel->next;
 		}
-
-		// Close the client socket
-		close(clientSocket);
 	}
 
-exit:
-	if (serverSocket > 0)
-	{
-		close(serverSocket);
-	}
+	return count;
 }
 
 /**
- * Constructs a new UDP socket.
+ * Sets the flag telling the clients to wake the server up
+ * with their next request.
  *
- * @param env JNIEnv interface.
- * @param obj object instance.
- * @return socket descriptor.
- * @throws IOException
+ * @param channels shared channels list.
+ * @param waiting waiting flag value.
  */
-static int NewUdpSocket(JNIEnv* env, jobject obj)
+static void SetSharedChannelsWaiting(
+		struct SharedChannel* channels,
+		uint32_t waiting)
 {
-	// Construct socket
-	LogMessage(env, obj, "Constructing a new UDP socket...");
-	int udpSocket = socket(PF_INET, SOCK_DGRAM, 0);
-
-	// Check if socket is properly constructed
-	if (-1 == udpSocket)
+	for (struct SharedChannel* channel = channels; NULL != channel;
+			channel = channel->next)
 	{
-		// Throw an exception with error number
-		ThrowErrnoException(env, "java/io/IOException", errno);
+		__atomic_store_n(&channel->inbound->consumerWaiting, waiting,
+				__ATOMIC_SEQ_CST);
 	}
-
-	return udpSocket;
 }
 
 /**
- * Block and receive datagram from the socket into
- * the buffer, and populate the client address.
+ * Runs the shared memory server loop. Spins over the rings
+ * while there are requests, and sleeps on epoll for the
+ * eventfds, the new clients and the closed clients.
  *
  * @param env JNIEnv interface.
  * @param obj object instance.
- * @param sd socket descriptor.
- * @param address client address.
- * @param buffer data buffer.
- * @param bufferSize buffer size.
- * @return receive size.
+ * @param serverSocket server socket descriptor.
+ * @param epollFd epoll descriptor.
+ * @param channels shared channels list.
+ * @param stats worker counters.
+ * @param control server control or NULL.
  * @throws IOException
  */
-static ssize_t ReceiveDatagramFromSocket(
+static void RunSharedMemoryLoop(
 		JNIEnv* env,
 		jobject obj,
-		int sd,
-		struct sockaddr_in* address,
-		char* buffer,
-		size_t bufferSize)
+		int serverSocket,
+		int epollFd,
+		struct SharedChannel** channels,
+		struct EchoWorkerStats* stats,
+		struct EchoServerControl* control)
 {
-	socklen_t addressLength = sizeof(struct sockaddr_in);
+	struct epoll_event events[MAX_EPOLL_EVENTS];
 
-	// Receive datagram from socket
-	LogMessage(env, obj, "Receiving from the socket...");
-	ssize_t recvSize = recvfrom(sd, buffer, bufferSize, 0,
-			(struct sockaddr*) address,
-			&addressLength);
+	LogMessage(env, obj, "Waiting for client connections...");
 
-	// If receive is failed
-	if (-1 == recvSize)
+	// Replies are already in the rings, nothing to drain
+	while (!EchoIsStopRequested(control))
 	{
-		// Throw an exception with error number
-		ThrowErrnoException(env, "java/io/IOException", errno);
-	}
-	else
-	{
-		// Log address
-		LogAddress(env, obj, "Received from", address);
+		// Spin while the clients keep sending, without syscalls
+		for (int spin = 0; spin < GetSharedSpinCount(); spin++)
+		{
+			if (ServeSharedChannels(env, obj, channels, stats) > 0)
+			{
+				if (EchoIsStopRequested(control))
+					break;
+
+				spin = 0;
+			}
+
+			CpuRelax();
+		}
 
-		// NULL terminate the buffer to make it a string
-		buffer[recvSize] = NULL;
+		// Check once more after telling the clients to wake us up
+		SetSharedChannelsWaiting(*channels, 1);
 
-		// If data is received
-		if (recvSize > 0)
+		if (ServeSharedChannels(env, obj, channels, stats) > 0)
 		{
-			LogMessage(env, obj, "Received %d bytes: %s", recvSize, buffer);
+			SetSharedChannelsWaiting(*channels, 0);
+			continue;
 		}
-	}
 
-	return recvSize;
-}
+		int eventCount = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, -1);
+		EchoAddStat(stats, STAT_SYSCALLS, 1);
 
-/**
- * Sends datagram to the given address using the given socket.
- *
- * @param env JNIEnv interface.
- * @param obj object instance.
- * @param sd socket descriptor.
- * @param address remote address.
- * @param buffer data buffer.
- * @param bufferSize buffer size.
- * @return sent size.
- * @throws IOException
- */
-static ssize_t SendDatagramToSocket(
-		JNIEnv* env,
-		jobject obj,
-		int sd,
-		const struct sockaddr_in* address,
-		const char* buffer,
-		size_t bufferSize)
-{
-	// Send data buffer to the socket
-	LogAddress(env, obj, "Sending to", address);
-	ssize_t sentSize = sendto(sd, buffer, bufferSize, 0,
-			(const sockaddr*) address,
-			sizeof(struct sockaddr_in));
+		SetSharedChannelsWaiting(*channels, 0);
 
-	// If send is failed
-	if (-1 == sentSize)
-	{
-		// Throw an exception with error number
-		ThrowErrnoException(env, "java/io/IOException", errno);
-	}
-	else if (sentSize > 0)
-	{
-		LogMessage(env, obj, "Sent %d bytes: %s", sentSize, buffer);
+		if (-1 == eventCount)
+		{
+			if (EINTR == errno)
+				continue;
+
+			// Throw an exception with error number
+			ThrowErrnoException(env, jniCache.ioException, errno);
+			return;
+		}
+
+		for (int i = 0; i < eventCount; i++)
+		{
+			// Stop is checked by the loop
+			if ((NULL != control) && ((void*) control == events[i].data.ptr))
+				continue;
+
+			struct SharedChannel* channel =
+					(struct SharedChannel*) events[i].data.ptr;
+
+			// Listening socket has a pending client
+			if (NULL == channel)
+			{
+				channel = AcceptSharedChannel(env, obj, serverSocket);
+				if (NULL != env->ExceptionOccurred())
+					return;
+
+				if (NULL == channel)
+					continue;
+
+				EchoAddStat(stats, STAT_ACCEPTS, 1);
+				EchoAddStat(stats, STAT_ACTIVE_CONNECTIONS, 1);
+
+				channel->next = *channels;
+				*channels = channel;
+
+				// Watch the eventfd, and the control socket for closing
+				struct epoll_event event;
+				memset(&event, 0, sizeof(event));
+				event.data.ptr = channel;
+
+				event.events = EPOLLIN;
+				bool watched = (0 == epoll_ctl(epollFd, EPOLL_CTL_ADD,
+						channel->wakeFd, &event));
+
+				event.events = EPOLLRDHUP;
+				watched = watched && (0 == epoll_ctl(epollFd, EPOLL_CTL_ADD,
+						channel->controlSocket, &event));
+
+				if (!watched)
+				{
+					LogErrno(env, obj, "Unable to watch shared channel:",
+							errno);
+					channel->closed = true;
+				}
+			}
+			else if (0 != (events[i].events
+					& (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+			{
+				// Deleted with the next serve, closing removes it from epoll
+				channel->closed = true;
+			}
+			else if (!ClearSharedWakeUps(channel))
+			{
+				LogErrno(env, obj, "Unable to read shared channel eventfd:",
+						errno);
+				channel->closed = true;
+			}
+		}
 	}
 
-	return sentSize;
+	LogMessage(env, obj, "Server stopped.");
 }
 
-void Java_com_apress_echo_EchoClientActivity_nativeStartUdpClient(
+void Java_com_apress_echo_LocalEchoActivity_nativeStartSharedMemoryServer(
 		JNIEnv* env,
 		jobject obj,
-		jstring ip,
-		jint port,
-		jstring message)
+		jstring name,
+		jlong handle)
 {
-	// Construct a new UDP socket.
-	int clientSocket = NewUdpSocket(env, obj);
-	if (NULL == env->ExceptionOccurred())
+	// Log through the log ring
+	obj = BeginLog(env, obj);
+	if (NULL == obj)
+		return;
+
+	int serverSocket = -1;
+	int epollFd = -1;
+	const char* nameText = NULL;
+	struct SharedChannel* channels = NULL;
+	struct EchoServerControl* control = NULL;
+	struct epoll_event event;
+
+	struct EchoWorkerStats* stats = EchoAcquireWorkerStats();
+	if (NULL == stats)
 	{
-		struct sockaddr_in address;
+		ThrowException(env, jniCache.illegalStateException,
+				"Too many workers.");
+		goto exit;
+	}
 
-		memset(&address, 0, sizeof(address));
-		address.sin_family = PF_INET;
+	// Channels are set up over a sequenced packet local socket
+	serverSocket = NewLocalSocket(env, obj, SOCK_SEQPACKET);
+	if (NULL != env->ExceptionOccurred())
+		goto exit;
 
-		// Get IP address as C string
-		const char* ipAddress = env->GetStringUTFChars(ip, NULL);
-		if (NULL == ipAddress)
-			goto exit;
+	// Get name as C string
+	nameText = env->GetStringUTFChars(name, NULL);
+	if (NULL == nameText)
+		goto exit;
 
-		// Convert IP address string to Internet address
-		int result = inet_aton(ipAddress, &(address.sin_addr));
+	// Bind socket to a port number
+	BindLocalSocketToName(env, obj, serverSocket, nameText);
 
-		// Release the IP address
-		env->ReleaseStringUTFChars(ip, ipAddress);
+	// Release the name text
+	env->ReleaseStringUTFChars(name, nameText);
 
-		// If conversion is failed
-		if (0 == result)
-		{
-			// Throw an exception with error number
-			ThrowErrnoException(env, "java/io/IOException", errno);
-			goto exit;
-		}
+	// If bind is failed
+	if (NULL != env->ExceptionOccurred())
+		goto exit;
 
-		// Convert port to network byte order
-		address.sin_port = htons(port);
+	// Listen on socket with the profile backlog
+	ListenOnSocket(env, obj, serverSocket, config.socket.backlog);
+	if (NULL != env->ExceptionOccurred())
+		goto exit;
 
-		// Get message as C string
-		const char* messageText = env->GetStringUTFChars(message, NULL);
-		if (NULL == messageText)
-			goto exit;
+	// Listening socket is marked with a NULL data pointer
+	epollFd = epoll_create(MAX_EPOLL_EVENTS);
 
-		// Get the message size
-		jsize messageSize = env->GetStringUTFLength(message);
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
 
-		// Send message to socket
-		SendDatagramToSocket(env, obj, clientSocket, &address,
-				messageText, messageSize);
+	if ((-1 == epollFd)
+			|| (-1 == epoll_ctl(epollFd, EPOLL_CTL_ADD, serverSocket, &event)))
+	{
+		// Throw an exception with error number
+		ThrowErrnoException(env, jniCache.ioException, errno);
+		goto exit;
+	}
 
-		// Release the message text
-		env->ReleaseStringUTFChars(message, messageText);
+	// Stop descriptor is marked with the server control
+	control = GetServerControl(handle);
+	event.data.ptr = control;
 
-		// If send was not successful
-		if (NULL != env->ExceptionOccurred())
-			goto exit;
+	if ((NULL != control) && (-1 == epoll_ctl(epollFd, EPOLL_CTL_ADD,
+			control->stopFd, &event)))
+	{
+		// Throw an exception with error number
+		ThrowErrnoException(env, jniCache.ioException, errno);
+		goto exit;
+	}
 
-		char buffer[MAX_BUFFER_SIZE];
+	// Serve the clients until a fatal error or the stop
+	RunSharedMemoryLoop(env, obj, serverSocket, epollFd, &channels, stats,
+			control);
 
-		// Clear address
-		memset(&address, 0, sizeof(address));
+exit:
+	// Close the shared channels and the server socket
+	while (NULL != channels)
+	{
+		struct SharedChannel* channel = channels;
+		channels = channel->next;
 
-		// Receive from the socket
-		ReceiveDatagramFromSocket(env, obj, clientSocket, &address,
-				buffer, MAX_BUFFER_SIZE);
+		DeleteSharedChannel(channel);
+		EchoAddStat(stats, STAT_ACTIVE_CONNECTIONS, (uint64_t) -1);
 	}
 
-exit:
-	if (clientSocket > 0)
+	if (-1 != epollFd)
 	{
-		close(clientSocket);
+		close(epollFd);
+	}
+
+	if (serverSocket > 0)
+	{
+		close(serverSocket);
+	}
+
+	if (NULL != stats)
+	{
+		EchoReleaseWorkerStats(stats);
 	}
+
+	// Let the pending messages drain
+	EndLog(env, obj);
 }
 
-void Java_com_apress_echo_EchoServerActivity_nativeStartUdpServer(
-		JNIEnv* env,
-		jobject obj,
-		jint port)
+/**
+ * Sends the message over the local socket and receives the
+ * echoed message back.
+ *
+ * @param sd socket descriptor.
+ * @param message message buffer.
+ * @param reply reply buffer.
+ * @param size message size.
+ * @return zero or negative error number.
+ */
+static int EchoOverLocalSocket(
+		int sd,
+		char* message,
+		char* reply,
+		size_t size)
 {
-	// Construct a new UDP socket.
-	int serverSocket = NewUdpSocket(env, obj);
-	if (NULL == env->ExceptionOccurred())
+	for (size_t sent = 0; sent < size;)
 	{
-		// Bind socket to a port number
-		BindSocketToPort(env, obj, serverSocket, (unsigned short) port);
-		if (NULL != env->ExceptionOccurred())
-			goto exit;
+		ssize_t sentSize = send(sd, message + sent, size - sent, MSG_NOSIGNAL);
 
-		// If random port number is requested
-		if (0 == port)
+		if (-1 == sentSize)
 		{
-			// Get the port number socket is currently binded
-			GetSocketPort(env, obj, serverSocket);
-			if (NULL != env->ExceptionOccurred())
-				goto exit;
-		}
+			if (EINTR == errno)
+				continue;
 
-		// Client address
-		struct sockaddr_in address;
-		memset(&address, 0, sizeof(address));
+			return -errno;
+		}
 
-		char buffer[MAX_BUFFER_SIZE];
-		ssize_t recvSize;
-		ssize_t sentSize;
+		sent += (size_t) sentSize;
+	}
 
-		// Receive from the socket
-		recvSize = ReceiveDatagramFromSocket(env, obj, serverSocket,
-				&address, buffer, MAX_BUFFER_SIZE);
+	ssize_t recvSize = ReceiveFully(sd, reply, size);
 
-		if ((0 == recvSize) || (NULL != env->ExceptionOccurred()))
-			goto exit;
+	if (-1 == recvSize)
+		return -errno;
 
-		// Send to the socket
-		sentSize = SendDatagramToSocket(env, obj, serverSocket,
-				&address, buffer, (size_t) recvSize);
-	}
+	// Peer closed the connection before the whole reply
+	if ((size_t) recvSize < size)
+		return -ECONNRESET;
 
-exit:
-	if (serverSocket > 0)
-	{
-		close(serverSocket);
-	}
+	return 0;
 }
 
 /**
- * Constructs a new Local UNIX socket.
+ * Sends the message over the shared channel and receives
+ * the echoed message back.
  *
- * @param env JNIEnv interface.
- * @param obj object instance.
- * @return socket descriptor.
- * @throws IOException
+ * @param channel shared channel.
+ * @param message message buffer.
+ * @param reply reply buffer.
+ * @param size message size.
+ * @return zero or negative error number.
  */
-static int NewLocalSocket(JNIEnv* env, jobject obj)
+static int EchoOverSharedChannel(
+		struct SharedChannel* channel,
+		char* message,
+		char* reply,
+		size_t size)
 {
-	// Construct socket
-	LogMessage(env, obj, "Constructing a new Local UNIX socket...");
-	int localSocket = socket(PF_LOCAL, SOCK_STREAM, 0);
+	while (!PushSharedMessage(channel, message, (uint32_t) size))
+	{
+		if (!WaitSharedChannel(channel, SHARED_HEADER_SIZE + (uint32_t) size))
+			return -ECONNRESET;
+	}
 
-	// Check if socket is properly constructed
-	if (-1 == localSocket)
+	ssize_t recvSize;
+
+	while (-1 == (recvSize = PopSharedMessage(channel, reply,
+			(uint32_t) size)))
 	{
-		// Throw an exception with error number
-		ThrowErrnoException(env, "java/io/IOException", errno);
+		if (!WaitSharedChannel(channel, 0))
+			return -ECONNRESET;
 	}
 
-	return localSocket;
+	if ((size_t) recvSize != size)
+		return -EPROTO;
+
+	return 0;
 }
 
-/**
- * Binds a local UNIX socket to a name.
- *
- * @param env JNIEnv interface.
- * @param obj object instance.
- * @param sd socket descriptor.
- * @param name socket name.
- * @throws IOException
- */
-static void BindLocalSocketToName(
+void Java_com_apress_echo_LocalEchoActivity_nativeStartLocalBenchmark(
 		JNIEnv* env,
 		jobject obj,
-		int sd,
-		const char* name)
+		jstring name,
+		jint transport,
+		jint payloadSize,
+		jint duration)
 {
-	struct sockaddr_un address;
-
-	// Name length
-	const size_t nameLength = strlen(name);
+	// Log through the log ring
+	obj = BeginLog(env, obj);
+	if (NULL == obj)
+		return;
+
+	int sd = -1;
+	struct SharedChannel* channel = NULL;
+	char* message = NULL;
+	char* reply = NULL;
+	struct EchoHistogram* histogram = NULL;
+	const char* nameText = NULL;
+	uint64_t startTime;
+	uint64_t endTime;
+	uint64_t count = 0;
+
+	// Check the benchmark parameters
+	if (((LOCAL_TRANSPORT_SOCKET != transport)
+			&& (LOCAL_TRANSPORT_SHARED_MEMORY != transport))
+			|| (payloadSize < 1) || (payloadSize > MAX_BUFFER_SIZE)
+			|| (duration < 1))
+	{
+		ThrowException(env, jniCache.illegalArgumentException,
+				"Invalid benchmark parameters.");
+		goto exit;
+	}
 
-	// Path length is initiall equal to name length
-	size_t pathLength = nameLength;
+	message = NewBuffer(env, (size_t) payloadSize);
+	if (NULL == message)
+		goto exit;
 
-	// If name is not starting with a slash it is
-	// in the abstract namespace
-	bool abstractNamespace = ('/' != name[0]);
+	reply = NewBuffer(env, (size_t) payloadSize);
+	if (NULL == reply)
+		goto exit;
 
-	// Abstract namespace requires having the first
-	// byte of the path to be the zero byte, update
-	// the path length to include the zero byte
-	if (abstractNamespace)
+	histogram = (struct EchoHistogram*) calloc(1,
+			sizeof(struct EchoHistogram));
+	if (NULL == histogram)
 	{
-		pathLength++;
+		ThrowException(env, jniCache.outOfMemoryError,
+				"Unable to allocate histogram.");
+		goto exit;
 	}
 
-	// Check the path length
-	if (pathLength > sizeof(address.sun_path))
+	memset(message, 'e', (size_t) payloadSize);
+
+	// Get name as C string
+	nameText = env->GetStringUTFChars(name, NULL);
+	if (NULL == nameText)
+		goto exit;
+
+	if (LOCAL_TRANSPORT_SHARED_MEMORY == transport)
 	{
-		// Throw an exception with error number
-		ThrowException(env, "java/io/IOException", "Name is too big.");
+		channel = NewSharedChannel(env, obj, nameText);
 	}
 	else
 	{
-		// Clear the address bytes
-		memset(&address, 0, sizeof(address));
-		address.sun_family = PF_LOCAL;
-
-		// Socket path
-		char* sunPath = address.sun_path;
-
-		// First byte must be zero to use the abstract namespace
-		if (abstractNamespace)
+		sd = NewLocalSocket(env, obj, SOCK_STREAM);
+		if (NULL == env->ExceptionOccurred())
 		{
-			*sunPath++ = NULL;
+			ConnectToLocalName(env, obj, sd, nameText);
 		}
+	}
 
-		// Append the local name
-		strcpy(sunPath, name);
+	// Release the name text
+	env->ReleaseStringUTFChars(name, nameText);
 
-		// Address length
-		socklen_t addressLength =
-				(offsetof(struct sockaddr_un, sun_path))
-				+ pathLength;
+	if (NULL != env->ExceptionOccurred())
+		goto exit;
 
-		// Unlink if the socket name is already binded
-		unlink(address.sun_path);
+	LogMessage(env, obj, "Running %s ping pong benchmark for %d s...",
+			(NULL != channel) ? "shared memory" : "local socket", duration);
 
-		// Bind socket
-		LogMessage(env, obj, "Binding to local name %s%s.",
-				(abstractNamespace) ? "(null)" : "",
-				name);
+	startTime = EchoGetMonotonicTime();
+	endTime = startTime + ((uint64_t) duration * 1000000000ULL);
 
-		if (-1 == bind(sd, (struct sockaddr*) &address, addressLength))
+	// One message in flight, the round trip is the latency
+	for (uint64_t now = startTime; now < endTime;)
+	{
+		int result = (NULL != channel)
+				? EchoOverSharedChannel(channel, message, reply,
+						(size_t) payloadSize)
+				: EchoOverLocalSocket(sd, message, reply,
+						(size_t) payloadSize);
+
+		// Errors are turned into an exception once, off the hot path
+		if (result < 0)
 		{
-			// Throw an exception with error number
-			ThrowErrnoException(env, "java/io/IOException", errno);
+			ThrowResultException(env, result);
+			goto exit;
 		}
-	}
-}
 
-/**
- * Blocks and waits for incoming client connections on the
- * given socket.
- *
- * @param env JNIEnv interface.
- * @param obj object instance.
- * @param sd socket descriptor.
- * @return client socket.
- * @throws IOException
- */
-static int AcceptOnLocalSocket(
-		JNIEnv* env,
-		jobject obj,
-		int sd)
-{
-	// Blocks and waits for an incoming client connection
-	// and accepts it
-	LogMessage(env, obj, "Waiting for a client connection...");
-	int clientSocket = accept(sd, NULL, NULL);
+		uint64_t replyTime = EchoGetMonotonicTime();
+		EchoRecordHistogramValue(histogram, replyTime - now);
+		count++;
 
-	// If client socket is not valid
-	if (-1 == clientSocket)
-	{
-		// Throw an exception with error number
-		ThrowErrnoException(env, "java/io/IOException", errno);
+		now = replyTime;
 	}
 
-	return clientSocket;
-}
-
-void Java_com_apress_echo_LocalEchoActivity_nativeStartLocalServer(
-		JNIEnv* env,
-		jobject obj,
-		jstring name)
-{
-	// Construct a new local UNIX socket.
-	int serverSocket = NewLocalSocket(env, obj);
-	if (NULL == env->ExceptionOccurred())
 	{
-		// Get name as C string
-		const char* nameText = env->GetStringUTFChars(name, NULL);
-		if (NULL == nameText)
-			goto exit;
+		double elapsed = (double) (EchoGetMonotonicTime() - startTime) / 1e9;
 
-		// Bind socket to a port number
-		BindLocalSocketToName(env, obj, serverSocket, nameText);
+		LogMessage(env, obj, "Echoed %llu messages in %.2f s.",
+				(unsigned long long) count, elapsed);
 
-		// Release the name text
-		env->ReleaseStringUTFChars(name, nameText);
+		LogMessage(env, obj, "Throughput %.0f msgs/s, %.2f MB/s.",
+				(double) count / elapsed,
+				(double) (count * (uint64_t) payloadSize) / elapsed / 1e6);
 
-		// If bind is failed
-		if (NULL != env->ExceptionOccurred())
-			goto exit;
+		LogHistogramPercentiles(env, obj, histogram);
+	}
 
-		// Listen on socket with a backlog of 4 pending connections
-		ListenOnSocket(env, obj, serverSocket, 4);
-		if (NULL != env->ExceptionOccurred())
-			goto exit;
+exit:
+	if (NULL != channel)
+	{
+		DeleteSharedChannel(channel);
+	}
 
-		// Accept a client connection on socket
-		int clientSocket = AcceptOnLocalSocket(env, obj, serverSocket);
-		if (NULL != env->ExceptionOccurred())
-			goto exit;
+	if (-1 != sd)
+	{
+		close(sd);
+	}
 
-		char buffer[MAX_BUFFER_SIZE];
-		ssize_t recvSize;
-		ssize_t sentSize;
+	free(histogram);
+	free(reply);
+	free(message);
 
-		// Receive and send back the data
-		while (1)
-		{
-			// Receive from the socket
-			recvSize = ReceiveFromSocket(env, obj, clientSocket,
-					buffer, MAX_BUFFER_SIZE);
+	// Let the pending messages drain
+	EndLog(env, obj);
+}
 
-			if ((0 == recvSize) || (NULL != env->ExceptionOccurred()))
-				break;
+/**
+ * Gets a global reference to the given class.
+ *
+ * @param env JNIEnv interface.
+ * @param className class name.
+ * @return global class reference or NULL if not found.
+ */
+static jclass NewGlobalClassRef(JNIEnv* env, const char* className)
+{
+	jclass clazz = env->FindClass(className);
+	if (NULL == clazz)
+		return NULL;
 
-			// Send to the socket
-			sentSize = SendToSocket(env, obj, clientSocket,
-					buffer, (size_t) recvSize);
+	jclass globalClazz = (jclass) env->NewGlobalRef(clazz);
+	env->DeleteLocalRef(clazz);
 
-			if ((0 == sentSize) || (NULL != env->ExceptionOccurred()))
-				break;
-		}
+	return globalClazz;
+}
 
-		// Close the client socket
-		close(clientSocket);
-	}
+// AbstractEchoActivity native methods
+static const JNINativeMethod abstractEchoActivityMethods[] = {
+	{ "nativeConfigure", "([Ljava/lang/String;)V",
+			(void*) Java_com_apress_echo_AbstractEchoActivity_nativeConfigure },
+	{ "nativeNewServerHandle", "()J",
+			(void*) Java_com_apress_echo_AbstractEchoActivity_nativeNewServerHandle },
+	{ "nativeStopServer", "(J)V",
+			(void*) Java_com_apress_echo_AbstractEchoActivity_nativeStopServer },
+	{ "nativeDeleteServerHandle", "(J)V",
+			(void*) Java_com_apress_echo_AbstractEchoActivity_nativeDeleteServerHandle },
+	{ "nativeExportTrace", "(Ljava/lang/String;)I",
+			(void*) Java_com_apress_echo_AbstractEchoActivity_nativeExportTrace }
+};
+
+// EchoClientActivity native methods
+static const JNINativeMethod echoClientActivityMethods[] = {
+	{ "nativeStartTcpClient", "(Ljava/lang/String;ILjava/lang/String;)V",
+			(void*) Java_com_apress_echo_EchoClientActivity_nativeStartTcpClient },
+	{ "nativeStartUdpClient", "(Ljava/lang/String;ILjava/lang/String;)V",
+			(void*) Java_com_apress_echo_EchoClientActivity_nativeStartUdpClient },
+	{ "nativeStartTcpBufferClient",
+			"(Ljava/lang/String;ILjava/nio/ByteBuffer;ILjava/nio/ByteBuffer;)I",
+			(void*) Java_com_apress_echo_EchoClientActivity_nativeStartTcpBufferClient },
+	{ "nativeStartUdpBufferClient",
+			"(Ljava/lang/String;ILjava/nio/ByteBuffer;ILjava/nio/ByteBuffer;)I",
+			(void*) Java_com_apress_echo_EchoClientActivity_nativeStartUdpBufferClient },
+	{ "nativeOpenSession", "(Ljava/lang/String;II)J",
+			(void*) Java_com_apress_echo_EchoClientActivity_nativeOpenSession },
+	{ "nativeSend", "(JLjava/nio/ByteBuffer;I)I",
+			(void*) Java_com_apress_echo_EchoClientActivity_nativeSend },
+	{ "nativeReceive", "(JLjava/nio/ByteBuffer;)I",
+			(void*) Java_com_apress_echo_EchoClientActivity_nativeReceive },
+	{ "nativeSendFrame", "(JLjava/nio/ByteBuffer;I)I",
+			(void*) Java_com_apress_echo_EchoClientActivity_nativeSendFrame },
+	{ "nativeReceiveFrame", "(JLjava/nio/ByteBuffer;)I",
+			(void*) Java_com_apress_echo_EchoClientActivity_nativeReceiveFrame },
+	{ "nativeClose", "(J)V",
+			(void*) Java_com_apress_echo_EchoClientActivity_nativeClose },
+	{ "nativeConnectFanOut", "([Ljava/lang/String;[I)[J",
+			(void*) Java_com_apress_echo_EchoClientActivity_nativeConnectFanOut },
+	{ "nativeStartTcpBenchmark", "(Ljava/lang/String;IIIII)V",
+			(void*) Java_com_apress_echo_EchoClientActivity_nativeStartTcpBenchmark },
+	{ "nativeStartUdpBenchmark", "(Ljava/lang/String;IIIII)V",
+			(void*) Java_com_apress_echo_EchoClientActivity_nativeStartUdpBenchmark },
+	{ "nativeStartTcpReplay", "(Ljava/lang/String;ILjava/lang/String;II)V",
+			(void*) Java_com_apress_echo_EchoClientActivity_nativeStartTcpReplay }
+};
+
+// EchoServerActivity native methods
+static const JNINativeMethod echoServerActivityMethods[] = {
+	{ "nativeStartTcpServer", "(IIJ)V",
+			(void*) Java_com_apress_echo_EchoServerActivity_nativeStartTcpServer },
+	{ "nativeStartUdpServer", "(IIJ)V",
+			(void*) Java_com_apress_echo_EchoServerActivity_nativeStartUdpServer },
+	{ "nativeGetStats", "()[J",
+			(void*) Java_com_apress_echo_EchoServerActivity_nativeGetStats },
+	{ "nativeGetUdpFlows", "()[J",
+			(void*) Java_com_apress_echo_EchoServerActivity_nativeGetUdpFlows }
+};
+
+// LocalEchoActivity native methods
+static const JNINativeMethod localEchoActivityMethods[] = {
+	{ "nativeStartLocalServer", "(Ljava/lang/String;IJ)V",
+			(void*) Java_com_apress_echo_LocalEchoActivity_nativeStartLocalServer },
+	{ "nativeStartSharedMemoryServer", "(Ljava/lang/String;J)V",
+			(void*) Java_com_apress_echo_LocalEchoActivity_nativeStartSharedMemoryServer },
+	{ "nativeStartLocalBenchmark", "(Ljava/lang/String;III)V",
+			(void*) Java_com_apress_echo_LocalEchoActivity_nativeStartLocalBenchmark }
+};
 
-exit:
-	if (serverSocket > 0)
+/**
+ * Resolves the classes and method IDs once per process, and
+ * registers the native methods so that the VM does not need to
+ * look them up by their symbol names.
+ *
+ * @param vm Java VM.
+ * @param reserved reserved.
+ * @return JNI version or JNI_ERR if failed.
+ */
+JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM* vm, void* reserved)
+{
+	JNIEnv* env;
+
+	if (JNI_OK != vm->GetEnv((void**) &env, JNI_VERSION_1_6))
+		return JNI_ERR;
+
+	// Start from the default configuration
+	EchoInitConfig(&config);
+
+	// Pin the classes
+	jniCache.abstractEchoActivity = NewGlobalClassRef(env,
+			"com/apress/echo/AbstractEchoActivity");
+	jniCache.echoClientActivity = NewGlobalClassRef(env,
+			"com/apress/echo/EchoClientActivity");
+	jniCache.echoServerActivity = NewGlobalClassRef(env,
+			"com/apress/echo/EchoServerActivity");
+	jniCache.localEchoActivity = NewGlobalClassRef(env,
+			"com/apress/echo/LocalEchoActivity");
+
+	jniCache.ioException = NewGlobalClassRef(env, "java/io/IOException");
+	jniCache.illegalArgumentException = NewGlobalClassRef(env,
+			"java/lang/IllegalArgumentException");
+	jniCache.illegalStateException = NewGlobalClassRef(env,
+			"java/lang/IllegalStateException");
+	jniCache.nullPointerException = NewGlobalClassRef(env,
+			"java/lang/NullPointerException");
+	jniCache.outOfMemoryError = NewGlobalClassRef(env,
+			"java/lang/OutOfMemoryError");
+
+	// Class lookup failures leave a pending exception
+	if (NULL != env->ExceptionOccurred())
+		return JNI_ERR;
+
+	// Subclasses inherit the method ID of the base class
+	jniCache.logMessage = env->GetMethodID(jniCache.abstractEchoActivity,
+			"logMessage", "(Ljava/lang/String;)V");
+	if (NULL == jniCache.logMessage)
+		return JNI_ERR;
+
+	// Bind the native methods
+	if ((JNI_OK != env->RegisterNatives(jniCache.abstractEchoActivity,
+			abstractEchoActivityMethods,
+			ARRAY_SIZE(abstractEchoActivityMethods)))
+			|| (JNI_OK != env->RegisterNatives(jniCache.echoClientActivity,
+					echoClientActivityMethods,
+					ARRAY_SIZE(echoClientActivityMethods)))
+			|| (JNI_OK != env->RegisterNatives(jniCache.echoServerActivity,
+					echoServerActivityMethods,
+					ARRAY_SIZE(echoServerActivityMethods)))
+			|| (JNI_OK != env->RegisterNatives(jniCache.localEchoActivity,
+					localEchoActivityMethods,
+					ARRAY_SIZE(localEchoActivityMethods))))
 	{
-		close(serverSocket);
+		return JNI_ERR;
 	}
+
+	return JNI_VERSION_1_6;
 }
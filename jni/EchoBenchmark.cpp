@@ -0,0 +1,894 @@
+/**
+ * Standalone benchmark suite. Runs loopback TCP, UDP and local
+ * socket echo servers against the benchmark client in one
+ * process, over a matrix of payload sizes and concurrency
+ * levels, and writes the results as JSON.
+ *
+ * The servers are the server engine of the Echo library, the
+ * same event loops and UDP workers the app runs, and the client
+ * is its benchmark client. Both run on plain native threads
+ * that are never attached to a Java VM.
+ *
+ * The ping-pong scenario runs the TCP server with a coalesce
+ * delay on a single connection, and fails if the request and
+ * response traffic of the closed loop is held.
+ *
+ * Usage: EchoBenchmark [-o file] [-d seconds] [-s scenarios]
+ *            [-p sizes] [-c levels] [-w workers] [-P port]
+ *            [-C delay] [-v]
+ */
+#include "EchoSocket.h"
+#include "EchoServer.h"
+#include "EchoLoad.h"
+
+// fprintf, vfprintf, snprintf, fopen
+#include <stdio.h>
+
+// calloc, malloc, free, strtol, atoi
+#include <stdlib.h>
+
+// errno
+#include <errno.h>
+
+// memset, strcmp, strtok_r
+#include <string.h>
+
+// getopt, optarg, optind, close, sysconf
+#include <unistd.h>
+
+// pthread_create, pthread_join
+#include <pthread.h>
+
+// uname
+#include <sys/utsname.h>
+
+// sockaddr_in, htons, htonl
+#include <netinet/in.h>
+
+// TCP_NODELAY
+#include <netinet/tcp.h>
+
+// Number of elements in the given array
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+
+// Default message payload sizes
+#define DEFAULT_SUITE_SIZES "64,1024,16384"
+
+// Default numbers of concurrent connections or UDP flows
+#define DEFAULT_SUITE_LEVELS "1,8,64"
+
+// Default scenarios
+#define DEFAULT_SUITE_SCENARIOS "tcp,udp,local,pingpong"
+
+// Default duration of a benchmark run in seconds
+#define DEFAULT_SUITE_DURATION 2
+
+// Default TCP and UDP port number
+#define DEFAULT_SUITE_PORT 45000
+
+// Max number of payload sizes or concurrency levels
+#define MAX_SUITE_VALUES 16
+
+// Max length of the scenario list
+#define MAX_SCENARIO_LIST 256
+
+// Max message payload size
+#define MAX_SUITE_PAYLOAD 65536
+
+// Max UDP payload over IPv4
+#define MAX_UDP_PAYLOAD 65507
+
+// Max number of server workers
+#define MAX_SUITE_WORKERS 64
+
+// Max coalesce delay of the stream servers in microseconds
+#define MAX_SUITE_COALESCE_DELAY 100000
+
+// Coalesce delay of the ping-pong scenario in microseconds
+#define PINGPONG_COALESCE_DELAY 500
+
+// Receive buffer size of the client and the servers, large
+// enough for the datagrams to not be truncated
+#define SUITE_BUFFER_SIZE 65536
+
+// Listen backlog, all connections of a run connect at once
+#define SUITE_BACKLOG MAX_BENCHMARK_STREAMS
+
+// Local socket name of the local scenario
+#define SUITE_LOCAL_NAME "echo-benchmark"
+
+// Max error message length of a run
+#define MAX_SUITE_ERROR_LENGTH 128
+
+/**
+ * Benchmark scenario.
+ */
+struct Scenario
+{
+	// Scenario name
+	const char* name;
+
+	// Socket family and type
+	int family;
+	int type;
+
+	// Server holds the echoes for the ping-pong coalesce delay
+	bool pingPong;
+};
+
+// Scenarios by name
+static const struct Scenario scenarios[] =
+{
+	{ "tcp", PF_INET, SOCK_STREAM, false },
+	{ "udp", PF_INET, SOCK_DGRAM, false },
+	{ "local", PF_LOCAL, SOCK_STREAM, false },
+	{ "pingpong", PF_INET, SOCK_STREAM, true }
+};
+
+/**
+ * Echo server of a scenario, running the server engine of the
+ * Echo library on a thread of its own.
+ */
+struct SuiteServer
+{
+	// Scenario served
+	const struct Scenario* scenario;
+
+	// Time a stream connection may hold its echo in microseconds,
+	// zero to not hold
+	int coalesceDelay;
+
+	// Server and its stop request
+	struct EchoServer* server;
+	struct EchoServerControl* control;
+
+	// Thread running the server, and the result it stopped with
+	pthread_t thread;
+	int result;
+};
+
+/**
+ * Result of one benchmark run.
+ */
+struct SuiteResult
+{
+	// Run parameters
+	const struct Scenario* scenario;
+	size_t payloadSize;
+	size_t concurrency;
+
+	// Coalesce delay of the server in microseconds
+	int coalesceDelay;
+
+	// Sent and received messages
+	uint64_t sentCount;
+	uint64_t receivedCount;
+
+	// Run time in seconds
+	double elapsed;
+
+	// Round trip latency percentiles and max in nanoseconds
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+
+	// Error message failing the run, empty if none
+	char error[MAX_SUITE_ERROR_LENGTH];
+};
+
+// Log sink, NULL unless the log messages are printed
+static const struct EchoLogSink* sink = NULL;
+
+/**
+ * Prints a log message of the Echo library.
+ *
+ * @param context output file.
+ * @param level log level.
+ * @param format message format.
+ * @param ap message arguments.
+ */
+static void PrintLogMessage(
+		void* context,
+		int level,
+		const char* format,
+		va_list ap)
+{
+	FILE* file = (FILE*) context;
+
+	// Keep the messages of the threads apart
+	flockfile(file);
+
+	fputs((LOG_LEVEL_ERROR == level) ? "E " : (LOG_LEVEL_INFO == level)
+			? "I " : "D ", file);
+	vfprintf(file, format, ap);
+	fputc('\n', file);
+
+	funlockfile(file);
+}
+
+// Sink printing the log messages
+static const struct EchoLogSink stderrSink = { PrintLogMessage, stderr };
+
+/**
+ * Sets the error message failing the given run.
+ *
+ * @param result result.
+ * @param message error message.
+ */
+static void SetSuiteError(
+		struct SuiteResult* result,
+		const char* message)
+{
+	snprintf(result->error, sizeof(result->error), "%s", message);
+}
+
+/**
+ * Sets the error message of the given error number failing
+ * the given run.
+ *
+ * @param result result.
+ * @param error positive error number.
+ */
+static void SetSuiteErrno(
+		struct SuiteResult* result,
+		int error)
+{
+	EchoGetErrorMessage(error, result->error, sizeof(result->error));
+}
+
+/**
+ * Gets the number of server workers. Zero or a negative count
+ * defaults to the number of online CPUs.
+ *
+ * @param workerCount requested worker count.
+ * @return worker count.
+ */
+static int GetSuiteWorkerCount(int workerCount)
+{
+	if (workerCount <= 0)
+	{
+		// Get the number of online CPUs
+		workerCount = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	if (workerCount > MAX_SUITE_WORKERS)
+	{
+		workerCount = MAX_SUITE_WORKERS;
+	}
+
+	return (workerCount > 0) ? workerCount : 1;
+}
+
+/**
+ * Runs the server until it is stopped, on a thread that is
+ * never attached to a Java VM.
+ *
+ * @param arg suite server.
+ * @return NULL.
+ */
+static void* RunSuiteServer(void* arg)
+{
+	struct SuiteServer* server = (struct SuiteServer*) arg;
+
+	server->result = EchoRunServer(server->server);
+
+	return NULL;
+}
+
+/**
+ * Stops the server, waits for it and releases it.
+ *
+ * @param server suite server.
+ * @return zero or the negative error number the server
+ *         stopped with.
+ */
+static int StopSuiteServer(struct SuiteServer* server)
+{
+	EchoStopServer(server->control);
+	pthread_join(server->thread, NULL);
+
+	EchoDeleteServer(server->server);
+	EchoDeleteServerControl(server->control);
+
+	server->server = NULL;
+	server->control = NULL;
+
+	return server->result;
+}
+
+/**
+ * Starts the server of the scenario. The server listens once
+ * this returns, so the clients can connect right away.
+ *
+ * @param server suite server with the scenario and the coalesce
+ *        delay set.
+ * @param port TCP and UDP port number.
+ * @param workerCount number of workers.
+ * @return zero or negative error number.
+ */
+static int StartSuiteServer(
+		struct SuiteServer* server,
+		unsigned short port,
+		int workerCount)
+{
+	const struct Scenario* scenario = server->scenario;
+
+	struct EchoConfig config;
+	EchoInitConfig(&config);
+
+	// Datagrams must not be truncated, all connections of a run
+	// connect at once
+	config.bufferSize = SUITE_BUFFER_SIZE;
+	config.socket.backlog = SUITE_BACKLOG;
+	config.socket.coalesceDelay = server->coalesceDelay;
+
+	int result = EchoNewServerControl(&server->control);
+	if (result < 0)
+		return result;
+
+	if (PF_LOCAL == scenario->family)
+	{
+		result = EchoNewLocalServer(&server->server, sink, &config,
+				SUITE_LOCAL_NAME, LOCAL_STREAM, server->control);
+	}
+	else if (SOCK_STREAM == scenario->type)
+	{
+		result = EchoNewTcpServer(&server->server, sink, &config, port,
+				workerCount, server->control);
+	}
+	else
+	{
+		result = EchoNewUdpServer(&server->server, sink, &config, port,
+				workerCount, server->control);
+	}
+
+	if (0 == result)
+	{
+		result = -pthread_create(&server->thread, NULL, RunSuiteServer,
+				server);
+	}
+
+	if (result < 0)
+	{
+		EchoDeleteServer(server->server);
+		EchoDeleteServerControl(server->control);
+
+		server->server = NULL;
+		server->control = NULL;
+	}
+
+	return result;
+}
+
+/**
+ * Connects a new benchmark stream to the server of the
+ * scenario.
+ *
+ * @param scenario scenario.
+ * @param port TCP and UDP port number.
+ * @return connected socket descriptor or negative error number.
+ */
+static int ConnectSuiteStream(
+		const struct Scenario* scenario,
+		unsigned short port)
+{
+	int sd = EchoNewSocket(sink, scenario->family, scenario->type);
+	if (sd < 0)
+		return sd;
+
+	int result = 0;
+
+	if (PF_LOCAL == scenario->family)
+	{
+		result = EchoConnectToLocalName(sink, sd, SUITE_LOCAL_NAME);
+	}
+	else
+	{
+		struct sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = PF_INET;
+		address.sin_port = htons(port);
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		// Connected UDP sockets only receive from the server
+		if (-1 == connect(sd, (struct sockaddr*) &address, sizeof(address)))
+		{
+			result = -errno;
+		}
+
+		// Small messages must not wait for coalescing
+		int noDelay = 1;
+		if ((0 == result) && (SOCK_STREAM == scenario->type)
+				&& (-1 == setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &noDelay,
+						sizeof(noDelay))))
+		{
+			result = -errno;
+		}
+	}
+
+	if (result < 0)
+	{
+		close(sd);
+		return result;
+	}
+
+	return sd;
+}
+
+/**
+ * Runs a closed loop benchmark with the given parameters
+ * against the running server of the scenario.
+ *
+ * @param port TCP and UDP port number.
+ * @param duration duration in seconds.
+ * @param result result with the run parameters set.
+ */
+static void RunSuiteBenchmark(
+		unsigned short port,
+		int duration,
+		struct SuiteResult* result)
+{
+	struct EchoBenchmark* benchmark = NULL;
+
+	int error = EchoNewBenchmark(&benchmark, result->scenario->type,
+			result->concurrency, result->payloadSize, SUITE_BUFFER_SIZE, 0);
+
+	for (size_t i = 0; (0 == error) && (i < benchmark->streamCount); i++)
+	{
+		int sd = ConnectSuiteStream(result->scenario, port);
+		if (sd < 0)
+		{
+			error = sd;
+			break;
+		}
+
+		error = EchoAddBenchmarkStream(benchmark, i, sd);
+	}
+
+	if (0 == error)
+	{
+		uint64_t startTime = EchoGetMonotonicTime();
+		error = EchoRunBenchmark(benchmark,
+				startTime + ((uint64_t) duration * 1000000000ULL));
+
+		const struct EchoHistogram* histogram = &benchmark->histogram;
+
+		result->elapsed = (double) (EchoGetMonotonicTime() - startTime)
+				/ 1e9;
+		result->sentCount = benchmark->sentCount;
+		result->receivedCount = benchmark->receivedCount;
+		result->p50 = EchoGetHistogramPercentile(histogram, 50.0);
+		result->p99 = EchoGetHistogramPercentile(histogram, 99.0);
+		result->p999 = EchoGetHistogramPercentile(histogram, 99.9);
+		result->max = histogram->max;
+	}
+
+	if (error < 0)
+	{
+		SetSuiteErrno(result, -error);
+	}
+
+	if (NULL != benchmark)
+	{
+		EchoDeleteBenchmark(benchmark);
+	}
+}
+
+/**
+ * Writes the given text as a JSON string.
+ *
+ * @param file output file.
+ * @param text text.
+ */
+static void WriteJsonString(FILE* file, const char* text)
+{
+	fputc('"', file);
+
+	for (const char* p = text; '\0' != *p; p++)
+	{
+		unsigned char c = (unsigned char) *p;
+
+		if (('"' == c) || ('\\' == c))
+		{
+			fprintf(file, "\\%c", c);
+		}
+		else if (c < 0x20)
+		{
+			fprintf(file, "\\u%04x", c);
+		}
+		else
+		{
+			fputc(c, file);
+		}
+	}
+
+	fputc('"', file);
+}
+
+/**
+ * Writes the suite results as JSON.
+ *
+ * @param file output file.
+ * @param duration duration of a run in seconds.
+ * @param workerCount number of server workers.
+ * @param results results.
+ * @param resultCount number of results.
+ */
+static void WriteResults(
+		FILE* file,
+		int duration,
+		int workerCount,
+		const struct SuiteResult* results,
+		size_t resultCount)
+{
+	struct utsname name;
+	if (-1 == uname(&name))
+	{
+		memset(&name, 0, sizeof(name));
+	}
+
+	fprintf(file, "{\n  \"device\": { \"machine\": ");
+	WriteJsonString(file, name.machine);
+	fprintf(file, ", \"kernel\": ");
+	WriteJsonString(file, name.release);
+	fprintf(file, ", \"cpus\": %ld },\n", sysconf(_SC_NPROCESSORS_ONLN));
+
+	fprintf(file, "  \"duration\": %d,\n  \"workers\": %d,\n"
+			"  \"results\": [", duration, workerCount);
+
+	for (size_t i = 0; i < resultCount; i++)
+	{
+		const struct SuiteResult* result = &results[i];
+
+		fprintf(file, "%s\n    { \"scenario\": \"%s\", \"payloadSize\": %zu, "
+				"\"concurrency\": %zu, \"coalesceDelayUs\": %d, ",
+				(0 == i) ? "" : ",", result->scenario->name,
+				result->payloadSize, result->concurrency,
+				result->coalesceDelay);
+
+		if ('\0' != result->error[0])
+		{
+			fprintf(file, "\"error\": ");
+			WriteJsonString(file, result->error);
+			fprintf(file, " }");
+			continue;
+		}
+
+		double elapsed = (result->elapsed > 0) ? result->elapsed : 1;
+
+		fprintf(file, "\"sent\": %llu, \"received\": %llu, "
+				"\"seconds\": %.3f, \"messagesPerSecond\": %.1f, "
+				"\"megabytesPerSecond\": %.3f,\n      \"latencyUs\": { "
+				"\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+				"\"max\": %.1f } }",
+				(unsigned long long) result->sentCount,
+				(unsigned long long) result->receivedCount,
+				result->elapsed,
+				(double) result->receivedCount / elapsed,
+				(double) (result->receivedCount * result->payloadSize)
+						/ elapsed / 1e6,
+				result->p50 / 1e3, result->p99 / 1e3, result->p999 / 1e3,
+				result->max / 1e3);
+	}
+
+	fprintf(file, "\n  ]\n}\n");
+}
+
+/**
+ * Parses the given comma separated list of positive numbers.
+ *
+ * @param text list text.
+ * @param values parsed values, MAX_SUITE_VALUES at most.
+ * @param min min value.
+ * @param max max value.
+ * @return number of values, or zero if the list is invalid.
+ */
+static size_t ParseValueList(
+		const char* text,
+		size_t* values,
+		long min,
+		long max)
+{
+	size_t count = 0;
+	const char* p = text;
+
+	while (count < MAX_SUITE_VALUES)
+	{
+		char* end;
+		long value = strtol(p, &end, 10);
+
+		if ((end == p) || (value < min) || (value > max)
+				|| ((',' != *end) && ('\0' != *end)))
+			return 0;
+
+		values[count++] = (size_t) value;
+
+		if ('\0' == *end)
+			return count;
+
+		p = end + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Parses the given comma separated list of scenario names.
+ *
+ * @param text list text.
+ * @param selected scenario selected flags, by scenario index.
+ * @return true if valid.
+ */
+static bool ParseScenarioList(const char* text, bool* selected)
+{
+	char list[MAX_SCENARIO_LIST];
+	snprintf(list, sizeof(list), "%s", text);
+
+	char* state;
+	for (char* name = strtok_r(list, ",", &state); NULL != name;
+			name = strtok_r(NULL, ",", &state))
+	{
+		size_t i = 0;
+		while ((i < ARRAY_SIZE(scenarios))
+				&& (0 != strcmp(scenarios[i].name, name)))
+		{
+			i++;
+		}
+
+		if (ARRAY_SIZE(scenarios) == i)
+			return false;
+
+		selected[i] = true;
+	}
+
+	return true;
+}
+
+/**
+ * Prints the usage.
+ *
+ * @param program program name.
+ */
+static void PrintUsage(const char* program)
+{
+	fprintf(stderr,
+			"Usage: %s [-o file] [-d seconds] [-s scenarios] [-p sizes]\n"
+			"         [-c levels] [-w workers] [-P port] [-C delay] [-v]\n"
+			"  -o  JSON output file, stdout by default\n"
+			"  -d  duration of each run in seconds, %d by default\n"
+			"  -s  scenarios, %s by default\n"
+			"  -p  payload sizes, %s by default\n"
+			"  -c  connections or UDP flows, %s by default\n"
+			"  -w  server workers, zero for the CPU count by default\n"
+			"  -P  TCP and UDP port, %d by default\n"
+			"  -C  coalesce delay of the tcp and local servers in us,\n"
+			"      zero by default, pingpong always uses %d\n"
+			"  -v  print the log messages to stderr\n",
+			program, DEFAULT_SUITE_DURATION, DEFAULT_SUITE_SCENARIOS,
+			DEFAULT_SUITE_SIZES, DEFAULT_SUITE_LEVELS, DEFAULT_SUITE_PORT,
+			PINGPONG_COALESCE_DELAY);
+}
+
+int main(int argc, char** argv)
+{
+	const char* outputPath = NULL;
+	int duration = DEFAULT_SUITE_DURATION;
+	int workerCount = 0;
+	int port = DEFAULT_SUITE_PORT;
+	int coalesceDelay = 0;
+
+	bool selected[ARRAY_SIZE(scenarios)];
+	memset(selected, 0, sizeof(selected));
+	ParseScenarioList(DEFAULT_SUITE_SCENARIOS, selected);
+
+	size_t sizes[MAX_SUITE_VALUES];
+	size_t sizeCount = ParseValueList(DEFAULT_SUITE_SIZES, sizes,
+			sizeof(uint64_t), MAX_SUITE_PAYLOAD);
+
+	size_t levels[MAX_SUITE_VALUES];
+	size_t levelCount = ParseValueList(DEFAULT_SUITE_LEVELS, levels,
+			1, MAX_BENCHMARK_STREAMS);
+
+	int option;
+	while (-1 != (option = getopt(argc, argv, "o:d:s:p:c:w:P:C:vh")))
+	{
+		bool valid = true;
+
+		switch (option)
+		{
+		case 'o':
+			outputPath = optarg;
+			break;
+
+		case 'd':
+			duration = atoi(optarg);
+			valid = (duration > 0);
+			break;
+
+		case 's':
+			memset(selected, 0, sizeof(selected));
+			valid = ParseScenarioList(optarg, selected);
+			break;
+
+		case 'p':
+			sizeCount = ParseValueList(optarg, sizes, sizeof(uint64_t),
+					MAX_SUITE_PAYLOAD);
+			valid = (sizeCount > 0);
+			break;
+
+		case 'c':
+			levelCount = ParseValueList(optarg, levels, 1,
+					MAX_BENCHMARK_STREAMS);
+			valid = (levelCount > 0);
+			break;
+
+		case 'w':
+			workerCount = atoi(optarg);
+			break;
+
+		case 'P':
+			port = atoi(optarg);
+			valid = (port > 0) && (port <= 65535);
+			break;
+
+		case 'C':
+			coalesceDelay = atoi(optarg);
+			valid = (coalesceDelay >= 0)
+					&& (coalesceDelay <= MAX_SUITE_COALESCE_DELAY);
+			break;
+
+		case 'v':
+			sink = &stderrSink;
+			break;
+
+		default:
+			valid = false;
+			break;
+		}
+
+		if (!valid)
+		{
+			PrintUsage(argv[0]);
+			return 2;
+		}
+	}
+
+	if (optind < argc)
+	{
+		PrintUsage(argv[0]);
+		return 2;
+	}
+
+	workerCount = GetSuiteWorkerCount(workerCount);
+
+	size_t resultCount = 0;
+	struct SuiteResult* results = (struct SuiteResult*) calloc(
+			ARRAY_SIZE(scenarios) * sizeCount * levelCount,
+			sizeof(struct SuiteResult));
+
+	if (NULL == results)
+	{
+		fprintf(stderr, "Unable to allocate results.\n");
+		return 1;
+	}
+
+	int exitCode = 0;
+
+	for (size_t s = 0; s < ARRAY_SIZE(scenarios); s++)
+	{
+		if (!selected[s])
+			continue;
+
+		size_t firstResult = resultCount;
+
+		struct SuiteServer server;
+		memset(&server, 0, sizeof(server));
+		server.scenario = &scenarios[s];
+
+		if (scenarios[s].pingPong)
+		{
+			server.coalesceDelay = PINGPONG_COALESCE_DELAY;
+		}
+		else if (SOCK_STREAM == scenarios[s].type)
+		{
+			server.coalesceDelay = coalesceDelay;
+		}
+
+		int error = StartSuiteServer(&server, (unsigned short) port,
+				workerCount);
+
+		// Ping-pong latency is measured on a single connection,
+		// queueing behind other connections would hide the delay
+		const size_t singleLevel = 1;
+		const size_t* runLevels = scenarios[s].pingPong ? &singleLevel
+				: levels;
+		size_t runLevelCount = scenarios[s].pingPong ? 1 : levelCount;
+
+		for (size_t p = 0; p < sizeCount; p++)
+		{
+			for (size_t c = 0; c < runLevelCount; c++)
+			{
+				struct SuiteResult* result = &results[resultCount++];
+				result->scenario = &scenarios[s];
+				result->payloadSize = sizes[p];
+				result->concurrency = runLevels[c];
+				result->coalesceDelay = server.coalesceDelay;
+
+				if (error < 0)
+				{
+					SetSuiteErrno(result, -error);
+				}
+				else if ((SOCK_DGRAM == scenarios[s].type)
+						&& (sizes[p] > MAX_UDP_PAYLOAD))
+				{
+					SetSuiteError(result, "Payload does not fit a datagram.");
+				}
+				else
+				{
+					RunSuiteBenchmark((unsigned short) port, duration,
+							result);
+				}
+
+				// Closed loop waits for each reply, holding them only
+				// adds the delay
+				if (('\0' == result->error[0]) && scenarios[s].pingPong
+						&& (0 != server.coalesceDelay)
+						&& (result->p50 >= (uint64_t) server.coalesceDelay
+								* 1000ULL))
+				{
+					SetSuiteError(result,
+							"Request and response traffic is held.");
+				}
+
+				if ('\0' != result->error[0])
+				{
+					exitCode = 1;
+				}
+
+				fprintf(stderr, "%s payload %zu concurrency %zu: %s\n",
+						scenarios[s].name, sizes[p], runLevels[c],
+						('\0' != result->error[0]) ? result->error : "done");
+			}
+		}
+
+		if (0 == error)
+		{
+			// Runs of a failed server did not measure it
+			error = StopSuiteServer(&server);
+
+			for (size_t i = firstResult; (error < 0)
+					&& (i < resultCount); i++)
+			{
+				if ('\0' == results[i].error[0])
+				{
+					SetSuiteErrno(&results[i], -error);
+					exitCode = 1;
+				}
+			}
+		}
+	}
+
+	FILE* file = stdout;
+	if (NULL != outputPath)
+	{
+		file = fopen(outputPath, "w");
+		if (NULL == file)
+		{
+			perror(outputPath);
+			return 1;
+		}
+	}
+
+	WriteResults(file, duration, workerCount, results, resultCount);
+
+	if ((stdout != file) && (0 != fclose(file)))
+	{
+		perror(outputPath);
+		exitCode = 1;
+	}
+
+	free(results);
+
+	return exitCode;
+}
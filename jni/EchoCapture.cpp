@@ -0,0 +1,628 @@
+#include "EchoCapture.h"
+
+// NULL
+#include <stdio.h>
+
+// calloc, malloc, free
+#include <stdlib.h>
+
+// errno
+#include <errno.h>
+
+// memset, memcpy
+#include <string.h>
+
+// clock_gettime
+#include <time.h>
+
+// close, ftruncate
+#include <unistd.h>
+
+// open
+#include <fcntl.h>
+
+// mmap, munmap, madvise
+#include <sys/mman.h>
+
+// fstat
+#include <sys/stat.h>
+
+// send, recv
+#include <sys/socket.h>
+
+// epoll_create, epoll_ctl, epoll_wait
+#include <sys/epoll.h>
+
+// Max number of events returned by a single epoll wait
+#define REPLAY_EPOLL_EVENTS 64
+
+int EchoNewCapture(
+		struct EchoCapture** capture,
+		const struct EchoLogSink* sink,
+		const char* path,
+		size_t size)
+{
+	int result = 0;
+	void* region;
+	struct timespec now;
+	struct EchoCaptureHeader* header;
+
+	*capture = (struct EchoCapture*) calloc(1, sizeof(struct EchoCapture));
+	if (NULL == *capture)
+		return -ENOMEM;
+
+	(*capture)->size = size;
+	(*capture)->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+	if ((-1 == (*capture)->fd)
+			|| (-1 == ftruncate((*capture)->fd, (off_t) size)))
+	{
+		result = -errno;
+		goto exit;
+	}
+
+	region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			(*capture)->fd, 0);
+
+	if (MAP_FAILED == region)
+	{
+		result = -errno;
+		goto exit;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	// File is truncated, so the records are zero until written
+	header = (struct EchoCaptureHeader*) region;
+	header->magic = CAPTURE_MAGIC;
+	header->version = CAPTURE_VERSION;
+	header->startTime = ((uint64_t) now.tv_sec * 1000000000ULL)
+			+ (uint64_t) now.tv_nsec;
+
+	(*capture)->region = (char*) region;
+	(*capture)->used = sizeof(struct EchoCaptureHeader);
+	(*capture)->startTime = EchoGetMonotonicTime();
+
+	EchoLog(sink, LOG_LEVEL_INFO, "Capturing the received data to %s...",
+			path);
+
+	return 0;
+
+exit:
+	EchoDeleteCapture(*capture, sink);
+	*capture = NULL;
+
+	return result;
+}
+
+void EchoDeleteCapture(
+		struct EchoCapture* capture,
+		const struct EchoLogSink* sink)
+{
+	if (NULL == capture)
+		return;
+
+	if (NULL != capture->region)
+	{
+		// Readers trust the length only once the writers are gone
+		struct EchoCaptureHeader* header =
+				(struct EchoCaptureHeader*) capture->region;
+		header->length = capture->used - sizeof(struct EchoCaptureHeader);
+		header->recordCount = capture->recordCount;
+		header->connectionCount = capture->nextConnectionId;
+
+		munmap(capture->region, capture->size);
+
+		if (-1 == ftruncate(capture->fd, (off_t) capture->used))
+		{
+			EchoLogErrno(sink, "Unable to trim the capture file:", errno);
+		}
+
+		EchoLog(sink, LOG_LEVEL_INFO, "Captured %llu messages, %zu bytes, "
+				"%llu dropped.", (unsigned long long) capture->recordCount,
+				capture->used - sizeof(struct EchoCaptureHeader),
+				(unsigned long long) capture->dropCount);
+	}
+
+	if (-1 != capture->fd)
+	{
+		close(capture->fd);
+	}
+
+	free(capture);
+}
+
+void EchoCaptureData(
+		struct EchoCapture* capture,
+		uint32_t connectionId,
+		const char* data,
+		size_t size)
+{
+	uint64_t time = EchoGetMonotonicTime() - capture->startTime;
+	size_t recordSize = EchoGetCaptureRecordSize(size);
+	size_t offset = __atomic_load_n(&capture->used, __ATOMIC_RELAXED);
+
+	do
+	{
+		// Once full, the capture stays full
+		if (recordSize > capture->size - offset)
+		{
+			__atomic_fetch_add(&capture->dropCount, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(&capture->used, &offset,
+			offset + recordSize, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	struct EchoCaptureRecord* record =
+			(struct EchoCaptureRecord*) (capture->region + offset);
+
+	record->time = time;
+	record->connectionId = connectionId;
+	memcpy(record + 1, data, size);
+
+	// Size is stored last, a record cut short by a crash stays zero
+	__atomic_store_n(&record->size, (uint32_t) size, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&capture->recordCount, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Maps the given capture file into the replay and checks its
+ * header.
+ *
+ * @param replay replay.
+ * @param sink log sink or NULL.
+ * @param path capture file path.
+ * @return zero or negative error number, -EBADMSG if the file
+ *         is not a capture.
+ */
+static int MapReplayCapture(
+		struct EchoReplay* replay,
+		const struct EchoLogSink* sink,
+		const char* path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (-1 == fd)
+		return -errno;
+
+	struct stat status;
+	if (-1 == fstat(fd, &status))
+	{
+		int error = errno;
+		close(fd);
+		return -error;
+	}
+
+	if ((size_t) status.st_size < sizeof(struct EchoCaptureHeader))
+	{
+		close(fd);
+		EchoLog(sink, LOG_LEVEL_ERROR, "Capture file is too short.");
+		return -EBADMSG;
+	}
+
+	replay->size = (size_t) status.st_size;
+	void* region = mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	// Mapping stays valid once the file is closed
+	int error = errno;
+	close(fd);
+
+	if (MAP_FAILED == region)
+		return -error;
+
+	replay->region = (char*) region;
+
+	// Records are read once from the start to the end
+	madvise(region, replay->size, MADV_SEQUENTIAL);
+
+	const struct EchoCaptureHeader* header =
+			(const struct EchoCaptureHeader*) replay->region;
+
+	if ((CAPTURE_MAGIC != header->magic)
+			|| (CAPTURE_VERSION != header->version))
+	{
+		EchoLog(sink, LOG_LEVEL_ERROR, "Not a capture file.");
+		return -EBADMSG;
+	}
+
+	// Capture cut short by a crash ends at its first unwritten record
+	uint64_t length = replay->size - sizeof(struct EchoCaptureHeader);
+	if ((0 != header->length) && (header->length < length))
+	{
+		length = header->length;
+	}
+
+	replay->next = replay->region + sizeof(struct EchoCaptureHeader);
+	replay->end = replay->next + length;
+
+	return 0;
+}
+
+int EchoNewReplay(
+		struct EchoReplay** replay,
+		const struct EchoLogSink* sink,
+		const char* path,
+		size_t streamCount,
+		int speed,
+		size_t bufferSize)
+{
+	if ((speed < 0) || (0 == bufferSize))
+		return -EINVAL;
+
+	struct EchoReplay* result = (struct EchoReplay*) calloc(1,
+			sizeof(struct EchoReplay));
+
+	if (NULL == result)
+		return -ENOMEM;
+
+	result->epollFd = -1;
+	result->speed = (uint64_t) speed;
+	result->bufferSize = bufferSize;
+
+	int error = MapReplayCapture(result, sink, path);
+	if (error < 0)
+	{
+		EchoDeleteReplay(result);
+		return error;
+	}
+
+	if (0 == streamCount)
+	{
+		const struct EchoCaptureHeader* header =
+				(const struct EchoCaptureHeader*) result->region;
+
+		streamCount = header->connectionCount;
+		if (streamCount > MAX_BENCHMARK_STREAMS)
+		{
+			streamCount = MAX_BENCHMARK_STREAMS;
+		}
+		else if (0 == streamCount)
+		{
+			streamCount = 1;
+		}
+	}
+
+	result->streamCount = streamCount;
+	result->streams = (struct EchoReplayStream*) calloc(streamCount,
+			sizeof(struct EchoReplayStream));
+
+	if (NULL == result->streams)
+	{
+		EchoDeleteReplay(result);
+		return -ENOMEM;
+	}
+
+	for (size_t i = 0; i < streamCount; i++)
+	{
+		result->streams[i].sd = -1;
+		result->streams[i].writable = true;
+	}
+
+	result->buffer = (char*) malloc(bufferSize);
+	if (NULL == result->buffer)
+	{
+		EchoDeleteReplay(result);
+		return -ENOMEM;
+	}
+
+	result->epollFd = epoll_create(REPLAY_EPOLL_EVENTS);
+	if (-1 == result->epollFd)
+	{
+		error = errno;
+		EchoDeleteReplay(result);
+		return -error;
+	}
+
+	*replay = result;
+
+	return 0;
+}
+
+void EchoDeleteReplay(struct EchoReplay* replay)
+{
+	if (NULL != replay->streams)
+	{
+		for (size_t i = 0; i < replay->streamCount; i++)
+		{
+			if (-1 != replay->streams[i].sd)
+			{
+				close(replay->streams[i].sd);
+			}
+		}
+
+		free(replay->streams);
+	}
+
+	if (-1 != replay->epollFd)
+	{
+		close(replay->epollFd);
+	}
+
+	if (NULL != replay->region)
+	{
+		munmap(replay->region, replay->size);
+	}
+
+	free(replay->buffer);
+	free(replay);
+}
+
+int EchoAddReplayStream(
+		struct EchoReplay* replay,
+		size_t index,
+		int sd)
+{
+	struct EchoReplayStream* stream = &replay->streams[index];
+	stream->sd = sd;
+
+	int result = EchoSetSocketNonBlocking(stream->sd);
+	if (result < 0)
+		return result;
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	event.data.ptr = stream;
+
+	if (-1 == epoll_ctl(replay->epollFd, EPOLL_CTL_ADD, stream->sd, &event))
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * Gets the next complete record of the replay.
+ *
+ * @param replay replay.
+ * @return record or NULL if there are no more.
+ */
+static const struct EchoCaptureRecord* GetNextReplayRecord(
+		struct EchoReplay* replay)
+{
+	size_t remaining = (size_t) (replay->end - replay->next);
+	if (remaining < sizeof(struct EchoCaptureRecord))
+		return NULL;
+
+	const struct EchoCaptureRecord* record =
+			(const struct EchoCaptureRecord*) replay->next;
+
+	// Unwritten record ends the capture
+	if ((0 == record->size)
+			|| (EchoGetCaptureRecordSize(record->size) > remaining))
+		return NULL;
+
+	return record;
+}
+
+/**
+ * Sends the pending payload of the given replay stream until
+ * the socket would block.
+ *
+ * @param replay replay.
+ * @param stream replay stream.
+ * @return zero or negative error number.
+ */
+static int SendReplayData(
+		struct EchoReplay* replay,
+		struct EchoReplayStream* stream)
+{
+	while (stream->writable && (0 != stream->pendingSize))
+	{
+		ssize_t sentSize = send(stream->sd, stream->pending,
+				stream->pendingSize, MSG_NOSIGNAL);
+
+		if (-1 == sentSize)
+		{
+			if (EINTR == errno)
+				continue;
+
+			// Wait for the socket to become writable again
+			if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+			{
+				stream->writable = false;
+				return 0;
+			}
+
+			return -errno;
+		}
+
+		stream->pending += sentSize;
+		stream->pendingSize -= (size_t) sentSize;
+		replay->sentBytes += (uint64_t) sentSize;
+	}
+
+	return 0;
+}
+
+/**
+ * Receives the echoes of the given replay stream until the
+ * socket would block. Echoes are only counted.
+ *
+ * @param replay replay.
+ * @param stream replay stream.
+ * @return zero or negative error number.
+ */
+static int ReceiveReplayEchoes(
+		struct EchoReplay* replay,
+		struct EchoReplayStream* stream)
+{
+	while (1)
+	{
+		ssize_t recvSize = recv(stream->sd, replay->buffer,
+				replay->bufferSize, 0);
+
+		if (-1 == recvSize)
+		{
+			if (EINTR == errno)
+				continue;
+
+			// Wait for more echoes to arrive
+			if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+				return 0;
+
+			return -errno;
+		}
+
+		// Server closed the connection
+		if (0 == recvSize)
+			return -ECONNRESET;
+
+		replay->receivedBytes += (uint64_t) recvSize;
+	}
+}
+
+/**
+ * Sends the records that are due in capture order. Records of
+ * a connection go out in order, so a blocked connection holds
+ * back the records after its own.
+ *
+ * @param replay replay.
+ * @param startTime time the replay started at.
+ * @param now current time.
+ * @param wakeTime time the next record is due, or zero if none
+ *                 is waiting for its time.
+ * @return zero or negative error number.
+ */
+static int SendReplayRecords(
+		struct EchoReplay* replay,
+		uint64_t startTime,
+		uint64_t now,
+		uint64_t* wakeTime)
+{
+	const struct EchoCaptureRecord* record;
+
+	*wakeTime = 0;
+
+	while (NULL != (record = GetNextReplayRecord(replay)))
+	{
+		struct EchoReplayStream* stream =
+				&replay->streams[record->connectionId % replay->streamCount];
+
+		if (0 != replay->speed)
+		{
+			uint64_t dueTime = startTime
+					+ ((record->time * 100) / replay->speed);
+
+			if (dueTime > now)
+			{
+				*wakeTime = dueTime;
+				return 0;
+			}
+
+			if (0 != stream->pendingSize)
+				return 0;
+
+			EchoRecordHistogramValue(&replay->lag, now - dueTime);
+		}
+		else if (0 != stream->pendingSize)
+			return 0;
+
+		stream->pending = (const char*) (record + 1);
+		stream->pendingSize = record->size;
+		replay->next += EchoGetCaptureRecordSize(record->size);
+		replay->sentCount++;
+
+		int result = SendReplayData(replay, stream);
+		if (result < 0)
+			return result;
+	}
+
+	// Nothing left to send
+	replay->next = replay->end;
+
+	return 0;
+}
+
+/**
+ * Checks if the replay sent all records completely.
+ *
+ * @param replay replay.
+ * @return true if all sent.
+ */
+static bool IsReplaySent(struct EchoReplay* replay)
+{
+	if (replay->next != replay->end)
+		return false;
+
+	for (size_t i = 0; i < replay->streamCount; i++)
+	{
+		if (0 != replay->streams[i].pendingSize)
+			return false;
+	}
+
+	return true;
+}
+
+int EchoRunReplay(struct EchoReplay* replay)
+{
+	struct epoll_event events[REPLAY_EPOLL_EVENTS];
+
+	uint64_t startTime = EchoGetMonotonicTime();
+	uint64_t drainDeadline = 0;
+
+	while (1)
+	{
+		uint64_t now = EchoGetMonotonicTime();
+		uint64_t wakeTime;
+
+		int result = SendReplayRecords(replay, startTime, now, &wakeTime);
+		if (result < 0)
+			return result;
+
+		if (IsReplaySent(replay))
+		{
+			if (replay->receivedBytes >= replay->sentBytes)
+				return 0;
+
+			// Give the last echoes some time to arrive
+			if (0 == drainDeadline)
+			{
+				drainDeadline = now + REPLAY_DRAIN_TIMEOUT;
+			}
+			else if (now >= drainDeadline)
+				return 0;
+
+			wakeTime = drainDeadline;
+		}
+
+		// Blocked connections only wait for the socket events
+		int timeout = -1;
+		if (0 != wakeTime)
+		{
+			timeout = (wakeTime > now)
+					? (int) ((wakeTime - now + 999999) / 1000000) : 0;
+		}
+
+		int eventCount = epoll_wait(replay->epollFd, events,
+				REPLAY_EPOLL_EVENTS, timeout);
+
+		if (-1 == eventCount)
+		{
+			if (EINTR == errno)
+				continue;
+
+			return -errno;
+		}
+
+		for (int i = 0; i < eventCount; i++)
+		{
+			struct EchoReplayStream* stream =
+					(struct EchoReplayStream*) events[i].data.ptr;
+
+			if (0 != (events[i].events & EPOLLOUT))
+			{
+				stream->writable = true;
+
+				result = SendReplayData(replay, stream);
+				if (result < 0)
+					return result;
+			}
+
+			if (0 != (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+			{
+				result = ReceiveReplayEchoes(replay, stream);
+				if (result < 0)
+					return result;
+			}
+		}
+	}
+}
@@ -0,0 +1,279 @@
+/**
+ * Capture files of the Echo library: the stream servers record
+ * the received data into a mapped file, and the replay client
+ * sends it again at the captured timing. Free of JNI like the
+ * socket core.
+ *
+ * Failures are returned as negative error numbers.
+ */
+#ifndef ECHO_CAPTURE_H
+#define ECHO_CAPTURE_H
+
+#include "EchoSocket.h"
+#include "EchoLoad.h"
+
+// size_t
+#include <stddef.h>
+
+// uint32_t, uint64_t
+#include <stdint.h>
+
+// Capture file layout check, "ECAP"
+#define CAPTURE_MAGIC 0x45434150
+#define CAPTURE_VERSION 1
+
+// Alignment of the capture records
+#define CAPTURE_ALIGNMENT 8
+
+// Time the replay waits for the last echoes, in nanoseconds
+#define REPLAY_DRAIN_TIMEOUT 5000000000ULL
+
+/**
+ * Header at the start of a capture file. The records follow
+ * it, each aligned to CAPTURE_ALIGNMENT.
+ */
+struct EchoCaptureHeader
+{
+	// File layout check
+	uint32_t magic;
+	uint32_t version;
+
+	// Wall clock time the capture started at, in ns since the epoch
+	uint64_t startTime;
+
+	// Bytes of the records that follow the header
+	uint64_t length;
+
+	// Number of records and of captured connections
+	uint64_t recordCount;
+	uint32_t connectionCount;
+
+	uint32_t reserved;
+};
+
+/**
+ * Data received in a single call, followed by its payload.
+ * A zero size marks a record that is not written yet.
+ */
+struct EchoCaptureRecord
+{
+	// Time since the capture started, in nanoseconds
+	uint64_t time;
+
+	// Connection the data arrived on, numbered in accept order
+	uint32_t connectionId;
+
+	// Payload size, stored once the payload is written
+	uint32_t size;
+};
+
+/**
+ * Append-only capture file mapped into memory, shared by the
+ * workers of a server. Records are written through the mapping,
+ * so recording a message takes no system call.
+ */
+struct EchoCapture
+{
+	// Capture file descriptor
+	int fd;
+
+	// Mapped file, starting with the header
+	char* region;
+
+	// Size of the mapped file
+	size_t size;
+
+	// Bytes taken by the header and the records
+	size_t used;
+
+	// Monotonic time the capture started at, in nanoseconds
+	uint64_t startTime;
+
+	// Number of records, and of the records that did not fit
+	uint64_t recordCount;
+	uint64_t dropCount;
+
+	// Id given to the next accepted connection
+	uint32_t nextConnectionId;
+};
+
+/**
+ * Replay connection.
+ */
+struct EchoReplayStream
+{
+	// Socket descriptor
+	int sd;
+
+	// Payload of the current record that is not sent yet
+	const char* pending;
+	size_t pendingSize;
+
+	// Socket accepted the last send completely
+	bool writable;
+};
+
+/**
+ * Replay of a mapped capture file.
+ */
+struct EchoReplay
+{
+	// epoll descriptor
+	int epollFd;
+
+	// Connections the captured ones are spread over
+	struct EchoReplayStream* streams;
+
+	// Number of connections
+	size_t streamCount;
+
+	// Mapped capture file
+	char* region;
+	size_t size;
+
+	// Next record to send, and the end of the records
+	const char* next;
+	const char* end;
+
+	// Replay speed in percent of the captured timing, zero for no waits
+	uint64_t speed;
+
+	// Receive buffer shared by the connections
+	char* buffer;
+	size_t bufferSize;
+
+	// Number of sent records, and of the sent and echoed bytes
+	uint64_t sentCount;
+	uint64_t sentBytes;
+	uint64_t receivedBytes;
+
+	// Time the records were sent behind their schedule, in nanoseconds
+	struct EchoHistogram lag;
+};
+
+/**
+ * Gets the size a record with the given payload takes in the
+ * capture file.
+ *
+ * @param size payload size.
+ * @return record size.
+ */
+static inline size_t EchoGetCaptureRecordSize(size_t size)
+{
+	return (sizeof(struct EchoCaptureRecord) + size + CAPTURE_ALIGNMENT - 1)
+			& ~((size_t) CAPTURE_ALIGNMENT - 1);
+}
+
+/**
+ * Gets the id of a newly accepted connection.
+ *
+ * @param capture capture.
+ * @return connection id.
+ */
+static inline uint32_t EchoNewCaptureConnectionId(struct EchoCapture* capture)
+{
+	return __atomic_fetch_add(&capture->nextConnectionId, 1,
+			__ATOMIC_RELAXED);
+}
+
+/**
+ * Constructs a new capture into the given file. The file is
+ * sized and mapped up front, and replaced if it exists.
+ *
+ * @param capture new capture.
+ * @param sink log sink or NULL.
+ * @param path capture file path.
+ * @param size size the file is mapped with, records beyond it
+ *             are dropped.
+ * @return zero or negative error number.
+ */
+int EchoNewCapture(
+		struct EchoCapture** capture,
+		const struct EchoLogSink* sink,
+		const char* path,
+		size_t size);
+
+/**
+ * Closes the capture file, trimming it to the recorded data,
+ * and releases the capture. The writers must be gone.
+ *
+ * @param capture capture or NULL.
+ * @param sink log sink or NULL.
+ */
+void EchoDeleteCapture(
+		struct EchoCapture* capture,
+		const struct EchoLogSink* sink);
+
+/**
+ * Appends the given received data to the capture. Space is
+ * claimed with a single atomic update, so the workers record
+ * in parallel. Data that does not fit is dropped and counted.
+ *
+ * @param capture capture.
+ * @param connectionId connection id.
+ * @param data received data.
+ * @param size data size.
+ */
+void EchoCaptureData(
+		struct EchoCapture* capture,
+		uint32_t connectionId,
+		const char* data,
+		size_t size);
+
+/**
+ * Constructs a new replay of the given capture file with
+ * unconnected streams.
+ *
+ * @param replay new replay.
+ * @param sink log sink or NULL.
+ * @param path capture file path.
+ * @param streamCount number of connections, zero for one for each
+ *                    captured connection.
+ * @param speed replay speed in percent, zero for no waits.
+ * @param bufferSize receive buffer size.
+ * @return zero or negative error number, -EBADMSG if the file
+ *         is not a capture.
+ */
+int EchoNewReplay(
+		struct EchoReplay** replay,
+		const struct EchoLogSink* sink,
+		const char* path,
+		size_t streamCount,
+		int speed,
+		size_t bufferSize);
+
+/**
+ * Closes the replay connections and the epoll instance, and
+ * unmaps the capture file.
+ *
+ * @param replay replay.
+ */
+void EchoDeleteReplay(struct EchoReplay* replay);
+
+/**
+ * Adds the given connected socket to the replay as the socket
+ * of the stream at the given index. The socket is put into the
+ * non-blocking mode.
+ *
+ * @param replay replay.
+ * @param index stream index.
+ * @param sd connected socket descriptor, owned by the stream
+ *           even if failed.
+ * @return zero or negative error number.
+ */
+int EchoAddReplayStream(
+		struct EchoReplay* replay,
+		size_t index,
+		int sd);
+
+/**
+ * Runs the replay until all records are sent and echoed, or
+ * the echoes stop arriving for the drain timeout. A server
+ * closing a connection fails the replay with ECONNRESET.
+ *
+ * @param replay replay with all streams added.
+ * @return zero or negative error number.
+ */
+int EchoRunReplay(struct EchoReplay* replay);
+
+#endif
@@ -0,0 +1,58 @@
+#include "EchoCoalesce.h"
+
+void EchoRecordArrival(
+		struct EchoArrivals* arrivals,
+		uint64_t now,
+		uint64_t delay,
+		bool queued)
+{
+	if (queued && (0 != arrivals->time))
+	{
+		uint64_t gap = now - arrivals->time;
+		uint64_t maxGap = 2 * delay;
+
+		if (gap > maxGap)
+		{
+			gap = maxGap;
+		}
+
+		// Zero marks the average as not known
+		if (0 == gap)
+		{
+			gap = 1;
+		}
+
+		// First measured gap starts the average
+		if (0 == arrivals->gap)
+		{
+			arrivals->gap = gap;
+		}
+		else if (gap > arrivals->gap)
+		{
+			arrivals->gap += (gap - arrivals->gap) >> COALESCE_GAP_SHIFT;
+		}
+		else
+		{
+			arrivals->gap -= (arrivals->gap - gap) >> COALESCE_GAP_SHIFT;
+		}
+	}
+
+	arrivals->time = now;
+}
+
+bool EchoIsArrivalFast(
+		const struct EchoArrivals* arrivals,
+		uint64_t delay)
+{
+	return (0 != arrivals->gap) && (arrivals->gap < delay);
+}
+
+void EchoEndHold(
+		struct EchoArrivals* arrivals,
+		uint64_t holdTime)
+{
+	if (arrivals->time <= holdTime)
+	{
+		arrivals->gap = 0;
+	}
+}
@@ -0,0 +1,76 @@
+/**
+ * Coalescing policy of the Echo stream servers. Free of JNI like
+ * the socket core.
+ *
+ * A server may hold the echoed data of a connection to send it
+ * with the data that follows. That only pays off while the client
+ * keeps sending without waiting for the replies, so the time
+ * between the arrivals is only measured for the data arriving
+ * while earlier data of the connection is still queued. Request
+ * and response traffic finds its previous reply sent each time,
+ * and it is never held.
+ */
+#ifndef ECHO_COALESCE_H
+#define ECHO_COALESCE_H
+
+// uint64_t
+#include <stdint.h>
+
+// Weight of the last arrival gap in the average, as a shift
+#define COALESCE_GAP_SHIFT 3
+
+/**
+ * Arrivals of the data on a connection.
+ */
+struct EchoArrivals
+{
+	// Time the last data arrived at, in nanoseconds
+	uint64_t time;
+
+	// Moving average of the time between the arrivals that found
+	// earlier data queued, in nanoseconds, or zero if not known
+	uint64_t gap;
+};
+
+/**
+ * Records the arrival of data on the connection. Gaps longer
+ * than twice the coalesce delay count as twice the delay, so
+ * that the average follows the rate changes within a few
+ * arrivals.
+ *
+ * @param arrivals connection arrivals.
+ * @param now current time.
+ * @param delay coalesce delay in nanoseconds.
+ * @param queued earlier data of the connection is still queued.
+ */
+void EchoRecordArrival(
+		struct EchoArrivals* arrivals,
+		uint64_t now,
+		uint64_t delay,
+		bool queued);
+
+/**
+ * Checks if the data arrives faster than the coalesce delay,
+ * so that holding it coalesces the data that follows.
+ *
+ * @param arrivals connection arrivals.
+ * @param delay coalesce delay in nanoseconds.
+ * @return true if the output may be held.
+ */
+bool EchoIsArrivalFast(
+		const struct EchoArrivals* arrivals,
+		uint64_t delay);
+
+/**
+ * Ends the hold that started at the given time once its delay
+ * passed. No data arriving during the hold shows the client
+ * waits for the replies, the average starts over then.
+ *
+ * @param arrivals connection arrivals.
+ * @param holdTime time the hold started at.
+ */
+void EchoEndHold(
+		struct EchoArrivals* arrivals,
+		uint64_t holdTime);
+
+#endif
@@ -0,0 +1,512 @@
+#include "EchoLoad.h"
+#include "EchoSocket.h"
+
+// NULL
+#include <stdio.h>
+
+// calloc, malloc, free
+#include <stdlib.h>
+
+// errno
+#include <errno.h>
+
+// memset, memcpy
+#include <string.h>
+
+// close
+#include <unistd.h>
+
+// send, recv
+#include <sys/socket.h>
+
+// epoll_create, epoll_ctl, epoll_wait
+#include <sys/epoll.h>
+
+// Max number of events returned by a single epoll wait
+#define BENCHMARK_EPOLL_EVENTS 64
+
+/**
+ * Gets the histogram bucket index for the given value.
+ *
+ * @param value value.
+ * @return bucket index.
+ */
+static size_t GetHistogramIndex(uint64_t value)
+{
+	const uint64_t subBucketCount = 1ULL << HISTOGRAM_SUB_BUCKET_BITS;
+	const uint64_t maxValue = (1ULL << HISTOGRAM_RANGE_BITS) - 1;
+
+	if (value > maxValue)
+	{
+		value = maxValue;
+	}
+
+	// Values below the sub-bucket count are exact
+	if (value < subBucketCount)
+		return (size_t) value;
+
+	// Higher powers of two use the upper half of the sub-buckets
+	int shift = 64 - __builtin_clzll(value) - HISTOGRAM_SUB_BUCKET_BITS;
+
+	return ((size_t) (shift + 1) << (HISTOGRAM_SUB_BUCKET_BITS - 1))
+			+ (size_t) (value >> shift) - (size_t) (subBucketCount >> 1);
+}
+
+/**
+ * Gets the highest value that falls into the given histogram
+ * bucket.
+ *
+ * @param index bucket index.
+ * @return highest value.
+ */
+static uint64_t GetHistogramValue(size_t index)
+{
+	const size_t halfCount = 1 << (HISTOGRAM_SUB_BUCKET_BITS - 1);
+
+	if (index < (halfCount << 1))
+		return (uint64_t) index;
+
+	int shift = (int) (index / halfCount) - 1;
+	uint64_t subBucket = (uint64_t) ((index % halfCount) + halfCount);
+
+	return ((subBucket + 1) << shift) - 1;
+}
+
+void EchoRecordHistogramValue(
+		struct EchoHistogram* histogram,
+		uint64_t value)
+{
+	histogram->counts[GetHistogramIndex(value)]++;
+	histogram->count++;
+
+	if (value > histogram->max)
+	{
+		histogram->max = value;
+	}
+}
+
+uint64_t EchoGetHistogramPercentile(
+		const struct EchoHistogram* histogram,
+		double percentile)
+{
+	uint64_t target = (uint64_t) ((percentile / 100.0)
+			* (double) histogram->count + 0.5);
+
+	if (target < 1)
+	{
+		target = 1;
+	}
+
+	uint64_t total = 0;
+
+	for (size_t i = 0; i < HISTOGRAM_BUCKET_COUNT; i++)
+	{
+		total += histogram->counts[i];
+		if (total >= target)
+		{
+			uint64_t value = GetHistogramValue(i);
+			return (value < histogram->max) ? value : histogram->max;
+		}
+	}
+
+	return histogram->max;
+}
+
+int EchoNewBenchmark(
+		struct EchoBenchmark** benchmark,
+		int type,
+		size_t streamCount,
+		size_t payloadSize,
+		size_t bufferSize,
+		uint64_t interval)
+{
+	if ((0 == streamCount) || (payloadSize < sizeof(uint64_t))
+			|| (0 == bufferSize)
+			|| ((SOCK_DGRAM == type) && (bufferSize < payloadSize)))
+		return -EINVAL;
+
+	struct EchoBenchmark* result = (struct EchoBenchmark*) calloc(1,
+			sizeof(struct EchoBenchmark));
+
+	if (NULL == result)
+		return -ENOMEM;
+
+	result->epollFd = -1;
+	result->type = type;
+	result->streamCount = streamCount;
+	result->payloadSize = payloadSize;
+	result->interval = interval;
+	result->bufferSize = bufferSize;
+
+	result->streams = (struct EchoBenchmarkStream*) calloc(streamCount,
+			sizeof(struct EchoBenchmarkStream));
+
+	if (NULL == result->streams)
+	{
+		EchoDeleteBenchmark(result);
+		return -ENOMEM;
+	}
+
+	for (size_t i = 0; i < streamCount; i++)
+	{
+		result->streams[i].sd = -1;
+	}
+
+	result->buffer = (char*) malloc(bufferSize);
+	if (NULL == result->buffer)
+	{
+		EchoDeleteBenchmark(result);
+		return -ENOMEM;
+	}
+
+	result->epollFd = epoll_create(BENCHMARK_EPOLL_EVENTS);
+	if (-1 == result->epollFd)
+	{
+		int error = errno;
+		EchoDeleteBenchmark(result);
+		return -error;
+	}
+
+	for (size_t i = 0; i < streamCount; i++)
+	{
+		struct EchoBenchmarkStream* stream = &result->streams[i];
+
+		stream->message = (char*) malloc(payloadSize);
+		if (NULL == stream->message)
+		{
+			EchoDeleteBenchmark(result);
+			return -ENOMEM;
+		}
+
+		memset(stream->message, 'x', payloadSize);
+		stream->sendOffset = payloadSize;
+		stream->writable = true;
+
+		// Spread the first messages over the interval
+		stream->dueTime = (interval * i) / streamCount;
+	}
+
+	*benchmark = result;
+
+	return 0;
+}
+
+void EchoDeleteBenchmark(struct EchoBenchmark* benchmark)
+{
+	if (NULL != benchmark->streams)
+	{
+		for (size_t i = 0; i < benchmark->streamCount; i++)
+		{
+			if (-1 != benchmark->streams[i].sd)
+			{
+				close(benchmark->streams[i].sd);
+			}
+
+			free(benchmark->streams[i].message);
+		}
+
+		free(benchmark->streams);
+	}
+
+	if (-1 != benchmark->epollFd)
+	{
+		close(benchmark->epollFd);
+	}
+
+	free(benchmark->buffer);
+	free(benchmark);
+}
+
+int EchoAddBenchmarkStream(
+		struct EchoBenchmark* benchmark,
+		size_t index,
+		int sd)
+{
+	struct EchoBenchmarkStream* stream = &benchmark->streams[index];
+	stream->sd = sd;
+
+	int result = EchoSetSocketNonBlocking(stream->sd);
+	if (result < 0)
+		return result;
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	event.data.ptr = stream;
+
+	if (-1 == epoll_ctl(benchmark->epollFd, EPOLL_CTL_ADD, stream->sd,
+			&event))
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * Sends the due messages of the given stream until the socket
+ * would block. Each message carries its intended send time, so
+ * the open loop latency includes the time a message waited
+ * behind the previous ones.
+ *
+ * @param benchmark benchmark.
+ * @param stream benchmark stream.
+ * @param now current time.
+ * @return zero or negative error number.
+ */
+static int SendBenchmarkMessages(
+		struct EchoBenchmark* benchmark,
+		struct EchoBenchmarkStream* stream,
+		uint64_t now)
+{
+	while (stream->writable)
+	{
+		// Start a new message once the previous one is sent
+		if (stream->sendOffset == benchmark->payloadSize)
+		{
+			uint64_t sendTime;
+
+			if (0 != benchmark->interval)
+			{
+				// Open loop sends on schedule
+				if (stream->dueTime > now)
+					return 0;
+
+				sendTime = stream->dueTime;
+				stream->dueTime += benchmark->interval;
+			}
+			else
+			{
+				// Closed loop waits for the reply, or a UDP timeout
+				if ((0 != stream->inFlight)
+						&& ((SOCK_STREAM == benchmark->type)
+								|| (stream->dueTime > now)))
+					return 0;
+
+				sendTime = now;
+				stream->inFlight = 0;
+				stream->dueTime = now + BENCHMARK_UDP_TIMEOUT;
+			}
+
+			memcpy(stream->message, &sendTime, sizeof(sendTime));
+			stream->sendOffset = 0;
+			stream->inFlight++;
+			benchmark->sentCount++;
+		}
+
+		ssize_t sentSize = send(stream->sd,
+				stream->message + stream->sendOffset,
+				benchmark->payloadSize - stream->sendOffset, MSG_NOSIGNAL);
+
+		if (-1 == sentSize)
+		{
+			if (EINTR == errno)
+				continue;
+
+			// Wait for the socket to become writable again
+			if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+			{
+				stream->writable = false;
+				return 0;
+			}
+
+			return -errno;
+		}
+
+		stream->sendOffset += (size_t) sentSize;
+	}
+
+	return 0;
+}
+
+/**
+ * Records the round trip time of the reply received by the
+ * given stream.
+ *
+ * @param benchmark benchmark.
+ * @param stream benchmark stream.
+ * @param now current time.
+ */
+static void CompleteBenchmarkReply(
+		struct EchoBenchmark* benchmark,
+		struct EchoBenchmarkStream* stream,
+		uint64_t now)
+{
+	EchoRecordHistogramValue(&benchmark->histogram,
+			(now > stream->replyTime) ? (now - stream->replyTime) : 0);
+
+	benchmark->receivedCount++;
+
+	// Late UDP replies may arrive after the timeout
+	if (stream->inFlight > 0)
+	{
+		stream->inFlight--;
+	}
+
+	// Closed loop sends the next message right away
+	if (0 == benchmark->interval)
+	{
+		stream->dueTime = now;
+	}
+}
+
+/**
+ * Receives the replies of the given stream until the socket
+ * would block.
+ *
+ * @param benchmark benchmark.
+ * @param stream benchmark stream.
+ * @return zero or negative error number.
+ */
+static int ReceiveBenchmarkReplies(
+		struct EchoBenchmark* benchmark,
+		struct EchoBenchmarkStream* stream)
+{
+	while (1)
+	{
+		ssize_t recvSize = recv(stream->sd, benchmark->buffer,
+				benchmark->bufferSize, 0);
+
+		if (-1 == recvSize)
+		{
+			if (EINTR == errno)
+				continue;
+
+			// Wait for more replies to arrive
+			if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+				return 0;
+
+			return -errno;
+		}
+
+		uint64_t now = EchoGetMonotonicTime();
+
+		if (SOCK_DGRAM == benchmark->type)
+		{
+			// Each datagram is a whole reply
+			if ((size_t) recvSize == benchmark->payloadSize)
+			{
+				memcpy(&stream->replyTime, benchmark->buffer,
+						sizeof(stream->replyTime));
+				CompleteBenchmarkReply(benchmark, stream, now);
+			}
+
+			continue;
+		}
+
+		// Server closed the connection
+		if (0 == recvSize)
+			return -ECONNRESET;
+
+		// Replies may span multiple receives
+		const char* data = benchmark->buffer;
+		size_t size = (size_t) recvSize;
+
+		while (size > 0)
+		{
+			size_t part = benchmark->payloadSize - stream->recvOffset;
+			if (part > size)
+			{
+				part = size;
+			}
+
+			// Collect the send time from the head of the reply
+			if (stream->recvOffset < sizeof(stream->replyTime))
+			{
+				size_t timeSize = sizeof(stream->replyTime)
+						- stream->recvOffset;
+				if (timeSize > part)
+				{
+					timeSize = part;
+				}
+
+				memcpy((char*) &stream->replyTime + stream->recvOffset,
+						data, timeSize);
+			}
+
+			stream->recvOffset += part;
+			data += part;
+			size -= part;
+
+			if (stream->recvOffset == benchmark->payloadSize)
+			{
+				stream->recvOffset = 0;
+				CompleteBenchmarkReply(benchmark, stream, now);
+			}
+		}
+	}
+}
+
+int EchoRunBenchmark(
+		struct EchoBenchmark* benchmark,
+		uint64_t endTime)
+{
+	struct epoll_event events[BENCHMARK_EPOLL_EVENTS];
+
+	uint64_t startTime = EchoGetMonotonicTime();
+	for (size_t i = 0; i < benchmark->streamCount; i++)
+	{
+		benchmark->streams[i].dueTime += startTime;
+	}
+
+	while (1)
+	{
+		uint64_t now = EchoGetMonotonicTime();
+		if (now >= endTime)
+			break;
+
+		// Send the due messages and find the next due time
+		uint64_t wakeTime = endTime;
+
+		for (size_t i = 0; i < benchmark->streamCount; i++)
+		{
+			struct EchoBenchmarkStream* stream = &benchmark->streams[i];
+
+			int result = SendBenchmarkMessages(benchmark, stream, now);
+			if (result < 0)
+				return result;
+
+			// Closed loop over TCP only waits for the replies
+			bool timed = (0 != benchmark->interval)
+					|| (SOCK_DGRAM == benchmark->type);
+
+			if (timed && stream->writable && (stream->dueTime < wakeTime))
+			{
+				wakeTime = stream->dueTime;
+			}
+		}
+
+		now = EchoGetMonotonicTime();
+		int timeout = (wakeTime > now) ? (int) ((wakeTime - now) / 1000000)
+				: 0;
+
+		int eventCount = epoll_wait(benchmark->epollFd, events,
+				BENCHMARK_EPOLL_EVENTS, timeout);
+
+		if (-1 == eventCount)
+		{
+			if (EINTR == errno)
+				continue;
+
+			return -errno;
+		}
+
+		for (int i = 0; i < eventCount; i++)
+		{
+			struct EchoBenchmarkStream* stream =
+					(struct EchoBenchmarkStream*) events[i].data.ptr;
+
+			if (0 != (events[i].events & EPOLLOUT))
+			{
+				stream->writable = true;
+			}
+
+			if (0 != (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+			{
+				int result = ReceiveBenchmarkReplies(benchmark, stream);
+				if (result < 0)
+					return result;
+			}
+		}
+	}
+
+	return 0;
+}
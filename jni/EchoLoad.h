@@ -0,0 +1,192 @@
+/**
+ * Benchmark client of the Echo library. Free of JNI like the
+ * socket core, so that the app and the standalone benchmark
+ * suite drive the same load generator.
+ *
+ * Failures are returned as negative error numbers.
+ */
+#ifndef ECHO_LOAD_H
+#define ECHO_LOAD_H
+
+// size_t
+#include <stddef.h>
+
+// uint64_t
+#include <stdint.h>
+
+// Max number of benchmark connections or UDP flows
+#define MAX_BENCHMARK_STREAMS 1024
+
+// Time to wait for a UDP benchmark reply in nanoseconds
+#define BENCHMARK_UDP_TIMEOUT 200000000ULL
+
+// Linear sub-buckets per power of two in the latency histogram, as bits
+#define HISTOGRAM_SUB_BUCKET_BITS 7
+
+// Latency histogram range in nanoseconds, as bits
+#define HISTOGRAM_RANGE_BITS 40
+
+// Number of latency histogram buckets
+#define HISTOGRAM_BUCKET_COUNT ((HISTOGRAM_RANGE_BITS \
+		- HISTOGRAM_SUB_BUCKET_BITS + 2) << (HISTOGRAM_SUB_BUCKET_BITS - 1))
+
+/**
+ * Latency histogram with linear sub-buckets within each power
+ * of two, keeping the relative error bounded across the range.
+ */
+struct EchoHistogram
+{
+	// Number of values in each bucket
+	uint64_t counts[HISTOGRAM_BUCKET_COUNT];
+
+	// Number of recorded values
+	uint64_t count;
+
+	// Max recorded value
+	uint64_t max;
+};
+
+/**
+ * Benchmark connection or UDP flow.
+ */
+struct EchoBenchmarkStream
+{
+	// Socket descriptor
+	int sd;
+
+	// Message buffer holding the send time in its first bytes
+	char* message;
+
+	// Bytes of the current message that are sent, or the message size
+	size_t sendOffset;
+
+	// Bytes of the current reply that are received
+	size_t recvOffset;
+
+	// Send time carried by the current reply
+	uint64_t replyTime;
+
+	// Time the next message is due in nanoseconds
+	uint64_t dueTime;
+
+	// Messages sent but not received yet
+	size_t inFlight;
+
+	// Socket accepted the last send completely
+	bool writable;
+};
+
+/**
+ * Benchmark state shared by all streams on the calling thread.
+ */
+struct EchoBenchmark
+{
+	// epoll descriptor
+	int epollFd;
+
+	// Socket type, stream or datagram
+	int type;
+
+	// Connections or UDP flows
+	struct EchoBenchmarkStream* streams;
+
+	// Number of streams
+	size_t streamCount;
+
+	// Message size
+	size_t payloadSize;
+
+	// Interval between messages of a stream, zero for closed loop
+	uint64_t interval;
+
+	// Receive buffer shared by the streams
+	char* buffer;
+	size_t bufferSize;
+
+	// Number of sent and received messages
+	uint64_t sentCount;
+	uint64_t receivedCount;
+
+	// Round trip times in nanoseconds
+	struct EchoHistogram histogram;
+};
+
+/**
+ * Records the given value in the histogram.
+ *
+ * @param histogram latency histogram.
+ * @param value value.
+ */
+void EchoRecordHistogramValue(
+		struct EchoHistogram* histogram,
+		uint64_t value);
+
+/**
+ * Gets the value at the given percentile of the histogram.
+ *
+ * @param histogram latency histogram.
+ * @param percentile percentile.
+ * @return value, zero if nothing is recorded.
+ */
+uint64_t EchoGetHistogramPercentile(
+		const struct EchoHistogram* histogram,
+		double percentile);
+
+/**
+ * Constructs a new benchmark with unconnected streams.
+ *
+ * @param benchmark new benchmark.
+ * @param type socket type.
+ * @param streamCount number of streams.
+ * @param payloadSize message size, at least the size of a time.
+ * @param bufferSize receive buffer size, at least the message
+ *                   size for datagrams.
+ * @param interval interval between messages of a stream in
+ *                 nanoseconds, zero for closed loop.
+ * @return zero or negative error number.
+ */
+int EchoNewBenchmark(
+		struct EchoBenchmark** benchmark,
+		int type,
+		size_t streamCount,
+		size_t payloadSize,
+		size_t bufferSize,
+		uint64_t interval);
+
+/**
+ * Closes the benchmark streams and the epoll instance, and
+ * releases the buffers.
+ *
+ * @param benchmark benchmark.
+ */
+void EchoDeleteBenchmark(struct EchoBenchmark* benchmark);
+
+/**
+ * Adds the given connected socket to the benchmark as the
+ * socket of the stream at the given index. The socket is put
+ * into the non-blocking mode.
+ *
+ * @param benchmark benchmark.
+ * @param index stream index.
+ * @param sd connected socket descriptor, owned by the stream
+ *           even if failed.
+ * @return zero or negative error number.
+ */
+int EchoAddBenchmarkStream(
+		struct EchoBenchmark* benchmark,
+		size_t index,
+		int sd);
+
+/**
+ * Runs the benchmark until the given end time. A server closing
+ * a stream connection fails the run with ECONNRESET.
+ *
+ * @param benchmark benchmark with all streams added.
+ * @param endTime end time.
+ * @return zero or negative error number.
+ */
+int EchoRunBenchmark(
+		struct EchoBenchmark* benchmark,
+		uint64_t endTime);
+
+#endif
@@ -0,0 +1,5861 @@
+#include "EchoServer.h"
+#include "EchoSocket.h"
+#include "EchoTrace.h"
+#include "EchoCoalesce.h"
+#include "EchoCapture.h"
+
+// NULL
+#include <stdio.h>
+
+// errno
+#include <errno.h>
+
+// memset, memcpy, memmove
+#include <string.h>
+
+// socket, bind, listen, accept, recv, send
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// sockaddr_in, sockaddr_in6
+#include <netinet/in.h>
+
+// close, pipe, read, write, sysconf
+#include <unistd.h>
+
+// malloc, calloc, free
+#include <stdlib.h>
+
+// fcntl
+#include <fcntl.h>
+
+// epoll_create, epoll_ctl, epoll_wait
+#include <sys/epoll.h>
+
+// mmap, munmap
+#include <sys/mman.h>
+
+// pthread_create, pthread_join, pthread_mutex_lock
+#include <pthread.h>
+
+// sched_setaffinity, sched_setscheduler
+#include <sched.h>
+
+// setpriority
+#include <sys/resource.h>
+
+// iovec
+#include <sys/uio.h>
+
+// SOL_UDP
+#include <netinet/udp.h>
+
+// clock_gettime
+#include <time.h>
+
+// syscall
+#include <sys/syscall.h>
+
+// eventfd
+#include <sys/eventfd.h>
+
+// poll
+#include <poll.h>
+
+// recvmmsg, sendmmsg, splice and accept4 are only in API level 21 and later
+#if !defined(__ANDROID__) || (defined(__ANDROID_API__) && (__ANDROID_API__ >= 21))
+#define HAVE_SENDMMSG 1
+#define HAVE_SPLICE 1
+#define HAVE_ACCEPT4 1
+#endif
+
+// timerfd is missing from the older C libraries
+#if defined(__NR_timerfd_create) && defined(__NR_timerfd_settime)
+#define HAVE_TIMERFD 1
+#endif
+
+#ifndef TFD_TIMER_ABSTIME
+#define TFD_TIMER_ABSTIME 1
+#endif
+
+// io_uring is only in the newer kernel headers
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// io_uring loop needs multishot receives and provided buffer rings
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+
+// UDP segmentation offload options missing from the older platform headers
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// Default pipe capacity, max data moved by a single splice
+#define PIPE_SIZE 65536
+
+// Max number of events returned by a single event loop wait
+#define MAX_EPOLL_EVENTS 64
+
+// Max connections accepted per event loop turn, the rest wait for the next
+#define ACCEPT_BUDGET 64
+
+// Max number of queued segments sent with a single call
+#define MAX_OUTPUT_VECTORS 16
+
+// Size of the big endian frame length prefix
+#define FRAME_HEADER_SIZE 4
+
+// Number of submission queue entries of an io_uring loop
+#define URING_ENTRIES 256
+
+// Number of receive buffers provided to the kernel, must be a power of two
+#define URING_BUFFER_COUNT 256
+
+// Provided receive buffer group ID
+#define URING_BUFFER_GROUP 0
+
+// io_uring operation kinds, kept in the low bits of the user data
+#define URING_OP_ACCEPT 0
+#define URING_OP_RECEIVE 1
+#define URING_OP_SEND 2
+#define URING_OP_CANCEL 3
+#define URING_OP_MASK 3
+
+// Stop poll and drain timeout, a cancel without a connection
+#define URING_OP_STOP URING_OP_CANCEL
+
+// Timer wheel tick in nanoseconds
+#define TIMER_TICK 10000000ULL
+
+// Timer wheel levels, each with 64 slots, spanning 2^24 ticks
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+
+// Max number of datagrams received and sent with a single call
+#define UDP_BATCH_SIZE 32
+
+// Receive buffer size of the UDP batch with segmentation offload
+#define UDP_GRO_BUFFER_SIZE 65536
+
+// Flow table slots probed for a peer
+#define UDP_FLOW_PROBES 8
+
+// Time without datagrams after which a UDP flow is gone, in nanoseconds
+#define UDP_FLOW_TIMEOUT 30000000000ULL
+
+// Max number of workers counting at the same time
+#define MAX_STATS_SLOTS 256
+
+// Process wide worker counters, kept after the workers stop
+static struct EchoWorkerStats workerStats[MAX_STATS_SLOTS];
+
+/**
+ * Adds the given value to a counter. Having a single writer,
+ * it needs no atomic read-modify-write, only a store that the
+ * readers never see torn.
+ *
+ * @param counter counter.
+ * @param value value to add.
+ */
+static inline void AddCounter(uint64_t* counter, uint64_t value)
+{
+	__atomic_store_n(counter,
+			__atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+			__ATOMIC_RELAXED);
+}
+
+/**
+ * Slab of buffers allocated at once by a buffer pool.
+ */
+struct BufferSlab
+{
+	// Slab memory
+	void* memory;
+
+	// Slab memory length
+	size_t length;
+
+	// Next slab in the pool
+	struct BufferSlab* next;
+};
+
+/**
+ * Pool of fixed-size buffers carved out of page aligned slabs.
+ * Released buffers are recycled, the pool grows by a slab
+ * only when it runs out of buffers.
+ */
+struct BufferPool
+{
+	// Buffer size
+	size_t bufferSize;
+
+	// Number of buffers in a slab
+	size_t slabSize;
+
+	// Free buffers, linked through their first bytes
+	void* freeBuffers;
+
+	// Number of free buffers
+	size_t freeCount;
+
+	// Slabs in the pool
+	struct BufferSlab* slabs;
+};
+
+/**
+ * Grows the buffer pool by a new slab.
+ *
+ * @param pool buffer pool.
+ * @return true if grown.
+ */
+static bool GrowBufferPool(struct BufferPool* pool)
+{
+	struct BufferSlab* slab = (struct BufferSlab*) malloc(
+			sizeof(struct BufferSlab));
+
+	if (NULL == slab)
+		return false;
+
+	slab->length = EchoGetPageAlignedSize(pool->bufferSize * pool->slabSize);
+	slab->memory = mmap(NULL, slab->length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (MAP_FAILED == slab->memory)
+	{
+		free(slab);
+		return false;
+	}
+
+	// Link the slab buffers to the free buffers
+	char* buffer = (char*) slab->memory;
+
+	for (size_t i = 0; i < pool->slabSize; i++)
+	{
+		*((void**) buffer) = pool->freeBuffers;
+		pool->freeBuffers = buffer;
+		buffer += pool->bufferSize;
+	}
+
+	pool->freeCount += pool->slabSize;
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+
+	return true;
+}
+
+/**
+ * Constructs a new buffer pool with the given buffer size,
+ * and allocates the first slab. Buffers that are multiple
+ * of the page size are page aligned.
+ *
+ * @param sink log sink.
+ * @param pool buffer pool.
+ * @param bufferSize buffer size.
+ * @param slabSize number of buffers in a slab.
+ * @return zero or -ENOMEM.
+ */
+static int NewBufferPool(
+		const struct EchoLogSink* sink,
+		struct BufferPool* pool,
+		size_t bufferSize,
+		size_t slabSize)
+{
+	memset(pool, 0, sizeof(struct BufferPool));
+
+	// Keep buffers on their own cache lines
+	pool->bufferSize = (bufferSize + CACHE_LINE_SIZE - 1)
+			& ~((size_t) CACHE_LINE_SIZE - 1);
+	pool->slabSize = slabSize;
+
+	if (!GrowBufferPool(pool))
+	{
+		EchoLog(sink, LOG_LEVEL_ERROR, "Unable to allocate buffer pool.");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * Deletes the buffer pool by releasing all its slabs. The
+ * buffers must not be used after.
+ *
+ * @param pool buffer pool.
+ */
+static void DeleteBufferPool(struct BufferPool* pool)
+{
+	while (NULL != pool->slabs)
+	{
+		struct BufferSlab* slab = pool->slabs;
+		pool->slabs = slab->next;
+
+		munmap(slab->memory, slab->length);
+		free(slab);
+	}
+
+	pool->freeBuffers = NULL;
+	pool->freeCount = 0;
+}
+
+/**
+ * Acquires a buffer from the buffer pool.
+ *
+ * @param pool buffer pool.
+ * @return buffer or NULL if out of memory.
+ */
+static void* AcquireBuffer(struct BufferPool* pool)
+{
+	if ((NULL == pool->freeBuffers) && !GrowBufferPool(pool))
+		return NULL;
+
+	void* buffer = pool->freeBuffers;
+	pool->freeBuffers = *((void**) buffer);
+	pool->freeCount--;
+
+	return buffer;
+}
+
+/**
+ * Releases the buffer back to the buffer pool.
+ *
+ * @param pool buffer pool.
+ * @param buffer buffer.
+ */
+static void ReleaseBuffer(struct BufferPool* pool, void* buffer)
+{
+	*((void**) buffer) = pool->freeBuffers;
+	pool->freeBuffers = buffer;
+	pool->freeCount++;
+}
+
+/**
+ * Constructs a new non-blocking pipe.
+ *
+ * @param pipeFds pipe read and write descriptors.
+ * @return true if constructed.
+ */
+static bool NewPipe(int pipeFds[2])
+{
+	if (-1 == pipe(pipeFds))
+	{
+		pipeFds[0] = -1;
+		pipeFds[1] = -1;
+		return false;
+	}
+
+	for (int i = 0; i < 2; i++)
+	{
+		int flags = fcntl(pipeFds[i], F_GETFL, 0);
+		fcntl(pipeFds[i], F_SETFL, flags | O_NONBLOCK);
+	}
+
+	return true;
+}
+
+/**
+ * Closes the given pipe if it is open.
+ *
+ * @param pipeFds pipe read and write descriptors.
+ */
+static void ClosePipe(int pipeFds[2])
+{
+	for (int i = 0; i < 2; i++)
+	{
+		if (-1 != pipeFds[i])
+		{
+			close(pipeFds[i]);
+			pipeFds[i] = -1;
+		}
+	}
+}
+
+/**
+ * Adds the accepted connections to the worker counters and
+ * to the accept rate of the current second.
+ *
+ * @param stats worker counters.
+ * @param count number of accepted connections.
+ */
+static void CountAccepts(struct EchoWorkerStats* stats, uint64_t count)
+{
+	if (0 == count)
+		return;
+
+	EchoAddStat(stats, STAT_ACCEPTS, count);
+
+	uint64_t second = EchoGetMonotonicTime() / 1000000000ULL;
+
+	// Roll over, a gap of more than a second had no accepts
+	if (second != stats->acceptSecond)
+	{
+		uint64_t last = (second == stats->acceptSecond + 1)
+				? stats->acceptsThisSecond : 0;
+
+		__atomic_store_n(&stats->acceptsLastSecond, last, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats->acceptsThisSecond, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats->acceptSecond, second, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&stats->acceptsThisSecond,
+			stats->acceptsThisSecond + count, __ATOMIC_RELAXED);
+}
+
+/**
+ * Gets the connections the worker accepted in the last full
+ * second. Read while the worker counts, so it is approximate.
+ *
+ * @param stats worker counters.
+ * @param second current second of the monotonic clock.
+ * @return accepted connections.
+ */
+static uint64_t GetAcceptRate(struct EchoWorkerStats* stats, uint64_t second)
+{
+	uint64_t acceptSecond = __atomic_load_n(&stats->acceptSecond,
+			__ATOMIC_ACQUIRE);
+
+	if (acceptSecond == second)
+		return __atomic_load_n(&stats->acceptsLastSecond, __ATOMIC_RELAXED);
+
+	if (acceptSecond + 1 == second)
+		return __atomic_load_n(&stats->acceptsThisSecond, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/**
+ * Gets the descriptor a loop watches for the stop request.
+ *
+ * @param control server control or NULL.
+ * @return stop descriptor or -1 if not stoppable.
+ */
+static int GetStopFd(struct EchoServerControl* control)
+{
+	return (NULL == control) ? -1 : control->stopFd;
+}
+
+/**
+ * Gets the time a stopping server sends the queued data until.
+ *
+ * @param config configuration.
+ * @return drain deadline in nanoseconds.
+ */
+static uint64_t GetDrainDeadline(const struct EchoConfig* config)
+{
+	return EchoGetMonotonicTime()
+			+ ((uint64_t) config->drainTimeout * 1000000ULL);
+}
+
+/**
+ * Timer kept in a timer wheel slot, embedded in the state it
+ * times out. Timers of a slot form a circular list around the
+ * slot head, so arming and canceling are O(1).
+ */
+struct Timer
+{
+	// Slot list links, NULL if not armed
+	struct Timer* prev;
+	struct Timer* next;
+
+	// Tick the timer expires at
+	uint64_t expires;
+};
+
+/**
+ * Hierarchical timer wheel. Level 0 has a slot per tick, and
+ * a slot of each higher level spans a full turn of the level
+ * below. Timers are cascaded down as the wheel turns, so that
+ * they expire from the level 0 slot of their tick.
+ */
+struct TimerWheel
+{
+	// Current tick, the earlier ticks are expired
+	uint64_t current;
+
+	// Number of armed timers
+	size_t count;
+
+	// Slot list heads
+	struct Timer slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+/**
+ * Gets the current timer wheel tick.
+ *
+ * @return tick.
+ */
+static uint64_t GetTimerTick()
+{
+	return EchoGetMonotonicTime() / TIMER_TICK;
+}
+
+/**
+ * Gets the given timeout in timer wheel ticks, rounded up.
+ *
+ * @param timeout timeout in ms.
+ * @return timeout in ticks.
+ */
+static uint64_t GetTimeoutTicks(int timeout)
+{
+	return ((uint64_t) timeout * 1000000ULL + TIMER_TICK - 1) / TIMER_TICK;
+}
+
+/**
+ * Initializes the timer wheel with empty slots.
+ *
+ * @param wheel timer wheel.
+ * @param now current tick.
+ */
+static void InitTimerWheel(struct TimerWheel* wheel, uint64_t now)
+{
+	wheel->current = now;
+	wheel->count = 0;
+
+	for (int level = 0; level < TIMER_LEVELS; level++)
+	{
+		for (int slot = 0; slot < TIMER_SLOTS; slot++)
+		{
+			struct Timer* head = &wheel->slots[level][slot];
+			head->prev = head;
+			head->next = head;
+		}
+	}
+}
+
+/**
+ * Checks if the timer is armed.
+ *
+ * @param timer timer.
+ * @return true if armed.
+ */
+static inline bool IsTimerArmed(struct Timer* timer)
+{
+	return (NULL != timer->next);
+}
+
+/**
+ * Links the timer into the slot of its expiry tick, on the
+ * lowest level that reaches that far.
+ *
+ * @param wheel timer wheel.
+ * @param timer timer.
+ */
+static void LinkTimer(struct TimerWheel* wheel, struct Timer* timer)
+{
+	uint64_t last = wheel->current
+			+ (1ULL << (TIMER_LEVELS * TIMER_SLOT_BITS)) - 1;
+
+	// Expired ones go to the current slot, too far ones are capped
+	if (timer->expires < wheel->current)
+	{
+		timer->expires = wheel->current;
+	}
+	else if (timer->expires > last)
+	{
+		timer->expires = last;
+	}
+
+	uint64_t delta = timer->expires - wheel->current;
+
+	int level = 0;
+	while ((level < TIMER_LEVELS - 1)
+			&& (delta >= (1ULL << ((level + 1) * TIMER_SLOT_BITS))))
+	{
+		level++;
+	}
+
+	struct Timer* head = &wheel->slots[level][(timer->expires
+			>> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK];
+
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+/**
+ * Unlinks the timer from its slot.
+ *
+ * @param timer timer.
+ */
+static void UnlinkTimer(struct Timer* timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->prev = NULL;
+	timer->next = NULL;
+}
+
+/**
+ * Cancels the timer if it is armed.
+ *
+ * @param wheel timer wheel.
+ * @param timer timer.
+ */
+static void CancelTimer(struct TimerWheel* wheel, struct Timer* timer)
+{
+	if (IsTimerArmed(timer))
+	{
+		UnlinkTimer(timer);
+		wheel->count--;
+	}
+}
+
+/**
+ * Arms the timer to expire at the given tick, moving it if
+ * it is already armed.
+ *
+ * @param wheel timer wheel.
+ * @param timer timer.
+ * @param now current tick.
+ * @param expires expiry tick.
+ */
+static void ArmTimer(
+		struct TimerWheel* wheel,
+		struct Timer* timer,
+		uint64_t now,
+		uint64_t expires)
+{
+	// Rearming on every event mostly lands on the same tick
+	if (IsTimerArmed(timer) && (expires == timer->expires))
+		return;
+
+	CancelTimer(wheel, timer);
+
+	// Empty wheel is not turned, it catches up at once
+	if ((0 == wheel->count) && (now > wheel->current))
+	{
+		wheel->current = now;
+	}
+
+	timer->expires = expires;
+	LinkTimer(wheel, timer);
+	wheel->count++;
+}
+
+/**
+ * Cascades the timers of the higher level slots that the
+ * current tick starts, moving them closer to their expiry.
+ *
+ * @param wheel timer wheel.
+ */
+static void CascadeTimers(struct TimerWheel* wheel)
+{
+	for (int level = 1; level < TIMER_LEVELS; level++)
+	{
+		int shift = level * TIMER_SLOT_BITS;
+
+		// Slot of this level starts only when the level below wraps
+		if (0 != (wheel->current & ((1ULL << shift) - 1)))
+			break;
+
+		struct Timer* head = &wheel->slots[level][(wheel->current >> shift)
+				& TIMER_SLOT_MASK];
+
+		// Timers of the slot expire within its span, so they move down
+		while (head->next != head)
+		{
+			struct Timer* timer = head->next;
+
+			UnlinkTimer(timer);
+			LinkTimer(wheel, timer);
+		}
+	}
+}
+
+/**
+ * Turns the timer wheel up to the given tick and takes an
+ * expired timer off it. Called until it returns NULL, the
+ * expired timers may be armed again in between.
+ *
+ * @param wheel timer wheel.
+ * @param now current tick.
+ * @return expired timer or NULL.
+ */
+static struct Timer* ExpireTimer(struct TimerWheel* wheel, uint64_t now)
+{
+	while (1)
+	{
+		struct Timer* head = &wheel->slots[0][wheel->current
+				& TIMER_SLOT_MASK];
+
+		if (head->next != head)
+		{
+			struct Timer* timer = head->next;
+			CancelTimer(wheel, timer);
+
+			return timer;
+		}
+
+		if (wheel->current >= now)
+			return NULL;
+
+		// Nothing to cascade, skip the idle ticks at once
+		if (0 == wheel->count)
+		{
+			wheel->current = now;
+			return NULL;
+		}
+
+		wheel->current++;
+		CascadeTimers(wheel);
+	}
+}
+
+/**
+ * Gets the time until the timer wheel has to be turned next,
+ * either for an expiring timer or for a cascade that may
+ * bring one down.
+ *
+ * @param wheel timer wheel.
+ * @param time current time in nanoseconds.
+ * @return timeout in ms, or -1 if no timer is armed.
+ */
+static int GetTimerTimeout(struct TimerWheel* wheel, uint64_t time)
+{
+	if (0 == wheel->count)
+		return -1;
+
+	uint64_t next = wheel->current + (1ULL << (TIMER_LEVELS
+			* TIMER_SLOT_BITS));
+
+	// Level 0 slots are ticks, the higher ones start at cascades
+	for (int level = 0; level < TIMER_LEVELS; level++)
+	{
+		int shift = level * TIMER_SLOT_BITS;
+		uint64_t base = wheel->current >> shift;
+
+		// Current slot of a higher level is a full turn away
+		int first = (0 == level) ? 0 : 1;
+
+		for (int i = first; i < first + TIMER_SLOTS; i++)
+		{
+			struct Timer* head = &wheel->slots[level][(base + i)
+					& TIMER_SLOT_MASK];
+
+			if (head->next != head)
+			{
+				uint64_t start = (base + i) << shift;
+				if (start < next)
+				{
+					next = start;
+				}
+
+				break;
+			}
+		}
+	}
+
+	uint64_t nextTime = next * TIMER_TICK;
+	if (nextTime <= time)
+		return 0;
+
+	return (int) ((nextTime - time + 999999ULL) / 1000000ULL);
+}
+
+/**
+ * Segment of the received data that is queued to be sent
+ * back to the client.
+ */
+struct OutputSegment
+{
+	// Next segment in the output queue
+	struct OutputSegment* next;
+
+	// Data buffer from the event loop buffer pool
+	char* buffer;
+
+	// Offset of the first byte that is not sent yet
+	size_t offset;
+
+	// Size of the received data in the buffer
+	size_t length;
+
+	// Descriptors received with the data, passed on with it
+	int fds[MAX_PASSED_FDS];
+	int fdCount;
+
+	// Segment holds a whole message or descriptors, takes no more data
+	bool sealed;
+};
+
+/**
+ * Client connection state that is kept by the event loop
+ * for each connected client.
+ */
+struct Connection
+{
+	// Client socket descriptor
+	int sd;
+
+	// Size of the data pending in the pipe in zero copy mode
+	size_t pendingSize;
+
+	// Previous connection in the event loop
+	struct Connection* prev;
+
+	// Next connection in the event loop
+	struct Connection* next;
+
+	// First and last segments of the output queue
+	struct OutputSegment* outputHead;
+	struct OutputSegment* outputTail;
+
+	// Bytes in the output queue that are not sent yet
+	size_t queuedSize;
+
+	// Socket accepted the last send completely
+	bool writable;
+
+	// Client has shut down its side of the connection
+	bool peerClosed;
+
+	// Length prefix of the next frame read so far
+	uint32_t frameHeader;
+
+	// Bytes of the length prefix read so far
+	size_t frameHeaderSize;
+
+	// Bytes of the current frame payload not received yet
+	size_t frameRemaining;
+
+	// Tick the first byte of the current frame arrived at
+	uint64_t frameStarted;
+
+	// Pipe holding the pending data in zero copy mode, or -1
+	int pipeFds[2];
+
+	// Closes the connection once it stays idle or stalled
+	struct Timer timer;
+
+	// Arrivals of the data, timed to decide if the output is held
+	struct EchoArrivals arrivals;
+
+	// Time the held output is sent at, or zero if not held
+	uint64_t flushTime;
+
+	// Links of the connections holding their output
+	struct Connection* prevHeld;
+	struct Connection* nextHeld;
+
+	// Id the received data is captured with
+	uint32_t captureId;
+};
+
+/**
+ * Event loop serving multiple client connections on
+ * a single thread.
+ */
+struct EventLoop
+{
+	// epoll descriptor
+	int epollFd;
+
+	// Listening server socket descriptor
+	int serverSocket;
+
+	// Server socket is a pipe the accept thread hands the clients over
+	bool handoff;
+
+	// Active client connections
+	struct Connection* connections;
+
+	// Number of active client connections
+	size_t connectionCount;
+
+	// Pool of connection states
+	struct BufferPool connectionPool;
+
+	// Pool of output segments
+	struct BufferPool segmentPool;
+
+	// Pool of connection data buffers
+	struct BufferPool bufferPool;
+
+	// Bytes queued for a connection before reading from it stops
+	size_t highWaterMark;
+
+	// Echo the data with splice instead of copying it
+	bool zeroCopy;
+
+	// Check the length prefixed frames, or zero if not framing
+	size_t maxFrameSize;
+
+	// Each segment is one message, sent on its own
+	bool messages;
+
+	// Descriptors passed by the clients are echoed back with the data
+	bool passFds;
+
+	// Descriptor that becomes readable when the server is stopped, or -1
+	int stopFd;
+
+	// Server is stopped, connections close once their data is sent
+	bool stopping;
+
+	// Time the queued data is sent until while stopping
+	uint64_t drainDeadline;
+
+	// Accept budget ran out, the backlog is drained on the next turn
+	bool acceptPending;
+
+	// Connection timeouts in ticks, zero if disabled
+	uint64_t idleTimeout;
+	uint64_t readTimeout;
+	uint64_t writeTimeout;
+
+	// Any of the connection timeouts is enabled
+	bool timeouts;
+
+	// Tick of the last wake up, the timers are armed from it
+	uint64_t now;
+
+	// Connection timers
+	struct TimerWheel timers;
+
+	// Time the output may be held to coalesce it in ns, zero if not
+	uint64_t coalesceDelay;
+
+	// Bytes held before they are sent regardless of the delay
+	size_t coalesceSize;
+
+	// timerfd that fires when the first held output is due, or -1
+	int coalesceFd;
+
+	// Connections holding their output, in flush time order
+	struct Connection* heldHead;
+	struct Connection* heldTail;
+
+	// Capture the received data is recorded in, or NULL
+	struct EchoCapture* capture;
+
+	// Counters of the worker running the loop
+	struct EchoWorkerStats* stats;
+
+	// Server configuration
+	const struct EchoConfig* config;
+};
+
+/**
+ * Constructs the timer that sends the held output of the
+ * event loop when it is due. Coalescing is disabled if the
+ * timer is not available.
+ *
+ * @param sink log sink.
+ * @param loop event loop.
+ */
+static void NewCoalesceTimer(
+		const struct EchoLogSink* sink,
+		struct EventLoop* loop)
+{
+#ifdef HAVE_TIMERFD
+	loop->coalesceFd = (int) syscall(__NR_timerfd_create, CLOCK_MONOTONIC,
+			O_NONBLOCK | O_CLOEXEC);
+
+	if (-1 != loop->coalesceFd)
+	{
+		// Coalesce timer is marked with its descriptor, level triggered
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = &loop->coalesceFd;
+
+		if (0 == epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->coalesceFd,
+				&event))
+		{
+			const struct EchoSocketProfile* profile = &loop->config->socket;
+
+			loop->coalesceDelay = (uint64_t) profile->coalesceDelay * 1000ULL;
+
+			// Held output is sent with a single call below the high-water mark
+			loop->coalesceSize = (size_t) profile->coalesceSize;
+			if (loop->coalesceSize > loop->highWaterMark)
+			{
+				loop->coalesceSize = loop->highWaterMark;
+			}
+
+			if (loop->coalesceSize
+					> MAX_OUTPUT_VECTORS * loop->bufferPool.bufferSize)
+			{
+				loop->coalesceSize =
+						MAX_OUTPUT_VECTORS * loop->bufferPool.bufferSize;
+			}
+
+			return;
+		}
+
+		close(loop->coalesceFd);
+		loop->coalesceFd = -1;
+	}
+
+	EchoLogErrno(sink, "Unable to construct coalesce timer, sending at once:",
+			errno);
+#else
+	EchoLog(sink, LOG_LEVEL_INFO, "timerfd is not supported, sending at once.");
+#endif
+}
+
+/**
+ * Constructs a new event loop for the given listening
+ * server socket.
+ *
+ * @param sink log sink.
+ * @param config server configuration, kept by the loop.
+ * @param loop event loop.
+ * @param serverSocket server socket descriptor.
+ * @param stats worker counters.
+ * @param stopFd stop descriptor or -1 if not stoppable.
+ * @return zero or negative error number.
+ */
+static int NewEventLoop(
+		const struct EchoLogSink* sink,
+		const struct EchoConfig* config,
+		struct EventLoop* loop,
+		int serverSocket,
+		struct EchoWorkerStats* stats,
+		int stopFd)
+{
+	memset(loop, 0, sizeof(struct EventLoop));
+	loop->serverSocket = serverSocket;
+	loop->stopFd = stopFd;
+	loop->coalesceFd = -1;
+	loop->stats = stats;
+	loop->config = config;
+
+	// Construct an epoll instance, the size is only a hint
+	EchoLog(sink, LOG_LEVEL_INFO, "Constructing a new event loop...");
+	loop->epollFd = epoll_create(MAX_EPOLL_EVENTS);
+
+	// Check if epoll is properly constructed
+	if (-1 == loop->epollFd)
+		return -errno;
+
+	// Server socket must not block the loop
+	int result = EchoSetSocketNonBlocking(serverSocket);
+	if (result < 0)
+		return result;
+
+	// Connection states, segments and buffers come from the pools
+	result = NewBufferPool(sink, &loop->connectionPool,
+			sizeof(struct Connection), config->poolSize);
+	if (result < 0)
+		return result;
+
+	result = NewBufferPool(sink, &loop->segmentPool,
+			sizeof(struct OutputSegment), config->poolSize);
+	if (result < 0)
+		return result;
+
+	result = NewBufferPool(sink, &loop->bufferPool,
+			EchoGetPageAlignedSize(config->bufferSize), config->poolSize);
+	if (result < 0)
+		return result;
+
+	loop->highWaterMark = config->highWaterMark;
+
+	if (config->framing)
+	{
+		loop->maxFrameSize = config->maxFrameSize;
+		loop->readTimeout = GetTimeoutTicks(config->readTimeout);
+	}
+
+	loop->idleTimeout = GetTimeoutTicks(config->idleTimeout);
+	loop->writeTimeout = GetTimeoutTicks(config->writeTimeout);
+	loop->timeouts = (0 != loop->idleTimeout) || (0 != loop->readTimeout)
+			|| (0 != loop->writeTimeout);
+
+	loop->now = GetTimerTick();
+	InitTimerWheel(&loop->timers, loop->now);
+
+#ifdef HAVE_SPLICE
+	// Frames cannot be checked nor captured without seeing the data
+	loop->zeroCopy = config->zeroCopy && !config->framing
+			&& ('\0' == config->capturePath[0]);
+#endif
+
+	// Listening socket is marked with a NULL data pointer
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = NULL;
+
+	if (-1 == epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, serverSocket, &event))
+		return -errno;
+
+	// Stop descriptor is marked with the loop itself, level triggered
+	event.events = EPOLLIN;
+	event.data.ptr = loop;
+
+	if ((-1 != stopFd)
+			&& (-1 == epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, stopFd, &event)))
+		return -errno;
+
+	if (0 != config->socket.coalesceDelay)
+	{
+		NewCoalesceTimer(sink, loop);
+	}
+
+	return 0;
+}
+
+/**
+ * Releases the first segment of the connection output queue.
+ *
+ * @param loop event loop.
+ * @param connection client connection.
+ */
+static void ReleaseOutputSegment(
+		struct EventLoop* loop,
+		struct Connection* connection)
+{
+	struct OutputSegment* segment = connection->outputHead;
+
+	connection->outputHead = segment->next;
+	if (NULL == connection->outputHead)
+	{
+		connection->outputTail = NULL;
+	}
+
+	connection->queuedSize -= segment->length - segment->offset;
+
+	// Close the descriptors that are not passed on
+	for (int i = 0; i < segment->fdCount; i++)
+	{
+		close(segment->fds[i]);
+	}
+
+	ReleaseBuffer(&loop->bufferPool, segment->buffer);
+	ReleaseBuffer(&loop->segmentPool, segment);
+}
+
+/**
+ * Appends an empty segment to the connection output queue.
+ *
+ * @param loop event loop.
+ * @param connection client connection.
+ * @return segment or NULL if pool is exhausted.
+ */
+static struct OutputSegment* AppendOutputSegment(
+		struct EventLoop* loop,
+		struct Connection* connection)
+{
+	struct OutputSegment* segment = (struct OutputSegment*) AcquireBuffer(
+			&loop->segmentPool);
+
+	if (NULL == segment)
+		return NULL;
+
+	segment->buffer = (char*) AcquireBuffer(&loop->bufferPool);
+	if (NULL == segment->buffer)
+	{
+		ReleaseBuffer(&loop->segmentPool, segment);
+		return NULL;
+	}
+
+	segment->next = NULL;
+	segment->offset = 0;
+	segment->length = 0;
+	segment->fdCount = 0;
+	segment->sealed = false;
+
+	if (NULL == connection->outputTail)
+	{
+		connection->outputHead = segment;
+	}
+	else
+	{
+		connection->outputTail->next = segment;
+	}
+
+	connection->outputTail = segment;
+
+	return segment;
+}
+
+/**
+ * Removes the connection from the connections holding their
+ * output, it is sent on the next flush.
+ *
+ * @param loop event loop.
+ * @param connection client connection.
+ */
+static void ReleaseHeldOutput(
+		struct EventLoop* loop,
+		struct Connection* connection)
+{
+	if (0 == connection->flushTime)
+		return;
+
+	if (NULL != connection->prevHeld)
+	{
+		connection->prevHeld->nextHeld = connection->nextHeld;
+	}
+	else
+	{
+		loop->heldHead = connection->nextHeld;
+	}
+
+	if (NULL != connection->nextHeld)
+	{
+		connection->nextHeld->prevHeld = connection->prevHeld;
+	}
+	else
+	{
+		loop->heldTail = connection->prevHeld;
+	}
+
+	connection->prevHeld = NULL;
+	connection->nextHeld = NULL;
+	connection->flushTime = 0;
+}
+
+/**
+ * Releases the given client connection state and closes
+ * its socket.
+ *
+ * @param loop event loop.
+ * @param connection client connection.
+ */
+static void FreeConnection(
+		struct EventLoop* loop,
+		struct Connection* connection)
+{
+	// Unlink from the active connections
+	if (NULL != connection->prev)
+	{
+		connection->prev->next = connection->next;
+	}
+	else
+	{
+		loop->connections = connection->next;
+	}
+
+	if (NULL != connection->next)
+	{
+		connection->next->prev = connection->prev;
+	}
+
+	loop->connectionCount--;
+	EchoAddStat(loop->stats, STAT_ACTIVE_CONNECTIONS, (uint64_t) -1);
+
+	CancelTimer(&loop->timers, &connection->timer);
+	ReleaseHeldOutput(loop, connection);
+
+	// Closing the socket also removes it from epoll
+	close(connection->sd);
+	ClosePipe(connection->pipeFds);
+
+	// Recycle the output queue and the connection state
+	while (NULL != connection->outputHead)
+	{
+		ReleaseOutputSegment(loop, connection);
+	}
+
+	ReleaseBuffer(&loop->connectionPool, connection);
+}
+
+/**
+ * Closes the given client connection.
+ *
+ * @param sink log sink.
+ * @param loop event loop.
+ * @param connection client connection.
+ */
+static void CloseConnection(
+		const struct EchoLogSink* sink,
+		struct EventLoop* loop,
+		struct Connection* connection)
+{
+	FreeConnection(loop, connection);
+
+	EchoLog(sink, LOG_LEVEL_INFO,
+			"Connection closed, %zu active connections.",
+			loop->connectionCount);
+}
+
+/**
+ * Checks if the connection has data waiting to be sent.
+ *
+ * @param connection client connection.
+ * @return true if sending.
+ */
+static inline bool IsConnectionSending(struct Connection* connection)
+{
+	return (NULL != connection->outputHead) || (connection->pendingSize > 0);
+}
+
+/**
+ * Checks if the connection has received a part of a frame.
+ *
+ * @param connection client connection.
+ * @return true if receiving a frame.
+ */
+static inline bool IsConnectionInFrame(struct Connection* connection)
+{
+	return (0 != connection->frameHeaderSize)
+			|| (0 != connection->frameRemaining);
+}
+
+/**
+ * Arms the connection timer for the timeout of its state.
+ * Queued data gets the write timeout, otherwise the idle
+ * timeout applies. A partial frame also gets the read timeout
+ * from its first byte, so trickling it in does not keep the
+ * connection open.
+ *
+ * @param loop event loop.
+ * @param connection client connection.
+ */
+static void UpdateConnectionTimer(
+		struct EventLoop* loop,
+		struct Connection* connection)
+{
+	uint64_t timeout = IsConnectionSending(connection) ? loop->writeTimeout
+			: loop->idleTimeout;
+
+	// Zero is never a deadline, ticks start with the system
+	uint64_t expires = (0 == timeout) ? 0 : loop->now + timeout;
+
+	if ((0 != loop->readTimeout) && IsConnectionInFrame(connection))
+	{
+		uint64_t frameExpires = connection->frameStarted + loop->readTimeout;
+
+		if ((0 == expires) || (frameExpires < expires))
+		{
+			expires = frameExpires;
+		}
+	}
+
+	if (0 == expires)
+	{
+		CancelTimer(&loop->timers, &connection->timer);
+	}
+	else
+	{
+		ArmTimer(&loop->timers, &connection->timer, loop->now, expires);
+	}
+}
+
+/**
+ * Closes the connections whose timers expired.
+ *
+ * @param sink log sink.
+ * @param loop event loop.
+ */
+static void ExpireConnections(
+		const struct EchoLogSink* sink,
+		struct EventLoop* loop)
+{
+	struct Timer* timer;
+
+	while (NULL != (timer = ExpireTimer(&loop->timers, loop->now)))
+	{
+		struct Connection* connection = (struct Connection*) ((char*) timer
+				- offsetof(struct Connection, timer));
+
+		// State is the same as when the timer was armed
+		if ((0 != loop->readTimeout) && IsConnectionInFrame(connection)
+				&& (connection->frameStarted + loop->readTimeout <= loop->now))
+		{
+			EchoLog(sink, LOG_LEVEL_INFO, "Frame receive timed out.");
+		}
+		else if (IsConnectionSending(connection))
+		{
+			EchoLog(sink, LOG_LEVEL_INFO,
+					"Send timed out, client is not reading.");
+		}
+		else
+		{
+			EchoLog(sink, LOG_LEVEL_INFO, "Connection idle timed out.");
+		}
+
+		EchoAddStat(loop->stats, STAT_TIMEOUTS, 1);
+		CloseConnection(sink, loop, connection);
+	}
+}
+
+/**
+ * Deletes the event loop by closing all active client
+ * connections, the epoll instance, and releasing the
+ * pooled buffers. The server socket
+ * is owned by the caller. Nothing is logged since an
+ * exception may be pending.
+ *
+ * @param loop event loop.
+ */
+static void DeleteEventLoop(struct EventLoop* loop)
+{
+	while (NULL != loop->connections)
+	{
+		FreeConnection(loop, loop->connections);
+	}
+
+	if (-1 != loop->epollFd)
+	{
+		close(loop->epollFd);
+		loop->epollFd = -1;
+	}
+
+	if (-1 != loop->coalesceFd)
+	{
+		close(loop->coalesceFd);
+		loop->coalesceFd = -1;
+	}
+
+	DeleteBufferPool(&loop->connectionPool);
+	DeleteBufferPool(&loop->segmentPool);
+	DeleteBufferPool(&loop->bufferPool);
+}
+
+/**
+ * Receives a client socket handed over by the accept thread.
+ *
+ * @param fd handoff pipe read descriptor.
+ * @return client socket descriptor or -1 with errno.
+ */
+static int ReceiveHandoff(int fd)
+{
+	int clientSocket;
+
+	// Descriptors are written whole, that is atomic for a pipe
+	ssize_t readSize = read(fd, &clientSocket, sizeof(clientSocket));
+
+	if ((ssize_t) sizeof(clientSocket) == readSize)
+		return clientSocket;
+
+	// Pipe is only closed once the workers stopped
+	if (-1 != readSize)
+	{
+		errno = EAGAIN;
+	}
+
+	return -1;
+}
+
+/**
+ * Accepts the pending client connections on the server
+ * socket and adds them to the event loop. At most the accept
+ * budget is taken at once, so that a connection storm does
+ * not starve the established connections.
+ *
+ * @param sink log sink.
+ * @param loop event loop.
+ */
+static void AcceptConnections(
+		const struct EchoLogSink* sink,
+		struct EventLoop* loop)
+{
+	uint64_t accepted = 0;
+
+	// Edge triggered, the backlog has to be drained until EAGAIN
+	loop->acceptPending = true;
+
+	while (accepted < ACCEPT_BUDGET)
+	{
+		struct sockaddr_storage address;
+		socklen_t addressLength = sizeof(address);
+		int clientSocket;
+
+		TRACE_BEGIN(TRACE_ACCEPT);
+		if (loop->handoff)
+		{
+			// Accept thread already applied the profile
+			clientSocket = ReceiveHandoff(loop->serverSocket);
+			address.ss_family = AF_UNSPEC;
+		}
+		else
+		{
+#ifdef HAVE_ACCEPT4
+			// Client socket must not block the other connections
+			clientSocket = accept4(loop->serverSocket,
+					(struct sockaddr*) &address,
+					&addressLength,
+					SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+			clientSocket = accept(loop->serverSocket,
+					(struct sockaddr*) &address,
+					&addressLength);
+#endif
+		}
+		TRACE_END();
+
+		EchoAddStat(loop->stats, STAT_SYSCALLS, 1);
+
+		if (-1 == clientSocket)
+		{
+			if (EINTR == errno)
+				continue;
+
+			loop->acceptPending = false;
+
+			// Any other error only drops the pending connection
+			if ((EAGAIN != errno) && (EWOULDBLOCK != errno))
+			{
+				EchoLogErrno(sink, "Unable to accept connection:", errno);
+				EchoAddStat(loop->stats, STAT_DROPS, 1);
+			}
+			else
+			{
+				EchoAddStat(loop->stats, STAT_EAGAINS, 1);
+			}
+
+			break;
+		}
+
+		accepted++;
+
+		bool inet = (AF_INET == address.ss_family)
+				|| (AF_INET6 == address.ss_family);
+
+		if (inet)
+		{
+			EchoApplySocketProfile(sink, &loop->config->socket, clientSocket,
+					address.ss_family, SOCK_STREAM, SOCKET_ACCEPTED);
+		}
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+		// Log address, local clients are unnamed
+		if (inet)
+		{
+			EchoLogAddress(sink, LOG_LEVEL_DEBUG, "Client connection from ",
+					&address);
+		}
+		else if (!loop->handoff)
+		{
+			EchoLogDebug(sink, "Local client connection.");
+		}
+#endif
+
+#ifndef HAVE_ACCEPT4
+		// Client socket must not block the other connections
+		int result = EchoSetSocketNonBlocking(clientSocket);
+		if (result < 0)
+		{
+			EchoLogErrno(sink, "Unable to accept connection:", -result);
+			EchoAddStat(loop->stats, STAT_DROPS, 1);
+			close(clientSocket);
+			continue;
+		}
+#endif
+
+		// Acquire the connection state from the pool
+		struct Connection* connection = (struct Connection*) AcquireBuffer(
+				&loop->connectionPool);
+
+		if (NULL == connection)
+		{
+			EchoLog(sink, LOG_LEVEL_ERROR, "Unable to allocate connection.");
+			EchoAddStat(loop->stats, STAT_DROPS, 1);
+			close(clientSocket);
+			continue;
+		}
+
+		connection->sd = clientSocket;
+		connection->pendingSize = 0;
+		connection->outputHead = NULL;
+		connection->outputTail = NULL;
+		connection->queuedSize = 0;
+		connection->writable = true;
+		connection->peerClosed = false;
+		connection->frameHeader = 0;
+		connection->frameHeaderSize = 0;
+		connection->frameRemaining = 0;
+		connection->timer.prev = NULL;
+		connection->timer.next = NULL;
+		connection->arrivals.time = 0;
+		connection->arrivals.gap = 0;
+		connection->flushTime = 0;
+		connection->prevHeld = NULL;
+		connection->nextHeld = NULL;
+
+		if (NULL != loop->capture)
+		{
+			connection->captureId = EchoNewCaptureConnectionId(loop->capture);
+		}
+
+		// Pipe to splice the data through
+		if (!loop->zeroCopy || !NewPipe(connection->pipeFds))
+		{
+			connection->pipeFds[0] = -1;
+			connection->pipeFds[1] = -1;
+		}
+
+		// Watch for both directions, edge triggered
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = connection;
+
+		if (-1 == epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, clientSocket, &event))
+		{
+			EchoLogErrno(sink, "Unable to watch connection:", errno);
+			EchoAddStat(loop->stats, STAT_DROPS, 1);
+			close(clientSocket);
+			ClosePipe(connection->pipeFds);
+			ReleaseBuffer(&loop->connectionPool, connection);
+			continue;
+		}
+
+		// Link to the active connections
+		connection->prev = NULL;
+		connection->next = loop->connections;
+
+		if (NULL != loop->connections)
+		{
+			loop->connections->prev = connection;
+		}
+
+		loop->connections = connection;
+		loop->connectionCount++;
+		EchoAddStat(loop->stats, STAT_ACTIVE_CONNECTIONS, 1);
+
+		// Clients that never send are closed by the idle timeout
+		if (loop->timeouts)
+		{
+			UpdateConnectionTimer(loop, connection);
+		}
+	}
+
+	CountAccepts(loop->stats, accepted);
+}
+
+/**
+ * Receives into the free space of the given segment,
+ * keeping the descriptors passed with the data in the
+ * segment so that they are passed back with it.
+ *
+ * @param sink log sink.
+ * @param loop event loop.
+ * @param connection client connection.
+ * @param segment last output segment.
+ * @return received size or -1 with errno.
+ */
+static ssize_t ReceiveWithFds(
+		const struct EchoLogSink* sink,
+		struct EventLoop* loop,
+		struct Connection* connection,
+		struct OutputSegment* segment)
+{
+	struct iovec vector;
+	vector.iov_base = segment->buffer + segment->length;
+	vector.iov_len = loop->bufferPool.bufferSize - segment->length;
+
+	union EchoPassedFdsControl control;
+
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &vector;
+	message.msg_iovlen = 1;
+	message.msg_control = control.buffer;
+	message.msg_controllen = sizeof(control.buffer);
+
+	TRACE_BEGIN(TRACE_RECV);
+	ssize_t recvSize = recvmsg(connection->sd, &message, MSG_CMSG_CLOEXEC);
+	TRACE_END();
+
+	if (-1 == recvSize)
+		return -1;
+
+	for (struct cmsghdr* header = CMSG_FIRSTHDR(&message); NULL != header;
+			header = CMSG_NXTHDR(&message, header))
+	{
+		if ((SOL_SOCKET != header->cmsg_level)
+				|| (SCM_RIGHTS != header->cmsg_type))
+		{
+			continue;
+		}
+
+		int* fds = (int*) CMSG_DATA(header);
+		size_t fdCount = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+		for (size_t i = 0; i < fdCount; i++)
+		{
+			if (segment->fdCount < MAX_PASSED_FDS)
+			{
+				segment->fds[segment->fdCount++] = fds[i];
+			}
+			else
+			{
+				close(fds[i]);
+			}
+		}
+
+		// Later data goes to a new segment, so it is not sent before them
+		segment->sealed = true;
+	}
+
+	if (0 != (message.msg_flags & MSG_CTRUNC))
+	{
+		EchoLog(sink, LOG_LEVEL_ERROR, "Passed descriptors are truncated.");
+		EchoAddStat(loop->stats, STAT_DROPS, 1);
+	}
+
+	// Rest of a message bigger than the buffer is lost
+	if (0 != (message.msg_flags & MSG_TRUNC))
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	return recvSize;
+}
+
+/**
+ * Sends the output queue of the client connection back to
+ * the socket, gathering multiple segments into each call,
+ * until all is sent or the socket would block. Messages are
+ * sent one by one, and the passed descriptors go with the
+ * first byte of their segment.
+ *
+ * @param sink log sink.
+ * @param loop event loop.
+ * @param connection client connection.
+ * @return 1 if all is sent, 0 if would block, -1 if failed.
+ */
+static int FlushConnection(
+		const struct EchoLogSink* sink,
+		struct EventLoop* loop,
+		struct Connection* connection)
+{
+	while (NULL != connection->outputHead)
+	{
+		struct iovec vectors[MAX_OUTPUT_VECTORS];
+		size_t vectorCount = 0;
+		size_t vectorSize = 0;
+
+		// Gather the unsent part of the queued segments
+		for (struct OutputSegment* segment = connection->outputHead;
+				(NULL != segment) && (vectorCount < MAX_OUTPUT_VECTORS);
+				segment = segment->next)
+		{
+			if ((vectorCount > 0)
+					&& (loop->messages || (segment->fdCount > 0)))
+			{
+				break;
+			}
+
+			vectors[vectorCount].iov_base = segment->buffer + segment->offset;
+			vectors[vectorCount].iov_len = segment->length - segment->offset;
+			vectorSize += vectors[vectorCount].iov_len;
+			vectorCount++;
+		}
+
+		// Same as writev, but without raising SIGPIPE
+		struct msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = vectors;
+		message.msg_iovlen = vectorCount;
+
+		// Pass the descriptors received with the first segment
+		struct OutputSegment* head = connection->outputHead;
+		union EchoPassedFdsControl control;
+
+		if (head->fdCount > 0)
+		{
+			memset(&control, 0, sizeof(control));
+			message.msg_control = control.buffer;
+			message.msg_controllen = CMSG_SPACE(head->fdCount * sizeof(int));
+
+			struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+			header->cmsg_level = SOL_SOCKET;
+			header->cmsg_type = SCM_RIGHTS;
+			header->cmsg_len = CMSG_LEN(head->fdCount * sizeof(int));
+			memcpy(CMSG_DATA(header), head->fds, head->fdCount * sizeof(int));
+		}
+
+		TRACE_BEGIN(TRACE_SEND);
+		ssize_t sentSize = sendmsg(connection->sd, &message, MSG_NOSIGNAL);
+		TRACE_END();
+
+		EchoAddStat(loop->stats, STAT_SYSCALLS, 1);
+
+		if (-1 == sentSize)
+		{
+			if (EINTR == errno)
+				continue;
+
+			// Wait for the socket to become writable again
+			if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+			{
+				EchoAddStat(loop->stats, STAT_EAGAINS, 1);
+				connection->writable = false;
+				return 0;
+			}
+
+			EchoLogErrno(sink, "Unable to send:", errno);
+			return -1;
+		}
+
+		EchoLogDebug(sink, "Sent %zd bytes.", sentSize);
+		EchoAddStat(loop->stats, STAT_BYTES_OUT, (uint64_t) sentSize);
+
+		// Peer holds its own copies of the passed descriptors
+		for (int i = 0; i < head->fdCount; i++)
+		{
+			close(head->fds[i]);
+		}
+
+		head->fdCount = 0;
+
+		// Release the segments that are completely sent
+		size_t remaining = (size_t) sentSize;
+		while (NULL != connection->outputHead)
+		{
+			struct OutputSegment* segment = connection->outputHead;
+			size_t segmentSize = segment->length - segment->offset;
+
+			if (remaining < segmentSize)
+			{
+				segment->offset += remaining;
+				connection->queuedSize -= remaining;
+				break;
+			}
+
+			remaining -= segmentSize;
+			ReleaseOutputSegment(loop, connection);
+		}
+
+		// Short send means the socket buffer is full
+		if ((size_t) sentSize < vectorSize)
+		{
+			EchoAddStat(loop->stats, STAT_SHORT_WRITES, 1);
+			connection->writable = false;
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Arms the coalesce timer for the first held output.
+ *
+ * @param loop event loop.
+ */
+static void ArmCoalesceTimer(struct EventLoop* loop)
+{
+#ifdef HAVE_TIMERFD
+	// Zero disarms the timer
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+
+	if (NULL != loop->heldHead)
+	{
+		spec.it_value.tv_sec = (time_t) (loop->heldHead->flushTime
+				/ 1000000000ULL);
+		spec.it_value.tv_nsec = (long) (loop->heldHead->flushTime
+				% 1000000000ULL);
+	}
+
+	syscall(__NR_timerfd_settime, loop->coalesceFd, TFD_TIMER_ABSTIME,
+			&spec, NULL);
+#endif
+}
+
+/**
+ * Checks if the queued output of the connection is held to
+ * be sent with the data that follows. Output is held while
+ * the data arrives faster than the coalesce delay without
+ * waiting for the replies, until the coalesce size is queued
+ * or the delay passes since the first held byte.
+ *
+ * @param loop event loop.
+ * @param connection client connection.
+ * @return true if held.
+ */
+static bool HoldOutput(
+		struct EventLoop* loop,
+		struct Connection* connection)
+{
+	if ((0 == loop->coalesceDelay) || loop->messages
+			|| connection->peerClosed
+			|| (connection->queuedSize >= loop->coalesceSize)
+			|| !EchoIsArrivalFast(&connection->arrivals, loop->coalesceDelay))
+	{
+		ReleaseHeldOutput(loop, connection);
+		return false;
+	}
+
+	if (0 != connection->flushTime)
+		return true;
+
+	// Delays are the same, so the list stays in flush time order
+	connection->flushTime = connection->arrivals.time + loop->coalesceDelay;
+	connection->prevHeld = loop->heldTail;
+	connection->nextHeld = NULL;
+
+	if (NULL == loop->heldTail)
+	{
+		loop->heldHead = connection;
+		ArmCoalesceTimer(loop);
+	}
+	else
+	{
+		loop->heldTail->nextHeld = connection;
+	}
+
+	loop->heldTail = connection;
+
+	return true;
+}
+
+/**
+ * Sends the held output that is due, and arms the coalesce
+ * timer for the rest.
+ *
+ * @param sink log sink.
+ * @param loop event loop.
+ */
+static void FlushHeldConnections(
+		const struct EchoLogSink* sink,
+		struct EventLoop* loop)
+{
+	uint64_t expirations;
+
+	// Level triggered, the expirations have to be read
+	while (-1 == read(loop->coalesceFd, &expirations, sizeof(expirations)))
+	{
+		if (EINTR == errno)
+			continue;
+
+		// Already read, or the timer was re-armed since it fired
+		if ((EAGAIN != errno) && (EWOULDBLOCK != errno))
+		{
+			EchoLogErrno(sink, "Unable to read the coalesce timer:", errno);
+		}
+
+		break;
+	}
+
+	uint64_t now = EchoGetMonotonicTime();
+
+	while ((NULL != loop->heldHead) && (loop->heldHead->flushTime <= now))
+	{
+		struct Connection* connection = loop->heldHead;
+
+		EchoEndHold(&connection->arrivals,
+				connection->flushTime - loop->coalesceDelay);
+		ReleaseHeldOutput(loop, connection);
+
+		// Blocked output is sent once the socket becomes writable
+		if (!connection->writable)
+			continue;
+
+		if (-1 == FlushConnection(sink, loop, connection))
+		{
+			CloseConnection(sink, loop, connection);
+		}
+		else if (loop->timeouts)
+		{
+			UpdateConnectionTimer(loop, connection);
+		}
+	}
+
+	ArmCoalesceTimer(loop);
+}
+
+#ifdef HAVE_SPLICE
+/**
+ * Moves the data from the client connection back to itself
+ * through the connection pipe without copying it to the
+ * user space, until the socket would block.
+ *
+ * @param sink log sink.
+ * @param loop event loop.
+ * @param connection client connection.
+ * @return 1 if connection is still open, 0 if closed,
+ *         -1 if splice is not supported.
+ */
+static int SpliceConnection(
+		const struct EchoLogSink* sink,
+		struct EventLoop* loop,
+		struct Connection* connection)
+{
+	while (1)
+	{
+		// Data in the pipe must be sent back before receiving more
+		while (connection->pendingSize > 0)
+		{
+			TRACE_BEGIN(TRACE_SPLICE);
+			ssize_t sentSize = splice(connection->pipeFds[0], NULL,
+					connection->sd, NULL, connection->pendingSize,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			TRACE_END();
+
+			EchoAddStat(loop->stats, STAT_SYSCALLS, 1);
+
+			if (-1 == sentSize)
+			{
+				if (EINTR == errno)
+					continue;
+
+				// Wait for the socket to become writable again
+				if (EAGAIN == errno)
+				{
+					EchoAddStat(loop->stats, STAT_EAGAINS, 1);
+					return 1;
+				}
+
+				EchoLogErrno(sink, "Unable to send:", errno);
+				return 0;
+			}
+
+			EchoLogDebug(sink, "Spliced %zd bytes out.", sentSize);
+			EchoAddStat(loop->stats, STAT_BYTES_OUT, (uint64_t) sentSize);
+
+			if ((size_t) sentSize < connection->pendingSize)
+			{
+				EchoAddStat(loop->stats, STAT_SHORT_WRITES, 1);
+			}
+
+			connection->pendingSize -= sentSize;
+		}
+
+		// Server is stopped, nothing more is received
+		if (connection->peerClosed)
+			return 0;
+
+		// Move the received data into the pipe
+		TRACE_BEGIN(TRACE_SPLICE);
+		ssize_t recvSize = splice(connection->sd, NULL,
+				connection->pipeFds[1], NULL, PIPE_SIZE,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		TRACE_END();
+
+		EchoAddStat(loop->stats, STAT_SYSCALLS, 1);
+
+		if (-1 == recvSize)
+		{
+			if (EINTR == errno)
+				continue;
+
+			// Wait for more data to arrive
+			if (EAGAIN == errno)
+			{
+				EchoAddStat(loop->stats, STAT_EAGAINS, 1);
+				return 1;
+			}
+
+			// Nothing is moved yet, copying can take over
+			if ((EINVAL == errno) || (ENOSYS == errno))
+				return -1;
+
+			EchoLogErrno(sink, "Unable to receive:", errno);
+			return 0;
+		}
+
+		if (0 == recvSize)
+		{
+			EchoLog(sink, LOG_LEVEL_INFO, "Client disconnected.");
+			return 0;
+		}
+
+		EchoLogDebug(sink, "Spliced %zd bytes in.", recvSize);
+		EchoAddStat(loop->stats, STAT_BYTES_IN, (uint64_t) recvSize);
+		connection->pendingSize = (size_t) recvSize;
+	}
+}
+#endif
+
+/**
+ * Follows the length prefixed frames in the received data.
+ * Data is echoed as is so the frame boundaries are preserved,
+ * only the frame sizes are checked.
+ *
+ * @param connection client connection.
+ * @param data received data.
+ * @param size received size.
+ * @param maxFrameSize max frame payload size.
+ * @param now current tick.
+ * @return false if a frame is too large.
+ */
+static bool ParseFrames(
+		struct Connection* connection,
+		const char* data,
+		size_t size,
+		size_t maxFrameSize,
+		uint64_t now)
+{
+	while (size > 0)
+	{
+		// Skip over the frame payload
+		if (connection->frameRemaining > 0)
+		{
+			size_t part = (size < connection->frameRemaining) ? size
+					: connection->frameRemaining;
+
+			connection->frameRemaining -= part;
+			data += part;
+			size -= part;
+			continue;
+		}
+
+		// Read timeout counts from the first byte of the frame
+		if (0 == connection->frameHeaderSize)
+		{
+			connection->frameStarted = now;
+		}
+
+		// Collect the length prefix a byte at a time
+		connection->frameHeader = (connection->frameHeader << 8)
+				| (unsigned char) *data;
+		connection->frameHeaderSize++;
+		data++;
+		size--;
+
+		if (FRAME_HEADER_SIZE == connection->frameHeaderSize)
+		{
+			if (connection->frameHeader > maxFrameSize)
+				return false;
+
+			connection->frameRemaining = connection->frameHeader;
+			connection->frameHeader = 0;
+			connection->frameHeaderSize = 0;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Receives data from the client connection into its output
+ * queue and sends the queue back, until the socket would block
+ * or the queue reaches the high-water mark. Reading resumes
+ * when the queue drains after the socket becomes writable.
+ *
+ * @param sink log sink.
+ * @param loop event loop.
+ * @param connection client connection.
+ * @param events epoll events.
+ * @return true if connection is still open.
+ */
+static bool ServeConnection(
+		const struct EchoLogSink* sink,
+		struct EventLoop* loop,
+		struct Connection* connection,
+		uint32_t events)
+{
+#ifdef HAVE_SPLICE
+	if (-1 != connection->pipeFds[0])
+	{
+		int result = SpliceConnection(sink, loop, connection);
+		if (-1 != result)
+			return (1 == result);
+
+		EchoLog(sink, LOG_LEVEL_INFO,
+				"splice is not supported, copying the data.");
+		ClosePipe(connection->pipeFds);
+		loop->zeroCopy = false;
+	}
+#endif
+
+	if (0 != (events & EPOLLOUT))
+	{
+		connection->writable = true;
+	}
+
+	// Coalescing loops receive all that arrived before they send
+	// it back, so that the data arriving behind queued data is seen
+	bool readAhead = (0 != loop->coalesceDelay) && !loop->messages;
+	bool drained = false;
+
+	while (1)
+	{
+		// Send back the queued data while the socket takes it,
+		// unless it is held to coalesce it with the data that follows
+		if (connection->writable && (NULL != connection->outputHead)
+				&& (!readAhead || drained || connection->peerClosed
+						|| (connection->queuedSize >= loop->highWaterMark))
+				&& !HoldOutput(loop, connection))
+		{
+			if (-1 == FlushConnection(sink, loop, connection))
+				return false;
+		}
+
+		// Close once everything is echoed after the client shut down
+		if (connection->peerClosed)
+			return (NULL != connection->outputHead);
+
+		// Everything that arrived is sent or queued
+		if (drained)
+			return true;
+
+		// Stop reading until the queue drains below the high-water mark
+		if (connection->queuedSize >= loop->highWaterMark)
+			return true;
+
+		// Receive into the free space of the last segment
+		struct OutputSegment* segment = connection->outputTail;
+		if ((NULL == segment) || segment->sealed
+				|| (segment->length == loop->bufferPool.bufferSize))
+		{
+			segment = AppendOutputSegment(loop, connection);
+			if (NULL == segment)
+			{
+				EchoLog(sink, LOG_LEVEL_ERROR,
+						"Unable to allocate output segment.");
+				EchoAddStat(loop->stats, STAT_DROPS, 1);
+				return false;
+			}
+		}
+
+		ssize_t recvSize;
+
+		if (loop->passFds)
+		{
+			recvSize = ReceiveWithFds(sink, loop, connection, segment);
+		}
+		else
+		{
+			TRACE_BEGIN(TRACE_RECV);
+			recvSize = recv(connection->sd,
+					segment->buffer + segment->length,
+					loop->bufferPool.bufferSize - segment->length, 0);
+			TRACE_END();
+		}
+
+		EchoAddStat(loop->stats, STAT_SYSCALLS, 1);
+
+		// Idle connections do not hold a buffer, an empty segment
+		// behind the others is released once they are sent
+		if ((recvSize <= 0) && (0 == segment->length)
+				&& (connection->outputHead == segment))
+		{
+			ReleaseOutputSegment(loop, connection);
+		}
+
+		if (-1 == recvSize)
+		{
+			if (EINTR == errno)
+				continue;
+
+			// Wait for more data to arrive
+			if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+			{
+				EchoAddStat(loop->stats, STAT_EAGAINS, 1);
+				if (!readAhead)
+					return true;
+
+				drained = true;
+				continue;
+			}
+
+			EchoLogErrno(sink, "Unable to receive:", errno);
+			return false;
+		}
+
+		if (0 == recvSize)
+		{
+			EchoLog(sink, LOG_LEVEL_INFO, "Client disconnected.");
+			connection->peerClosed = true;
+			continue;
+		}
+
+		EchoAddStat(loop->stats, STAT_BYTES_IN, (uint64_t) recvSize);
+
+		EchoLogDebug(sink, "Received %zd bytes: %.*s", recvSize,
+				(int) recvSize, segment->buffer + segment->length);
+
+		if (0 != loop->coalesceDelay)
+		{
+			EchoRecordArrival(&connection->arrivals, EchoGetMonotonicTime(),
+					loop->coalesceDelay, 0 != connection->queuedSize);
+		}
+
+		if (NULL != loop->capture)
+		{
+			EchoCaptureData(loop->capture, connection->captureId,
+					segment->buffer + segment->length, (size_t) recvSize);
+		}
+
+		if ((0 != loop->maxFrameSize) && !ParseFrames(connection,
+				segment->buffer + segment->length, (size_t) recvSize,
+				loop->maxFrameSize, loop->now))
+		{
+			EchoLog(sink, LOG_LEVEL_ERROR, "Frame exceeds the max frame size.");
+			EchoAddStat(loop->stats, STAT_DROPS, 1);
+			return false;
+		}
+
+		segment->length += (size_t) recvSize;
+		connection->queuedSize += (size_t) recvSize;
+
+		// Next message goes to a new segment
+		if (loop->messages)
+		{
+			segment->sealed = true;
+		}
+	}
+}
+
+/**
+ * Stops the event loop from accepting and receiving. The
+ * connections are treated as shut down by the clients, and
+ * they are closed once their queued data is sent.
+ *
+ * @param sink log sink.
+ * @param loop event loop.
+ */
+static void StopEventLoop(
+		const struct EchoLogSink* sink,
+		struct EventLoop* loop)
+{
+	EchoLog(sink, LOG_LEVEL_INFO, "Stopping, draining %zu connections...",
+			loop->connectionCount);
+
+	loop->stopping = true;
+	loop->drainDeadline = GetDrainDeadline(loop->config);
+	loop->acceptPending = false;
+
+	// Server socket is owned by the caller, only stop watching it
+	epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, loop->serverSocket, NULL);
+	epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, loop->stopFd, NULL);
+
+	struct Connection* connection = loop->connections;
+
+	while (NULL != connection)
+	{
+		// Connection may be closed while serving it
+		struct Connection* next = connection->next;
+
+		connection->peerClosed = true;
+
+		if (!ServeConnection(sink, loop, connection, 0))
+		{
+			CloseConnection(sink, loop, connection);
+		}
+
+		connection = next;
+	}
+}
+
+/**
+ * Runs the event loop, accepting new connections and serving
+ * the active ones, until a fatal error occurs or the server
+ * is stopped and the connections are drained.
+ *
+ * @param sink log sink.
+ * @param loop event loop.
+ * @return zero or negative error number.
+ */
+static int RunEventLoop(
+		const struct EchoLogSink* sink,
+		struct EventLoop* loop)
+{
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+
+	EchoLog(sink, LOG_LEVEL_INFO, "Waiting for client connections...");
+
+	while (!loop->stopping || (loop->connectionCount > 0))
+	{
+		int timeout = -1;
+
+		// Wait for the queued data only until the deadline
+		if (loop->stopping)
+		{
+			uint64_t now = EchoGetMonotonicTime();
+			if (now >= loop->drainDeadline)
+			{
+				EchoLog(sink, LOG_LEVEL_INFO,
+						"Drain timed out, closing %zu connections.",
+						loop->connectionCount);
+				break;
+			}
+
+			timeout = (int) ((loop->drainDeadline - now + 999999ULL)
+					/ 1000000ULL);
+		}
+
+		// Wake up for the next connection timer
+		if (0 != loop->timers.count)
+		{
+			int timerTimeout = GetTimerTimeout(&loop->timers,
+					EchoGetMonotonicTime());
+
+			if ((-1 == timeout) || (timerTimeout < timeout))
+			{
+				timeout = timerTimeout;
+			}
+		}
+
+		// Only poll if the backlog is still to be drained
+		if (loop->acceptPending)
+		{
+			timeout = 0;
+		}
+
+		// Block and wait for events
+		TRACE_BEGIN(TRACE_EPOLL_WAIT);
+		int eventCount = epoll_wait(loop->epollFd, events,
+				MAX_EPOLL_EVENTS, timeout);
+		TRACE_END();
+
+		EchoAddStat(loop->stats, STAT_SYSCALLS, 1);
+
+		if (-1 == eventCount)
+		{
+			if (EINTR == errno)
+				continue;
+
+			return -errno;
+		}
+
+		if (loop->timeouts)
+		{
+			loop->now = GetTimerTick();
+		}
+
+		bool stopped = false;
+		bool accepted = false;
+		bool flushHeld = false;
+
+		for (int i = 0; i < eventCount; i++)
+		{
+			struct Connection* connection =
+					(struct Connection*) events[i].data.ptr;
+
+			// Listening socket has pending connections
+			if (NULL == connection)
+			{
+				AcceptConnections(sink, loop);
+				accepted = true;
+			}
+			else if ((void*) loop == (void*) connection)
+			{
+				// Stop after the batch, it may refer to the connections
+				stopped = true;
+			}
+			else if ((void*) &loop->coalesceFd == (void*) connection)
+			{
+				// Flush after the batch, it may refer to the connections
+				flushHeld = true;
+			}
+			else if (!ServeConnection(sink, loop, connection,
+					events[i].events))
+			{
+				CloseConnection(sink, loop, connection);
+			}
+			else if (loop->timeouts)
+			{
+				UpdateConnectionTimer(loop, connection);
+			}
+		}
+
+		// Rest of the backlog gets its turn after the connections
+		if (loop->acceptPending && !accepted)
+		{
+			AcceptConnections(sink, loop);
+		}
+
+		if (flushHeld)
+		{
+			FlushHeldConnections(sink, loop);
+		}
+
+		// Expire after the batch, it may refer to the connections
+		if (0 != loop->timers.count)
+		{
+			ExpireConnections(sink, loop);
+		}
+
+		if (stopped && !loop->stopping)
+		{
+			StopEventLoop(sink, loop);
+		}
+	}
+
+	EchoLog(sink, LOG_LEVEL_INFO, "Server stopped.");
+
+	return 0;
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * Client connection served by an io_uring loop. Data is
+ * received into the provided buffers and echoed straight
+ * from them, the connection only keeps the buffer IDs.
+ */
+struct UringConnection
+{
+	// Client socket descriptor
+	int sd;
+
+	// Operations submitted and not completed yet
+	int pendingOps;
+
+	// Receive is submitted
+	bool receiving;
+
+	// Receive is stopped until the buffers are returned
+	bool starved;
+
+	// Receive is stopped until the queued data is sent
+	bool throttled;
+
+	// Peer closed its side, close once the queued data is sent
+	bool peerClosed;
+
+	// Connection is closing, free once the operations complete
+	bool closing;
+
+	// Socket is shut down so that the pending operations complete
+	bool shutDown;
+
+	// Received buffers in order, the first ones are being sent
+	int queuedHead;
+	int queuedTail;
+
+	// Number of queued buffers in the submitted send chain
+	int sendingCount;
+
+	// Bytes queued for the connection
+	size_t queuedSize;
+
+	// Active connections list links
+	struct UringConnection* prev;
+	struct UringConnection* next;
+
+	// Closes the connection once it stays idle or stalled
+	struct Timer timer;
+};
+
+/**
+ * Completion based event loop. Accepts and receives are
+ * multishot, receives pick the data buffers from a ring
+ * provided to the kernel, and all operations queued while
+ * handling the completions go out with a single enter.
+ */
+struct UringLoop
+{
+	// io_uring instance descriptor
+	int ringFd;
+
+	// Listening socket descriptor, owned by the caller
+	int serverSocket;
+
+	// Submission and completion rings in a single mapping
+	void* rings;
+	size_t ringsSize;
+
+	// Submission queue entries
+	struct io_uring_sqe* sqes;
+	size_t sqesSize;
+
+	// Submission ring
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned* sqArray;
+	unsigned sqMask;
+	unsigned sqEntries;
+
+	// Entries queued since the last enter
+	unsigned sqPending;
+
+	// Completion ring
+	unsigned* cqHead;
+	unsigned* cqTail;
+	struct io_uring_cqe* cqes;
+	unsigned cqMask;
+
+	// Ring of the receive buffers provided to the kernel
+	struct io_uring_buf_ring* bufferRing;
+	size_t bufferRingSize;
+	unsigned short bufferTail;
+
+	// Receive buffers, indexed by the buffer ID
+	char* buffers;
+	size_t bufferSize;
+
+	// Received length and next queued buffer, by buffer ID
+	unsigned* bufferLengths;
+	int* bufferLinks;
+
+	// Buffers were returned while handling the completions
+	bool buffersReturned;
+
+	// Connections waiting for the returned buffers
+	size_t starvedCount;
+
+	// Multishot accept is submitted
+	bool accepting;
+
+	// Kernel supports the multishot accept and receive
+	bool multishotAccept;
+	bool multishotReceive;
+
+	// Active connections
+	struct UringConnection* connections;
+	size_t connectionCount;
+
+	// Connection states come from the pool
+	struct BufferPool connectionPool;
+
+	// Bytes queued for a connection before receiving stops
+	size_t highWaterMark;
+
+	// Descriptor that becomes readable when the server is stopped, or -1
+	int stopFd;
+
+	// Server is stopped, connections close once their data is sent
+	bool stopping;
+
+	// Drain timeout expired, remaining connections are closed
+	bool drainExpired;
+
+	// Drain timeout, read by the kernel on submit
+	struct __kernel_timespec drainTimeout;
+
+	// Connection timeouts in ticks, zero if disabled
+	uint64_t idleTimeout;
+	uint64_t writeTimeout;
+
+	// Any of the connection timeouts is enabled
+	bool timeouts;
+
+	// Tick of the last wake up, the timers are armed from it
+	uint64_t now;
+
+	// Connection timers
+	struct TimerWheel timers;
+
+	// Worker counters
+	struct EchoWorkerStats* stats;
+
+	// Server configuration
+	const struct EchoConfig* config;
+};
+
+/**
+ * Sets up a new io_uring instance.
+ *
+ * @param entries number of submission queue entries.
+ * @param params instance parameters.
+ * @return instance descriptor or -1 with errno.
+ */
+static int UringSetup(unsigned entries, struct io_uring_params* params)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+/**
+ * Submits the queued entries and waits for the completions.
+ *
+ * @param fd instance descriptor.
+ * @param toSubmit number of entries to submit.
+ * @param minComplete number of completions to wait for.
+ * @param flags enter flags.
+ * @param arg signal mask or extended argument, or NULL.
+ * @param argSize argument size.
+ * @return number of entries submitted or -1 with errno.
+ */
+static int UringEnter(
+		int fd,
+		unsigned toSubmit,
+		unsigned minComplete,
+		unsigned flags,
+		void* arg,
+		size_t argSize)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete,
+			flags, arg, argSize);
+}
+
+/**
+ * Registers resources with the io_uring instance.
+ *
+ * @param fd instance descriptor.
+ * @param opcode register operation.
+ * @param arg operation argument.
+ * @param count number of argument elements.
+ * @return zero or -1 with errno.
+ */
+static int UringRegister(int fd, unsigned opcode, void* arg, unsigned count)
+{
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/**
+ * Submits the queued entries to the kernel, optionally
+ * waiting for the given number of completions.
+ *
+ * @param loop io_uring loop.
+ * @param minComplete number of completions to wait for.
+ * @param timeout wait timeout in ms, or -1 to wait forever.
+ * @return number of entries submitted or -1 with errno,
+ *         ETIME if the wait timed out.
+ */
+static int EnterUringLoop(
+		struct UringLoop* loop,
+		unsigned minComplete,
+		int timeout)
+{
+	unsigned flags = (minComplete > 0) ? IORING_ENTER_GETEVENTS : 0;
+	int result;
+
+	if ((minComplete > 0) && (timeout >= 0))
+	{
+		struct __kernel_timespec ts;
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (long long) (timeout % 1000) * 1000000LL;
+
+		struct io_uring_getevents_arg arg;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (uint64_t) (uintptr_t) &ts;
+
+		TRACE_BEGIN(TRACE_URING_ENTER);
+		result = UringEnter(loop->ringFd, loop->sqPending, minComplete,
+				flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+		TRACE_END();
+	}
+	else
+	{
+		TRACE_BEGIN(TRACE_URING_ENTER);
+		result = UringEnter(loop->ringFd, loop->sqPending, minComplete,
+				flags, NULL, 0);
+		TRACE_END();
+	}
+
+	EchoAddStat(loop->stats, STAT_SYSCALLS, 1);
+
+	if (result > 0)
+	{
+		loop->sqPending -= (unsigned) result;
+	}
+
+	return result;
+}
+
+/**
+ * Gets the number of free submission queue entries.
+ *
+ * @param loop io_uring loop.
+ * @return number of free entries.
+ */
+static unsigned GetUringSpace(struct UringLoop* loop)
+{
+	unsigned head = __atomic_load_n(loop->sqHead, __ATOMIC_ACQUIRE);
+
+	return loop->sqEntries - (*loop->sqTail - head);
+}
+
+/**
+ * Gets the next cleared submission queue entry. The queue
+ * is submitted first if it is full. There is no polling
+ * thread, the kernel reads the entries only on enter.
+ *
+ * @param loop io_uring loop.
+ * @return entry or NULL if the queue cannot be submitted.
+ */
+static struct io_uring_sqe* GetUringEntry(struct UringLoop* loop)
+{
+	if ((0 == GetUringSpace(loop))
+			&& ((-1 == EnterUringLoop(loop, 0, -1))
+					|| (0 == GetUringSpace(loop))))
+	{
+		return NULL;
+	}
+
+	unsigned tail = *loop->sqTail;
+	unsigned index = tail & loop->sqMask;
+
+	struct io_uring_sqe* sqe = &loop->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+	loop->sqArray[index] = index;
+	__atomic_store_n(loop->sqTail, tail + 1, __ATOMIC_RELEASE);
+	loop->sqPending++;
+
+	return sqe;
+}
+
+/**
+ * Gets the user data for the given connection operation.
+ *
+ * @param connection client connection or NULL.
+ * @param op operation kind.
+ * @return user data.
+ */
+static uint64_t GetUringUserData(struct UringConnection* connection, int op)
+{
+	return (uint64_t) (uintptr_t) connection | (uint64_t) op;
+}
+
+/**
+ * Returns the given receive buffer to the kernel.
+ *
+ * @param loop io_uring loop.
+ * @param bid buffer ID.
+ */
+static void ReturnUringBuffer(struct UringLoop* loop, int bid)
+{
+	// Flexible array member is offset in C++, index the ring directly
+	struct io_uring_buf* buf = (struct io_uring_buf*) loop->bufferRing
+			+ (loop->bufferTail & (URING_BUFFER_COUNT - 1));
+
+	buf->addr = (uint64_t) (uintptr_t) (loop->buffers
+			+ (size_t) bid * loop->bufferSize);
+	buf->len = (unsigned) loop->bufferSize;
+	buf->bid = (unsigned short) bid;
+
+	// Publish the buffer after its entry is written
+	loop->bufferTail++;
+	__atomic_store_n(&loop->bufferRing->tail, loop->bufferTail,
+			__ATOMIC_RELEASE);
+
+	loop->buffersReturned = true;
+}
+
+/**
+ * Removes the first buffer of the connection queue and
+ * returns it to the kernel.
+ *
+ * @param loop io_uring loop.
+ * @param connection client connection.
+ */
+static void PopUringBuffer(
+		struct UringLoop* loop,
+		struct UringConnection* connection)
+{
+	int bid = connection->queuedHead;
+
+	connection->queuedHead = loop->bufferLinks[bid];
+	if (-1 == connection->queuedHead)
+	{
+		connection->queuedTail = -1;
+	}
+
+	connection->queuedSize -= loop->bufferLengths[bid];
+
+	ReturnUringBuffer(loop, bid);
+}
+
+/**
+ * Deletes the io_uring loop by closing all active client
+ * connections, the io_uring instance, and releasing the
+ * buffers. The server socket is owned by the caller.
+ * Nothing is logged since an exception may be pending.
+ *
+ * @param loop io_uring loop.
+ */
+static void DeleteUringLoop(struct UringLoop* loop)
+{
+	// Sockets are closed first so that no receive is in progress
+	while (NULL != loop->connections)
+	{
+		struct UringConnection* connection = loop->connections;
+		loop->connections = connection->next;
+
+		close(connection->sd);
+		EchoAddStat(loop->stats, STAT_ACTIVE_CONNECTIONS, (uint64_t) -1);
+	}
+
+	loop->connectionCount = 0;
+
+	if (-1 != loop->ringFd)
+	{
+		close(loop->ringFd);
+		loop->ringFd = -1;
+	}
+
+	if (NULL != loop->rings)
+	{
+		munmap(loop->rings, loop->ringsSize);
+		loop->rings = NULL;
+	}
+
+	if (NULL != loop->sqes)
+	{
+		munmap(loop->sqes, loop->sqesSize);
+		loop->sqes = NULL;
+	}
+
+	if (NULL != loop->bufferRing)
+	{
+		munmap(loop->bufferRing, loop->bufferRingSize);
+		loop->bufferRing = NULL;
+	}
+
+	free(loop->buffers);
+	loop->buffers = NULL;
+
+	free(loop->bufferLengths);
+	loop->bufferLengths = NULL;
+
+	free(loop->bufferLinks);
+	loop->bufferLinks = NULL;
+
+	DeleteBufferPool(&loop->connectionPool);
+}
+
+/**
+ * Submits the accept on the server socket.
+ *
+ * @param loop io_uring loop.
+ * @return true if submitted.
+ */
+static bool AcceptUring(struct UringLoop* loop)
+{
+	struct io_uring_sqe* sqe = GetUringEntry(loop);
+	if (NULL == sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = loop->serverSocket;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = GetUringUserData(NULL, URING_OP_ACCEPT);
+
+	if (loop->multishotAccept)
+	{
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	}
+
+	loop->accepting = true;
+
+	return true;
+}
+
+/**
+ * Submits the receive on the client connection. The kernel
+ * picks the buffer from the provided buffer ring.
+ *
+ * @param loop io_uring loop.
+ * @param connection client connection.
+ * @return true if submitted.
+ */
+static bool ReceiveUring(
+		struct UringLoop* loop,
+		struct UringConnection* connection)
+{
+	struct io_uring_sqe* sqe = GetUringEntry(loop);
+	if (NULL == sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = connection->sd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = GetUringUserData(connection, URING_OP_RECEIVE);
+
+	if (loop->multishotReceive)
+	{
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+	}
+
+	connection->receiving = true;
+	connection->pendingOps++;
+
+	return true;
+}
+
+/**
+ * Cancels the multishot receive on the client connection.
+ *
+ * @param loop io_uring loop.
+ * @param connection client connection.
+ * @return true if submitted.
+ */
+static bool CancelUringReceive(
+		struct UringLoop* loop,
+		struct UringConnection* connection)
+{
+	struct io_uring_sqe* sqe = GetUringEntry(loop);
+	if (NULL == sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = GetUringUserData(connection, URING_OP_RECEIVE);
+	sqe->user_data = GetUringUserData(connection, URING_OP_CANCEL);
+
+	connection->pendingOps++;
+
+	return true;
+}
+
+/**
+ * Submits the poll for the stop request.
+ *
+ * @param loop io_uring loop.
+ * @return true if submitted.
+ */
+static bool PollUringStop(struct UringLoop* loop)
+{
+	struct io_uring_sqe* sqe = GetUringEntry(loop);
+	if (NULL == sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = loop->stopFd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = GetUringUserData(NULL, URING_OP_STOP);
+
+	return true;
+}
+
+/**
+ * Submits the timeout for draining the connections.
+ *
+ * @param loop io_uring loop.
+ * @return true if submitted.
+ */
+static bool SubmitUringDrainTimeout(struct UringLoop* loop)
+{
+	struct io_uring_sqe* sqe = GetUringEntry(loop);
+	if (NULL == sqe)
+		return false;
+
+	loop->drainTimeout.tv_sec = loop->config->drainTimeout / 1000;
+	loop->drainTimeout.tv_nsec = (long long) (loop->config->drainTimeout
+			% 1000) * 1000000LL;
+
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uint64_t) (uintptr_t) &loop->drainTimeout;
+	sqe->len = 1;
+	sqe->user_data = GetUringUserData(NULL, URING_OP_STOP);
+
+	return true;
+}
+
+/**
+ * Submits the queued buffers of the client connection as
+ * a linked send chain, so that they go out in order. Only
+ * one chain is in flight at a time.
+ *
+ * @param loop io_uring loop.
+ * @param connection client connection.
+ * @return true if submitted or nothing to send.
+ */
+static bool SendUring(
+		struct UringLoop* loop,
+		struct UringConnection* connection)
+{
+	if ((connection->sendingCount > 0) || (-1 == connection->queuedHead))
+		return true;
+
+	int count = 0;
+	for (int bid = connection->queuedHead;
+			(-1 != bid) && (count < MAX_OUTPUT_VECTORS);
+			bid = loop->bufferLinks[bid])
+	{
+		count++;
+	}
+
+	// Chain must not be split across two submissions
+	if ((GetUringSpace(loop) < (unsigned) count)
+			&& (-1 == EnterUringLoop(loop, 0, -1)))
+	{
+		return false;
+	}
+
+	int bid = connection->queuedHead;
+
+	for (int i = 0; i < count; i++)
+	{
+		struct io_uring_sqe* sqe = GetUringEntry(loop);
+		if (NULL == sqe)
+			return false;
+
+		// Wait all, a short send would break the chain
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = connection->sd;
+		sqe->addr = (uint64_t) (uintptr_t) (loop->buffers
+				+ (size_t) bid * loop->bufferSize);
+		sqe->len = loop->bufferLengths[bid];
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		sqe->user_data = GetUringUserData(connection, URING_OP_SEND);
+
+		if (i + 1 < count)
+		{
+			sqe->flags = IOSQE_IO_LINK;
+		}
+
+		connection->sendingCount++;
+		connection->pendingOps++;
+
+		bid = loop->bufferLinks[bid];
+	}
+
+	return true;
+}
+
+/**
+ * Constructs a new io_uring loop for the given server
+ * socket. The epoll loop is used instead if io_uring is
+ * disabled, or if the kernel does not support it.
+ *
+ * @param sink log sink.
+ * @param config server configuration, kept by the loop.
+ * @param loop io_uring loop.
+ * @param serverSocket server socket descriptor.
+ * @param stats worker counters.
+ * @param stopFd stop descriptor or -1 if not stoppable.
+ * @return one if constructed, zero if the epoll loop is to be
+ *         used, or -ENOMEM.
+ */
+static int NewUringLoop(
+		const struct EchoLogSink* sink,
+		const struct EchoConfig* config,
+		struct UringLoop* loop,
+		int serverSocket,
+		struct EchoWorkerStats* stats,
+		int stopFd)
+{
+	memset(loop, 0, sizeof(struct UringLoop));
+	loop->ringFd = -1;
+	loop->serverSocket = serverSocket;
+	loop->stopFd = stopFd;
+	loop->stats = stats;
+	loop->config = config;
+	loop->highWaterMark = config->highWaterMark;
+	loop->idleTimeout = GetTimeoutTicks(config->idleTimeout);
+	loop->writeTimeout = GetTimeoutTicks(config->writeTimeout);
+	loop->timeouts = (0 != loop->idleTimeout) || (0 != loop->writeTimeout);
+	loop->now = GetTimerTick();
+	InitTimerWheel(&loop->timers, loop->now);
+
+	// Frames, splice, coalescing and captures are only handled by
+	// the epoll loop
+	if (!config->ioUring || config->framing || config->zeroCopy
+			|| (0 != config->socket.coalesceDelay)
+			|| ('\0' != config->capturePath[0]))
+		return 0;
+
+	EchoLog(sink, LOG_LEVEL_INFO, "Constructing a new io_uring loop...");
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+#ifdef IORING_SETUP_COOP_TASKRUN
+	// Completions are only reaped on enter, no interrupts needed.
+	// Not single issuer, the ring is set up on another thread.
+	params.flags = IORING_SETUP_COOP_TASKRUN;
+#endif
+
+	loop->ringFd = UringSetup(URING_ENTRIES, &params);
+
+	// Older kernels reject the setup flags
+	if ((-1 == loop->ringFd) && (EINVAL == errno))
+	{
+		memset(&params, 0, sizeof(params));
+		loop->ringFd = UringSetup(URING_ENTRIES, &params);
+	}
+
+	if (-1 == loop->ringFd)
+	{
+		EchoLogErrno(sink, "io_uring is not supported, using epoll:", errno);
+		return 0;
+	}
+
+	if (0 == (params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		EchoLog(sink, LOG_LEVEL_ERROR,
+				"io_uring needs a single ring mapping.");
+		DeleteUringLoop(loop);
+		return 0;
+	}
+
+	// Timers need the completions to be waited for with a timeout
+	if (loop->timeouts && (0 == (params.features & IORING_FEAT_EXT_ARG)))
+	{
+		EchoLog(sink, LOG_LEVEL_INFO,
+				"io_uring cannot wait with a timeout, using epoll.");
+		DeleteUringLoop(loop);
+		return 0;
+	}
+
+	// Map the submission and completion rings together
+	size_t sqRingSize = params.sq_off.array
+			+ params.sq_entries * sizeof(unsigned);
+	size_t cqRingSize = params.cq_off.cqes
+			+ params.cq_entries * sizeof(struct io_uring_cqe);
+
+	loop->ringsSize = (sqRingSize > cqRingSize) ? sqRingSize : cqRingSize;
+	loop->rings = mmap(NULL, loop->ringsSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, loop->ringFd, IORING_OFF_SQ_RING);
+
+	if (MAP_FAILED == loop->rings)
+	{
+		loop->rings = NULL;
+		EchoLogErrno(sink, "Unable to map io_uring:", errno);
+		DeleteUringLoop(loop);
+		return 0;
+	}
+
+	loop->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	void* sqes = mmap(NULL, loop->sqesSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, loop->ringFd, IORING_OFF_SQES);
+
+	if (MAP_FAILED == sqes)
+	{
+		EchoLogErrno(sink, "Unable to map io_uring:", errno);
+		DeleteUringLoop(loop);
+		return 0;
+	}
+
+	loop->sqes = (struct io_uring_sqe*) sqes;
+
+	char* rings = (char*) loop->rings;
+	loop->sqHead = (unsigned*) (rings + params.sq_off.head);
+	loop->sqTail = (unsigned*) (rings + params.sq_off.tail);
+	loop->sqArray = (unsigned*) (rings + params.sq_off.array);
+	loop->sqMask = *(unsigned*) (rings + params.sq_off.ring_mask);
+	loop->sqEntries = *(unsigned*) (rings + params.sq_off.ring_entries);
+	loop->cqHead = (unsigned*) (rings + params.cq_off.head);
+	loop->cqTail = (unsigned*) (rings + params.cq_off.tail);
+	loop->cqes = (struct io_uring_cqe*) (rings + params.cq_off.cqes);
+	loop->cqMask = *(unsigned*) (rings + params.cq_off.ring_mask);
+
+	// Provided buffer ring must be page aligned
+	loop->bufferRingSize = EchoGetPageAlignedSize(
+			URING_BUFFER_COUNT * sizeof(struct io_uring_buf));
+	void* bufferRing = mmap(NULL, loop->bufferRingSize,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (MAP_FAILED == bufferRing)
+	{
+		EchoLog(sink, LOG_LEVEL_ERROR, "Unable to allocate buffer ring.");
+		DeleteUringLoop(loop);
+		return -ENOMEM;
+	}
+
+	loop->bufferRing = (struct io_uring_buf_ring*) bufferRing;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) loop->bufferRing;
+	reg.ring_entries = URING_BUFFER_COUNT;
+	reg.bgid = URING_BUFFER_GROUP;
+
+	if (-1 == UringRegister(loop->ringFd, IORING_REGISTER_PBUF_RING,
+			&reg, 1))
+	{
+		EchoLogErrno(sink, "Unable to register io_uring buffers:", errno);
+		DeleteUringLoop(loop);
+		return 0;
+	}
+
+	// Receive buffers and their queue links
+	loop->bufferSize = config->bufferSize;
+	loop->buffers = EchoNewBuffer(URING_BUFFER_COUNT * loop->bufferSize);
+	loop->bufferLengths = (unsigned*) calloc(URING_BUFFER_COUNT,
+			sizeof(unsigned));
+	loop->bufferLinks = (int*) calloc(URING_BUFFER_COUNT, sizeof(int));
+
+	if ((NULL == loop->buffers) || (NULL == loop->bufferLengths)
+			|| (NULL == loop->bufferLinks))
+	{
+		EchoLog(sink, LOG_LEVEL_ERROR, "Unable to allocate buffers.");
+		DeleteUringLoop(loop);
+		return -ENOMEM;
+	}
+
+	int result = NewBufferPool(sink, &loop->connectionPool,
+			sizeof(struct UringConnection), config->poolSize);
+	if (result < 0)
+	{
+		DeleteUringLoop(loop);
+		return result;
+	}
+
+	for (int bid = 0; bid < URING_BUFFER_COUNT; bid++)
+	{
+		ReturnUringBuffer(loop, bid);
+	}
+
+	// Multishot is assumed until the kernel rejects it
+	loop->multishotAccept = true;
+	loop->multishotReceive = true;
+
+	return 1;
+}
+
+/**
+ * Frees the client connection once its operations are
+ * complete.
+ *
+ * @param sink log sink.
+ * @param loop io_uring loop.
+ * @param connection client connection.
+ */
+static void FreeUringConnection(
+		const struct EchoLogSink* sink,
+		struct UringLoop* loop,
+		struct UringConnection* connection)
+{
+	// Unlink from the active connections
+	if (NULL != connection->prev)
+	{
+		connection->prev->next = connection->next;
+	}
+	else
+	{
+		loop->connections = connection->next;
+	}
+
+	if (NULL != connection->next)
+	{
+		connection->next->prev = connection->prev;
+	}
+
+	loop->connectionCount--;
+	EchoAddStat(loop->stats, STAT_ACTIVE_CONNECTIONS, (uint64_t) -1);
+
+	CancelTimer(&loop->timers, &connection->timer);
+
+	if (connection->starved)
+	{
+		loop->starvedCount--;
+	}
+
+	close(connection->sd);
+
+	// Recycle the received data and the connection state
+	while (-1 != connection->queuedHead)
+	{
+		PopUringBuffer(loop, connection);
+	}
+
+	ReleaseBuffer(&loop->connectionPool, connection);
+
+	EchoLog(sink, LOG_LEVEL_INFO,
+			"Connection closed, %zu active connections.",
+			loop->connectionCount);
+}
+
+/**
+ * Shuts the client connection down. The pending
+ * operations complete with an error, and the connection
+ * is freed once they are all complete.
+ *
+ * @param sink log sink.
+ * @param loop io_uring loop.
+ * @param connection client connection.
+ */
+static void CloseUringConnection(
+		const struct EchoLogSink* sink,
+		struct UringLoop* loop,
+		struct UringConnection* connection)
+{
+	// Closing may already be flagged by a completion
+	connection->closing = true;
+	CancelTimer(&loop->timers, &connection->timer);
+
+	if (!connection->shutDown)
+	{
+		connection->shutDown = true;
+		shutdown(connection->sd, SHUT_RDWR);
+	}
+
+	if (0 == connection->pendingOps)
+	{
+		FreeUringConnection(sink, loop, connection);
+	}
+}
+
+/**
+ * Arms the connection timer for the timeout of its state.
+ * Queued data gets the write timeout, otherwise the idle
+ * timeout applies.
+ *
+ * @param loop io_uring loop.
+ * @param connection client connection.
+ */
+static void UpdateUringTimer(
+		struct UringLoop* loop,
+		struct UringConnection* connection)
+{
+	uint64_t timeout = (-1 != connection->queuedHead) ? loop->writeTimeout
+			: loop->idleTimeout;
+
+	if (0 == timeout)
+	{
+		CancelTimer(&loop->timers, &connection->timer);
+	}
+	else
+	{
+		ArmTimer(&loop->timers, &connection->timer, loop->now,
+				loop->now + timeout);
+	}
+}
+
+/**
+ * Continues serving the client connection after one of
+ * its operations completed.
+ *
+ * @param sink log sink.
+ * @param loop io_uring loop.
+ * @param connection client connection.
+ */
+static void ServeUringConnection(
+		const struct EchoLogSink* sink,
+		struct UringLoop* loop,
+		struct UringConnection* connection)
+{
+	if (!connection->closing)
+	{
+		// Resume receiving once the queued data is sent
+		if (connection->throttled
+				&& (connection->queuedSize < loop->highWaterMark))
+		{
+			connection->throttled = false;
+		}
+
+		if (!SendUring(loop, connection))
+		{
+			EchoLog(sink, LOG_LEVEL_ERROR, "Unable to submit send.");
+			connection->closing = true;
+		}
+		else if (connection->peerClosed)
+		{
+			// Echo the remaining data before closing
+			if (-1 == connection->queuedHead)
+			{
+				if (!loop->stopping)
+				{
+					EchoLog(sink, LOG_LEVEL_INFO, "Client disconnected.");
+				}
+
+				connection->closing = true;
+			}
+		}
+		else if (!connection->receiving && !connection->throttled
+				&& !connection->starved
+				&& !ReceiveUring(loop, connection))
+		{
+			EchoLog(sink, LOG_LEVEL_ERROR, "Unable to submit receive.");
+			connection->closing = true;
+		}
+	}
+
+	if (connection->closing)
+	{
+		CloseUringConnection(sink, loop, connection);
+	}
+	else if (loop->timeouts)
+	{
+		UpdateUringTimer(loop, connection);
+	}
+}
+
+/**
+ * Handles the accept completion by adding the client
+ * connection to the loop.
+ *
+ * @param sink log sink.
+ * @param loop io_uring loop.
+ * @param result accepted socket or negative error number.
+ * @param flags completion flags.
+ */
+static void CompleteUringAccept(
+		const struct EchoLogSink* sink,
+		struct UringLoop* loop,
+		int result,
+		unsigned flags)
+{
+	// Accept is submitted again after the completions
+	if (0 == (flags & IORING_CQE_F_MORE))
+	{
+		loop->accepting = false;
+	}
+
+	if (result < 0)
+	{
+		// Kernel does not support the multishot accept
+		if ((-EINVAL == result) && loop->multishotAccept)
+		{
+			loop->multishotAccept = false;
+			return;
+		}
+
+		// Any other error only drops the pending connection
+		EchoLogErrno(sink, "Unable to accept connection:", -result);
+		EchoAddStat(loop->stats, STAT_DROPS, 1);
+		return;
+	}
+
+	int clientSocket = result;
+
+	// Multishot accept is left to the ring teardown
+	if (loop->stopping)
+	{
+		close(clientSocket);
+		return;
+	}
+
+	CountAccepts(loop->stats, 1);
+
+	EchoApplySocketProfile(sink, &loop->config->socket, clientSocket,
+			PF_INET, SOCK_STREAM, SOCKET_ACCEPTED);
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+	// Log address, only looked up for debugging
+	struct sockaddr_storage address;
+	socklen_t addressLength = sizeof(address);
+
+	if (0 == getpeername(clientSocket, (struct sockaddr*) &address,
+			&addressLength))
+	{
+		EchoLogAddress(sink, LOG_LEVEL_DEBUG, "Client connection from ",
+				&address);
+	}
+#endif
+
+	// Acquire the connection state from the pool
+	struct UringConnection* connection =
+			(struct UringConnection*) AcquireBuffer(&loop->connectionPool);
+
+	if (NULL == connection)
+	{
+		EchoLog(sink, LOG_LEVEL_ERROR, "Unable to allocate connection.");
+		EchoAddStat(loop->stats, STAT_DROPS, 1);
+		close(clientSocket);
+		return;
+	}
+
+	memset(connection, 0, sizeof(struct UringConnection));
+	connection->sd = clientSocket;
+	connection->queuedHead = -1;
+	connection->queuedTail = -1;
+
+	// Link to the active connections
+	connection->prev = NULL;
+	connection->next = loop->connections;
+
+	if (NULL != loop->connections)
+	{
+		loop->connections->prev = connection;
+	}
+
+	loop->connections = connection;
+	loop->connectionCount++;
+	EchoAddStat(loop->stats, STAT_ACTIVE_CONNECTIONS, 1);
+
+	ServeUringConnection(sink, loop, connection);
+}
+
+/**
+ * Handles the receive completion by queueing the received
+ * buffer for sending it back.
+ *
+ * @param sink log sink.
+ * @param loop io_uring loop.
+ * @param connection client connection.
+ * @param result received size or negative error number.
+ * @param flags completion flags.
+ */
+static void CompleteUringReceive(
+		const struct EchoLogSink* sink,
+		struct UringLoop* loop,
+		struct UringConnection* connection,
+		int result,
+		unsigned flags)
+{
+	// Multishot receive stays submitted while more is flagged
+	if (0 == (flags & IORING_CQE_F_MORE))
+	{
+		connection->receiving = false;
+		connection->pendingOps--;
+	}
+
+	if (result > 0)
+	{
+		int bid = (int) (flags >> IORING_CQE_BUFFER_SHIFT);
+
+		EchoLogDebug(sink, "Received %d bytes.", result);
+		EchoAddStat(loop->stats, STAT_BYTES_IN, (uint64_t) result);
+
+		if (connection->closing)
+		{
+			ReturnUringBuffer(loop, bid);
+			return;
+		}
+
+		// Append to the connection queue
+		loop->bufferLengths[bid] = (unsigned) result;
+		loop->bufferLinks[bid] = -1;
+
+		if (-1 == connection->queuedTail)
+		{
+			connection->queuedHead = bid;
+		}
+		else
+		{
+			loop->bufferLinks[connection->queuedTail] = bid;
+		}
+
+		connection->queuedTail = bid;
+		connection->queuedSize += (size_t) result;
+
+		// Stop receiving until the queued data is sent
+		if (!connection->throttled
+				&& (connection->queuedSize >= loop->highWaterMark))
+		{
+			connection->throttled = true;
+
+			if (connection->receiving
+					&& !CancelUringReceive(loop, connection))
+			{
+				EchoLog(sink, LOG_LEVEL_ERROR, "Unable to submit cancel.");
+				connection->closing = true;
+			}
+		}
+	}
+	else if (0 == result)
+	{
+		connection->peerClosed = true;
+	}
+	else if (-ENOBUFS == result)
+	{
+		// Receive again once the buffers are returned
+		EchoAddStat(loop->stats, STAT_EAGAINS, 1);
+
+		if (!connection->starved)
+		{
+			connection->starved = true;
+			loop->starvedCount++;
+		}
+	}
+	else if ((-EINVAL == result) && loop->multishotReceive)
+	{
+		// Kernel does not support the multishot receive
+		EchoLog(sink, LOG_LEVEL_INFO, "Multishot receive is not supported.");
+		loop->multishotReceive = false;
+	}
+	else if (-ECANCELED != result)
+	{
+		if (!connection->closing)
+		{
+			EchoLogErrno(sink, "Unable to receive:", -result);
+		}
+
+		connection->closing = true;
+	}
+}
+
+/**
+ * Handles the send completion by returning the sent
+ * buffer to the kernel.
+ *
+ * @param sink log sink.
+ * @param loop io_uring loop.
+ * @param connection client connection.
+ * @param result sent size or negative error number.
+ */
+static void CompleteUringSend(
+		const struct EchoLogSink* sink,
+		struct UringLoop* loop,
+		struct UringConnection* connection,
+		int result)
+{
+	unsigned length = loop->bufferLengths[connection->queuedHead];
+
+	connection->pendingOps--;
+	connection->sendingCount--;
+	PopUringBuffer(loop, connection);
+
+	if (result < 0)
+	{
+		// Rest of a broken chain is canceled
+		if (!connection->closing && (-ECANCELED != result))
+		{
+			EchoLogErrno(sink, "Unable to send:", -result);
+		}
+
+		connection->closing = true;
+	}
+	else
+	{
+		EchoLogDebug(sink, "Sent %d bytes.", result);
+		EchoAddStat(loop->stats, STAT_BYTES_OUT, (uint64_t) result);
+
+		// Wait all only stops short on an error
+		if ((unsigned) result < length)
+		{
+			EchoAddStat(loop->stats, STAT_SHORT_WRITES, 1);
+			connection->closing = true;
+		}
+	}
+}
+
+/**
+ * Handles the stop request by no longer accepting, and by
+ * treating the connections as shut down by the clients so
+ * that they are closed once their queued data is sent. The
+ * next stop completion is the drain timeout.
+ *
+ * @param sink log sink.
+ * @param loop io_uring loop.
+ */
+static void CompleteUringStop(
+		const struct EchoLogSink* sink,
+		struct UringLoop* loop)
+{
+	if (loop->stopping)
+	{
+		EchoLog(sink, LOG_LEVEL_INFO,
+				"Drain timed out, closing %zu connections.",
+				loop->connectionCount);
+		loop->drainExpired = true;
+		return;
+	}
+
+	EchoLog(sink, LOG_LEVEL_INFO, "Stopping, draining %zu connections...",
+			loop->connectionCount);
+
+	loop->stopping = true;
+
+	if (!SubmitUringDrainTimeout(loop))
+	{
+		EchoLog(sink, LOG_LEVEL_ERROR, "Unable to submit drain timeout.");
+		loop->drainExpired = true;
+		return;
+	}
+
+	struct UringConnection* connection = loop->connections;
+
+	while (NULL != connection)
+	{
+		// Connection may be freed while serving it
+		struct UringConnection* next = connection->next;
+
+		connection->peerClosed = true;
+		ServeUringConnection(sink, loop, connection);
+
+		connection = next;
+	}
+}
+
+/**
+ * Handles the given completion.
+ *
+ * @param sink log sink.
+ * @param loop io_uring loop.
+ * @param userData completion user data.
+ * @param result completion result.
+ * @param flags completion flags.
+ */
+static void CompleteUring(
+		const struct EchoLogSink* sink,
+		struct UringLoop* loop,
+		uint64_t userData,
+		int result,
+		unsigned flags)
+{
+	int op = (int) (userData & URING_OP_MASK);
+	struct UringConnection* connection = (struct UringConnection*)
+			(uintptr_t) (userData & ~((uint64_t) URING_OP_MASK));
+
+	// Only the stop has no connection besides the accept
+	if ((URING_OP_STOP == op) && (NULL == connection))
+	{
+		CompleteUringStop(sink, loop);
+		return;
+	}
+
+	switch (op)
+	{
+	case URING_OP_ACCEPT:
+		CompleteUringAccept(sink, loop, result, flags);
+		return;
+
+	case URING_OP_RECEIVE:
+		CompleteUringReceive(sink, loop, connection, result, flags);
+		break;
+
+	case URING_OP_SEND:
+		CompleteUringSend(sink, loop, connection, result);
+		break;
+
+	default:
+		connection->pendingOps--;
+		break;
+	}
+
+	ServeUringConnection(sink, loop, connection);
+}
+
+/**
+ * Receives again on the connections that ran out of the
+ * provided buffers.
+ *
+ * @param sink log sink.
+ * @param loop io_uring loop.
+ */
+static void ResumeStarvedConnections(
+		const struct EchoLogSink* sink,
+		struct UringLoop* loop)
+{
+	struct UringConnection* connection = loop->connections;
+
+	while ((NULL != connection) && (loop->starvedCount > 0))
+	{
+		// Connection may be freed while serving it
+		struct UringConnection* next = connection->next;
+
+		if (connection->starved)
+		{
+			connection->starved = false;
+			loop->starvedCount--;
+
+			ServeUringConnection(sink, loop, connection);
+		}
+
+		connection = next;
+	}
+}
+
+/**
+ * Shuts down the connections whose timers expired.
+ *
+ * @param sink log sink.
+ * @param loop io_uring loop.
+ */
+static void ExpireUringConnections(
+		const struct EchoLogSink* sink,
+		struct UringLoop* loop)
+{
+	struct Timer* timer;
+
+	while (NULL != (timer = ExpireTimer(&loop->timers, loop->now)))
+	{
+		struct UringConnection* connection = (struct UringConnection*)
+				((char*) timer - offsetof(struct UringConnection, timer));
+
+		// State is the same as when the timer was armed
+		if (-1 != connection->queuedHead)
+		{
+			EchoLog(sink, LOG_LEVEL_INFO,
+					"Send timed out, client is not reading.");
+		}
+		else
+		{
+			EchoLog(sink, LOG_LEVEL_INFO, "Connection idle timed out.");
+		}
+
+		EchoAddStat(loop->stats, STAT_TIMEOUTS, 1);
+		CloseUringConnection(sink, loop, connection);
+	}
+}
+
+/**
+ * Runs the io_uring loop by submitting the queued
+ * operations and handling the completions with one enter
+ * per iteration, until a fatal error occurs or the server
+ * is stopped and the connections are drained.
+ *
+ * @param sink log sink.
+ * @param loop io_uring loop.
+ * @return zero or negative error number.
+ */
+static int RunUringLoop(
+		const struct EchoLogSink* sink,
+		struct UringLoop* loop)
+{
+	EchoLog(sink, LOG_LEVEL_INFO, "Waiting for client connections...");
+
+	if ((-1 != loop->stopFd) && !PollUringStop(loop))
+	{
+		EchoLog(sink, LOG_LEVEL_ERROR, "Unable to submit stop poll.");
+		return -EBUSY;
+	}
+
+	// Remaining connections are closed with the loop
+	while (!loop->stopping
+			|| ((loop->connectionCount > 0) && !loop->drainExpired))
+	{
+		if (!loop->accepting && !loop->stopping && !AcceptUring(loop))
+		{
+			EchoLog(sink, LOG_LEVEL_ERROR, "Unable to submit accept.");
+			return -EBUSY;
+		}
+
+		// Wake up for the next connection timer
+		int timeout = (0 == loop->timers.count) ? -1
+				: GetTimerTimeout(&loop->timers, EchoGetMonotonicTime());
+
+		// Submit and block until there is a completion
+		if (-1 == EnterUringLoop(loop, 1, timeout))
+		{
+			if (EINTR == errno)
+				continue;
+
+			// Completion ring is full, reap it first
+			if ((EBUSY != errno) && (ETIME != errno))
+				return -errno;
+		}
+
+		if (loop->timeouts)
+		{
+			loop->now = GetTimerTick();
+		}
+
+		unsigned head = *loop->cqHead;
+		unsigned tail = __atomic_load_n(loop->cqTail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++)
+		{
+			struct io_uring_cqe* cqe = &loop->cqes[head & loop->cqMask];
+
+			CompleteUring(sink, loop, cqe->user_data, cqe->res,
+					cqe->flags);
+		}
+
+		// Let the kernel reuse the completion entries
+		__atomic_store_n(loop->cqHead, head, __ATOMIC_RELEASE);
+
+		if (0 != loop->timers.count)
+		{
+			ExpireUringConnections(sink, loop);
+		}
+
+		if (loop->buffersReturned && (loop->starvedCount > 0))
+		{
+			ResumeStarvedConnections(sink, loop);
+		}
+
+		loop->buffersReturned = false;
+	}
+
+	EchoLog(sink, LOG_LEVEL_INFO, "Server stopped.");
+
+	return 0;
+}
+#endif
+
+/**
+ * Server worker running its own loop on its own server
+ * socket, on its own native thread.
+ */
+struct Worker
+{
+	// Log sink of the server
+	const struct EchoLogSink* sink;
+
+	// Configuration of the server
+	const struct EchoConfig* config;
+
+	// Server socket descriptor
+	int serverSocket;
+
+	// Position among the workers, picks the CPU to pin to
+	int index;
+
+	// Worker only accepts and hands the clients to its peers
+	bool acceptor;
+
+	// Handoff pipe write descriptor of an I/O worker, or -1
+	int handoffFd;
+
+	// I/O workers the acceptor hands the clients to
+	struct Worker* peers;
+	int peerCount;
+
+	// Event loop for the stream servers
+	struct EventLoop loop;
+
+#ifdef HAVE_IO_URING
+	// io_uring loop used instead of the event loop if supported
+	struct UringLoop uring;
+#endif
+
+	// Worker body, returns zero or negative error number
+	int (*run)(const struct EchoLogSink* sink, struct Worker* worker);
+
+	// Native thread
+	pthread_t thread;
+
+	// Error number the worker stopped with, zero if none
+	int result;
+
+	// Worker counters
+	struct EchoWorkerStats* stats;
+
+	// Stop request shared by the workers, or NULL
+	struct EchoServerControl* control;
+};
+
+/**
+ * Echo server with its workers.
+ */
+struct EchoServer
+{
+	// Log sink
+	struct EchoLogSink sink;
+
+	// Configuration, a snapshot taken at construction
+	struct EchoConfig config;
+
+	// Workers, the accept thread after the I/O workers
+	struct Worker* workers;
+	int workerCount;
+
+	// Workers run on their own threads even if there is one
+	bool scheduled;
+
+	// Port number, zero for a local server
+	unsigned short port;
+
+	// Capture the stream workers record into, or NULL
+	struct EchoCapture* capture;
+};
+
+/**
+ * Gets the number of workers to start. Zero or a negative
+ * count defaults to the number of online CPUs.
+ *
+ * @param workerCount requested worker count.
+ * @return worker count.
+ */
+static int GetWorkerCount(int workerCount)
+{
+	if (workerCount <= 0)
+	{
+		// Get the number of online CPUs
+		workerCount = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	return (workerCount > 0) ? workerCount : 1;
+}
+
+/**
+ * Allocates the given number of workers for the server.
+ *
+ * @param server server.
+ * @param count worker count.
+ * @param control server control or NULL.
+ * @return zero, -ENOMEM, or -EUSERS if there are too many
+ *         workers.
+ */
+static int NewWorkers(
+		struct EchoServer* server,
+		int count,
+		struct EchoServerControl* control)
+{
+	struct Worker* workers = (struct Worker*) calloc(count,
+			sizeof(struct Worker));
+
+	if (NULL == workers)
+	{
+		EchoLog(&server->sink, LOG_LEVEL_ERROR,
+				"Unable to allocate workers.");
+		return -ENOMEM;
+	}
+
+	server->workers = workers;
+	server->workerCount = count;
+
+	for (int i = 0; i < count; i++)
+	{
+		workers[i].sink = &server->sink;
+		workers[i].config = &server->config;
+		workers[i].serverSocket = -1;
+		workers[i].index = i;
+		workers[i].handoffFd = -1;
+		workers[i].loop.epollFd = -1;
+		workers[i].control = control;
+#ifdef HAVE_IO_URING
+		workers[i].uring.ringFd = -1;
+#endif
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		workers[i].stats = EchoAcquireWorkerStats();
+		if (NULL == workers[i].stats)
+		{
+			EchoLog(&server->sink, LOG_LEVEL_ERROR, "Too many workers.");
+			return -EUSERS;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Deletes the workers by deleting their event loops and
+ * closing their server sockets.
+ *
+ * @param workers workers.
+ * @param count worker count.
+ */
+static void DeleteWorkers(struct Worker* workers, int count)
+{
+	if (NULL == workers)
+		return;
+
+	for (int i = 0; i < count; i++)
+	{
+		DeleteEventLoop(&workers[i].loop);
+#ifdef HAVE_IO_URING
+		DeleteUringLoop(&workers[i].uring);
+#endif
+
+		// Server socket may be shared with the first worker
+		int sd = workers[i].serverSocket;
+
+		if (-1 != workers[i].handoffFd)
+		{
+			// Close the clients not taken over yet
+			int clientSocket;
+			while (-1 != (clientSocket = ReceiveHandoff(sd)))
+			{
+				close(clientSocket);
+			}
+
+			close(workers[i].handoffFd);
+		}
+
+		if ((sd > 0) && ((0 == i) || (sd != workers[0].serverSocket)))
+		{
+			close(sd);
+		}
+
+		EchoReleaseWorkerStats(workers[i].stats);
+	}
+
+	free(workers);
+}
+
+/**
+ * Checks if any of the worker scheduling options is set.
+ *
+ * @param scheduling worker scheduling.
+ * @return true if the workers are scheduled.
+ */
+static bool IsWorkerSchedulingSet(
+		const struct EchoWorkerScheduling* scheduling)
+{
+	return (scheduling->cpuCount > 0)
+			|| (scheduling->acceptCpuCount > 0)
+			|| (SCHED_INHERIT != scheduling->policy)
+			|| scheduling->niceSet;
+}
+
+/**
+ * Applies the configured affinity, policy and nice value to
+ * the calling worker thread. Failures are only logged, the
+ * worker runs on with the inherited scheduling.
+ *
+ * @param sink log sink.
+ * @param worker worker.
+ */
+static void ApplyWorkerScheduling(
+		const struct EchoLogSink* sink,
+		struct Worker* worker)
+{
+	const struct EchoWorkerScheduling* scheduling =
+			&worker->config->scheduling;
+
+	// Acceptor may run on any of its CPUs, I/O workers on one each
+	const int* cpus = scheduling->cpus;
+	size_t cpuCount = scheduling->cpuCount;
+
+	if (worker->acceptor)
+	{
+		cpus = scheduling->acceptCpus;
+		cpuCount = scheduling->acceptCpuCount;
+	}
+
+	if (cpuCount > 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+
+		if (worker->acceptor)
+		{
+			for (size_t i = 0; i < cpuCount; i++)
+			{
+				CPU_SET(cpus[i], &set);
+			}
+		}
+		else
+		{
+			CPU_SET(cpus[(size_t) worker->index % cpuCount], &set);
+		}
+
+		// Zero is the calling thread, not the whole process
+		if (-1 == sched_setaffinity(0, sizeof(set), &set))
+		{
+			EchoLogErrno(sink, "Unable to pin worker:", errno);
+		}
+	}
+
+	if (SCHED_INHERIT != scheduling->policy)
+	{
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+
+		// Only the real time policies have a priority
+		if ((SCHED_FIFO == scheduling->policy)
+				|| (SCHED_RR == scheduling->policy))
+		{
+			param.sched_priority = (0 != scheduling->priority)
+					? scheduling->priority
+					: sched_get_priority_min(scheduling->policy);
+		}
+
+		if (-1 == sched_setscheduler(0, scheduling->policy, &param))
+		{
+			EchoLogErrno(sink, "Unable to set worker policy:", errno);
+		}
+	}
+
+	// Nice value is per thread on Linux
+	if (scheduling->niceSet
+			&& (-1 == setpriority(PRIO_PROCESS, 0, scheduling->nice)))
+	{
+		EchoLogErrno(sink, "Unable to set worker nice value:", errno);
+	}
+}
+
+/**
+ * Worker thread entry point. The thread is not attached to the
+ * Java VM, the worker body only logs through the sink and
+ * returns its error number for the starting thread.
+ *
+ * @param arg worker.
+ * @return NULL.
+ */
+static void* WorkerThread(void* arg)
+{
+	struct Worker* worker = (struct Worker*) arg;
+
+	ApplyWorkerScheduling(worker->sink, worker);
+	worker->result = worker->run(worker->sink, worker);
+
+	return NULL;
+}
+
+/**
+ * Runs the given workers each on its own native thread and
+ * waits for all of them to stop. A single worker runs on
+ * the calling thread, unless it is to be scheduled.
+ *
+ * @param sink log sink.
+ * @param workers workers.
+ * @param count worker count.
+ * @param scheduled run a single worker on its own thread.
+ * @return zero, or the error number of the first failed worker.
+ */
+static int RunWorkers(
+		const struct EchoLogSink* sink,
+		struct Worker* workers,
+		int count,
+		bool scheduled)
+{
+	// No need for threads just for one worker
+	if ((1 == count) && !scheduled)
+		return workers[0].run(sink, &workers[0]);
+
+	EchoLog(sink, LOG_LEVEL_INFO, "Starting %d workers...", count);
+
+	for (int i = 0; i < count; i++)
+	{
+		workers[i].result = 0;
+
+		int result = pthread_create(&workers[i].thread, NULL,
+				WorkerThread, &workers[i]);
+
+		if (0 != result)
+		{
+			// Nobody to serve this worker socket
+			EchoLogErrno(sink, "Unable to start worker:", result);
+			workers[i].run = NULL;
+		}
+	}
+
+	// Wait for the workers to stop
+	int result = 0;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (NULL == workers[i].run)
+			continue;
+
+		pthread_join(workers[i].thread, NULL);
+
+		// Keep only the first error
+		if ((0 == result) && (workers[i].result < 0))
+		{
+			result = workers[i].result;
+		}
+	}
+
+	return result;
+}
+
+/**
+ * TCP worker body, serves the clients on the worker
+ * event loop.
+ *
+ * @param sink log sink.
+ * @param worker worker.
+ * @return zero or negative error number.
+ */
+static int RunTcpWorker(
+		const struct EchoLogSink* sink,
+		struct Worker* worker)
+{
+	return RunEventLoop(sink, &worker->loop);
+}
+
+/**
+ * Accept worker body, accepts the clients on its own thread
+ * and hands them to the I/O workers in turn, so that a
+ * connection storm does not delay the established ones.
+ *
+ * @param sink log sink.
+ * @param worker worker.
+ * @return zero or negative error number.
+ */
+static int RunAcceptWorker(
+		const struct EchoLogSink* sink,
+		struct Worker* worker)
+{
+	struct pollfd fds[2];
+	fds[0].fd = worker->serverSocket;
+	fds[0].events = POLLIN;
+	fds[1].fd = GetStopFd(worker->control);
+	fds[1].events = POLLIN;
+
+	int next = 0;
+
+	EchoLog(sink, LOG_LEVEL_INFO, "Accepting for %d workers...",
+			worker->peerCount);
+
+	while (!EchoIsStopRequested(worker->control))
+	{
+		// Negative stop descriptor is ignored if not stoppable
+		if (-1 == poll(fds, 2, -1))
+		{
+			if (EINTR == errno)
+				continue;
+
+			int error = errno;
+			EchoLogErrno(sink, "Unable to wait for connections:", error);
+			return -error;
+		}
+
+		if (0 != fds[1].revents)
+			break;
+
+		while (1)
+		{
+			struct sockaddr_storage address;
+			socklen_t addressLength = sizeof(address);
+
+			TRACE_BEGIN(TRACE_ACCEPT);
+#ifdef HAVE_ACCEPT4
+			int clientSocket = accept4(worker->serverSocket,
+					(struct sockaddr*) &address,
+					&addressLength,
+					SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+			int clientSocket = accept(worker->serverSocket,
+					(struct sockaddr*) &address,
+					&addressLength);
+#endif
+			TRACE_END();
+
+			EchoAddStat(worker->stats, STAT_SYSCALLS, 1);
+
+			if (-1 == clientSocket)
+			{
+				if (EINTR == errno)
+					continue;
+
+				// Any other error only drops the pending connection
+				if ((EAGAIN != errno) && (EWOULDBLOCK != errno))
+				{
+					EchoLogErrno(sink, "Unable to accept connection:", errno);
+					EchoAddStat(worker->stats, STAT_DROPS, 1);
+				}
+				else
+				{
+					EchoAddStat(worker->stats, STAT_EAGAINS, 1);
+				}
+
+				break;
+			}
+
+#ifndef HAVE_ACCEPT4
+			// Client socket must not block the I/O worker
+			int result = EchoSetSocketNonBlocking(clientSocket);
+			if (result < 0)
+			{
+				EchoLogErrno(sink, "Unable to accept connection:", -result);
+				EchoAddStat(worker->stats, STAT_DROPS, 1);
+				close(clientSocket);
+				continue;
+			}
+#endif
+
+			if ((AF_INET == address.ss_family)
+					|| (AF_INET6 == address.ss_family))
+			{
+				EchoApplySocketProfile(sink, &worker->config->socket,
+						clientSocket, address.ss_family, SOCK_STREAM,
+						SOCKET_ACCEPTED);
+				EchoLogAddress(sink, LOG_LEVEL_DEBUG,
+						"Client connection from ", &address);
+			}
+
+			struct Worker* peer = &worker->peers[next];
+			next = (next + 1) % worker->peerCount;
+
+			if ((ssize_t) sizeof(clientSocket) != write(peer->handoffFd,
+					&clientSocket, sizeof(clientSocket)))
+			{
+				// Pipe is full, the worker is far behind
+				EchoLogErrno(sink, "Unable to hand off connection:", errno);
+				EchoAddStat(worker->stats, STAT_DROPS, 1);
+				close(clientSocket);
+			}
+		}
+	}
+
+	return 0;
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * TCP worker body, serves the clients on the worker
+ * io_uring loop.
+ *
+ * @param sink log sink.
+ * @param worker worker.
+ * @return zero or negative error number.
+ */
+static int RunUringWorker(
+		const struct EchoLogSink* sink,
+		struct Worker* worker)
+{
+	return RunUringLoop(sink, &worker->uring);
+}
+#endif
+
+/**
+ * Waits for a datagram to arrive on the socket, or for the
+ * server to be stopped.
+ *
+ * @param sink log sink.
+ * @param sd socket descriptor.
+ * @param control server control.
+ * @return 1 if a datagram has arrived, 0 if stopped, or
+ *         negative error number.
+ */
+static int WaitForDatagrams(
+		const struct EchoLogSink* sink,
+		int sd,
+		struct EchoServerControl* control)
+{
+	struct pollfd fds[2];
+	fds[0].fd = sd;
+	fds[0].events = POLLIN;
+	fds[1].fd = control->stopFd;
+	fds[1].events = POLLIN;
+
+	while (-1 == poll(fds, 2, -1))
+	{
+		if (EINTR != errno)
+		{
+			int error = errno;
+			EchoLogErrno(sink, "Unable to wait for datagrams:", error);
+			return -error;
+		}
+	}
+
+	return (0 == fds[1].revents) ? 1 : 0;
+}
+
+/**
+ * Flow of a UDP peer, kept in the flow table of the worker
+ * receiving from it. Fields read by the flow snapshots are
+ * stored atomically, as the worker counters are.
+ */
+struct UdpFlow
+{
+	// Peer IPv6 address as two big endian halves, IPv4 is mapped
+	uint64_t address[2];
+
+	// Peer port
+	uint16_t port;
+
+	// Rate limit tokens left
+	uint32_t tokens;
+
+	// Time the tokens are refilled up to, in nanoseconds
+	uint64_t refillTime;
+
+	// Time the last datagram arrived in nanoseconds, zero if unused
+	uint64_t lastSeen;
+
+	// Received datagrams and bytes
+	uint64_t datagrams;
+	uint64_t bytes;
+
+	// Datagrams not echoed because of the rate limit
+	uint64_t drops;
+};
+
+/**
+ * Fixed size open addressed table of the UDP peers of a
+ * worker. Peers are looked up within a few slots from their
+ * hash, so that the receive path neither allocates nor walks
+ * long chains. A new peer takes over the least recently seen
+ * slot of its probes.
+ */
+struct UdpFlowTable
+{
+	// Flow slots, NULL if the flows are disabled
+	struct UdpFlow* flows;
+
+	// Slot count minus one, the count is a power of two
+	size_t mask;
+
+	// Datagrams per second echoed to a peer, zero for no limit
+	uint32_t rateLimit;
+
+	// Published tables list links, guarded by the registry mutex
+	struct UdpFlowTable* prev;
+	struct UdpFlowTable* next;
+};
+
+/**
+ * Flow tables of the running UDP workers, for the snapshots.
+ */
+struct UdpFlowRegistry
+{
+	// Protects the tables list
+	pthread_mutex_t mutex;
+
+	// Published tables
+	struct UdpFlowTable* tables;
+};
+
+// Process wide flow table registry
+static struct UdpFlowRegistry udpFlowRegistry = { PTHREAD_MUTEX_INITIALIZER,
+		NULL };
+
+/**
+ * Constructs the flow table of a UDP worker with the
+ * configured size and publishes it for the snapshots.
+ *
+ * @param sink log sink.
+ * @param config server configuration.
+ * @param table flow table.
+ * @return zero or -ENOMEM.
+ */
+static int NewUdpFlowTable(
+		const struct EchoLogSink* sink,
+		const struct EchoConfig* config,
+		struct UdpFlowTable* table)
+{
+	memset(table, 0, sizeof(struct UdpFlowTable));
+
+	if (0 == config->udpFlows)
+		return 0;
+
+	size_t size = 1;
+	while (size < config->udpFlows)
+	{
+		size <<= 1;
+	}
+
+	table->flows = (struct UdpFlow*) calloc(size, sizeof(struct UdpFlow));
+	if (NULL == table->flows)
+	{
+		EchoLog(sink, LOG_LEVEL_ERROR, "Unable to allocate flow table.");
+		return -ENOMEM;
+	}
+
+	table->mask = size - 1;
+	table->rateLimit = (uint32_t) config->udpRateLimit;
+
+	pthread_mutex_lock(&udpFlowRegistry.mutex);
+
+	table->next = udpFlowRegistry.tables;
+	if (NULL != udpFlowRegistry.tables)
+	{
+		udpFlowRegistry.tables->prev = table;
+	}
+
+	udpFlowRegistry.tables = table;
+
+	pthread_mutex_unlock(&udpFlowRegistry.mutex);
+
+	return 0;
+}
+
+/**
+ * Withdraws the flow table from the snapshots and releases
+ * its slots.
+ *
+ * @param table flow table.
+ */
+static void DeleteUdpFlowTable(struct UdpFlowTable* table)
+{
+	if (NULL == table->flows)
+		return;
+
+	pthread_mutex_lock(&udpFlowRegistry.mutex);
+
+	if (NULL != table->prev)
+	{
+		table->prev->next = table->next;
+	}
+	else
+	{
+		udpFlowRegistry.tables = table->next;
+	}
+
+	if (NULL != table->next)
+	{
+		table->next->prev = table->prev;
+	}
+
+	pthread_mutex_unlock(&udpFlowRegistry.mutex);
+
+	free(table->flows);
+	table->flows = NULL;
+}
+
+/**
+ * Gets the flow key of the peer address. IPv4 peers are keyed
+ * by their mapped IPv6 address, so a dual stack socket sees
+ * the same peer either way.
+ *
+ * @param address peer address.
+ * @param key address key halves.
+ */
+static void GetFlowKey(
+		const struct sockaddr_storage* address,
+		uint64_t key[2])
+{
+	unsigned char bytes[16];
+
+	if (AF_INET6 == address->ss_family)
+	{
+		memcpy(bytes, &((const struct sockaddr_in6*) address)->sin6_addr,
+				sizeof(bytes));
+	}
+	else
+	{
+		memset(bytes, 0, 10);
+		bytes[10] = 0xff;
+		bytes[11] = 0xff;
+		memcpy(bytes + 12, &((const struct sockaddr_in*) address)->sin_addr,
+				4);
+	}
+
+	key[0] = 0;
+	key[1] = 0;
+
+	for (int i = 0; i < 8; i++)
+	{
+		key[0] = (key[0] << 8) | bytes[i];
+		key[1] = (key[1] << 8) | bytes[i + 8];
+	}
+}
+
+/**
+ * Gets the flow of the given peer, taking over a slot for
+ * it if it has none.
+ *
+ * @param table flow table.
+ * @param address peer address.
+ * @param now current time in nanoseconds.
+ * @return flow.
+ */
+static struct UdpFlow* GetUdpFlow(
+		struct UdpFlowTable* table,
+		const struct sockaddr_storage* address,
+		uint64_t now)
+{
+	uint64_t key[2];
+	GetFlowKey(address, key);
+
+	uint16_t port = EchoGetAddressPort(address);
+
+	// Fibonacci hash of the folded address and port
+	size_t index = (size_t) (((key[0] ^ key[1] ^ ((uint64_t) port << 48))
+			* 0x9E3779B97F4A7C15ULL) >> 32);
+
+	struct UdpFlow* victim = NULL;
+
+	for (size_t i = 0; i < UDP_FLOW_PROBES; i++)
+	{
+		struct UdpFlow* flow = &table->flows[(index + i) & table->mask];
+
+		if ((0 != flow->lastSeen) && (key[0] == flow->address[0])
+				&& (key[1] == flow->address[1]) && (port == flow->port))
+			return flow;
+
+		// Unused slots are seen at zero, so they are taken first
+		if ((NULL == victim) || (flow->lastSeen < victim->lastSeen))
+		{
+			victim = flow;
+		}
+	}
+
+	__atomic_store_n(&victim->address[0], key[0], __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->address[1], key[1], __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->port, port, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->datagrams, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->bytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&victim->drops, 0, __ATOMIC_RELAXED);
+
+	victim->tokens = table->rateLimit;
+	victim->refillTime = now;
+
+	return victim;
+}
+
+/**
+ * Counts the received datagrams into the flow of their sender
+ * and checks them against the rate limit. Tokens of a second
+ * worth of datagrams refill at the limit rate.
+ *
+ * @param table flow table.
+ * @param address sender address.
+ * @param count number of datagrams, more than one if coalesced.
+ * @param size total size of the datagrams.
+ * @param now current time in nanoseconds.
+ * @return number of leading datagrams within the rate limit.
+ */
+static size_t AdmitUdpDatagrams(
+		struct UdpFlowTable* table,
+		const struct sockaddr_storage* address,
+		size_t count,
+		size_t size,
+		uint64_t now)
+{
+	if (NULL == table->flows)
+		return count;
+
+	struct UdpFlow* flow = GetUdpFlow(table, address, now);
+
+	__atomic_store_n(&flow->lastSeen, now, __ATOMIC_RELAXED);
+	AddCounter(&flow->datagrams, count);
+	AddCounter(&flow->bytes, size);
+
+	if (0 == table->rateLimit)
+		return count;
+
+	uint64_t interval = 1000000000ULL / table->rateLimit;
+
+	// Only whole tokens are refilled, the remainder is kept for later
+	if (now - flow->refillTime >= interval)
+	{
+		uint64_t refill = (now - flow->refillTime) / interval;
+
+		if (flow->tokens + refill >= table->rateLimit)
+		{
+			flow->tokens = table->rateLimit;
+			flow->refillTime = now;
+		}
+		else
+		{
+			flow->tokens += (uint32_t) refill;
+			flow->refillTime += refill * interval;
+		}
+	}
+
+	size_t admitted = (count < flow->tokens) ? count : flow->tokens;
+
+	flow->tokens -= (uint32_t) admitted;
+
+	if (admitted < count)
+	{
+		AddCounter(&flow->drops, count - admitted);
+	}
+
+	return admitted;
+}
+
+/**
+ * Receives datagrams from the socket and sends them back
+ * to their senders until a fatal error or the stop.
+ *
+ * @param sink log sink.
+ * @param worker worker.
+ * @param flows flow table.
+ * @return zero or negative error number.
+ */
+static int RunUdpEchoLoop(
+		const struct EchoLogSink* sink,
+		struct Worker* worker,
+		struct UdpFlowTable* flows)
+{
+	int sd = worker->serverSocket;
+	size_t bufferSize = worker->config->bufferSize;
+	struct EchoWorkerStats* stats = worker->stats;
+	struct EchoServerControl* control = worker->control;
+
+	// Client address
+	struct sockaddr_storage address;
+
+	// Allocate the receive buffer
+	char* buffer = EchoNewBuffer(bufferSize);
+	if (NULL == buffer)
+	{
+		EchoLog(sink, LOG_LEVEL_ERROR, "Unable to allocate buffer.");
+		return -ENOMEM;
+	}
+
+	int result = 0;
+
+	while (!EchoIsStopRequested(control))
+	{
+		// Blocking receive would not see the stop
+		if (NULL != control)
+		{
+			result = WaitForDatagrams(sink, sd, control);
+			if (result <= 0)
+				break;
+
+			result = 0;
+		}
+
+		memset(&address, 0, sizeof(address));
+
+		// Receive from the socket
+		ssize_t recvSize = EchoReceiveDatagram(sink, sd,
+				&address, buffer, bufferSize);
+
+		if (recvSize < 0)
+		{
+			result = (int) recvSize;
+			EchoLogErrno(sink, "Unable to receive datagram:", -result);
+			break;
+		}
+
+		EchoAddStat(stats, STAT_BYTES_IN, (uint64_t) recvSize);
+
+		// Rate limited peer is not echoed
+		if (0 == AdmitUdpDatagrams(flows, &address, 1, (size_t) recvSize,
+				EchoGetMonotonicTime()))
+		{
+			EchoAddStat(stats, STAT_DROPS, 1);
+			EchoAddStat(stats, STAT_SYSCALLS, 1);
+			continue;
+		}
+
+		// Send to the socket
+		ssize_t sentSize = EchoSendDatagram(sink, sd,
+				&address, buffer, (size_t) recvSize);
+
+		if (sentSize < 0)
+		{
+			result = (int) sentSize;
+			EchoLogErrno(sink, "Unable to send datagram:", -result);
+			break;
+		}
+
+		EchoAddStat(stats, STAT_BYTES_OUT, (uint64_t) recvSize);
+		EchoAddStat(stats, STAT_SYSCALLS, 2);
+	}
+
+	// Release the receive buffer
+	free(buffer);
+
+	return result;
+}
+
+#ifdef HAVE_SENDMMSG
+/**
+ * Control buffer for the UDP segment size, aligned for the
+ * control message header.
+ */
+union UdpSegmentControl
+{
+	struct cmsghdr header;
+	char buffer[CMSG_SPACE(sizeof(int))];
+};
+
+/**
+ * Pre-allocated datagram buffers and addresses for receiving
+ * and sending a batch of datagrams with a single call.
+ */
+struct DatagramBatch
+{
+	// Message headers
+	struct mmsghdr messages[UDP_BATCH_SIZE];
+
+	// Message data vectors
+	struct iovec vectors[UDP_BATCH_SIZE];
+
+	// Client addresses
+	struct sockaddr_storage addresses[UDP_BATCH_SIZE];
+
+	// Segment size control messages, received and sent back
+	union UdpSegmentControl controls[UDP_BATCH_SIZE];
+
+	// Datagrams are coalesced on receive and segmented on send
+	bool offload;
+
+	// Size of each data buffer
+	size_t bufferSize;
+
+	// Data buffers, one after the other
+	char* buffers;
+};
+
+/**
+ * Prepares the datagram batch for receiving.
+ *
+ * @param batch datagram batch.
+ */
+static void ResetDatagramBatch(struct DatagramBatch* batch)
+{
+	for (int i = 0; i < UDP_BATCH_SIZE; i++)
+	{
+		struct msghdr* header = &batch->messages[i].msg_hdr;
+
+		batch->vectors[i].iov_base = batch->buffers + (i * batch->bufferSize);
+		batch->vectors[i].iov_len = batch->bufferSize;
+
+		memset(header, 0, sizeof(struct msghdr));
+		header->msg_name = &batch->addresses[i];
+		header->msg_namelen = sizeof(struct sockaddr_storage);
+		header->msg_iov = &batch->vectors[i];
+		header->msg_iovlen = 1;
+
+		// Kernel reports the segment size of the coalesced datagrams
+		if (batch->offload)
+		{
+			header->msg_control = batch->controls[i].buffer;
+			header->msg_controllen = sizeof(batch->controls[i].buffer);
+		}
+
+		batch->messages[i].msg_len = 0;
+	}
+}
+
+/**
+ * Enables receiving coalesced datagrams on the socket.
+ *
+ * @param sink log sink.
+ * @param sd socket descriptor.
+ * @param enabled true to enable, false to disable.
+ * @return true if set.
+ */
+static bool SetUdpGro(
+		const struct EchoLogSink* sink,
+		int sd,
+		bool enabled)
+{
+	int value = enabled ? 1 : 0;
+
+	if (-1 == setsockopt(sd, SOL_UDP, UDP_GRO, &value, sizeof(value)))
+	{
+		EchoLogErrno(sink, "Unable to set UDP_GRO:", errno);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Gets the segment size of the coalesced datagrams from the
+ * received control messages.
+ *
+ * @param header received message header.
+ * @return segment size, or zero if not coalesced.
+ */
+static size_t GetUdpSegmentSize(struct msghdr* header)
+{
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(header); NULL != cmsg;
+			cmsg = CMSG_NXTHDR(header, cmsg))
+	{
+		if ((SOL_UDP == cmsg->cmsg_level) && (UDP_GRO == cmsg->cmsg_type))
+		{
+			int segmentSize;
+			memcpy(&segmentSize, CMSG_DATA(cmsg), sizeof(segmentSize));
+
+			return (segmentSize > 0) ? (size_t) segmentSize : 0;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Sets the control message of the datagram to be sent, so
+ * that the kernel splits it into datagrams of the segment
+ * size. Data that fits a single segment is sent as it is.
+ *
+ * @param batch datagram batch.
+ * @param index datagram index.
+ * @param segmentSize segment size, or zero if not coalesced.
+ */
+static void SetUdpSegmentSize(
+		struct DatagramBatch* batch,
+		int index,
+		size_t segmentSize)
+{
+	struct msghdr* header = &batch->messages[index].msg_hdr;
+
+	if ((0 == segmentSize) || (batch->vectors[index].iov_len <= segmentSize))
+	{
+		header->msg_control = NULL;
+		header->msg_controllen = 0;
+		return;
+	}
+
+	header->msg_control = batch->controls[index].buffer;
+	header->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(header);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+	uint16_t size = (uint16_t) segmentSize;
+	memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+}
+
+/**
+ * Receives up to a batch of datagrams from the socket with
+ * a single call, and sends them all back to their senders
+ * with a single call, until a fatal error or the stop. With
+ * the offload, each received buffer may hold a run of
+ * datagrams of the same sender, and it is sent back as one
+ * buffer for the kernel to split again.
+ *
+ * @param sink log sink.
+ * @param worker worker.
+ * @param flows flow table.
+ * @return 1 when stopped, 0 if not supported by the kernel, or
+ *         negative error number.
+ */
+static int RunUdpBatchEchoLoop(
+		const struct EchoLogSink* sink,
+		struct Worker* worker,
+		struct UdpFlowTable* flows)
+{
+	int sd = worker->serverSocket;
+	struct EchoWorkerStats* stats = worker->stats;
+	struct EchoServerControl* control = worker->control;
+
+	struct DatagramBatch* batch = (struct DatagramBatch*) malloc(
+			sizeof(struct DatagramBatch));
+
+	if (NULL == batch)
+	{
+		EchoLog(sink, LOG_LEVEL_ERROR, "Unable to allocate datagram batch.");
+		return -ENOMEM;
+	}
+
+	// Coalesced datagrams take up to a full buffer
+	batch->offload = worker->config->udpOffload && SetUdpGro(sink, sd, true);
+
+	size_t bufferSize = worker->config->bufferSize;
+	if (batch->offload && (bufferSize < UDP_GRO_BUFFER_SIZE))
+	{
+		bufferSize = UDP_GRO_BUFFER_SIZE;
+	}
+
+	// Page aligned buffers for the whole batch
+	batch->bufferSize = EchoGetPageAlignedSize(bufferSize);
+	batch->buffers = EchoNewBuffer(batch->bufferSize * UDP_BATCH_SIZE);
+	if (NULL == batch->buffers)
+	{
+		EchoLog(sink, LOG_LEVEL_ERROR, "Unable to allocate buffer.");
+		free(batch);
+		return -ENOMEM;
+	}
+
+	bool supported = true;
+	int result = 0;
+
+	// Stoppable loop waits for the stop too when there is no datagram
+	int flags = MSG_WAITFORONE | ((NULL != control) ? MSG_DONTWAIT : 0);
+
+	while (!EchoIsStopRequested(control))
+	{
+		ResetDatagramBatch(batch);
+
+		// Block until a datagram arrives, then take the ones queued
+		TRACE_BEGIN(TRACE_RECV_BATCH);
+		int recvCount = recvmmsg(sd, batch->messages, UDP_BATCH_SIZE,
+				flags, NULL);
+		TRACE_END();
+
+		EchoAddStat(stats, STAT_SYSCALLS, 1);
+
+		if (-1 == recvCount)
+		{
+			if (EINTR == errno)
+				continue;
+
+			if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+			{
+				EchoAddStat(stats, STAT_EAGAINS, 1);
+
+				int waited = WaitForDatagrams(sink, sd, control);
+				if (waited <= 0)
+				{
+					result = waited;
+					break;
+				}
+
+				continue;
+			}
+
+			// Kernels prior to 2.6.33 do not have it
+			if (ENOSYS == errno)
+			{
+				supported = false;
+				break;
+			}
+
+			result = -errno;
+			EchoLogErrno(sink, "Unable to receive datagrams:", -result);
+			break;
+		}
+
+		EchoLogDebug(sink, "Received %d datagrams.", recvCount);
+
+		uint64_t now = (NULL != flows->flows) ? EchoGetMonotonicTime() : 0;
+		int sendCount = 0;
+
+		// Send back only the received data to its sender
+		for (int i = 0; i < recvCount; i++)
+		{
+			size_t length = batch->messages[i].msg_len;
+			EchoAddStat(stats, STAT_BYTES_IN, length);
+
+			size_t segmentSize = batch->offload
+					? GetUdpSegmentSize(&batch->messages[i].msg_hdr) : 0;
+
+			size_t count = (0 == segmentSize) ? 1
+					: (length + segmentSize - 1) / segmentSize;
+
+			// Rate limited datagrams are cut off the send batch
+			size_t admitted = AdmitUdpDatagrams(flows, &batch->addresses[i],
+					count, length, now);
+
+			if (admitted < count)
+			{
+				EchoAddStat(stats, STAT_DROPS, count - admitted);
+
+				if (0 == admitted)
+					continue;
+
+				length = admitted * segmentSize;
+			}
+
+			batch->vectors[i].iov_len = length;
+
+			if (batch->offload)
+			{
+				SetUdpSegmentSize(batch, i, segmentSize);
+			}
+
+			if (sendCount != i)
+			{
+				batch->messages[sendCount] = batch->messages[i];
+			}
+
+			sendCount++;
+		}
+
+		int sentCount = 0;
+		while (sentCount < sendCount)
+		{
+			TRACE_BEGIN(TRACE_SEND_BATCH);
+			int sent = sendmmsg(sd, batch->messages + sentCount,
+					sendCount - sentCount, 0);
+			TRACE_END();
+
+			EchoAddStat(stats, STAT_SYSCALLS, 1);
+
+			if (-1 == sent)
+			{
+				if (EINTR == errno)
+					continue;
+
+				if (ENOSYS == errno)
+				{
+					supported = false;
+					break;
+				}
+
+				// Drop only the datagram that failed
+				EchoLogErrno(sink, "Unable to send datagram:", errno);
+				EchoAddStat(stats, STAT_DROPS, 1);
+				sentCount++;
+				continue;
+			}
+
+			// Rest of the batch goes with the next call
+			if (sent < (sendCount - sentCount))
+			{
+				EchoAddStat(stats, STAT_SHORT_WRITES, 1);
+			}
+
+			for (int i = sentCount; i < (sentCount + sent); i++)
+			{
+				EchoAddStat(stats, STAT_BYTES_OUT, batch->messages[i].msg_len);
+			}
+
+			sentCount += sent;
+		}
+
+		if (!supported)
+			break;
+
+		EchoLogDebug(sink, "Sent %d datagrams.", sentCount);
+	}
+
+	// Datagram at a time fallback cannot split the coalesced ones
+	if (!supported && batch->offload)
+	{
+		SetUdpGro(sink, sd, false);
+	}
+
+	free(batch->buffers);
+	free(batch);
+
+	if (!supported)
+		return 0;
+
+	return (result < 0) ? result : 1;
+}
+#endif
+
+/**
+ * UDP worker body, echoes the datagrams on the worker
+ * server socket.
+ *
+ * @param sink log sink.
+ * @param worker worker.
+ * @return zero or negative error number.
+ */
+static int RunUdpWorker(
+		const struct EchoLogSink* sink,
+		struct Worker* worker)
+{
+	// Each worker keeps the flows of the peers it receives from
+	struct UdpFlowTable flows;
+	int result = NewUdpFlowTable(sink, worker->config, &flows);
+	if (result < 0)
+		return result;
+
+#ifdef HAVE_SENDMMSG
+	// Fall back to a datagram at a time if not supported
+	result = RunUdpBatchEchoLoop(sink, worker, &flows);
+
+	if (0 == result)
+	{
+		EchoLog(sink, LOG_LEVEL_INFO, "recvmmsg is not supported, "
+				"receiving a datagram at a time.");
+		result = RunUdpEchoLoop(sink, worker, &flows);
+	}
+	else if (result > 0)
+	{
+		result = 0;
+	}
+#else
+	result = RunUdpEchoLoop(sink, worker, &flows);
+#endif
+
+	DeleteUdpFlowTable(&flows);
+
+	return result;
+}
+
+void EchoInitConfig(struct EchoConfig* config)
+{
+	memset(config, 0, sizeof(struct EchoConfig));
+
+	config->bufferSize = DEFAULT_BUFFER_SIZE;
+	config->poolSize = DEFAULT_POOL_SIZE;
+	config->highWaterMark = DEFAULT_HIGH_WATER_MARK;
+	config->maxFrameSize = DEFAULT_MAX_FRAME_SIZE;
+	config->ioUring = DEFAULT_IO_URING;
+	config->drainTimeout = DEFAULT_DRAIN_TIMEOUT;
+	config->idleTimeout = DEFAULT_IDLE_TIMEOUT;
+	config->readTimeout = DEFAULT_READ_TIMEOUT;
+	config->writeTimeout = DEFAULT_WRITE_TIMEOUT;
+	config->udpFlows = DEFAULT_UDP_FLOWS;
+	config->udpRateLimit = DEFAULT_UDP_RATE_LIMIT;
+	config->dualStack = true;
+	config->resolveTimeout = DEFAULT_RESOLVE_TIMEOUT;
+	config->connectTimeout = DEFAULT_CONNECT_TIMEOUT;
+
+	// Default socket profile only disables Nagle
+	config->socket.noDelay = true;
+	config->socket.backlog = DEFAULT_BACKLOG;
+	config->socket.coalesceSize = DEFAULT_COALESCE_SIZE;
+
+	config->scheduling.policy = SCHED_INHERIT;
+
+	config->captureSize = DEFAULT_CAPTURE_SIZE;
+}
+
+struct EchoWorkerStats* EchoAcquireWorkerStats()
+{
+	for (int i = 0; i < MAX_STATS_SLOTS; i++)
+	{
+		int expected = 0;
+
+		if (__atomic_compare_exchange_n(&workerStats[i].inUse, &expected, 1,
+				false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			return &workerStats[i];
+		}
+	}
+
+	return NULL;
+}
+
+void EchoReleaseWorkerStats(struct EchoWorkerStats* stats)
+{
+	if (NULL != stats)
+	{
+		__atomic_store_n(&stats->inUse, 0, __ATOMIC_RELEASE);
+	}
+}
+
+void EchoGetStats(uint64_t totals[STAT_COUNT])
+{
+	memset(totals, 0, STAT_COUNT * sizeof(uint64_t));
+
+	uint64_t second = EchoGetMonotonicTime() / 1000000000ULL;
+
+	// Sum the counters without stopping the workers
+	for (int i = 0; i < MAX_STATS_SLOTS; i++)
+	{
+		for (int j = 0; j < STAT_COUNT; j++)
+		{
+			totals[j] += __atomic_load_n(&workerStats[i].counters[j],
+					__ATOMIC_RELAXED);
+		}
+
+		// Rate is not a counter, it is derived from the last second
+		totals[STAT_ACCEPT_RATE] += GetAcceptRate(&workerStats[i], second);
+	}
+}
+
+int EchoGetUdpFlows(uint64_t** values, size_t* count)
+{
+	*values = NULL;
+	*count = 0;
+
+	uint64_t now = EchoGetMonotonicTime();
+
+	pthread_mutex_lock(&udpFlowRegistry.mutex);
+
+	// Room for every slot, only the active flows are taken
+	size_t capacity = 0;
+	for (struct UdpFlowTable* table = udpFlowRegistry.tables; NULL != table;
+			table = table->next)
+	{
+		capacity += table->mask + 1;
+	}
+
+	if (capacity > 0)
+	{
+		*values = (uint64_t*) malloc(capacity * UDP_FLOW_FIELDS
+				* sizeof(uint64_t));
+	}
+
+	// Flows are read while the workers update them
+	for (struct UdpFlowTable* table = udpFlowRegistry.tables;
+			(NULL != table) && (NULL != *values); table = table->next)
+	{
+		for (size_t i = 0; i <= table->mask; i++)
+		{
+			struct UdpFlow* flow = &table->flows[i];
+
+			uint64_t lastSeen = __atomic_load_n(&flow->lastSeen,
+					__ATOMIC_RELAXED);
+
+			if ((0 == lastSeen) || (lastSeen + UDP_FLOW_TIMEOUT < now))
+				continue;
+
+			uint64_t* value = &(*values)[*count * UDP_FLOW_FIELDS];
+			value[0] = __atomic_load_n(&flow->address[0], __ATOMIC_RELAXED);
+			value[1] = __atomic_load_n(&flow->address[1], __ATOMIC_RELAXED);
+			value[2] = __atomic_load_n(&flow->port, __ATOMIC_RELAXED);
+			value[3] = __atomic_load_n(&flow->datagrams, __ATOMIC_RELAXED);
+			value[4] = __atomic_load_n(&flow->bytes, __ATOMIC_RELAXED);
+			value[5] = __atomic_load_n(&flow->drops, __ATOMIC_RELAXED);
+			value[6] = (now > lastSeen) ? (now - lastSeen) / 1000000ULL : 0;
+
+			(*count)++;
+		}
+	}
+
+	pthread_mutex_unlock(&udpFlowRegistry.mutex);
+
+	if ((capacity > 0) && (NULL == *values))
+		return -ENOMEM;
+
+	return 0;
+}
+
+int EchoNewServerControl(struct EchoServerControl** control)
+{
+	*control = (struct EchoServerControl*) calloc(1,
+			sizeof(struct EchoServerControl));
+
+	if (NULL == *control)
+		return -ENOMEM;
+
+	// Never read, so it wakes up every loop watching it
+	(*control)->stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (-1 == (*control)->stopFd)
+	{
+		int error = errno;
+
+		free(*control);
+		*control = NULL;
+
+		return -error;
+	}
+
+	return 0;
+}
+
+void EchoStopServer(struct EchoServerControl* control)
+{
+	__atomic_store_n(&control->stopping, 1, __ATOMIC_RELEASE);
+
+	uint64_t value = 1;
+	while ((-1 == write(control->stopFd, &value, sizeof(value)))
+			&& (EINTR == errno))
+	{
+	}
+}
+
+void EchoDeleteServerControl(struct EchoServerControl* control)
+{
+	if (NULL == control)
+		return;
+
+	close(control->stopFd);
+	free(control);
+}
+
+/**
+ * Allocates a new server and its workers, with copies of the
+ * log sink and the configuration for the workers to use.
+ *
+ * @param server new server.
+ * @param sink log sink or NULL.
+ * @param config configuration.
+ * @param count worker count.
+ * @param control server control or NULL.
+ * @return zero or negative error number.
+ */
+static int NewServer(
+		struct EchoServer** server,
+		const struct EchoLogSink* sink,
+		const struct EchoConfig* config,
+		int count,
+		struct EchoServerControl* control)
+{
+	*server = (struct EchoServer*) calloc(1, sizeof(struct EchoServer));
+	if (NULL == *server)
+		return -ENOMEM;
+
+	if (NULL != sink)
+	{
+		(*server)->sink = *sink;
+	}
+
+	(*server)->config = *config;
+	(*server)->scheduled = IsWorkerSchedulingSet(&config->scheduling);
+
+	return NewWorkers(*server, count, control);
+}
+
+/**
+ * Constructs a new listening server socket for a worker,
+ * bound to the given port.
+ *
+ * @param server server.
+ * @param type socket type, stream or datagram.
+ * @param reusePort share the port with the other workers,
+ *                  cleared if not supported.
+ * @return socket descriptor or negative error number.
+ */
+static int NewWorkerSocket(
+		struct EchoServer* server,
+		int type,
+		bool* reusePort)
+{
+	const struct EchoLogSink* sink = &server->sink;
+	int family;
+
+	// Servers are dual stack unless IPv6 is not available
+	int sd = EchoNewServerSocket(sink, &server->config.socket, type,
+			server->config.dualStack, &family);
+	if (sd < 0)
+		return sd;
+
+	int result = 0;
+
+	// Restart binds over the connections the stop left in TIME_WAIT
+	if (SOCK_STREAM == type)
+	{
+		result = EchoSetSocketReuseAddress(sd);
+		if (result < 0)
+			goto exit;
+	}
+
+	// Allow the worker sockets to bind to the same port
+	if (*reusePort)
+	{
+		result = EchoSetSocketReusePort(sink, sd);
+		if (result < 0)
+			goto exit;
+
+		*reusePort = (result > 0);
+	}
+
+	// Bind socket to a port number
+	result = EchoBindSocketToPort(sink, sd, family, server->port);
+	if (result < 0)
+		goto exit;
+
+	// If random port number is requested
+	if (0 == server->port)
+	{
+		// Other workers bind to the same random port
+		result = EchoGetSocketPort(sink, sd);
+		if (result < 0)
+			goto exit;
+
+		server->port = (unsigned short) result;
+	}
+
+	if (SOCK_STREAM == type)
+	{
+		// Fast open queue is set up before listening
+		EchoApplySocketProfile(sink, &server->config.socket, sd, family,
+				SOCK_STREAM, SOCKET_LISTENING);
+
+		// Listen on socket with the profile backlog
+		result = EchoListenOnSocket(sink, sd, server->config.socket.backlog);
+		if (result < 0)
+			goto exit;
+	}
+
+	return sd;
+
+exit:
+	close(sd);
+
+	return result;
+}
+
+/**
+ * Constructs the capture the stream workers record into if a
+ * capture path is configured.
+ *
+ * @param server server.
+ * @return zero or negative error number.
+ */
+static int NewServerCapture(struct EchoServer* server)
+{
+	if ('\0' == server->config.capturePath[0])
+		return 0;
+
+	int result = EchoNewCapture(&server->capture, &server->sink,
+			server->config.capturePath, server->config.captureSize);
+	if (result < 0)
+	{
+		EchoLogErrno(&server->sink, "Unable to construct the capture:",
+				-result);
+	}
+
+	return result;
+}
+
+int EchoNewTcpServer(
+		struct EchoServer** server,
+		const struct EchoLogSink* sink,
+		const struct EchoConfig* config,
+		unsigned short port,
+		int workerCount,
+		struct EchoServerControl* control)
+{
+	int count = GetWorkerCount(workerCount);
+
+	// Accept thread is the last worker, after the I/O workers
+	bool acceptThread = config->scheduling.acceptThread;
+	int total = acceptThread ? count + 1 : count;
+	bool reusePort = (count > 1) && !acceptThread;
+
+	int stopFd = GetStopFd(control);
+	struct Worker* workers;
+
+	// Allocate the workers
+	int result = NewServer(server, sink, config, total, control);
+	if (result < 0)
+		goto exit;
+
+	(*server)->port = port;
+	sink = &(*server)->sink;
+	config = &(*server)->config;
+	workers = (*server)->workers;
+
+	// Workers record into a single capture if one is configured
+	result = NewServerCapture(*server);
+	if (result < 0)
+		goto exit;
+
+	for (int i = 0; i < total; i++)
+	{
+		struct Worker* worker = &workers[i];
+		worker->run = RunTcpWorker;
+
+		if (acceptThread && (i < count))
+		{
+			// I/O workers get the clients through their pipes
+			int pipeFds[2];
+			if (!NewPipe(pipeFds))
+			{
+				result = -errno;
+				goto exit;
+			}
+
+			worker->serverSocket = pipeFds[0];
+			worker->handoffFd = pipeFds[1];
+
+			result = NewEventLoop(sink, config, &worker->loop,
+					worker->serverSocket, worker->stats, stopFd);
+			if (result < 0)
+				goto exit;
+
+			worker->loop.handoff = true;
+			worker->loop.capture = (*server)->capture;
+			continue;
+		}
+
+		// Share the first server socket if port cannot be reused
+		if ((i > 0) && !reusePort && !acceptThread)
+		{
+			worker->serverSocket = workers[0].serverSocket;
+		}
+		else
+		{
+			result = NewWorkerSocket(*server, SOCK_STREAM, &reusePort);
+			if (result < 0)
+				goto exit;
+
+			worker->serverSocket = result;
+		}
+
+		if (acceptThread)
+		{
+			result = EchoSetSocketNonBlocking(worker->serverSocket);
+			if (result < 0)
+				goto exit;
+
+			worker->acceptor = true;
+			worker->peers = workers;
+			worker->peerCount = count;
+			worker->run = RunAcceptWorker;
+			continue;
+		}
+
+#ifdef HAVE_IO_URING
+		// Prefer the io_uring loop if the kernel supports it
+		result = NewUringLoop(sink, config, &worker->uring,
+				worker->serverSocket, worker->stats, stopFd);
+		if (result < 0)
+			goto exit;
+
+		if (result > 0)
+		{
+			worker->run = RunUringWorker;
+			continue;
+		}
+#endif
+
+		// Construct the event loop for the server socket
+		result = NewEventLoop(sink, config, &worker->loop,
+				worker->serverSocket, worker->stats, stopFd);
+		if (result < 0)
+			goto exit;
+
+		worker->loop.capture = (*server)->capture;
+	}
+
+	return 0;
+
+exit:
+	// Close what is constructed so far
+	EchoDeleteServer(*server);
+	*server = NULL;
+
+	return result;
+}
+
+int EchoNewUdpServer(
+		struct EchoServer** server,
+		const struct EchoLogSink* sink,
+		const struct EchoConfig* config,
+		unsigned short port,
+		int workerCount,
+		struct EchoServerControl* control)
+{
+	int count = GetWorkerCount(workerCount);
+	bool reusePort = (count > 1);
+	struct Worker* workers;
+
+	// Allocate the workers
+	int result = NewServer(server, sink, config, count, control);
+	if (result < 0)
+		goto exit;
+
+	(*server)->port = port;
+	workers = (*server)->workers;
+
+	for (int i = 0; i < count; i++)
+	{
+		struct Worker* worker = &workers[i];
+		worker->run = RunUdpWorker;
+
+		// Share the first server socket if port cannot be reused
+		if ((i > 0) && !reusePort)
+		{
+			worker->serverSocket = workers[0].serverSocket;
+			continue;
+		}
+
+		result = NewWorkerSocket(*server, SOCK_DGRAM, &reusePort);
+		if (result < 0)
+			goto exit;
+
+		worker->serverSocket = result;
+	}
+
+	return 0;
+
+exit:
+	// Close what is constructed so far
+	EchoDeleteServer(*server);
+	*server = NULL;
+
+	return result;
+}
+
+int EchoNewLocalServer(
+		struct EchoServer** server,
+		const struct EchoLogSink* sink,
+		const struct EchoConfig* config,
+		const char* name,
+		int type,
+		struct EchoServerControl* control)
+{
+	*server = NULL;
+
+	if ((LOCAL_STREAM != type) && (LOCAL_SEQPACKET != type))
+		return -EINVAL;
+
+	struct Worker* worker;
+
+	// Clients are served on a single event loop
+	int result = NewServer(server, sink, config, 1, control);
+	if (result < 0)
+		goto exit;
+
+	// Local server serves on the calling thread
+	(*server)->scheduled = false;
+	sink = &(*server)->sink;
+
+	worker = &(*server)->workers[0];
+	worker->run = RunTcpWorker;
+
+	// Construct a new local UNIX socket.
+	worker->serverSocket = EchoNewSocket(sink, PF_LOCAL,
+			(LOCAL_SEQPACKET == type) ? SOCK_SEQPACKET : SOCK_STREAM);
+	if (worker->serverSocket < 0)
+	{
+		result = worker->serverSocket;
+		goto exit;
+	}
+
+	// Bind socket to the name
+	result = EchoBindLocalSocketToName(sink, worker->serverSocket, name);
+	if (result < 0)
+		goto exit;
+
+	// Listen on socket with the profile backlog
+	result = EchoListenOnSocket(sink, worker->serverSocket,
+			config->socket.backlog);
+	if (result < 0)
+		goto exit;
+
+	// Construct the event loop for the server socket
+	result = NewEventLoop(sink, &(*server)->config, &worker->loop,
+			worker->serverSocket, worker->stats, GetStopFd(control));
+	if (result < 0)
+		goto exit;
+
+	// Splice would drop the passed descriptors and the boundaries
+	worker->loop.zeroCopy = false;
+	worker->loop.passFds = true;
+	worker->loop.messages = (LOCAL_SEQPACKET == type);
+
+	result = NewServerCapture(*server);
+	if (result < 0)
+		goto exit;
+
+	worker->loop.capture = (*server)->capture;
+
+	return 0;
+
+exit:
+	// Close what is constructed so far
+	EchoDeleteServer(*server);
+	*server = NULL;
+
+	return result;
+}
+
+unsigned short EchoGetServerPort(const struct EchoServer* server)
+{
+	return server->port;
+}
+
+int EchoRunServer(struct EchoServer* server)
+{
+	// Serve the clients until a fatal error or the stop
+	return RunWorkers(&server->sink, server->workers, server->workerCount,
+			server->scheduled);
+}
+
+void EchoDeleteServer(struct EchoServer* server)
+{
+	if (NULL == server)
+		return;
+
+	// Close the client connections and the server sockets
+	DeleteWorkers(server->workers, server->workerCount);
+
+	// Workers are gone, the capture can be trimmed
+	EchoDeleteCapture(server->capture, &server->sink);
+
+	free(server);
+}
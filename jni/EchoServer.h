@@ -0,0 +1,428 @@
+/**
+ * Echo servers of the Echo library: the TCP workers on epoll or
+ * io_uring, the UDP workers and the local UNIX socket server.
+ * Free of JNI like the socket core, so that the app and the
+ * standalone benchmark suite run the same server loops on native
+ * threads that are not attached to the Java VM.
+ *
+ * Failures are returned as negative error numbers.
+ */
+#ifndef ECHO_SERVER_H
+#define ECHO_SERVER_H
+
+#include "EchoSocket.h"
+
+// size_t
+#include <stddef.h>
+
+// uint64_t
+#include <stdint.h>
+
+// Default data buffer size
+#define DEFAULT_BUFFER_SIZE 4096
+
+// Default number of buffers allocated at once by a buffer pool
+#define DEFAULT_POOL_SIZE 16
+
+// Cache line size
+#define CACHE_LINE_SIZE 64
+
+// Default bytes queued for a connection before reading stops
+#define DEFAULT_HIGH_WATER_MARK 262144
+
+// Default frame payload size accepted by the server
+#define DEFAULT_MAX_FRAME_SIZE 1048576
+
+// io_uring is off by default on Android, the app seccomp filter traps it
+#ifdef __ANDROID__
+#define DEFAULT_IO_URING false
+#else
+#define DEFAULT_IO_URING true
+#endif
+
+// Time given to a stopping server to send the queued data, in ms
+#define DEFAULT_DRAIN_TIMEOUT 1000
+
+// Connection timeouts in ms, zero disables them
+#define DEFAULT_IDLE_TIMEOUT 0
+#define DEFAULT_READ_TIMEOUT 0
+#define DEFAULT_WRITE_TIMEOUT 0
+
+// Listen backlog, the kernel caps it at somaxconn
+#define DEFAULT_BACKLOG 128
+
+// Bytes coalesced before they are sent
+#define DEFAULT_COALESCE_SIZE 16384
+
+// Max length of the capture file path
+#define MAX_CAPTURE_PATH 256
+
+// Default size of the capture file
+#define DEFAULT_CAPTURE_SIZE 67108864
+
+// Max number of CPUs in a worker CPU list
+#define MAX_WORKER_CPUS 64
+
+// Scheduling policy that keeps the inherited one
+#define SCHED_INHERIT -1
+
+// Time to wait for the resolver thread in ms
+#define DEFAULT_RESOLVE_TIMEOUT 5000
+
+// Time a connect attempt may take in ms, zero for the system limit
+#define DEFAULT_CONNECT_TIMEOUT 10000
+
+// Flows kept per UDP worker, rounded up to a power of two, zero disables them
+#define DEFAULT_UDP_FLOWS 1024
+
+// Datagrams per second a UDP peer may send, zero for no limit
+#define DEFAULT_UDP_RATE_LIMIT 0
+
+// Values per flow in a flow snapshot, same as in EchoServerActivity
+#define UDP_FLOW_FIELDS 7
+
+// Local socket types, same as in LocalEchoActivity
+#define LOCAL_STREAM 0
+#define LOCAL_SEQPACKET 1
+
+// Worker counter indices, same as in EchoServerActivity
+#define STAT_ACCEPTS 0
+#define STAT_ACTIVE_CONNECTIONS 1
+#define STAT_BYTES_IN 2
+#define STAT_BYTES_OUT 3
+#define STAT_SYSCALLS 4
+#define STAT_EAGAINS 5
+#define STAT_SHORT_WRITES 6
+#define STAT_DROPS 7
+#define STAT_TIMEOUTS 8
+#define STAT_ACCEPT_RATE 9
+#define STAT_COUNT 10
+
+/**
+ * Scheduling of the native worker threads. Defaults keep
+ * what the threads inherit from the starting thread.
+ */
+struct EchoWorkerScheduling
+{
+	// CPUs the workers are pinned to, one each in turn, none to not pin
+	int cpus[MAX_WORKER_CPUS];
+	size_t cpuCount;
+
+	// Stream servers accept on a thread of their own
+	bool acceptThread;
+
+	// CPUs the accept thread runs on, none to not pin
+	int acceptCpus[MAX_WORKER_CPUS];
+	size_t acceptCpuCount;
+
+	// Scheduling policy, or SCHED_INHERIT
+	int policy;
+
+	// Real time priority of the FIFO and RR policies, zero for the lowest
+	int priority;
+
+	// Nice value of the other policies, applied only if set
+	bool niceSet;
+	int nice;
+};
+
+/**
+ * Echo library configuration, read when a server or client
+ * is started.
+ */
+struct EchoConfig
+{
+	// Data buffer size
+	size_t bufferSize;
+
+	// Number of buffers allocated at once by a buffer pool
+	size_t poolSize;
+
+	// Echo stream data with splice instead of copying it
+	bool zeroCopy;
+
+	// Bytes queued for a connection before reading from it stops
+	size_t highWaterMark;
+
+	// Session keepalive idle time in seconds, zero to disable
+	int keepAlive;
+
+	// Stream server checks the length prefixed frames
+	bool framing;
+
+	// Max frame payload size accepted by the server
+	size_t maxFrameSize;
+
+	// Stream server uses io_uring if the kernel supports it
+	bool ioUring;
+
+	// Time given to a stopping server to send the queued data, in ms
+	int drainTimeout;
+
+	// Time a connection may receive and send nothing, in ms
+	int idleTimeout;
+
+	// Time a frame may take to arrive from its first byte, in ms
+	int readTimeout;
+
+	// Time the queued data may wait for the client to read, in ms
+	int writeTimeout;
+
+	// Flow table size of a UDP worker, zero to disable the flows
+	size_t udpFlows;
+
+	// Datagrams per second echoed to a UDP peer, zero for no limit
+	int udpRateLimit;
+
+	// UDP server receives coalesced datagrams and sends them segmented
+	bool udpOffload;
+
+	// Servers listen on IPv6 and IPv4 with a single socket
+	bool dualStack;
+
+	// Time a client waits for the host name to resolve, in ms
+	int resolveTimeout;
+
+	// Time a client waits for a connect attempt, in ms
+	int connectTimeout;
+
+	// Socket options
+	struct EchoSocketProfile socket;
+
+	// Worker thread scheduling
+	struct EchoWorkerScheduling scheduling;
+
+	// File the stream servers record the received data in, empty if not
+	char capturePath[MAX_CAPTURE_PATH];
+
+	// Size the capture file is mapped with, records beyond it are dropped
+	size_t captureSize;
+};
+
+/**
+ * Counters of a single worker. Each worker has its own cache
+ * line, and only the owning worker writes to its counters.
+ */
+struct EchoWorkerStats
+{
+	// Counter values, indexed by the STAT constants
+	uint64_t counters[STAT_COUNT];
+
+	// Second of the monotonic clock the accepts are counted in
+	uint64_t acceptSecond;
+
+	// Accepts in that second and in the one before it
+	uint64_t acceptsThisSecond;
+	uint64_t acceptsLastSecond;
+
+	// Slot is owned by a running worker
+	int inUse;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/**
+ * Stop request shared by the controlling thread and a running
+ * server. A control stops a single server run.
+ */
+struct EchoServerControl
+{
+	// Eventfd that stays readable once the stop is requested
+	int stopFd;
+
+	// Stop is requested, checked by the busy loops without a syscall
+	int stopping;
+};
+
+/**
+ * Echo server with its sockets and workers, opaque.
+ */
+struct EchoServer;
+
+/**
+ * Adds the given value to a worker counter. Having a single
+ * writer, it needs no atomic read-modify-write, only a store
+ * that the readers never see torn.
+ *
+ * @param stats worker counters.
+ * @param index counter index.
+ * @param value value to add.
+ */
+static inline void EchoAddStat(
+		struct EchoWorkerStats* stats,
+		int index,
+		uint64_t value)
+{
+	__atomic_store_n(&stats->counters[index],
+			__atomic_load_n(&stats->counters[index], __ATOMIC_RELAXED) + value,
+			__ATOMIC_RELAXED);
+}
+
+/**
+ * Checks if the server is requested to stop.
+ *
+ * @param control server control or NULL.
+ * @return true if stopping.
+ */
+static inline bool EchoIsStopRequested(const struct EchoServerControl* control)
+{
+	return (NULL != control)
+			&& (0 != __atomic_load_n(&control->stopping, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Sets the given configuration to the defaults.
+ *
+ * @param config configuration.
+ */
+void EchoInitConfig(struct EchoConfig* config);
+
+/**
+ * Acquires a free worker counters slot. Counters are not
+ * reset so that the totals keep increasing.
+ *
+ * @return worker counters or NULL if all slots are in use.
+ */
+struct EchoWorkerStats* EchoAcquireWorkerStats();
+
+/**
+ * Releases the worker counters slot.
+ *
+ * @param stats worker counters or NULL.
+ */
+void EchoReleaseWorkerStats(struct EchoWorkerStats* stats);
+
+/**
+ * Gets the counters summed over all workers, with the accepts
+ * of the last full second as the accept rate.
+ *
+ * @param totals counter totals, indexed by the STAT constants.
+ */
+void EchoGetStats(uint64_t totals[STAT_COUNT]);
+
+/**
+ * Gets a snapshot of the flows of the running UDP workers,
+ * UDP_FLOW_FIELDS values per flow: the IPv6 address as two
+ * big endian halves, the port, datagrams and bytes received,
+ * datagrams dropped, and milliseconds since the last one.
+ *
+ * @param values flow values, released with free, NULL if no
+ *               flows.
+ * @param count number of flows.
+ * @return zero or negative error number.
+ */
+int EchoGetUdpFlows(uint64_t** values, size_t* count);
+
+/**
+ * Constructs a new server control.
+ *
+ * @param control new server control.
+ * @return zero or negative error number.
+ */
+int EchoNewServerControl(struct EchoServerControl** control);
+
+/**
+ * Requests the server using the given control to stop. Safe
+ * to call from any thread, and before the server runs.
+ *
+ * @param control server control.
+ */
+void EchoStopServer(struct EchoServerControl* control);
+
+/**
+ * Deletes the given server control once the server is done.
+ *
+ * @param control server control or NULL.
+ */
+void EchoDeleteServerControl(struct EchoServerControl* control);
+
+/**
+ * Constructs a new TCP echo server listening on the given port.
+ * Each worker serves its connections with an event loop, on
+ * io_uring if configured and supported, on epoll otherwise.
+ *
+ * @param server new server.
+ * @param sink log sink or NULL, copied, its context is used
+ *             until the server is deleted.
+ * @param config configuration, copied.
+ * @param port port number or zero for random port.
+ * @param workerCount number of workers.
+ * @param control server control or NULL if not stoppable.
+ * @return zero or negative error number, the server is NULL
+ *         on failure.
+ */
+int EchoNewTcpServer(
+		struct EchoServer** server,
+		const struct EchoLogSink* sink,
+		const struct EchoConfig* config,
+		unsigned short port,
+		int workerCount,
+		struct EchoServerControl* control);
+
+/**
+ * Constructs a new UDP echo server listening on the given port.
+ *
+ * @param server new server.
+ * @param sink log sink or NULL, copied, its context is used
+ *             until the server is deleted.
+ * @param config configuration, copied.
+ * @param port port number or zero for random port.
+ * @param workerCount number of workers.
+ * @param control server control or NULL if not stoppable.
+ * @return zero or negative error number, the server is NULL
+ *         on failure.
+ */
+int EchoNewUdpServer(
+		struct EchoServer** server,
+		const struct EchoLogSink* sink,
+		const struct EchoConfig* config,
+		unsigned short port,
+		int workerCount,
+		struct EchoServerControl* control);
+
+/**
+ * Constructs a new local UNIX socket echo server listening on
+ * the given name. It serves on the calling thread.
+ *
+ * @param server new server.
+ * @param sink log sink or NULL, copied, its context is used
+ *             until the server is deleted.
+ * @param config configuration, copied.
+ * @param name socket name.
+ * @param type LOCAL_STREAM or LOCAL_SEQPACKET.
+ * @param control server control or NULL if not stoppable.
+ * @return zero or negative error number, the server is NULL
+ *         on failure.
+ */
+int EchoNewLocalServer(
+		struct EchoServer** server,
+		const struct EchoLogSink* sink,
+		const struct EchoConfig* config,
+		const char* name,
+		int type,
+		struct EchoServerControl* control);
+
+/**
+ * Gets the port the given server listens on.
+ *
+ * @param server TCP or UDP server.
+ * @return port number.
+ */
+unsigned short EchoGetServerPort(const struct EchoServer* server);
+
+/**
+ * Runs the given server until it is stopped or fails. Blocks
+ * until all of its workers are done.
+ *
+ * @param server server.
+ * @return zero, or the negative error number the first failed
+ *         worker stopped with.
+ */
+int EchoRunServer(struct EchoServer* server);
+
+/**
+ * Closes the sockets of the given server and releases it.
+ *
+ * @param server server or NULL.
+ */
+void EchoDeleteServer(struct EchoServer* server);
+
+#endif
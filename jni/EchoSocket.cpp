@@ -0,0 +1,747 @@
+#include "EchoSocket.h"
+#include "EchoTrace.h"
+
+// NULL, snprintf
+#include <stdio.h>
+
+// errno
+#include <errno.h>
+
+// memset, strlen, strcpy, strchr, strerror_r
+#include <string.h>
+
+// htons, sockaddr_in, sockaddr_in6
+#include <netinet/in.h>
+
+// inet_ntop
+#include <arpa/inet.h>
+
+// close, unlink, sysconf
+#include <unistd.h>
+
+// offsetof
+#include <stddef.h>
+
+// posix_memalign
+#include <stdlib.h>
+
+// fcntl
+#include <fcntl.h>
+
+// clock_gettime
+#include <time.h>
+
+// TCP_NODELAY
+#include <netinet/tcp.h>
+
+// SO_REUSEPORT is missing from the older platform headers
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+
+// Socket profile options missing from the older platform headers
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+#ifndef TCP_QUICKACK
+#define TCP_QUICKACK 12
+#endif
+
+#ifndef TCP_FASTOPEN
+#define TCP_FASTOPEN 23
+#endif
+
+void EchoLog(
+		const struct EchoLogSink* sink,
+		int level,
+		const char* format,
+		...)
+{
+	if ((NULL == sink) || (NULL == sink->log) || (level > LOG_LEVEL))
+		return;
+
+	va_list ap;
+	va_start(ap, format);
+	sink->log(sink->context, level, format, ap);
+	va_end(ap);
+}
+
+void EchoLogErrno(
+		const struct EchoLogSink* sink,
+		const char* message,
+		int errnum)
+{
+	char buffer[MAX_LOG_MESSAGE_LENGTH];
+
+	// Log message
+	EchoLog(sink, LOG_LEVEL_ERROR, "%s %s", message,
+			EchoGetErrorMessage(errnum, buffer, sizeof(buffer)));
+}
+
+/**
+ * Gets the message of the XSI strerror_r.
+ *
+ * @param result strerror_r result.
+ * @param buffer message buffer.
+ * @return message.
+ */
+static inline const char* GetErrorMessage(int result, const char* buffer)
+{
+	return (0 == result) ? buffer : "Unknown error";
+}
+
+/**
+ * Gets the message of the GNU strerror_r.
+ *
+ * @param result strerror_r result.
+ * @param buffer message buffer.
+ * @return message.
+ */
+static inline const char* GetErrorMessage(const char* result, const char*)
+{
+	return result;
+}
+
+const char* EchoGetErrorMessage(
+		int errnum,
+		char* buffer,
+		size_t bufferSize)
+{
+	// The GNU strerror_r may return a static message instead
+	const char* message = GetErrorMessage(
+			strerror_r(errnum, buffer, bufferSize), buffer);
+
+	if (message != buffer)
+	{
+		snprintf(buffer, bufferSize, "%s", message);
+	}
+
+	return buffer;
+}
+
+uint64_t EchoGetMonotonicTime()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return ((uint64_t) now.tv_sec * 1000000000ULL) + (uint64_t) now.tv_nsec;
+}
+
+size_t EchoGetPageAlignedSize(size_t size)
+{
+	size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+
+	return ((size + pageSize - 1) / pageSize) * pageSize;
+}
+
+char* EchoNewBuffer(size_t size)
+{
+	void* buffer = NULL;
+
+	if (0 != posix_memalign(&buffer, (size_t) sysconf(_SC_PAGESIZE),
+			EchoGetPageAlignedSize(size)))
+	{
+		buffer = NULL;
+	}
+
+	return (char*) buffer;
+}
+
+/**
+ * Sets the given integer socket option, logging it if the
+ * kernel rejects it.
+ *
+ * @param sink log sink or NULL.
+ * @param sd socket descriptor.
+ * @param level option level.
+ * @param option option name.
+ * @param value option value.
+ * @param message message logged if it is rejected.
+ */
+static void SetSocketOption(
+		const struct EchoLogSink* sink,
+		int sd,
+		int level,
+		int option,
+		int value,
+		const char* message)
+{
+	if (-1 == setsockopt(sd, level, option, &value, sizeof(value)))
+	{
+		EchoLogErrno(sink, message, errno);
+	}
+}
+
+void EchoApplySocketProfile(
+		const struct EchoLogSink* sink,
+		const struct EchoSocketProfile* profile,
+		int sd,
+		int family,
+		int type,
+		int role)
+{
+	bool inet = (PF_INET == family) || (PF_INET6 == family);
+	bool tcp = inet && (SOCK_STREAM == type);
+
+	if (SOCKET_NEW == role)
+	{
+		if (0 != profile->receiveBuffer)
+		{
+			SetSocketOption(sink, sd, SOL_SOCKET, SO_RCVBUF,
+					profile->receiveBuffer, "Unable to set receive buffer:");
+		}
+
+		if (0 != profile->sendBuffer)
+		{
+			SetSocketOption(sink, sd, SOL_SOCKET, SO_SNDBUF,
+					profile->sendBuffer, "Unable to set send buffer:");
+		}
+
+		// Raising it above the system limit needs privileges
+		if ((0 != profile->busyPoll) && inet)
+		{
+			SetSocketOption(sink, sd, SOL_SOCKET, SO_BUSY_POLL,
+					profile->busyPoll, "Unable to set busy poll:");
+		}
+
+		if (tcp && profile->noDelay)
+		{
+			SetSocketOption(sink, sd, IPPROTO_TCP, TCP_NODELAY, 1,
+					"Unable to set no delay:");
+		}
+	}
+	else if ((SOCKET_LISTENING == role) && tcp && (0 != profile->fastOpen))
+	{
+		SetSocketOption(sink, sd, IPPROTO_TCP, TCP_FASTOPEN,
+				profile->fastOpen, "Unable to set fast open:");
+	}
+
+	// Quick ACK is not sticky, it is set again on accepted sockets
+	if (tcp && profile->quickAck && (SOCKET_LISTENING != role))
+	{
+		SetSocketOption(sink, sd, IPPROTO_TCP, TCP_QUICKACK, 1,
+				"Unable to set quick ACK:");
+	}
+}
+
+/**
+ * Gets the name of the given socket kind for the log.
+ *
+ * @param family socket family.
+ * @param type socket type.
+ * @return socket kind name.
+ */
+static const char* GetSocketKind(int family, int type)
+{
+	if (PF_LOCAL == family)
+		return "Local UNIX";
+
+	return (SOCK_DGRAM == type) ? "UDP" : "TCP";
+}
+
+int EchoNewSocket(
+		const struct EchoLogSink* sink,
+		int family,
+		int type)
+{
+	// Construct socket
+	EchoLog(sink, LOG_LEVEL_INFO, "Constructing a new %s socket...",
+			GetSocketKind(family, type));
+
+	int sd = socket(family, type, 0);
+
+	// Check if socket is properly constructed
+	return (-1 == sd) ? -errno : sd;
+}
+
+int EchoNewServerSocket(
+		const struct EchoLogSink* sink,
+		const struct EchoSocketProfile* profile,
+		int type,
+		bool dualStack,
+		int* family)
+{
+	if (dualStack)
+	{
+		int sd = socket(PF_INET6, type, 0);
+
+		if (-1 != sd)
+		{
+			int v6Only = 0;
+
+			if (0 == setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only,
+					sizeof(v6Only)))
+			{
+				EchoLog(sink, LOG_LEVEL_INFO,
+						"Constructed a new dual stack socket.");
+				EchoApplySocketProfile(sink, profile, sd, PF_INET6, type,
+						SOCKET_NEW);
+
+				*family = PF_INET6;
+				return sd;
+			}
+
+			close(sd);
+		}
+
+		EchoLogErrno(sink, "Dual stack is not available, using IPv4:",
+				errno);
+	}
+
+	*family = PF_INET;
+
+	int sd = EchoNewSocket(sink, PF_INET, type);
+	if (sd >= 0)
+	{
+		EchoApplySocketProfile(sink, profile, sd, PF_INET, type, SOCKET_NEW);
+	}
+
+	return sd;
+}
+
+int EchoSetSocketNonBlocking(int sd)
+{
+	// Get the current socket flags
+	int flags = fcntl(sd, F_GETFL, 0);
+
+	// Add the non-blocking flag
+	if ((-1 == flags) || (-1 == fcntl(sd, F_SETFL, flags | O_NONBLOCK)))
+		return -errno;
+
+	return 0;
+}
+
+int EchoSetSocketReuseAddress(int sd)
+{
+	int on = 1;
+
+	if (-1 == setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)))
+		return -errno;
+
+	return 0;
+}
+
+int EchoSetSocketReusePort(
+		const struct EchoLogSink* sink,
+		int sd)
+{
+	int on = 1;
+
+	if (-1 == setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)))
+	{
+		// Kernels prior to 3.9 do not know about it
+		if ((ENOPROTOOPT != errno) && (EINVAL != errno))
+			return -errno;
+
+		EchoLog(sink, LOG_LEVEL_INFO,
+				"SO_REUSEPORT is not supported, sharing the server socket.");
+
+		return 0;
+	}
+
+	return 1;
+}
+
+int EchoBindSocketToPort(
+		const struct EchoLogSink* sink,
+		int sd,
+		int family,
+		unsigned short port)
+{
+	struct sockaddr_storage address;
+	socklen_t addressLength;
+
+	// Address to bind socket
+	memset(&address, 0, sizeof(address));
+
+	if (PF_INET6 == family)
+	{
+		struct sockaddr_in6* address6 = (struct sockaddr_in6*) &address;
+		address6->sin6_family = PF_INET6;
+
+		// Bind to all addresses
+		address6->sin6_addr = in6addr_any;
+
+		// Convert port to network byte order
+		address6->sin6_port = htons(port);
+		addressLength = sizeof(struct sockaddr_in6);
+	}
+	else
+	{
+		struct sockaddr_in* address4 = (struct sockaddr_in*) &address;
+		address4->sin_family = PF_INET;
+
+		// Bind to all addresses
+		address4->sin_addr.s_addr = htonl(INADDR_ANY);
+
+		// Convert port to network byte order
+		address4->sin_port = htons(port);
+		addressLength = sizeof(struct sockaddr_in);
+	}
+
+	// Bind socket
+	EchoLog(sink, LOG_LEVEL_INFO, "Binding to port %hu.", port);
+
+	if (-1 == bind(sd, (struct sockaddr*) &address, addressLength))
+		return -errno;
+
+	return 0;
+}
+
+int EchoGetSocketPort(
+		const struct EchoLogSink* sink,
+		int sd)
+{
+	struct sockaddr_storage address;
+	socklen_t addressLength = sizeof(address);
+
+	// Get the socket address
+	if (-1 == getsockname(sd, (struct sockaddr*) &address, &addressLength))
+		return -errno;
+
+	// Convert port to host byte order
+	unsigned short port = EchoGetAddressPort(&address);
+
+	EchoLog(sink, LOG_LEVEL_INFO, "Binded to random port %hu.", port);
+
+	return port;
+}
+
+int EchoListenOnSocket(
+		const struct EchoLogSink* sink,
+		int sd,
+		int backlog)
+{
+	// Listen on socket with the given backlog
+	EchoLog(sink, LOG_LEVEL_INFO,
+			"Listening on socket with a backlog of %d pending connections.",
+			backlog);
+
+	if (-1 == listen(sd, backlog))
+		return -errno;
+
+	return 0;
+}
+
+ssize_t EchoReceiveFromSocket(
+		const struct EchoLogSink* sink,
+		int sd,
+		char* buffer,
+		size_t bufferSize)
+{
+	// Block and receive data from the socket into the buffer
+	EchoLogDebug(sink, "Receiving from the socket...");
+	TRACE_BEGIN(TRACE_RECV);
+	ssize_t recvSize = recv(sd, buffer, bufferSize, 0);
+	TRACE_END();
+
+	// If receive is failed
+	if (-1 == recvSize)
+		return -errno;
+
+	// If data is received
+	if (recvSize > 0)
+	{
+		EchoLogDebug(sink, "Received %zd bytes: %.*s", recvSize,
+				(int) recvSize, buffer);
+	}
+	else
+	{
+		EchoLog(sink, LOG_LEVEL_INFO, "Client disconnected.");
+	}
+
+	return recvSize;
+}
+
+ssize_t EchoSendToSocket(
+		const struct EchoLogSink* sink,
+		int sd,
+		const char* buffer,
+		size_t bufferSize)
+{
+	// Send data buffer to the socket
+	EchoLogDebug(sink, "Sending to the socket...");
+	ssize_t sentSize = 0;
+
+	// Send may return before the whole buffer is sent
+	while ((size_t) sentSize < bufferSize)
+	{
+		TRACE_BEGIN(TRACE_SEND);
+		ssize_t result = send(sd, buffer + sentSize,
+				bufferSize - sentSize, 0);
+		TRACE_END();
+
+		// If send is failed
+		if (-1 == result)
+		{
+			if (EINTR == errno)
+				continue;
+
+			return -errno;
+		}
+
+		sentSize += result;
+	}
+
+	if (sentSize > 0)
+	{
+		EchoLogDebug(sink, "Sent %zd bytes: %.*s", sentSize,
+				(int) sentSize, buffer);
+	}
+	else
+	{
+		EchoLog(sink, LOG_LEVEL_INFO, "Client disconnected.");
+	}
+
+	return sentSize;
+}
+
+ssize_t EchoReceiveDatagram(
+		const struct EchoLogSink* sink,
+		int sd,
+		struct sockaddr_storage* address,
+		char* buffer,
+		size_t bufferSize)
+{
+	socklen_t addressLength = sizeof(struct sockaddr_storage);
+
+	// Receive datagram from socket
+	EchoLogDebug(sink, "Receiving from the socket...");
+	TRACE_BEGIN(TRACE_RECV);
+	ssize_t recvSize = recvfrom(sd, buffer, bufferSize, 0,
+			(struct sockaddr*) address,
+			&addressLength);
+	TRACE_END();
+
+	// If receive is failed
+	if (-1 == recvSize)
+		return -errno;
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+	// Log address
+	EchoLogAddress(sink, LOG_LEVEL_DEBUG, "Received from", address);
+
+	// If data is received
+	if (recvSize > 0)
+	{
+		EchoLog(sink, LOG_LEVEL_DEBUG, "Received %zd bytes: %.*s", recvSize,
+				(int) recvSize, buffer);
+	}
+#endif
+
+	return recvSize;
+}
+
+ssize_t EchoSendDatagram(
+		const struct EchoLogSink* sink,
+		int sd,
+		const struct sockaddr_storage* address,
+		const char* buffer,
+		size_t bufferSize)
+{
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+	// Log address
+	EchoLogAddress(sink, LOG_LEVEL_DEBUG, "Sending to", address);
+#endif
+
+	// Send data buffer to the socket
+	TRACE_BEGIN(TRACE_SEND);
+	ssize_t sentSize = sendto(sd, buffer, bufferSize, 0,
+			(const sockaddr*) address,
+			EchoGetAddressLength(address));
+	TRACE_END();
+
+	// If send is failed
+	if (-1 == sentSize)
+		return -errno;
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+	if (sentSize > 0)
+	{
+		EchoLog(sink, LOG_LEVEL_DEBUG, "Sent %zd bytes: %.*s", sentSize,
+				(int) sentSize, buffer);
+	}
+#endif
+
+	return sentSize;
+}
+
+unsigned short EchoGetAddressPort(const struct sockaddr_storage* address)
+{
+	if (AF_INET6 == address->ss_family)
+		return ntohs(((const struct sockaddr_in6*) address)->sin6_port);
+
+	return ntohs(((const struct sockaddr_in*) address)->sin_port);
+}
+
+void EchoSetAddressPort(struct sockaddr_storage* address, unsigned short port)
+{
+	if (AF_INET6 == address->ss_family)
+	{
+		((struct sockaddr_in6*) address)->sin6_port = htons(port);
+	}
+	else
+	{
+		((struct sockaddr_in*) address)->sin_port = htons(port);
+	}
+}
+
+socklen_t EchoGetAddressLength(const struct sockaddr_storage* address)
+{
+	return (AF_INET6 == address->ss_family) ? sizeof(struct sockaddr_in6)
+			: sizeof(struct sockaddr_in);
+}
+
+int EchoFormatAddress(
+		const struct sockaddr_storage* address,
+		char* ip,
+		size_t ipSize)
+{
+	const char* result;
+
+	if (AF_INET6 == address->ss_family)
+	{
+		const struct in6_addr* address6 =
+				&((const struct sockaddr_in6*) address)->sin6_addr;
+
+		if (IN6_IS_ADDR_V4MAPPED(address6))
+		{
+			result = inet_ntop(PF_INET, &address6->s6_addr[12], ip,
+					(socklen_t) ipSize);
+		}
+		else
+		{
+			result = inet_ntop(PF_INET6, address6, ip, (socklen_t) ipSize);
+		}
+	}
+	else
+	{
+		result = inet_ntop(PF_INET,
+				&((const struct sockaddr_in*) address)->sin_addr, ip,
+				(socklen_t) ipSize);
+	}
+
+	return (NULL == result) ? -errno : 0;
+}
+
+int EchoLogAddress(
+		const struct EchoLogSink* sink,
+		int level,
+		const char* message,
+		const struct sockaddr_storage* address)
+{
+	char ip[INET6_ADDRSTRLEN];
+
+	// Convert the IP address to string
+	int result = EchoFormatAddress(address, ip, sizeof(ip));
+	if (result < 0)
+		return result;
+
+	// Convert port to host byte order
+	unsigned short port = EchoGetAddressPort(address);
+
+	// Log address, IPv6 in brackets to set the port apart
+	if (NULL != strchr(ip, ':'))
+	{
+		EchoLog(sink, level, "%s [%s]:%hu.", message, ip, port);
+	}
+	else
+	{
+		EchoLog(sink, level, "%s %s:%hu.", message, ip, port);
+	}
+
+	return 0;
+}
+
+int EchoGetLocalAddress(const char* name, struct sockaddr_un* address)
+{
+	// Name length
+	const size_t nameLength = strlen(name);
+
+	// Path length is initiall equal to name length
+	size_t pathLength = nameLength;
+
+	// If name is not starting with a slash it is
+	// in the abstract namespace
+	bool abstractNamespace = ('/' != name[0]);
+
+	// Abstract namespace requires having the first
+	// byte of the path to be the zero byte, update
+	// the path length to include the zero byte
+	if (abstractNamespace)
+	{
+		pathLength++;
+	}
+
+	// Check the path length
+	if (pathLength > sizeof(address->sun_path))
+		return -ENAMETOOLONG;
+
+	// Clear the address bytes
+	memset(address, 0, sizeof(struct sockaddr_un));
+	address->sun_family = PF_LOCAL;
+
+	// Socket path
+	char* sunPath = address->sun_path;
+
+	// First byte must be zero to use the abstract namespace
+	if (abstractNamespace)
+	{
+		*sunPath++ = '\0';
+	}
+
+	// Append the local name
+	strcpy(sunPath, name);
+
+	// Address length
+	return (int) ((offsetof(struct sockaddr_un, sun_path)) + pathLength);
+}
+
+int EchoBindLocalSocketToName(
+		const struct EchoLogSink* sink,
+		int sd,
+		const char* name)
+{
+	struct sockaddr_un address;
+
+	int addressLength = EchoGetLocalAddress(name, &address);
+	if (addressLength < 0)
+		return addressLength;
+
+	// Unlink if the socket name is already binded
+	unlink(address.sun_path);
+
+	// Bind socket
+	EchoLog(sink, LOG_LEVEL_INFO, "Binding to local name %s%s.",
+			('/' != name[0]) ? "(null)" : "",
+			name);
+
+	if (-1 == bind(sd, (struct sockaddr*) &address,
+			(socklen_t) addressLength))
+		return -errno;
+
+	return 0;
+}
+
+int EchoConnectToLocalName(
+		const struct EchoLogSink* sink,
+		int sd,
+		const char* name)
+{
+	struct sockaddr_un address;
+
+	int addressLength = EchoGetLocalAddress(name, &address);
+	if (addressLength < 0)
+		return addressLength;
+
+	EchoLog(sink, LOG_LEVEL_INFO, "Connecting to local name %s%s...",
+			('/' != name[0]) ? "(null)" : "",
+			name);
+
+	if (-1 == connect(sd, (struct sockaddr*) &address,
+			(socklen_t) addressLength))
+		return -errno;
+
+	return 0;
+}
@@ -0,0 +1,467 @@
+/**
+ * Socket core of the Echo library. Free of JNI, so that it runs
+ * on any native thread, attached to the Java VM or not.
+ *
+ * Failures are returned as negative error numbers, nothing is
+ * allocated or thrown on the error paths. Messages go to the
+ * given log sink, a NULL sink or log function does not log.
+ */
+#ifndef ECHO_SOCKET_H
+#define ECHO_SOCKET_H
+
+// va_list
+#include <stdarg.h>
+
+// size_t
+#include <stddef.h>
+
+// uint64_t
+#include <stdint.h>
+
+// ssize_t
+#include <sys/types.h>
+
+// sockaddr_storage, socklen_t
+#include <sys/socket.h>
+
+// sockaddr_un
+#include <sys/un.h>
+
+/**
+ * Log levels. Messages above the LOG_LEVEL are compiled out,
+ * production builds drop the per-packet debug messages.
+ */
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+#ifndef LOG_LEVEL
+#ifdef NDEBUG
+#define LOG_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define EchoLogDebug(sink, ...) EchoLog(sink, LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define EchoLogDebug(...) do {} while (0)
+#endif
+
+// Max log message length
+#define MAX_LOG_MESSAGE_LENGTH 256
+
+// Socket roles a socket profile is applied for
+#define SOCKET_NEW 0
+#define SOCKET_LISTENING 1
+#define SOCKET_ACCEPTED 2
+
+// Max number of descriptors passed with a single message
+#define MAX_PASSED_FDS 8
+
+/**
+ * Log sink the socket core passes its messages to.
+ */
+struct EchoLogSink
+{
+	// Logs the message at the given level
+	void (*log)(void* context, int level, const char* format, va_list ap);
+
+	// Context passed to the log function
+	void* context;
+};
+
+/**
+ * Socket options applied to every socket the library
+ * creates. Zero keeps the system default.
+ */
+struct EchoSocketProfile
+{
+	// Socket receive and send buffer sizes
+	int receiveBuffer;
+	int sendBuffer;
+
+	// Disable Nagle's algorithm on the TCP connections
+	bool noDelay;
+
+	// Acknowledge the received data at once instead of delaying it
+	bool quickAck;
+
+	// Time a receive busy polls the device queue, in microseconds
+	int busyPoll;
+
+	// TCP Fast Open pending requests on the listening sockets
+	int fastOpen;
+
+	// Pending connections on the listening sockets
+	int backlog;
+
+	// Time the stream server may hold the echoed data to send it
+	// with the data that follows, in microseconds, zero to not hold
+	int coalesceDelay;
+
+	// Bytes held before they are sent regardless of the delay
+	int coalesceSize;
+};
+
+/**
+ * Control buffer for the descriptors passed with a message,
+ * aligned for the control message header.
+ */
+union EchoPassedFdsControl
+{
+	struct cmsghdr header;
+	char buffer[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+};
+
+/**
+ * Logs the given message to the sink.
+ *
+ * @param sink log sink or NULL.
+ * @param level log level.
+ * @param format message format and arguments.
+ */
+void EchoLog(
+		const struct EchoLogSink* sink,
+		int level,
+		const char* format,
+		...) __attribute__((format(printf, 3, 4)));
+
+/**
+ * Logs the given message with the message of the given error
+ * number as an error.
+ *
+ * @param sink log sink or NULL.
+ * @param message message text.
+ * @param errnum error number.
+ */
+void EchoLogErrno(
+		const struct EchoLogSink* sink,
+		const char* message,
+		int errnum);
+
+/**
+ * Copies the message of the given error number into the buffer.
+ *
+ * @param errnum error number.
+ * @param buffer message buffer.
+ * @param bufferSize message buffer size.
+ * @return message buffer.
+ */
+const char* EchoGetErrorMessage(
+		int errnum,
+		char* buffer,
+		size_t bufferSize);
+
+/**
+ * Gets the monotonic clock time.
+ *
+ * @return time in nanoseconds.
+ */
+uint64_t EchoGetMonotonicTime();
+
+/**
+ * Gets the given size rounded up to the page size.
+ *
+ * @param size size in bytes.
+ * @return page aligned size.
+ */
+size_t EchoGetPageAlignedSize(size_t size);
+
+/**
+ * Allocates a new page aligned data buffer of the given size,
+ * released with free.
+ *
+ * @param size buffer size.
+ * @return data buffer or NULL if out of memory.
+ */
+char* EchoNewBuffer(size_t size);
+
+/**
+ * Applies the socket profile to the given socket. New sockets
+ * get the buffer sizes, the busy poll and the TCP options,
+ * listening sockets get the fast open queue, and the accepted
+ * ones get what is not inherited from the listening socket.
+ * Options are tuning only, so the ones the kernel rejects are
+ * logged and skipped.
+ *
+ * @param sink log sink or NULL.
+ * @param profile socket profile.
+ * @param sd socket descriptor.
+ * @param family socket family.
+ * @param type socket type.
+ * @param role SOCKET_NEW, SOCKET_LISTENING or SOCKET_ACCEPTED.
+ */
+void EchoApplySocketProfile(
+		const struct EchoLogSink* sink,
+		const struct EchoSocketProfile* profile,
+		int sd,
+		int family,
+		int type,
+		int role);
+
+/**
+ * Constructs a new socket.
+ *
+ * @param sink log sink or NULL.
+ * @param family socket family, PF_INET, PF_INET6 or PF_LOCAL.
+ * @param type socket type.
+ * @return socket descriptor or negative error number.
+ */
+int EchoNewSocket(
+		const struct EchoLogSink* sink,
+		int family,
+		int type);
+
+/**
+ * Constructs a new server socket with the socket profile
+ * applied. A dual stack IPv6 socket takes the IPv4 clients as
+ * mapped addresses, devices without IPv6 fall back to an IPv4
+ * socket.
+ *
+ * @param sink log sink or NULL.
+ * @param profile socket profile.
+ * @param type socket type, stream or datagram.
+ * @param dualStack prefer a dual stack socket.
+ * @param family constructed socket family.
+ * @return socket descriptor or negative error number.
+ */
+int EchoNewServerSocket(
+		const struct EchoLogSink* sink,
+		const struct EchoSocketProfile* profile,
+		int type,
+		bool dualStack,
+		int* family);
+
+/**
+ * Puts the given socket into the non-blocking mode.
+ *
+ * @param sd socket descriptor.
+ * @return zero or negative error number.
+ */
+int EchoSetSocketNonBlocking(int sd);
+
+/**
+ * Lets the given listening socket bind to a port that still
+ * has connections in TIME_WAIT, so a stopped server restarts
+ * on the same port at once.
+ *
+ * @param sd socket descriptor.
+ * @return zero or negative error number.
+ */
+int EchoSetSocketReuseAddress(int sd);
+
+/**
+ * Allows multiple sockets to bind to the same port so that
+ * the kernel spreads the connections and datagrams among them.
+ *
+ * @param sink log sink or NULL.
+ * @param sd socket descriptor.
+ * @return one if set, zero if not supported by the kernel, or
+ *         negative error number.
+ */
+int EchoSetSocketReusePort(
+		const struct EchoLogSink* sink,
+		int sd);
+
+/**
+ * Binds socket to a port number on all addresses.
+ *
+ * @param sink log sink or NULL.
+ * @param sd socket descriptor.
+ * @param family socket family, PF_INET or PF_INET6.
+ * @param port port number or zero for random port.
+ * @return zero or negative error number.
+ */
+int EchoBindSocketToPort(
+		const struct EchoLogSink* sink,
+		int sd,
+		int family,
+		unsigned short port);
+
+/**
+ * Gets the port number socket is currently binded.
+ *
+ * @param sink log sink or NULL.
+ * @param sd socket descriptor.
+ * @return port number or negative error number.
+ */
+int EchoGetSocketPort(
+		const struct EchoLogSink* sink,
+		int sd);
+
+/**
+ * Listens on given socket with the given backlog for
+ * pending connections. When the backlog is full, the
+ * new connections will be rejected.
+ *
+ * @param sink log sink or NULL.
+ * @param sd socket descriptor.
+ * @param backlog backlog size.
+ * @return zero or negative error number.
+ */
+int EchoListenOnSocket(
+		const struct EchoLogSink* sink,
+		int sd,
+		int backlog);
+
+/**
+ * Blocks and receives data from the socket into the buffer.
+ *
+ * @param sink log sink or NULL.
+ * @param sd socket descriptor.
+ * @param buffer data buffer.
+ * @param bufferSize buffer size.
+ * @return receive size, zero if the peer disconnected, or
+ *         negative error number.
+ */
+ssize_t EchoReceiveFromSocket(
+		const struct EchoLogSink* sink,
+		int sd,
+		char* buffer,
+		size_t bufferSize);
+
+/**
+ * Sends the whole data buffer to the socket, retrying the
+ * short and interrupted sends.
+ *
+ * @param sink log sink or NULL.
+ * @param sd socket descriptor.
+ * @param buffer data buffer.
+ * @param bufferSize buffer size.
+ * @return sent size or negative error number.
+ */
+ssize_t EchoSendToSocket(
+		const struct EchoLogSink* sink,
+		int sd,
+		const char* buffer,
+		size_t bufferSize);
+
+/**
+ * Blocks and receives a datagram from the socket into the
+ * buffer, and populates the sender address.
+ *
+ * @param sink log sink or NULL.
+ * @param sd socket descriptor.
+ * @param address sender address.
+ * @param buffer data buffer.
+ * @param bufferSize buffer size.
+ * @return receive size or negative error number.
+ */
+ssize_t EchoReceiveDatagram(
+		const struct EchoLogSink* sink,
+		int sd,
+		struct sockaddr_storage* address,
+		char* buffer,
+		size_t bufferSize);
+
+/**
+ * Sends a datagram to the given address.
+ *
+ * @param sink log sink or NULL.
+ * @param sd socket descriptor.
+ * @param address remote address.
+ * @param buffer data buffer.
+ * @param bufferSize buffer size.
+ * @return sent size or negative error number.
+ */
+ssize_t EchoSendDatagram(
+		const struct EchoLogSink* sink,
+		int sd,
+		const struct sockaddr_storage* address,
+		const char* buffer,
+		size_t bufferSize);
+
+/**
+ * Gets the port number of the given address.
+ *
+ * @param address IPv4 or IPv6 address.
+ * @return port number in host byte order.
+ */
+unsigned short EchoGetAddressPort(const struct sockaddr_storage* address);
+
+/**
+ * Sets the port number of the given address.
+ *
+ * @param address IPv4 or IPv6 address.
+ * @param port port number in host byte order.
+ */
+void EchoSetAddressPort(struct sockaddr_storage* address, unsigned short port);
+
+/**
+ * Gets the length of the given address for the socket calls.
+ *
+ * @param address IPv4 or IPv6 address.
+ * @return address length.
+ */
+socklen_t EchoGetAddressLength(const struct sockaddr_storage* address);
+
+/**
+ * Formats the IP address of the given address. IPv4 clients
+ * of a dual stack socket are shown by their IPv4 address.
+ *
+ * @param address IPv4 or IPv6 address.
+ * @param ip IP address text.
+ * @param ipSize IP address text size.
+ * @return zero or negative error number.
+ */
+int EchoFormatAddress(
+		const struct sockaddr_storage* address,
+		char* ip,
+		size_t ipSize);
+
+/**
+ * Logs the IP address and the port number from the given
+ * address.
+ *
+ * @param sink log sink or NULL.
+ * @param level log level.
+ * @param message message text.
+ * @param address IPv4 or IPv6 address.
+ * @return zero or negative error number.
+ */
+int EchoLogAddress(
+		const struct EchoLogSink* sink,
+		int level,
+		const char* message,
+		const struct sockaddr_storage* address);
+
+/**
+ * Gets the local UNIX socket address for the given name. Names
+ * not starting with a slash are in the abstract namespace.
+ *
+ * @param name socket name.
+ * @param address socket address.
+ * @return address length or -ENAMETOOLONG if name is too big.
+ */
+int EchoGetLocalAddress(const char* name, struct sockaddr_un* address);
+
+/**
+ * Binds a local UNIX socket to a name.
+ *
+ * @param sink log sink or NULL.
+ * @param sd socket descriptor.
+ * @param name socket name.
+ * @return zero or negative error number.
+ */
+int EchoBindLocalSocketToName(
+		const struct EchoLogSink* sink,
+		int sd,
+		const char* name);
+
+/**
+ * Connects the local UNIX socket to the given name.
+ *
+ * @param sink log sink or NULL.
+ * @param sd socket descriptor.
+ * @param name socket name.
+ * @return zero or negative error number.
+ */
+int EchoConnectToLocalName(
+		const struct EchoLogSink* sink,
+		int sd,
+		const char* name);
+
+#endif
@@ -0,0 +1,298 @@
+#include "EchoTrace.h"
+
+// errno
+#include <errno.h>
+
+#ifdef ECHO_TRACE
+// NULL, fopen, fprintf
+#include <stdio.h>
+
+// calloc
+#include <stdlib.h>
+
+// uint64_t
+#include <stdint.h>
+
+// clock_gettime
+#include <time.h>
+
+// getpid
+#include <unistd.h>
+
+// syscall
+#include <sys/syscall.h>
+
+// pthread_mutex_lock, pthread_once, pthread_key_create
+#include <pthread.h>
+
+// Spans kept per thread, must be a power of two
+#define TRACE_BUFFER_SIZE 4096
+
+// Max number of threads tracing at once
+#define MAX_TRACE_THREADS 64
+
+// Max nesting of the open spans of a thread
+#define MAX_TRACE_DEPTH 8
+
+// Trace span names, same order as the trace span indices
+static const char* const traceNames[] = { "accept", "recv", "send",
+		"splice", "epoll_wait", "io_uring_enter", "recvmmsg", "sendmmsg",
+		"logMessage" };
+
+/**
+ * Completed trace span.
+ */
+struct TraceSpan
+{
+	// Start and end times in nanoseconds
+	uint64_t start;
+	uint64_t end;
+
+	// Thread the span ran on
+	pid_t tid;
+
+	// Span name index
+	int id;
+};
+
+/**
+ * Ring of the completed spans of a thread. Only its owner
+ * thread writes it, the exporter reads it while it is written
+ * and drops the spans overwritten meanwhile. Buffers of the
+ * exited threads keep their spans until another thread takes
+ * them over.
+ */
+struct TraceBuffer
+{
+	// Number of spans ever written
+	size_t count;
+
+	// Buffer is taken by a running thread
+	bool owned;
+
+	// Spans
+	struct TraceSpan spans[TRACE_BUFFER_SIZE];
+};
+
+/**
+ * Trace buffers of all threads that have traced.
+ */
+struct TraceRegistry
+{
+	// Protects the buffer list
+	pthread_mutex_t mutex;
+
+	// Releases the buffer of an exiting thread
+	pthread_key_t key;
+
+	// Key is created
+	bool keyReady;
+
+	// Buffers
+	struct TraceBuffer* buffers[MAX_TRACE_THREADS];
+	size_t bufferCount;
+};
+
+// Process wide trace registry
+static struct TraceRegistry traceRegistry = { PTHREAD_MUTEX_INITIALIZER,
+		0, false, { NULL }, 0 };
+
+// Trace key initialization
+static pthread_once_t traceKeyOnce = PTHREAD_ONCE_INIT;
+
+// Trace buffer of the current thread, NULL if it has none yet
+static __thread struct TraceBuffer* traceBuffer = NULL;
+
+// Thread could not get a trace buffer, its spans are dropped
+static __thread bool traceUnavailable = false;
+
+// Thread identifier recorded in the spans
+static __thread pid_t traceThreadId = 0;
+
+// Open spans of the current thread
+static __thread uint64_t traceStarts[MAX_TRACE_DEPTH];
+static __thread int traceIds[MAX_TRACE_DEPTH];
+static __thread int traceDepth = 0;
+
+/**
+ * Gets the trace clock time, the same clock as systrace.
+ *
+ * @return time in nanoseconds.
+ */
+static inline uint64_t GetTraceTime()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return ((uint64_t) now.tv_sec * 1000000000ULL) + (uint64_t) now.tv_nsec;
+}
+
+/**
+ * Releases the trace buffer of an exiting thread, keeping its
+ * spans for the export.
+ *
+ * @param buffer trace buffer.
+ */
+static void ReleaseTraceBuffer(void* buffer)
+{
+	__atomic_store_n(&((struct TraceBuffer*) buffer)->owned, false,
+			__ATOMIC_RELEASE);
+}
+
+/**
+ * Creates the key with the trace buffer destructor.
+ */
+static void InitTraceKey()
+{
+	traceRegistry.keyReady = (0 == pthread_key_create(&traceRegistry.key,
+			ReleaseTraceBuffer));
+}
+
+/**
+ * Takes a trace buffer for the current thread, reusing the
+ * one of an exited thread or allocating a new one.
+ *
+ * @return trace buffer or NULL if none is available.
+ */
+static struct TraceBuffer* TakeTraceBuffer()
+{
+	pthread_once(&traceKeyOnce, InitTraceKey);
+	if (!traceRegistry.keyReady)
+		return NULL;
+
+	struct TraceBuffer* buffer = NULL;
+
+	pthread_mutex_lock(&traceRegistry.mutex);
+
+	for (size_t i = 0; (i < traceRegistry.bufferCount) && (NULL == buffer);
+			i++)
+	{
+		if (!__atomic_load_n(&traceRegistry.buffers[i]->owned,
+				__ATOMIC_ACQUIRE))
+		{
+			buffer = traceRegistry.buffers[i];
+		}
+	}
+
+	if ((NULL == buffer) && (traceRegistry.bufferCount < MAX_TRACE_THREADS))
+	{
+		buffer = (struct TraceBuffer*) calloc(1, sizeof(struct TraceBuffer));
+		if (NULL != buffer)
+		{
+			traceRegistry.buffers[traceRegistry.bufferCount++] = buffer;
+		}
+	}
+
+	if (NULL != buffer)
+	{
+		buffer->owned = true;
+		pthread_setspecific(traceRegistry.key, buffer);
+	}
+
+	pthread_mutex_unlock(&traceRegistry.mutex);
+
+	return buffer;
+}
+
+void EchoBeginTraceSpan(int id)
+{
+	if (traceDepth < MAX_TRACE_DEPTH)
+	{
+		traceIds[traceDepth] = id;
+		traceStarts[traceDepth] = GetTraceTime();
+	}
+
+	traceDepth++;
+}
+
+void EchoEndTraceSpan()
+{
+	int error = errno;
+
+	traceDepth--;
+
+	if ((traceDepth < MAX_TRACE_DEPTH) && !traceUnavailable)
+	{
+		uint64_t end = GetTraceTime();
+
+		if (NULL == traceBuffer)
+		{
+			traceBuffer = TakeTraceBuffer();
+			traceUnavailable = (NULL == traceBuffer);
+			traceThreadId = (pid_t) syscall(__NR_gettid);
+		}
+
+		if (NULL != traceBuffer)
+		{
+			size_t count = traceBuffer->count;
+			struct TraceSpan* span =
+					&traceBuffer->spans[count & (TRACE_BUFFER_SIZE - 1)];
+
+			span->start = traceStarts[traceDepth];
+			span->end = end;
+			span->tid = traceThreadId;
+			span->id = traceIds[traceDepth];
+
+			__atomic_store_n(&traceBuffer->count, count + 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	errno = error;
+}
+
+int EchoExportTrace(const char* path)
+{
+	FILE* file = fopen(path, "w");
+	if (NULL == file)
+		return -errno;
+
+	// Chrome JSON trace format, loaded by Perfetto and systrace
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+	int spanCount = 0;
+	pid_t pid = getpid();
+
+	pthread_mutex_lock(&traceRegistry.mutex);
+
+	for (size_t i = 0; i < traceRegistry.bufferCount; i++)
+	{
+		struct TraceBuffer* buffer = traceRegistry.buffers[i];
+
+		size_t end = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+		size_t start = (end > TRACE_BUFFER_SIZE) ? end - TRACE_BUFFER_SIZE : 0;
+
+		for (size_t j = start; j < end; j++)
+		{
+			struct TraceSpan span = buffer->spans[j & (TRACE_BUFFER_SIZE - 1)];
+
+			// Span is dropped if the thread wrapped over it meanwhile
+			if (j + TRACE_BUFFER_SIZE <= __atomic_load_n(&buffer->count,
+					__ATOMIC_ACQUIRE))
+				continue;
+
+			fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+					"\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+					(spanCount > 0) ? ",\n" : "\n", traceNames[span.id],
+					(int) pid, (int) span.tid, span.start / 1000.0,
+					(span.end - span.start) / 1000.0);
+			spanCount++;
+		}
+	}
+
+	pthread_mutex_unlock(&traceRegistry.mutex);
+
+	fprintf(file, "\n]}\n");
+
+	bool failed = (0 != ferror(file));
+
+	if (0 != fclose(file))
+		return -errno;
+
+	return failed ? -EIO : spanCount;
+}
+#else
+int EchoExportTrace(const char*)
+{
+	return -ENOSYS;
+}
+#endif
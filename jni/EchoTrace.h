@@ -0,0 +1,52 @@
+/**
+ * Trace probes of the Echo library, around the system calls and
+ * the Java calls of the hot paths. Compiled out unless ECHO_TRACE
+ * is defined, so the release builds have no trace code at all.
+ */
+#ifndef ECHO_TRACE_H
+#define ECHO_TRACE_H
+
+#ifdef ECHO_TRACE
+#define TRACE_BEGIN(id) EchoBeginTraceSpan(id)
+#define TRACE_END() EchoEndTraceSpan()
+#else
+#define TRACE_BEGIN(id) ((void) 0)
+#define TRACE_END() ((void) 0)
+#endif
+
+// Trace span names, indices into the trace name table
+#define TRACE_ACCEPT 0
+#define TRACE_RECV 1
+#define TRACE_SEND 2
+#define TRACE_SPLICE 3
+#define TRACE_EPOLL_WAIT 4
+#define TRACE_URING_ENTER 5
+#define TRACE_RECV_BATCH 6
+#define TRACE_SEND_BATCH 7
+#define TRACE_LOG_CALLBACK 8
+
+/**
+ * Opens a trace span on the current thread.
+ *
+ * @param id span name index.
+ */
+void EchoBeginTraceSpan(int id);
+
+/**
+ * Closes the innermost trace span of the current thread and
+ * records it. Keeps the errno of the traced call.
+ */
+void EchoEndTraceSpan();
+
+/**
+ * Exports the recorded spans of all threads to the given file
+ * in the Chrome JSON trace format, loaded by Perfetto and
+ * systrace.
+ *
+ * @param path trace file path.
+ * @return number of exported spans, -ENOSYS if the library is
+ *         built without the trace probes, or negative error number.
+ */
+int EchoExportTrace(const char* path);
+
+#endif
@@ -71,6 +71,102 @@ JNIEXPORT void JNICALL Java_com_apress_echo_EchoClientActivity_nativeStartTcpCli
 JNIEXPORT void JNICALL Java_com_apress_echo_EchoClientActivity_nativeStartUdpClient
   (JNIEnv *, jobject, jstring, jint, jstring);
 
+/*
+ * Class:     com_apress_echo_EchoClientActivity
+ * Method:    nativeStartTcpBufferClient
+ * Signature: (Ljava/lang/String;ILjava/nio/ByteBuffer;ILjava/nio/ByteBuffer;)I
+ */
+JNIEXPORT jint JNICALL Java_com_apress_echo_EchoClientActivity_nativeStartTcpBufferClient
+  (JNIEnv *, jobject, jstring, jint, jobject, jint, jobject);
+
+/*
+ * Class:     com_apress_echo_EchoClientActivity
+ * Method:    nativeStartUdpBufferClient
+ * Signature: (Ljava/lang/String;ILjava/nio/ByteBuffer;ILjava/nio/ByteBuffer;)I
+ */
+JNIEXPORT jint JNICALL Java_com_apress_echo_EchoClientActivity_nativeStartUdpBufferClient
+  (JNIEnv *, jobject, jstring, jint, jobject, jint, jobject);
+
+/*
+ * Class:     com_apress_echo_EchoClientActivity
+ * Method:    nativeOpenSession
+ * Signature: (Ljava/lang/String;II)J
+ */
+JNIEXPORT jlong JNICALL Java_com_apress_echo_EchoClientActivity_nativeOpenSession
+  (JNIEnv *, jclass, jstring, jint, jint);
+
+/*
+ * Class:     com_apress_echo_EchoClientActivity
+ * Method:    nativeSend
+ * Signature: (JLjava/nio/ByteBuffer;I)I
+ */
+JNIEXPORT jint JNICALL Java_com_apress_echo_EchoClientActivity_nativeSend
+  (JNIEnv *, jclass, jlong, jobject, jint);
+
+/*
+ * Class:     com_apress_echo_EchoClientActivity
+ * Method:    nativeReceive
+ * Signature: (JLjava/nio/ByteBuffer;)I
+ */
+JNIEXPORT jint JNICALL Java_com_apress_echo_EchoClientActivity_nativeReceive
+  (JNIEnv *, jclass, jlong, jobject);
+
+/*
+ * Class:     com_apress_echo_EchoClientActivity
+ * Method:    nativeSendFrame
+ * Signature: (JLjava/nio/ByteBuffer;I)I
+ */
+JNIEXPORT jint JNICALL Java_com_apress_echo_EchoClientActivity_nativeSendFrame
+  (JNIEnv *, jclass, jlong, jobject, jint);
+
+/*
+ * Class:     com_apress_echo_EchoClientActivity
+ * Method:    nativeReceiveFrame
+ * Signature: (JLjava/nio/ByteBuffer;)I
+ */
+JNIEXPORT jint JNICALL Java_com_apress_echo_EchoClientActivity_nativeReceiveFrame
+  (JNIEnv *, jclass, jlong, jobject);
+
+/*
+ * Class:     com_apress_echo_EchoClientActivity
+ * Method:    nativeClose
+ * Signature: (J)V
+ */
+JNIEXPORT void JNICALL Java_com_apress_echo_EchoClientActivity_nativeClose
+  (JNIEnv *, jclass, jlong);
+
+/*
+ * Class:     com_apress_echo_EchoClientActivity
+ * Method:    nativeConnectFanOut
+ * Signature: ([Ljava/lang/String;[I)[J
+ */
+JNIEXPORT jlongArray JNICALL Java_com_apress_echo_EchoClientActivity_nativeConnectFanOut
+  (JNIEnv *, jclass, jobjectArray, jintArray);
+
+/*
+ * Class:     com_apress_echo_EchoClientActivity
+ * Method:    nativeStartTcpBenchmark
+ * Signature: (Ljava/lang/String;IIIII)V
+ */
+JNIEXPORT void JNICALL Java_com_apress_echo_EchoClientActivity_nativeStartTcpBenchmark
+  (JNIEnv *, jobject, jstring, jint, jint, jint, jint, jint);
+
+/*
+ * Class:     com_apress_echo_EchoClientActivity
+ * Method:    nativeStartUdpBenchmark
+ * Signature: (Ljava/lang/String;IIIII)V
+ */
+JNIEXPORT void JNICALL Java_com_apress_echo_EchoClientActivity_nativeStartUdpBenchmark
+  (JNIEnv *, jobject, jstring, jint, jint, jint, jint, jint);
+
+/*
+ * Class:     com_apress_echo_EchoClientActivity
+ * Method:    nativeStartTcpReplay
+ * Signature: (Ljava/lang/String;ILjava/lang/String;II)V
+ */
+JNIEXPORT void JNICALL Java_com_apress_echo_EchoClientActivity_nativeStartTcpReplay
+  (JNIEnv *, jobject, jstring, jint, jstring, jint, jint);
+
 #ifdef __cplusplus
 }
 #endif
@@ -58,18 +58,18 @@ extern "C" {
 /*
  * Class:     com_apress_echo_EchoServerActivity
  * Method:    nativeStartTcpServer
- * Signature: (I)V
+ * Signature: (IIJ)V
  */
 JNIEXPORT void JNICALL Java_com_apress_echo_EchoServerActivity_nativeStartTcpServer
-  (JNIEnv *, jobject, jint);
+  (JNIEnv *, jobject, jint, jint, jlong);
 
 /*
  * Class:     com_apress_echo_EchoServerActivity
  * Method:    nativeStartUdpServer
- * Signature: (I)V
+ * Signature: (IIJ)V
  */
 JNIEXPORT void JNICALL Java_com_apress_echo_EchoServerActivity_nativeStartUdpServer
-  (JNIEnv *, jobject, jint);
+  (JNIEnv *, jobject, jint, jint, jlong);
 
 /*
  * Class:     com_apress_echo_EchoServerActivity
@@ -79,6 +79,22 @@ JNIEXPORT void JNICALL Java_com_apress_echo_EchoServerActivity_nativeStartUdpSer
 JNIEXPORT void JNICALL Java_com_apress_echo_EchoServerActivity_nativeStartLocalServer
   (JNIEnv *, jobject, jstring);
 
+/*
+ * Class:     com_apress_echo_EchoServerActivity
+ * Method:    nativeGetStats
+ * Signature: ()[J
+ */
+JNIEXPORT jlongArray JNICALL Java_com_apress_echo_EchoServerActivity_nativeGetStats
+  (JNIEnv *, jclass);
+
+/*
+ * Class:     com_apress_echo_EchoServerActivity
+ * Method:    nativeGetUdpFlows
+ * Signature: ()[J
+ */
+JNIEXPORT jlongArray JNICALL Java_com_apress_echo_EchoServerActivity_nativeGetUdpFlows
+  (JNIEnv *, jclass);
+
 #ifdef __cplusplus
 }
 #endif
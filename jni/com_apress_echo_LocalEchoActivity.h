@@ -58,10 +58,26 @@ extern "C" {
 /*
  * Class:     com_apress_echo_LocalEchoActivity
  * Method:    nativeStartLocalServer
- * Signature: (Ljava/lang/String;)V
+ * Signature: (Ljava/lang/String;IJ)V
  */
 JNIEXPORT void JNICALL Java_com_apress_echo_LocalEchoActivity_nativeStartLocalServer
-  (JNIEnv *, jobject, jstring);
+  (JNIEnv *, jobject, jstring, jint, jlong);
+
+/*
+ * Class:     com_apress_echo_LocalEchoActivity
+ * Method:    nativeStartSharedMemoryServer
+ * Signature: (Ljava/lang/String;J)V
+ */
+JNIEXPORT void JNICALL Java_com_apress_echo_LocalEchoActivity_nativeStartSharedMemoryServer
+  (JNIEnv *, jobject, jstring, jlong);
+
+/*
+ * Class:     com_apress_echo_LocalEchoActivity
+ * Method:    nativeStartLocalBenchmark
+ * Signature: (Ljava/lang/String;III)V
+ */
+JNIEXPORT void JNICALL Java_com_apress_echo_LocalEchoActivity_nativeStartLocalBenchmark
+  (JNIEnv *, jobject, jstring, jint, jint, jint);
 
 #ifdef __cplusplus
 }
@@ -1,5 +1,8 @@
 package com.apress.echo;
 
+import java.io.File;
+import java.io.IOException;
+
 import android.app.Activity;
 import android.os.Bundle;
 import android.os.Handler;
@@ -17,6 +20,9 @@ import android.widget.TextView;
  */
 public abstract class AbstractEchoActivity extends Activity implements
 		OnClickListener {
+	/** Trace file name in the cache directory. */
+	private static final String TRACE_FILE_NAME = "echo-trace.json";
+
 	/** Port number. */
 	protected EditText portEdit;
 
@@ -107,6 +113,24 @@ public abstract class AbstractEchoActivity extends Activity implements
 		logView.append("\n");
 		logScroll.fullScroll(View.FOCUS_DOWN);
 	}
+
+	/**
+	 * Exports the native trace spans to the cache directory, if the native
+	 * library is built with tracing.
+	 */
+	protected void exportTrace() {
+		File file = new File(getCacheDir(), TRACE_FILE_NAME);
+
+		try {
+			int spanCount = nativeExportTrace(file.getPath());
+			if (spanCount >= 0) {
+				logMessage(String.format("%d trace spans exported to %s.",
+						spanCount, file.getPath()));
+			}
+		} catch (IOException e) {
+			logMessage(e.getMessage());
+		}
+	}
 	
 	/**
 	 * Abstract async echo task.
@@ -137,6 +161,7 @@ public abstract class AbstractEchoActivity extends Activity implements
 
 		public void run() {
 			onBackground();
+			exportTrace();
 			
 			handler.post(new Runnable() {
 				public void run() {
@@ -158,6 +183,104 @@ public abstract class AbstractEchoActivity extends Activity implements
 		}
 	}
 
+	/**
+	 * Configures the native library with the given options, each given as a
+	 * name=value string. Options apply to the servers and clients started
+	 * afterwards.
+	 * 
+	 * @param options
+	 *            native options.
+	 * @throws IllegalArgumentException
+	 *             if an option is unknown or its value is invalid.
+	 */
+	protected static native void nativeConfigure(String[] options);
+
+	/**
+	 * Creates a new native handle to stop a server run with.
+	 * 
+	 * @return server handle.
+	 * @throws IOException
+	 */
+	private static native long nativeNewServerHandle() throws IOException;
+
+	/**
+	 * Requests the server started with the given handle to stop. The server
+	 * stops accepting, sends the queued data back within the drain timeout,
+	 * closes the connections, and returns from its start method.
+	 * 
+	 * @param handle
+	 *            server handle.
+	 */
+	private static native void nativeStopServer(long handle);
+
+	/**
+	 * Deletes the server handle once its server has returned.
+	 * 
+	 * @param handle
+	 *            server handle.
+	 */
+	private static native void nativeDeleteServerHandle(long handle);
+
+	/**
+	 * Exports the trace spans of the native threads to the given file, in
+	 * the JSON trace format that Perfetto and systrace load. Spans are only
+	 * recorded if the native library is built with ECHO_TRACE.
+	 * 
+	 * @param path
+	 *            trace file path.
+	 * @return number of spans exported, or -1 if tracing is not built in.
+	 * @throws IOException
+	 */
+	private static native int nativeExportTrace(String path)
+			throws IOException;
+
+	/**
+	 * Stop handle of a single native server run. It can be stopped from any
+	 * thread, also before the server is started.
+	 */
+	protected static class ServerHandle {
+		/** Native handle, zero when the server is not running. */
+		private long handle;
+
+		/** Stop is requested. */
+		private boolean stopped;
+
+		/**
+		 * Opens the native handle to start the server with.
+		 * 
+		 * @return native handle.
+		 * @throws IOException
+		 */
+		public synchronized long open() throws IOException {
+			handle = nativeNewServerHandle();
+			if (stopped) {
+				nativeStopServer(handle);
+			}
+
+			return handle;
+		}
+
+		/**
+		 * Requests the server to stop.
+		 */
+		public synchronized void stop() {
+			stopped = true;
+			if (handle != 0) {
+				nativeStopServer(handle);
+			}
+		}
+
+		/**
+		 * Closes the native handle once the server has returned.
+		 */
+		public synchronized void close() {
+			if (handle != 0) {
+				nativeDeleteServerHandle(handle);
+				handle = 0;
+			}
+		}
+	}
+
 	static {
 		System.loadLibrary("Echo");
 	}
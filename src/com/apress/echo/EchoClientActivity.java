@@ -1,5 +1,8 @@
 package com.apress.echo;
 
+import java.io.File;
+import java.nio.ByteBuffer;
+
 import android.os.Bundle;
 import android.widget.EditText;
 
@@ -9,7 +12,40 @@ import android.widget.EditText;
  * @author Onur Cinar
  */
 public class EchoClientActivity extends AbstractEchoActivity {	
-	/** IP address. */
+	/** Number of benchmark connections or UDP flows. */
+	private static final int BENCHMARK_STREAMS = 16;
+
+	/** Benchmark message size in bytes. */
+	private static final int BENCHMARK_PAYLOAD_SIZE = 64;
+
+	/** Benchmark messages per second per stream, zero for closed loop. */
+	private static final int BENCHMARK_RATE = 0;
+
+	/** Benchmark duration in seconds. */
+	private static final int BENCHMARK_DURATION = 10;
+
+	/** Capture file replayed, relative to the files directory. */
+	private static final String REPLAY_FILE = "capture.bin";
+
+	/** Replay connections, zero for one for each captured connection. */
+	private static final int REPLAY_CONNECTIONS = 0;
+
+	/** Replay speed in percent of the captured timing, zero for no waits. */
+	private static final int REPLAY_SPEED = 100;
+
+	/** TCP session protocol. */
+	private static final int SESSION_TCP = 0;
+
+	/** UDP session protocol. */
+	private static final int SESSION_UDP = 1;
+
+	/** Number of messages sent on a session. */
+	private static final int SESSION_MESSAGES = 100;
+
+	/** Number of frames kept in flight on a pipelined session. */
+	private static final int PIPELINE_DEPTH = 16;
+
+	/** Host name or IP address. */
 	private EditText ipEdit;
 
 	/** Message edit. */
@@ -41,11 +77,11 @@ public class EchoClientActivity extends AbstractEchoActivity {
 	}
 
 	/**
-	 * Starts the TCP client with the given server IP address and port number,
+	 * Starts the TCP client with the given server host and port number,
 	 * and sends the given message.
 	 * 
 	 * @param ip
-	 *            IP address.
+	 *            host name or IP address.
 	 * @param port
 	 *            port number.
 	 * @param message
@@ -56,10 +92,10 @@ public class EchoClientActivity extends AbstractEchoActivity {
 			throws Exception;
 
 	/**
-	 * Starts the UDP client with the given server IP address and port number.
+	 * Starts the UDP client with the given server host and port number.
 	 * 
 	 * @param ip
-	 *            IP address.
+	 *            host name or IP address.
 	 * @param port
 	 *            port number.
 	 * @param message
@@ -69,11 +105,374 @@ public class EchoClientActivity extends AbstractEchoActivity {
 	private native void nativeStartUdpClient(String ip, int port, String message)
 			throws Exception;
 
+	/**
+	 * Starts the TCP client with the given server host and port number,
+	 * sends the payload from the given direct buffer, and receives the echo
+	 * into the reply direct buffer without copying either of them.
+	 * 
+	 * @param ip
+	 *            host name or IP address.
+	 * @param port
+	 *            port number.
+	 * @param payload
+	 *            direct payload buffer.
+	 * @param payloadSize
+	 *            payload size in bytes.
+	 * @param reply
+	 *            direct reply buffer.
+	 * @return received size in bytes.
+	 * @throws Exception
+	 */
+	private native int nativeStartTcpBufferClient(String ip, int port,
+			ByteBuffer payload, int payloadSize, ByteBuffer reply)
+			throws Exception;
+
+	/**
+	 * Starts the UDP client with the given server host and port number,
+	 * sends the payload from the given direct buffer as a datagram, and
+	 * receives the echo into the reply direct buffer without copying either
+	 * of them.
+	 * 
+	 * @param ip
+	 *            host name or IP address.
+	 * @param port
+	 *            port number.
+	 * @param payload
+	 *            direct payload buffer.
+	 * @param payloadSize
+	 *            payload size in bytes.
+	 * @param reply
+	 *            direct reply buffer.
+	 * @return received size in bytes.
+	 * @throws Exception
+	 */
+	private native int nativeStartUdpBufferClient(String ip, int port,
+			ByteBuffer payload, int payloadSize, ByteBuffer reply)
+			throws Exception;
+
+	/**
+	 * Sends the given message through direct buffers with the TCP client.
+	 * 
+	 * @param ip
+	 *            host name or IP address.
+	 * @param port
+	 *            port number.
+	 * @param message
+	 *            message text.
+	 * @throws Exception
+	 */
+	private void startBufferClient(String ip, int port, String message)
+			throws Exception {
+		byte[] bytes = message.getBytes("UTF-8");
+
+		ByteBuffer payload = ByteBuffer.allocateDirect(bytes.length);
+		payload.put(bytes);
+
+		ByteBuffer reply = ByteBuffer.allocateDirect(bytes.length);
+		int replySize = nativeStartTcpBufferClient(ip, port, payload,
+				bytes.length, reply);
+
+		logMessage("Received " + replySize + " bytes.");
+	}
+
+	/**
+	 * Opens a session to the given server host and port number. Idle
+	 * connections of the closed sessions to the same server are reused.
+	 * 
+	 * @param ip
+	 *            host name or IP address.
+	 * @param port
+	 *            port number.
+	 * @param proto
+	 *            session protocol, SESSION_TCP or SESSION_UDP.
+	 * @return session handle.
+	 * @throws Exception
+	 */
+	private static native long nativeOpenSession(String ip, int port,
+			int proto) throws Exception;
+
+	/**
+	 * Sends the payload from the given direct buffer on the session.
+	 * 
+	 * @param session
+	 *            session handle.
+	 * @param payload
+	 *            direct payload buffer.
+	 * @param payloadSize
+	 *            payload size in bytes.
+	 * @return sent size in bytes.
+	 * @throws Exception
+	 */
+	private static native int nativeSend(long session, ByteBuffer payload,
+			int payloadSize) throws Exception;
+
+	/**
+	 * Receives into the given direct buffer on the session.
+	 * 
+	 * @param session
+	 *            session handle.
+	 * @param reply
+	 *            direct reply buffer.
+	 * @return received size in bytes, zero if the server closed the session.
+	 * @throws Exception
+	 */
+	private static native int nativeReceive(long session, ByteBuffer reply)
+			throws Exception;
+
+	/**
+	 * Sends the payload from the given direct buffer on the session as a
+	 * frame, prefixed with its length as a 4-byte big endian integer.
+	 * 
+	 * @param session
+	 *            session handle.
+	 * @param payload
+	 *            direct payload buffer.
+	 * @param payloadSize
+	 *            payload size in bytes.
+	 * @return sent payload size in bytes.
+	 * @throws Exception
+	 */
+	private static native int nativeSendFrame(long session,
+			ByteBuffer payload, int payloadSize) throws Exception;
+
+	/**
+	 * Receives a whole frame payload into the given direct buffer on the
+	 * session.
+	 * 
+	 * @param session
+	 *            session handle.
+	 * @param reply
+	 *            direct reply buffer.
+	 * @return frame payload size in bytes, -1 if the server closed the
+	 *         session.
+	 * @throws Exception
+	 */
+	private static native int nativeReceiveFrame(long session,
+			ByteBuffer reply) throws Exception;
+
+	/**
+	 * Closes the session, keeping its connection idle for reuse.
+	 * 
+	 * @param session
+	 *            session handle.
+	 */
+	private static native void nativeClose(long session);
+
+	/**
+	 * Connects to the given servers at once, closing each connection as soon
+	 * as it is established.
+	 * 
+	 * @param hosts
+	 *            host names or IP addresses.
+	 * @param ports
+	 *            port numbers, one for each host.
+	 * @return connect latency of each server in microseconds, or minus the
+	 *         error number if it failed, EHOSTUNREACH if it did not resolve.
+	 * @throws Exception
+	 */
+	private static native long[] nativeConnectFanOut(String[] hosts,
+			int[] ports) throws Exception;
+
+	/**
+	 * Sends the given message repeatedly on a single TCP session.
+	 * 
+	 * @param ip
+	 *            host name or IP address.
+	 * @param port
+	 *            port number.
+	 * @param message
+	 *            message text.
+	 * @throws Exception
+	 */
+	private void startSessionClient(String ip, int port, String message)
+			throws Exception {
+		byte[] bytes = message.getBytes("UTF-8");
+
+		ByteBuffer payload = ByteBuffer.allocateDirect(bytes.length);
+		payload.put(bytes);
+
+		ByteBuffer reply = ByteBuffer.allocateDirect(bytes.length);
+
+		long session = nativeOpenSession(ip, port, SESSION_TCP);
+
+		try {
+			long startTime = System.nanoTime();
+
+			for (int i = 0; i < SESSION_MESSAGES; i++) {
+				nativeSend(session, payload, bytes.length);
+
+				int replySize = 0;
+				while (replySize < bytes.length) {
+					reply.clear().position(replySize);
+					int recvSize = nativeReceive(session, reply.slice());
+					if (0 == recvSize) {
+						throw new Exception("Server closed the session.");
+					}
+
+					replySize += recvSize;
+				}
+			}
+
+			logMessage(String.format("%d messages echoed in %.1f ms.",
+					SESSION_MESSAGES, (System.nanoTime() - startTime) / 1e6));
+		} finally {
+			nativeClose(session);
+		}
+	}
+
+	/**
+	 * Sends the given message as frames on a single TCP session, keeping
+	 * multiple frames in flight instead of waiting for each echo.
+	 * 
+	 * @param ip
+	 *            host name or IP address.
+	 * @param port
+	 *            port number.
+	 * @param message
+	 *            message text.
+	 * @throws Exception
+	 */
+	private void startPipelinedClient(String ip, int port, String message)
+			throws Exception {
+		byte[] bytes = message.getBytes("UTF-8");
+
+		ByteBuffer payload = ByteBuffer.allocateDirect(bytes.length);
+		payload.put(bytes);
+
+		ByteBuffer reply = ByteBuffer.allocateDirect(bytes.length);
+
+		long session = nativeOpenSession(ip, port, SESSION_TCP);
+
+		try {
+			long startTime = System.nanoTime();
+			int sentCount = 0;
+			int receivedCount = 0;
+
+			while (receivedCount < SESSION_MESSAGES) {
+				// Fill the pipeline, then take one echo out
+				while ((sentCount < SESSION_MESSAGES)
+						&& (sentCount - receivedCount < PIPELINE_DEPTH)) {
+					nativeSendFrame(session, payload, bytes.length);
+					sentCount++;
+				}
+
+				if (-1 == nativeReceiveFrame(session, reply)) {
+					throw new Exception("Server closed the session.");
+				}
+
+				receivedCount++;
+			}
+
+			logMessage(String.format("%d frames echoed in %.1f ms.",
+					SESSION_MESSAGES, (System.nanoTime() - startTime) / 1e6));
+		} finally {
+			nativeClose(session);
+		}
+	}
+
+	/**
+	 * Connects to the comma separated servers on the same port in parallel,
+	 * and logs the connect latency of each.
+	 * 
+	 * @param ip
+	 *            comma separated host names or IP addresses.
+	 * @param port
+	 *            port number.
+	 * @throws Exception
+	 */
+	private void probeServers(String ip, int port) throws Exception {
+		String[] hosts = ip.split(",");
+		int[] ports = new int[hosts.length];
+
+		for (int i = 0; i < hosts.length; i++) {
+			hosts[i] = hosts[i].trim();
+			ports[i] = port;
+		}
+
+		long[] latencies = nativeConnectFanOut(hosts, ports);
+
+		for (int i = 0; i < hosts.length; i++) {
+			if (latencies[i] < 0) {
+				logMessage(String.format("%s failed with error %d.",
+						hosts[i], -latencies[i]));
+			} else {
+				logMessage(String.format("%s connected in %.2f ms.",
+						hosts[i], latencies[i] / 1e3));
+			}
+		}
+	}
+
+	/**
+	 * Starts the TCP benchmark with the given server host and port
+	 * number, and logs the throughput and latency percentiles.
+	 * 
+	 * @param ip
+	 *            host name or IP address.
+	 * @param port
+	 *            port number.
+	 * @param connectionCount
+	 *            number of concurrent connections.
+	 * @param payloadSize
+	 *            message size in bytes.
+	 * @param rate
+	 *            messages per second per connection, zero for closed loop.
+	 * @param duration
+	 *            duration in seconds.
+	 * @throws Exception
+	 */
+	private native void nativeStartTcpBenchmark(String ip, int port,
+			int connectionCount, int payloadSize, int rate, int duration)
+			throws Exception;
+
+	/**
+	 * Starts the UDP benchmark with the given server host and port
+	 * number, and logs the throughput and latency percentiles.
+	 * 
+	 * @param ip
+	 *            host name or IP address.
+	 * @param port
+	 *            port number.
+	 * @param flowCount
+	 *            number of concurrent UDP flows.
+	 * @param payloadSize
+	 *            datagram size in bytes.
+	 * @param rate
+	 *            datagrams per second per flow, zero for closed loop.
+	 * @param duration
+	 *            duration in seconds.
+	 * @throws Exception
+	 */
+	private native void nativeStartUdpBenchmark(String ip, int port,
+			int flowCount, int payloadSize, int rate, int duration)
+			throws Exception;
+
+	/**
+	 * Replays the traffic recorded in the given capture file against the
+	 * given server host and port number, and logs the sent and echoed bytes.
+	 * The captured connections are spread over the replay connections.
+	 * 
+	 * @param ip
+	 *            host name or IP address.
+	 * @param port
+	 *            port number.
+	 * @param path
+	 *            capture file path, recorded with the capturePath option.
+	 * @param connectionCount
+	 *            number of connections, zero for one for each captured
+	 *            connection.
+	 * @param speed
+	 *            speed in percent of the captured timing, zero to send
+	 *            without waits.
+	 * @throws Exception
+	 */
+	private native void nativeStartTcpReplay(String ip, int port,
+			String path, int connectionCount, int speed) throws Exception;
+
 	/**
 	 * Client task.
 	 */
 	private class ClientTask extends AbstractEchoTask {
-		/** IP address to connect. */
+		/** Host name or IP address to connect. */
 		private final String ip;
 
 		/** Port number. */
@@ -86,7 +485,7 @@ public class EchoClientActivity extends AbstractEchoActivity {
 		 * Constructor.
 		 * 
 		 * @param ip
-		 *            IP address to connect.
+		 *            host name or IP address to connect.
 		 * @param port
 		 *            port number to connect.
 		 * @param message
@@ -104,6 +503,17 @@ public class EchoClientActivity extends AbstractEchoActivity {
 			try {
 				// nativeStartTcpClient(ip, port, message);
 				nativeStartUdpClient(ip, port, message);
+				// startBufferClient(ip, port, message);
+				// startSessionClient(ip, port, message);
+				// startPipelinedClient(ip, port, message);
+				// probeServers(ip, port);
+				// nativeStartTcpBenchmark(ip, port, BENCHMARK_STREAMS,
+				// BENCHMARK_PAYLOAD_SIZE, BENCHMARK_RATE, BENCHMARK_DURATION);
+				// nativeStartUdpBenchmark(ip, port, BENCHMARK_STREAMS,
+				// BENCHMARK_PAYLOAD_SIZE, BENCHMARK_RATE, BENCHMARK_DURATION);
+				// nativeStartTcpReplay(ip, port,
+				// new File(getFilesDir(), REPLAY_FILE).getPath(),
+				// REPLAY_CONNECTIONS, REPLAY_SPEED);
 			} catch (Throwable e) {
 				logMessage(e.getMessage());
 			}
@@ -1,6 +1,6 @@
 package com.apress.echo;
 
-
+import android.os.Handler;
 
 /**
  * Echo server.
@@ -8,6 +8,33 @@ package com.apress.echo;
  * @author Onur Cinar
  */
 public class EchoServerActivity extends AbstractEchoActivity {
+	/** Number of native workers, zero for the online CPU count. */
+	private static final int WORKER_COUNT = 0;
+
+	/** Native options applied before starting the server. */
+	private static final String[] NATIVE_OPTIONS = { "bufferSize=16384" };
+
+	/** Native counter indices. */
+	private static final int STAT_ACCEPTS = 0;
+	private static final int STAT_ACTIVE_CONNECTIONS = 1;
+	private static final int STAT_BYTES_IN = 2;
+	private static final int STAT_BYTES_OUT = 3;
+	private static final int STAT_SYSCALLS = 4;
+	private static final int STAT_EAGAINS = 5;
+	private static final int STAT_SHORT_WRITES = 6;
+	private static final int STAT_DROPS = 7;
+	private static final int STAT_TIMEOUTS = 8;
+	private static final int STAT_ACCEPT_RATE = 9;
+
+	/** Values per flow in the UDP flow snapshot. */
+	private static final int UDP_FLOW_FIELDS = 7;
+
+	/** Interval between the logged native counter rates in milliseconds. */
+	private static final int STATS_INTERVAL = 5000;
+
+	/** Running server task. */
+	private ServerTask serverTask;
+
 	/**
 	 * Constructor.
 	 */
@@ -18,28 +45,135 @@ public class EchoServerActivity extends AbstractEchoActivity {
 	protected void onStartButtonClicked() {
 		Integer port = getPort();
 		if (port != null) {
-			ServerTask serverTask = new ServerTask(port);
+			serverTask = new ServerTask(port);
 			serverTask.start();
 		}
 	}
 
+	protected void onDestroy() {
+		// Let the server close its connections and sockets
+		if (serverTask != null) {
+			serverTask.serverHandle.stop();
+		}
+
+		super.onDestroy();
+	}
+
 	/**
-	 * Starts the TCP server on the given port.
+	 * Starts the TCP server on the given port with the given number of
+	 * native workers, each with its own socket bound to the same port.
 	 * 
 	 * @param port
 	 *            port number.
+	 * @param workerCount
+	 *            worker count, zero for the online CPU count.
+	 * @param handle
+	 *            server handle to stop the server with, or zero.
 	 * @throws Exception
 	 */
-	private native void nativeStartTcpServer(int port) throws Exception;
+	private native void nativeStartTcpServer(int port, int workerCount,
+			long handle) throws Exception;
 
 	/**
-	 * Starts the UDP server on the given port.
+	 * Starts the UDP server on the given port with the given number of
+	 * native workers, each with its own socket bound to the same port.
 	 * 
 	 * @param port
 	 *            port number.
+	 * @param workerCount
+	 *            worker count, zero for the online CPU count.
+	 * @param handle
+	 *            server handle to stop the server with, or zero.
 	 * @throws Exception
 	 */
-	private native void nativeStartUdpServer(int port) throws Exception;
+	private native void nativeStartUdpServer(int port, int workerCount,
+			long handle) throws Exception;
+
+	/**
+	 * Gets the native counters summed over all workers, indexed by the STAT
+	 * constants. Counters keep increasing across the server runs, except for
+	 * the active connections and the accepts in the last second.
+	 * 
+	 * @return native counters.
+	 */
+	private static native long[] nativeGetStats();
+
+	/**
+	 * Gets a snapshot of the active UDP flows of the running workers. Each
+	 * flow takes UDP_FLOW_FIELDS values: the IPv6 address of the peer as its
+	 * high and low 64 bits, IPv4 ones being mapped, the port of the peer,
+	 * the received datagrams and bytes, the datagrams dropped by the
+	 * rate limit, and the time since the last datagram in milliseconds.
+	 * Workers sharing a socket may each have a flow of the same peer.
+	 * 
+	 * @return flow values.
+	 */
+	private static native long[] nativeGetUdpFlows();
+
+	/**
+	 * Periodically logs the native counter rates while the server runs.
+	 */
+	private class StatsLogger implements Runnable {
+		/** Handler object. */
+		private final Handler handler = new Handler();
+
+		/** Previous counters. */
+		private long[] previous = nativeGetStats();
+
+		public void run() {
+			long[] stats = nativeGetStats();
+			double seconds = STATS_INTERVAL / 1000.0;
+
+			logMessageDirect(String.format(
+					"%d active, %d accepts/s, %.0f KB/s in, %.0f KB/s out, "
+							+ "%.0f syscalls/s, %.0f EAGAINs/s, "
+							+ "%d short writes, %d drops, %d timeouts",
+					stats[STAT_ACTIVE_CONNECTIONS],
+					stats[STAT_ACCEPT_RATE],
+					getRate(stats, STAT_BYTES_IN) / seconds / 1024,
+					getRate(stats, STAT_BYTES_OUT) / seconds / 1024,
+					getRate(stats, STAT_SYSCALLS) / seconds,
+					getRate(stats, STAT_EAGAINS) / seconds,
+					stats[STAT_SHORT_WRITES], stats[STAT_DROPS],
+					stats[STAT_TIMEOUTS]));
+
+			long[] flows = nativeGetUdpFlows();
+			if (flows.length > 0) {
+				logMessageDirect(String.format("%d UDP flows",
+						flows.length / UDP_FLOW_FIELDS));
+			}
+
+			previous = stats;
+			handler.postDelayed(this, STATS_INTERVAL);
+		}
+
+		/**
+		 * Gets the counter increase since the previous run.
+		 * 
+		 * @param stats
+		 *            current counters.
+		 * @param index
+		 *            counter index.
+		 * @return counter increase.
+		 */
+		private double getRate(long[] stats, int index) {
+			return stats[index] - previous[index];
+		}
+
+		/**
+		 * Starts logging.
+		 */
+		public void start() {
+			handler.postDelayed(this, STATS_INTERVAL);
+		}
+
+		/**
+		 * Stops logging.
+		 */
+		public void stop() {
+			handler.removeCallbacks(this);
+		}
+	}
 
 	/**
 	 * Server task.
@@ -47,6 +181,12 @@ public class EchoServerActivity extends AbstractEchoActivity {
 	private class ServerTask extends AbstractEchoTask {
 		/** Port number. */
 		private final int port;
+
+		/** Native counter logger. */
+		private StatsLogger statsLogger;
+
+		/** Server stop handle. */
+		private final ServerHandle serverHandle = new ServerHandle();
 		
 		/**
 		 * Constructor.
@@ -58,17 +198,35 @@ public class EchoServerActivity extends AbstractEchoActivity {
 			this.port = port;
 		}
 
+		protected void onPreExecute() {
+			super.onPreExecute();
+
+			statsLogger = new StatsLogger();
+			statsLogger.start();
+		}
+
 		protected void onBackground() {
 			logMessage("Starting server.");
 
 			try {
-				// nativeStartTcpServer(port);
-				nativeStartUdpServer(port);
+				nativeConfigure(NATIVE_OPTIONS);
+
+				long handle = serverHandle.open();
+				// nativeStartTcpServer(port, WORKER_COUNT, handle);
+				nativeStartUdpServer(port, WORKER_COUNT, handle);
 			} catch (Exception e) {
 				logMessage(e.getMessage());
+			} finally {
+				serverHandle.close();
 			}
 
 			logMessage("Server terminated.");
 		}
+
+		protected void onPostExecute() {
+			statsLogger.stop();
+
+			super.onPostExecute();
+		}
 	}
 }
@@ -15,9 +15,24 @@ import android.widget.EditText;
  * @author Onur Cinar
  */
 public class LocalEchoActivity extends AbstractEchoActivity {
+	/** Stream local socket. */
+	private static final int LOCAL_STREAM = 0;
+
+	/** Sequenced packet local socket, keeps the message boundaries. */
+	private static final int LOCAL_SEQPACKET = 1;
+
+	/** Benchmark over a stream local socket. */
+	private static final int LOCAL_TRANSPORT_SOCKET = 0;
+
+	/** Benchmark over a shared memory ring. */
+	private static final int LOCAL_TRANSPORT_SHARED_MEMORY = 1;
+
 	/** Message edit. */
 	private EditText messageEdit;
 
+	/** Running server task. */
+	private ServerTask serverTask;
+
 	/**
 	 * Constructor.
 	 */
@@ -47,7 +62,7 @@ public class LocalEchoActivity extends AbstractEchoActivity {
 				socketName = name;
 			}
 
-			ServerTask serverTask = new ServerTask(socketName);
+			serverTask = new ServerTask(socketName, LOCAL_STREAM);
 			serverTask.start();
 
 			ClientTask clientTask = new ClientTask(socketName, message);
@@ -55,6 +70,15 @@ public class LocalEchoActivity extends AbstractEchoActivity {
 		}
 	}
 
+	protected void onDestroy() {
+		// Let the server close its connections and socket
+		if (serverTask != null) {
+			serverTask.serverHandle.stop();
+		}
+
+		super.onDestroy();
+	}
+
 	/**
 	 * Check if name is a filesystem socket.
 	 * 
@@ -68,12 +92,53 @@ public class LocalEchoActivity extends AbstractEchoActivity {
 
 	/**
 	 * Starts the Local UNIX socket server binded to given name.
+	 * Clients are served at the same time, and the descriptors
+	 * they pass are echoed back with the data.
 	 * 
 	 * @param name
 	 *            socket name.
+	 * @param type
+	 *            local socket type, stream or sequenced packet.
+	 * @param handle
+	 *            server handle to stop the server with, or zero.
 	 * @throws Exception
 	 */
-	private native void nativeStartLocalServer(String name) throws Exception;
+	private native void nativeStartLocalServer(String name, int type,
+			long handle) throws Exception;
+
+	/**
+	 * Starts the shared memory echo server binded to given name.
+	 * Clients set up a shared memory ring pair over the local
+	 * socket, and the messages are echoed from ring to ring.
+	 * 
+	 * @param name
+	 *            socket name.
+	 * @param handle
+	 *            server handle to stop the server with, or zero.
+	 * @throws Exception
+	 */
+	private native void nativeStartSharedMemoryServer(String name,
+			long handle) throws Exception;
+
+	/**
+	 * Runs a ping pong benchmark against the local server with
+	 * given name, and logs the throughput and the latency
+	 * percentiles. A stream local server is used for the socket
+	 * transport, and a shared memory server for the shared
+	 * memory transport.
+	 * 
+	 * @param name
+	 *            socket name.
+	 * @param transport
+	 *            local socket or shared memory.
+	 * @param payloadSize
+	 *            message size in bytes.
+	 * @param duration
+	 *            duration in seconds.
+	 * @throws Exception
+	 */
+	private native void nativeStartLocalBenchmark(String name, int transport,
+			int payloadSize, int duration) throws Exception;
 
 	/**
 	 * Starts the local UNIX socket client.
@@ -140,23 +205,34 @@ public class LocalEchoActivity extends AbstractEchoActivity {
 		/** Socket name. */
 		private final String name;
 
+		/** Local socket type. */
+		private final int type;
+
+		/** Server stop handle. */
+		private final ServerHandle serverHandle = new ServerHandle();
+
 		/**
 		 * Constructor.
 		 * 
 		 * @param name
 		 *            socket name.
+		 * @param type
+		 *            local socket type.
 		 */
-		public ServerTask(String name) {
+		public ServerTask(String name, int type) {
 			this.name = name;
+			this.type = type;
 		}
 
 		protected void onBackground() {
 			logMessage("Starting server.");
 
 			try {
-				nativeStartLocalServer(name);
+				nativeStartLocalServer(name, type, serverHandle.open());
 			} catch (Exception e) {
 				logMessage(e.getMessage());
+			} finally {
+				serverHandle.close();
 			}
 
 			logMessage("Server terminated.");